@@ -1,3 +1,7 @@
+// Usage: bootable-iso-builder <kernel file path> <bootable img file path> [--uefi] [--trimmed]
+// --uefi creates a UEFI GPT image instead of a BIOS MBR one
+// --trimmed uses the release boot config: no framebuffer logging, bootloader logs only warnings to serial
+
 fn main() {
     let mut args = std::env::args();
     if args.len() < 3 {
@@ -11,19 +15,44 @@ fn main() {
     let bootable_img_file_path = args.next().unwrap();
     let bootable_img_file_path = std::path::Path::new(&bootable_img_file_path);
 
+    let mut uefi = false;
+    let mut trimmed = false;
+    for flag in args {
+        match flag.as_str() {
+            "--uefi" => uefi = true,
+            "--trimmed" => trimmed = true,
+            _ => panic!("Unknown flag: {flag}"),
+        }
+    }
+
     if !std::path::Path::new(&kernel_file_path).exists() {
         panic!("Failed to find kernel file");
     }
 
     // Create bootable img
     // Boot config
-    let boot_config = bootloader::BootConfig::default();
+    let mut boot_config = bootloader::BootConfig::default();
+    if trimmed {
+        // The kernel doesn't use the framebuffer, drawing the bootloader log into it is the slowest part of
+        // the boot before kmain
+        boot_config.frame_buffer_logging = false;
+        boot_config.log_level = bootloader_boot_config::LevelFilter::Warn;
+    }
 
-    let mut bootable_img = bootloader::BiosBoot::new(kernel_file_path);
-    bootable_img.set_boot_config(&boot_config);
-    let result = bootable_img.create_disk_image(bootable_img_file_path);
+    let result = if uefi {
+        let mut bootable_img = bootloader::UefiBoot::new(kernel_file_path);
+        bootable_img.set_boot_config(&boot_config);
+        bootable_img.create_disk_image(bootable_img_file_path)
+    } else {
+        let mut bootable_img = bootloader::BiosBoot::new(kernel_file_path);
+        bootable_img.set_boot_config(&boot_config);
+        bootable_img.create_disk_image(bootable_img_file_path)
+    };
     if let Err(error) = result {
         panic!("Failed to create bootable img: {error}");
     }
-    println!("Bootable img created: {bootable_img_file_path:?}");
+    println!(
+        "Bootable {} img created: {bootable_img_file_path:?}",
+        if uefi { "UEFI" } else { "BIOS" }
+    );
 }
@@ -1,10 +1,12 @@
+use crate::boot_profile;
 use crate::memory_management::general_purpose_allocator::GeneralPurposeAllocator;
 use crate::memory_management::virtual_memory_manager;
 use crate::memory_management::PAGE_SIZE;
+use crate::sync::Mutex;
 use acpi_lib::{AcpiTables, PhysicalMapping, PlatformInfo};
 use bootloader_api::BootInfo;
 use core::ptr::NonNull;
-use spin::{Mutex, Once};
+use spin::Once;
 use x86_64::PhysAddr;
 
 pub static ACPI_TABLES: Once<Mutex<AcpiTables<BaseAcpiHandler>>> = Once::new();
@@ -12,7 +14,9 @@ pub static ACPI_TABLES: Once<Mutex<AcpiTables<BaseAcpiHandler>>> = Once::new();
 pub static PLATFORM_INFO: Once<PlatformInfo<'static, GeneralPurposeAllocator>> = Once::new();
 
 /// Gets ACPI tables
-pub fn init(boot_info: &BootInfo) {
+///
+/// Doesn't require memory allocators, tables are accessed through CPMM
+pub fn init_tables(boot_info: &BootInfo) {
     // Get RSDP address
     let rsdp_phys_addr = PhysAddr::new(
         boot_info
@@ -29,15 +33,21 @@ pub fn init(boot_info: &BootInfo) {
     }
 
     // Collect ACPI tables
+    let _phase = boot_profile::phase("AcpiTables::from_rsdp");
     let acpi_tables = unsafe {
         AcpiTables::from_rsdp(BaseAcpiHandler, rsdp_phys_addr.as_u64() as usize)
             .expect("Failed to get ACPI tables")
     };
 
     ACPI_TABLES.call_once(|| Mutex::new(acpi_tables));
+}
 
-    // Collect PlatformInfo
-    let acpi_tables_mutex_guard = ACPI_TABLES.get().unwrap().lock();
+/// Collects PlatformInfo from ACPI tables
+///
+/// Requires general purpose allocator
+pub fn init_platform_info() {
+    let acpi_tables_mutex_guard = ACPI_TABLES.get().expect("ACPI tables not set").lock();
+    let _phase = boot_profile::phase("platform_info_in (MADT, SRAT, SLIT)");
     let platform_info = acpi_tables_mutex_guard
         .platform_info_in(GeneralPurposeAllocator)
         .expect("Failed to collect PlatformInfo from ACPI tables");
@@ -0,0 +1,514 @@
+// In-kernel microbenchmarks, built with the bench feature (just bench)
+//
+// A task started at the end of kmain waits for deferred memory init, runs the benchmarks and exits QEMU
+// through isa-debug-exit, with the pgo feature after dumping the profile. Single-CPU benchmarks run with
+// interrupts disabled, so timer and IPI noise stays out of the numbers, except the interrupt latency ones.
+//
+// Results are printed to COM1 one per line, TSC timestamped, in a format CI can grep and diff:
+// BENCH v1 tsc_hz=<Hz, 0 if unknown> cpus=<>
+// BENCH name=<> [parameters] ops=<> cycles_per_op=<> ns_per_op=<> tsc=<TSC when measured>
+// BENCH end
+
+use crate::interrupts::apic;
+use crate::interrupts::irq::{self, IrqReturn};
+use crate::memory_management::physical_memory_manager::{self, MemoryZoneEnum};
+use crate::memory_management::slab_allocator::{DefaultMemoryBackend, MagazineCache};
+use crate::memory_management::PAGE_SIZE;
+use crate::scheduler;
+use crate::smp::cpu_mask::CpuMask;
+use crate::smp::{ipi, per_cpu};
+use crate::timers::{self, hpet, tsc};
+use alloc::alloc::{alloc, dealloc, Layout};
+use core::fmt;
+use core::ptr::NonNull;
+use core::sync::atomic::{AtomicU64, AtomicUsize, Ordering};
+use core::time::Duration;
+use slab_allocator_lib::{Cache, ObjectSizeType};
+use x86_64::instructions::port::Port;
+use x86_64::PhysAddr;
+
+/// QEMU isa-debug-exit, QEMU exits with (value << 1) | 1
+const DEBUG_EXIT_PORT: u16 = 0xF4;
+/// QEMU exit code 33, just bench treats it as success
+const DEBUG_EXIT_SUCCESS: u32 = 0x10;
+
+/// Prefix of the result lines
+const LINE_PREFIX: &str = "BENCH";
+
+/// Blocks allocated before they are freed
+const BATCH: usize = 256;
+
+/// Batches of each allocator benchmark
+const ROUNDS: usize = 16;
+
+/// Orders of PMM benchmarks, 4 KB to 4 MB
+const PMM_ORDERS: usize = 11;
+
+/// Calls of each clock
+const CLOCK_CALLS: usize = 100_000;
+
+/// Interrupts of each latency benchmark
+const IRQ_ROUND_TRIPS: usize = 10_000;
+
+/// Operations of each CPU in contention benchmarks
+const CONTENTION_OPS: usize = 100_000;
+
+/// Live blocks of the mixed general purpose allocator benchmark
+const MIXED_LIVE: usize = 256;
+
+/// Operations of the mixed general purpose allocator benchmark
+const MIXED_OPS: usize = 200_000;
+
+/// Checks of deferred memory init
+const WAIT_INTERVAL: Duration = Duration::from_millis(10);
+
+/// Just below default tasks, system tasks aren't starved
+const BENCH_PRIORITY: u8 = scheduler::DEFAULT_PRIORITY + 1;
+
+/// Handler entry TSC of the self IPI benchmark
+static IRQ_ENTRY_TSC: AtomicU64 = AtomicU64::new(0);
+
+#[repr(C, align(64))]
+struct Object64([u8; 64]);
+
+#[repr(C, align(512))]
+struct Object512([u8; 512]);
+
+/// Starts the benchmark task
+pub fn start() {
+    scheduler::spawn("bench", BENCH_PRIORITY, bench_task, 0).expect("Failed to spawn bench task");
+}
+
+fn bench_task(_: usize) {
+    // Background tasks would take CPU time and change free memory while measuring
+    while !physical_memory_manager::deferred_init_finished() {
+        timers::lapic_timer::add_timer(
+            WAIT_INTERVAL,
+            WAIT_INTERVAL / 10,
+            wake_bench_task,
+            scheduler::current_task().as_ptr() as usize,
+        )
+        .expect("Failed to add benchmark wait timer");
+        scheduler::block_current();
+    }
+    log::info!("Benchmarks started");
+    crate::serial_println!(
+        "{LINE_PREFIX} v1 tsc_hz={} cpus={}",
+        if tsc::is_used() { tsc::frequency() } else { 0 },
+        per_cpu::cpus_number()
+    );
+
+    x86_64::instructions::interrupts::without_interrupts(|| {
+        bench_pmm();
+        bench_slab();
+        bench_general_purpose_allocator();
+        bench_clocks();
+    });
+    bench_self_ipi();
+    bench_remote_call();
+    bench_contention();
+
+    crate::serial_println!("{LINE_PREFIX} end");
+    log::info!("Benchmarks finished");
+    #[cfg(feature = "pgo")]
+    crate::pgo::dump();
+    unsafe {
+        Port::<u32>::new(DEBUG_EXIT_PORT).write(DEBUG_EXIT_SUCCESS);
+    }
+}
+
+fn wake_bench_task(task: usize) {
+    scheduler::wake(NonNull::new(task as *mut _).expect("Null bench task"));
+}
+
+/// Alloc and free of batches by zone and order
+fn bench_pmm() {
+    let mut blocks = [PhysAddr::zero(); BATCH];
+    for zone in MemoryZoneEnum::ALL {
+        for order in 0..PMM_ORDERS {
+            let size = PAGE_SIZE << order;
+            // Big blocks would drain small zones
+            let batch = (BATCH >> order).max(4);
+            let (mut alloc_cycles, mut free_cycles, mut ops) = (0, 0, 0);
+            for _ in 0..ROUNDS {
+                let start = tsc::read();
+                let mut allocated = 0;
+                while allocated < batch {
+                    let phys_addr = unsafe { physical_memory_manager::alloc(&[zone], size) };
+                    if phys_addr.is_null() {
+                        break;
+                    }
+                    blocks[allocated] = phys_addr;
+                    allocated += 1;
+                }
+                let middle = tsc::read();
+                for phys_addr in &blocks[..allocated] {
+                    unsafe {
+                        physical_memory_manager::free(*phys_addr, size);
+                    }
+                }
+                free_cycles += tsc::read() - middle;
+                alloc_cycles += middle - start;
+                ops += allocated;
+            }
+            report(
+                "pmm_alloc",
+                format_args!("zone={zone:?} order={order}"),
+                ops,
+                alloc_cycles,
+            );
+            report(
+                "pmm_free",
+                format_args!("zone={zone:?} order={order}"),
+                ops,
+                free_cycles,
+            );
+        }
+    }
+}
+
+/// Batches and alloc-free pairs of a 64 and a 512 bytes cache, pairs stay in the CPU's magazine
+fn bench_slab() {
+    let cache_64 = MagazineCache::new(
+        Cache::<Object64, _>::new(
+            PAGE_SIZE,
+            PAGE_SIZE,
+            ObjectSizeType::Small,
+            DefaultMemoryBackend,
+        )
+        .expect("Failed to create bench cache"),
+    );
+    bench_slab_cache(&cache_64, 64);
+    let cache_512 = MagazineCache::new(
+        Cache::<Object512, _>::new(
+            8 * PAGE_SIZE,
+            PAGE_SIZE,
+            ObjectSizeType::Large,
+            DefaultMemoryBackend,
+        )
+        .expect("Failed to create bench cache"),
+    );
+    bench_slab_cache(&cache_512, 512);
+}
+
+fn bench_slab_cache<T>(cache: &MagazineCache<T, DefaultMemoryBackend>, object_size: usize) {
+    let mut objects = [core::ptr::null_mut::<T>(); BATCH];
+    let (mut alloc_cycles, mut free_cycles) = (0, 0);
+    for _ in 0..ROUNDS {
+        let start = tsc::read();
+        for object in objects.iter_mut() {
+            *object = cache.alloc();
+        }
+        let middle = tsc::read();
+        for object in objects.into_iter().filter(|object| !object.is_null()) {
+            unsafe {
+                cache.free(object);
+            }
+        }
+        free_cycles += tsc::read() - middle;
+        alloc_cycles += middle - start;
+    }
+    let ops = ROUNDS * BATCH;
+    report(
+        "slab_alloc",
+        format_args!("size={object_size}"),
+        ops,
+        alloc_cycles,
+    );
+    report(
+        "slab_free",
+        format_args!("size={object_size}"),
+        ops,
+        free_cycles,
+    );
+
+    let start = tsc::read();
+    for _ in 0..ops {
+        let object = cache.alloc();
+        if !object.is_null() {
+            unsafe {
+                cache.free(object);
+            }
+        }
+    }
+    let cycles = tsc::read() - start;
+    report(
+        "slab_alloc_free",
+        format_args!("size={object_size}"),
+        ops,
+        cycles,
+    );
+}
+
+/// Random sizes from 8 bytes to 64 KB, a random live block is freed before each alloc
+fn bench_general_purpose_allocator() {
+    let mut live: [(usize, usize); MIXED_LIVE] = [(0, 0); MIXED_LIVE];
+    let mut random = Xorshift(0x9E37_79B9_7F4A_7C15);
+    let mut ops = 0;
+    let start = tsc::read();
+    for _ in 0..MIXED_OPS {
+        let slot = (random.next() % MIXED_LIVE as u64) as usize;
+        let (ptr, size) = live[slot];
+        if ptr != 0 {
+            unsafe {
+                dealloc(ptr as *mut u8, Layout::from_size_align(size, 8).unwrap());
+            }
+            ops += 1;
+        }
+        let size = (8usize << (random.next() % 14)) + (random.next() % 8) as usize * 8;
+        let ptr = unsafe { alloc(Layout::from_size_align(size, 8).unwrap()) };
+        live[slot] = (ptr as usize, size);
+        ops += 1;
+    }
+    let cycles = tsc::read() - start;
+    for (ptr, size) in live {
+        if ptr != 0 {
+            unsafe {
+                dealloc(ptr as *mut u8, Layout::from_size_align(size, 8).unwrap());
+            }
+        }
+    }
+    report(
+        "gpa_mixed",
+        format_args!("sizes=8-65536 live={MIXED_LIVE}"),
+        ops,
+        cycles,
+    );
+}
+
+/// Cost of reading the clocks
+fn bench_clocks() {
+    let start = tsc::read();
+    for _ in 0..CLOCK_CALLS {
+        core::hint::black_box(tsc::read());
+    }
+    report(
+        "clock",
+        format_args!("clock=rdtsc"),
+        CLOCK_CALLS,
+        tsc::read() - start,
+    );
+
+    if tsc::is_used() {
+        let start = tsc::read();
+        for _ in 0..CLOCK_CALLS {
+            core::hint::black_box(tsc::now());
+        }
+        report(
+            "clock",
+            format_args!("clock=tsc_now"),
+            CLOCK_CALLS,
+            tsc::read() - start,
+        );
+    }
+    if hpet::is_supported() {
+        let start = tsc::read();
+        for _ in 0..CLOCK_CALLS {
+            core::hint::black_box(hpet::get_current_ticks());
+        }
+        report(
+            "clock",
+            format_args!("clock=hpet"),
+            CLOCK_CALLS,
+            tsc::read() - start,
+        );
+    }
+    let start = tsc::read();
+    for _ in 0..CLOCK_CALLS {
+        core::hint::black_box(timers::now());
+    }
+    report(
+        "clock",
+        format_args!("clock=timers_now"),
+        CLOCK_CALLS,
+        tsc::read() - start,
+    );
+}
+
+/// Self IPI: send to handler entry, and send to return from the interrupt
+fn bench_self_ipi() {
+    let (cpu_index, vector) = x86_64::instructions::interrupts::without_interrupts(|| {
+        let cpu_index = per_cpu::cpu_index();
+        let vector = irq::allocate_vector(cpu_index, self_ipi_handler, 0)
+            .expect("No vector for the IPI benchmark");
+        (cpu_index, vector)
+    });
+    let (mut entry_cycles, mut round_trip_cycles, mut ops) = (0, 0, 0);
+    for _ in 0..IRQ_ROUND_TRIPS {
+        x86_64::instructions::interrupts::disable();
+        // The task may have been moved to another CPU by a steal
+        if per_cpu::cpu_index() != cpu_index {
+            x86_64::instructions::interrupts::enable();
+            continue;
+        }
+        IRQ_ENTRY_TSC.store(0, Ordering::Relaxed);
+        let start = tsc::read();
+        apic::send_fixed_ipi(apic::local_apic_id(), vector);
+        // The pending interrupt is taken right after sti
+        x86_64::instructions::interrupts::enable();
+        while IRQ_ENTRY_TSC.load(Ordering::Acquire) == 0 {
+            core::hint::spin_loop();
+        }
+        let end = tsc::read();
+        entry_cycles += IRQ_ENTRY_TSC.load(Ordering::Relaxed) - start;
+        round_trip_cycles += end - start;
+        ops += 1;
+    }
+    irq::free_vector(cpu_index, vector);
+    report(
+        "irq_self_ipi_entry",
+        format_args!("cpu={cpu_index}"),
+        ops,
+        entry_cycles,
+    );
+    report(
+        "irq_self_ipi_round_trip",
+        format_args!("cpu={cpu_index}"),
+        ops,
+        round_trip_cycles,
+    );
+}
+
+fn self_ipi_handler(_: usize) -> IrqReturn {
+    IRQ_ENTRY_TSC.store(tsc::read(), Ordering::Release);
+    IrqReturn::Handled
+}
+
+/// Call function IPI to another CPU and back
+fn bench_remote_call() {
+    let cpus_number = per_cpu::cpus_number();
+    if cpus_number < 2 {
+        return;
+    }
+    let target = (per_cpu::cpu_index() + 1) % cpus_number;
+    let start = tsc::read();
+    for _ in 0..IRQ_ROUND_TRIPS {
+        ipi::call_function_single(target, |_| {}, 0);
+    }
+    let cycles = tsc::read() - start;
+    report(
+        "ipi_call_round_trip",
+        format_args!("target={target}"),
+        IRQ_ROUND_TRIPS,
+        cycles,
+    );
+}
+
+/// Shared state of a contention run
+struct Contention {
+    workload: fn(),
+    cpus_number: usize,
+    arrived: AtomicUsize,
+    /// Sum of cycles of all CPUs
+    cycles: AtomicU64,
+    /// Slowest CPU
+    max_cycles: AtomicU64,
+}
+
+/// Scaling of allocators with 1 to all other CPUs running the same loop at once
+///
+/// Workers run in call function IPIs, the bench CPU waits for them and isn't one of them
+fn bench_contention() {
+    let workloads: [(&str, fn()); 3] = [
+        ("pmm_page", || unsafe {
+            let phys_addr = physical_memory_manager::alloc(&[MemoryZoneEnum::High], PAGE_SIZE);
+            if !phys_addr.is_null() {
+                physical_memory_manager::free(phys_addr, PAGE_SIZE);
+            }
+        }),
+        ("gpa_64", || unsafe {
+            let layout = Layout::from_size_align(64, 8).unwrap();
+            let ptr = core::hint::black_box(alloc(layout));
+            if !ptr.is_null() {
+                dealloc(ptr, layout);
+            }
+        }),
+        ("gpa_4096", || unsafe {
+            let layout = Layout::from_size_align(4096, 8).unwrap();
+            let ptr = core::hint::black_box(alloc(layout));
+            if !ptr.is_null() {
+                dealloc(ptr, layout);
+            }
+        }),
+    ];
+    for (name, workload) in workloads {
+        // Remote CPUs, the current one is skipped by call_function_many
+        let mut cpus = CpuMask::new();
+        let current = per_cpu::cpu_index();
+        for cpu_index in (0..per_cpu::cpus_number()).filter(|&cpu_index| cpu_index != current) {
+            cpus.set(cpu_index);
+            let contention = Contention {
+                workload,
+                cpus_number: cpus.iter().count(),
+                arrived: AtomicUsize::new(0),
+                cycles: AtomicU64::new(0),
+                max_cycles: AtomicU64::new(0),
+            };
+            ipi::call_function_many(
+                &cpus,
+                contention_worker,
+                &contention as *const Contention as usize,
+            );
+            let ops = contention.cpus_number * CONTENTION_OPS;
+            let max_cycles = contention.max_cycles.load(Ordering::Relaxed);
+            report(
+                "contention",
+                format_args!(
+                    "workload={name} cpus={} ops_per_sec={}",
+                    contention.cpus_number,
+                    if tsc::is_used() {
+                        ops as u64 * tsc::frequency() / max_cycles.max(1)
+                    } else {
+                        0
+                    }
+                ),
+                ops,
+                contention.cycles.load(Ordering::Relaxed),
+            );
+        }
+    }
+}
+
+fn contention_worker(data: usize) {
+    let contention = unsafe { &*(data as *const Contention) };
+    // All CPUs start together
+    contention.arrived.fetch_add(1, Ordering::AcqRel);
+    while contention.arrived.load(Ordering::Acquire) != contention.cpus_number {
+        core::hint::spin_loop();
+    }
+    let start = tsc::read();
+    for _ in 0..CONTENTION_OPS {
+        (contention.workload)();
+    }
+    let cycles = tsc::read() - start;
+    contention.cycles.fetch_add(cycles, Ordering::Relaxed);
+    contention.max_cycles.fetch_max(cycles, Ordering::Relaxed);
+}
+
+/// Prints the result line
+fn report(name: &str, parameters: fmt::Arguments, ops: usize, cycles: u64) {
+    let cycles_per_op = cycles / (ops as u64).max(1);
+    let ns_per_op = if tsc::is_used() {
+        tsc::ticks_to_nanoseconds(cycles) / (ops as u64).max(1)
+    } else {
+        0
+    };
+    crate::serial_println!(
+        "{LINE_PREFIX} name={name} {parameters} ops={ops} cycles_per_op={cycles_per_op} \
+         ns_per_op={ns_per_op} tsc={}",
+        tsc::read()
+    );
+}
+
+/// Deterministic sizes, runs are comparable
+struct Xorshift(u64);
+
+impl Xorshift {
+    #[inline]
+    fn next(&mut self) -> u64 {
+        self.0 ^= self.0 << 13;
+        self.0 ^= self.0 >> 7;
+        self.0 ^= self.0 << 17;
+        self.0
+    }
+}
@@ -0,0 +1,252 @@
+// Boot profile
+//
+// kmain marks top-level init stages with stage, init functions time their sub-steps with phase guards.
+// Timestamps are raw TSC reads, so phases are recorded from the first instruction of kmain, before any timer
+// is calibrated. They are converted to nanoseconds by the invariant TSC clock when the profile is reported,
+// without it they are reported in TSC cycles.
+//
+// Only the bootstrap processor records, in a fixed array (nothing is allocated). Phases after finish are ignored.
+//
+// report logs a table and prints the same data to COM1 in a line format for regression tracking:
+// BOOTPROF v1 unit=<ns|cycles> tsc_hz=<Hz, 0 if unknown> before_kmain=<TSC since reset> total=<kmain to finish>
+// BOOTPROF phase=<stage/phase/...> depth=<0 for stages> start=<since kmain> duration=<>
+// BOOTPROF end
+
+use crate::sync::Mutex;
+use crate::timers::tsc;
+use alloc::format;
+use alloc::string::String;
+use core::fmt;
+use core::sync::atomic::{AtomicBool, AtomicU64, AtomicUsize, Ordering};
+use tinyvec::ArrayVec;
+
+/// Recorded phases, the rest is dropped
+const MAX_PHASES: usize = 64;
+
+/// Prefix of the machine-readable lines
+const LINE_PREFIX: &str = "BOOTPROF";
+
+static PHASES: Mutex<ArrayVec<[Phase; MAX_PHASES]>> =
+    Mutex::new(ArrayVec::from_array_empty([Phase::EMPTY; MAX_PHASES]));
+
+/// TSC at the start of kmain
+static START_TSC: AtomicU64 = AtomicU64::new(0);
+
+/// TSC when the profile was finished
+static FINISH_TSC: AtomicU64 = AtomicU64::new(0);
+
+/// Depth of the next phase, 1 + number of open phases
+static DEPTH: AtomicUsize = AtomicUsize::new(1);
+
+static FINISHED: AtomicBool = AtomicBool::new(false);
+
+/// Phases that didn't fit
+static DROPPED: AtomicUsize = AtomicUsize::new(0);
+
+#[derive(Clone, Copy, Default)]
+struct Phase {
+    name: &'static str,
+    /// 0 for stages
+    depth: u8,
+    start_tsc: u64,
+    /// 0 while the phase is open
+    end_tsc: u64,
+}
+
+impl Phase {
+    const EMPTY: Self = Self {
+        name: "",
+        depth: 0,
+        start_tsc: 0,
+        end_tsc: 0,
+    };
+}
+
+/// Closes the phase when dropped
+pub struct PhaseGuard {
+    /// None if the phase isn't recorded
+    index: Option<usize>,
+}
+
+impl Drop for PhaseGuard {
+    fn drop(&mut self) {
+        if let Some(index) = self.index {
+            let end_tsc = tsc::read();
+            PHASES.lock()[index].end_tsc = end_tsc;
+            DEPTH.fetch_sub(1, Ordering::Relaxed);
+        }
+    }
+}
+
+/// Remembers the start of kmain, the first call of kmain
+#[inline]
+pub fn init() {
+    START_TSC.store(tsc::read(), Ordering::Relaxed);
+}
+
+/// Finishes the previous stage of kmain and starts the next one
+pub fn stage(name: &'static str) {
+    if FINISHED.load(Ordering::Relaxed) {
+        return;
+    }
+    let now = tsc::read();
+    let mut phases = PHASES.lock();
+    close_stage(&mut phases, now);
+    push(&mut phases, name, 0, now);
+}
+
+/// Starts a phase nested into the current stage or phase, it ends when the guard is dropped
+///
+/// Must be called on the bootstrap processor during boot, later calls aren't recorded
+#[must_use]
+pub fn phase(name: &'static str) -> PhaseGuard {
+    if FINISHED.load(Ordering::Relaxed) {
+        return PhaseGuard { index: None };
+    }
+    let depth = DEPTH.load(Ordering::Relaxed);
+    let index = push(&mut PHASES.lock(), name, depth as u8, tsc::read());
+    if index.is_some() {
+        DEPTH.store(depth + 1, Ordering::Relaxed);
+    }
+    PhaseGuard { index }
+}
+
+/// Finishes the last stage, later phases aren't recorded
+pub fn finish() {
+    let now = tsc::read();
+    close_stage(&mut PHASES.lock(), now);
+    FINISH_TSC.store(now, Ordering::Relaxed);
+    FINISHED.store(true, Ordering::Release);
+}
+
+/// Logs the profile table and prints the BOOTPROF lines
+///
+/// Must be called after [finish]
+pub fn report() {
+    assert!(
+        FINISHED.load(Ordering::Acquire),
+        "Boot profile isn't finished"
+    );
+    let phases = PHASES.lock().clone();
+    let start_tsc = START_TSC.load(Ordering::Relaxed);
+    let total = to_unit(FINISH_TSC.load(Ordering::Relaxed) - start_tsc);
+    let (unit, tsc_hz) = if tsc::is_used() {
+        ("ns", tsc::frequency())
+    } else {
+        ("cycles", 0)
+    };
+
+    log::info!("Boot profile ({unit}), kmain took {}", Value(total, unit));
+    log::info!(
+        "    {:<40} {:>14} {:>14} {:>5}",
+        "phase",
+        "start",
+        "duration",
+        "%"
+    );
+    for phase in phases.iter() {
+        let duration = phase_duration(phase);
+        log::info!(
+            "    {:indent$}{:<width$} {:>14} {:>14} {:>3}.{}",
+            "",
+            phase.name,
+            Value(to_unit(phase.start_tsc - start_tsc), unit),
+            Value(duration, unit),
+            duration * 100 / total.max(1),
+            duration * 1000 / total.max(1) % 10,
+            indent = phase.depth as usize * 2,
+            width = 40usize.saturating_sub(phase.depth as usize * 2),
+        );
+    }
+    let dropped = DROPPED.load(Ordering::Relaxed);
+    if dropped != 0 {
+        log::warn!("Boot profile: {dropped} phases dropped");
+    }
+
+    // Full paths of the phases, parents precede their children
+    crate::serial_println!(
+        "{LINE_PREFIX} v1 unit={unit} tsc_hz={tsc_hz} before_kmain={} total={total}",
+        to_unit(start_tsc)
+    );
+    let mut path: ArrayVec<[&'static str; MAX_PHASES]> = ArrayVec::new();
+    for phase in phases.iter() {
+        path.truncate(phase.depth as usize);
+        path.push(phase.name);
+        let mut joined = String::new();
+        for (i, name) in path.iter().enumerate() {
+            if i != 0 {
+                joined.push('/');
+            }
+            // Spaces would split the field
+            joined.extend(name.chars().map(|c| if c == ' ' { '_' } else { c }));
+        }
+        crate::serial_println!(
+            "{LINE_PREFIX} phase={joined} depth={} start={} duration={}",
+            phase.depth,
+            to_unit(phase.start_tsc - start_tsc),
+            phase_duration(phase)
+        );
+    }
+    crate::serial_println!("{LINE_PREFIX} end");
+}
+
+fn push(
+    phases: &mut ArrayVec<[Phase; MAX_PHASES]>,
+    name: &'static str,
+    depth: u8,
+    start_tsc: u64,
+) -> Option<usize> {
+    let phase = Phase {
+        name,
+        depth,
+        start_tsc,
+        end_tsc: 0,
+    };
+    if phases.try_push(phase).is_some() {
+        DROPPED.fetch_add(1, Ordering::Relaxed);
+        return None;
+    }
+    Some(phases.len() - 1)
+}
+
+/// Ends the open stage and phases left open in it
+fn close_stage(phases: &mut ArrayVec<[Phase; MAX_PHASES]>, now: u64) {
+    for phase in phases.iter_mut().rev() {
+        if phase.end_tsc == 0 {
+            phase.end_tsc = now;
+        }
+        if phase.depth == 0 {
+            break;
+        }
+    }
+}
+
+#[inline]
+fn phase_duration(phase: &Phase) -> u64 {
+    to_unit(phase.end_tsc.saturating_sub(phase.start_tsc))
+}
+
+/// TSC cycles to nanoseconds if TSC is calibrated
+#[inline]
+fn to_unit(cycles: u64) -> u64 {
+    if tsc::is_used() {
+        tsc::ticks_to_nanoseconds(cycles)
+    } else {
+        cycles
+    }
+}
+
+/// Nanoseconds as milliseconds with 3 decimals, cycles as is
+struct Value(u64, &'static str);
+
+impl fmt::Display for Value {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        // Formatted first, so the width of the table applies to the whole value
+        let text = if self.1 == "ns" {
+            format!("{}.{:03} ms", self.0 / 1_000_000, self.0 / 1_000 % 1_000)
+        } else {
+            format!("{}", self.0)
+        };
+        f.pad(&text)
+    }
+}
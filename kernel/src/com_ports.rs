@@ -1,6 +1,6 @@
 // COM ports global variables for synchronization
 
-use spin::Mutex;
+use crate::sync::Mutex;
 use x86_64::instructions::port::Port;
 
 /// COM1 port for printing QEMU logs
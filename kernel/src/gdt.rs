@@ -1,23 +1,74 @@
+// GDT, TSS and interrupt stack table of each CPU
+//
+// NMI, double fault and machine check switch to their own IST stacks, so they work on any stack:
+// a kernel stack overflow faults on the guard page, the page fault can't be pushed and the double fault
+// is handled on its IST stack instead of triple faulting. Other vectors stay on the current stack,
+// IRQ handlers move to the per-CPU IRQ stack themselves (interrupts::irq), so nesting works.
+
+use crate::memory_management::virtual_memory_manager::vmalloc::vmalloc;
 use x86_64::instructions::segmentation::Segment;
 use x86_64::registers::segmentation::SegmentSelector;
 use x86_64::structures::gdt::{Descriptor, GlobalDescriptorTable};
-use x86_64::PrivilegeLevel;
+use x86_64::structures::tss::TaskStateSegment;
+use x86_64::{PrivilegeLevel, VirtAddr};
+
+/// Indices of TSS interrupt stack table, IDT entries refer to them
+pub const NMI_IST_INDEX: u16 = 0;
+pub const DOUBLE_FAULT_IST_INDEX: u16 = 1;
+pub const MACHINE_CHECK_IST_INDEX: u16 = 2;
 
-static mut GDT: GlobalDescriptorTable = GlobalDescriptorTable::new();
+const IST_STACKS_NUMBER: usize = 3;
 
-/// Creates and loads GDT
-#[allow(static_mut_refs)]
+/// Panic handler runs on the double fault stack, it formats the frame
+const IST_STACK_SIZE: usize = 16 * 1024;
+
+/// GDT and TSS of the CPU
+///
+/// Each CPU has its own, stored in PerCpu
+pub struct CpuDescriptorTables {
+    gdt: GlobalDescriptorTable,
+    tss: TaskStateSegment,
+}
+
+impl CpuDescriptorTables {
+    pub const fn new() -> Self {
+        Self {
+            gdt: GlobalDescriptorTable::new(),
+            tss: TaskStateSegment::new(),
+        }
+    }
+}
+
+/// Allocates IST stacks of the current CPU and puts them into its TSS
+///
+/// Memory manager must be inited. Called before the CPU takes exceptions with IST entries,
+/// the TSS loaded by [init] is read by the CPU at each such exception, so it's updated in place
+pub fn init_interrupt_stacks() {
+    let tss = unsafe { &mut crate::smp::per_cpu::current().descriptor_tables.tss };
+    for index in 0..IST_STACKS_NUMBER {
+        // Followed by a guard page, an overflow of one IST stack doesn't run into another
+        let stack = vmalloc(IST_STACK_SIZE);
+        assert!(!stack.is_null(), "Failed to allocate IST stack");
+        tss.interrupt_stack_table[index] = VirtAddr::from_ptr(stack) + IST_STACK_SIZE as u64;
+    }
+}
+
+/// Creates and loads GDT and TSS of the current CPU
 pub fn init() {
     unsafe {
+        let per_cpu = crate::smp::per_cpu::current();
+        let CpuDescriptorTables { gdt, tss } = &mut per_cpu.descriptor_tables;
+        let tss: &'static TaskStateSegment = tss;
+
         // Null Descriptor already in GDT
         // GDT[1] Kernel Code
-        GDT.append(Descriptor::kernel_code_segment());
+        gdt.append(Descriptor::kernel_code_segment());
         // GDT[2] Kernel Data
-        GDT.append(Descriptor::kernel_data_segment());
+        gdt.append(Descriptor::kernel_data_segment());
         // GDT[3] User Code
-        GDT.append(Descriptor::user_code_segment());
+        gdt.append(Descriptor::user_code_segment());
         // GDT[4] User Data
-        GDT.append(Descriptor::user_data_segment());
+        gdt.append(Descriptor::user_data_segment());
         // Info about I/O Permission Bit Map in TSS:
         // "For I/O Permission Bit Map
         // If the I/O bit map base address is greater than or equal to the TSS segment limit, there is no I/O permission map,
@@ -28,13 +79,17 @@ pub fn init() {
         // !!!
         // The x86_64 library setting the System Segment TSS in GDT sets the limit equal to sizeof(TSS) - 1 and IOPB = sizeof(TSS),
         // so the I/O Permission Bit Map is considered empty.
+        // GDT[5-6] TSS (System Segment takes two entries)
+        let tss_selector = gdt.append(Descriptor::tss_segment(tss));
 
         // lgdt
-        GDT.load();
+        let gdt: &'static GlobalDescriptorTable = gdt;
+        gdt.load();
 
         // Set segment registers
         // CS, DS, SS, ES
-        // FS and GS not used
+        // FS not used
+        // GS not loaded, GS base points to PerCpu (loading the selector would reset it)
         x86_64::instructions::segmentation::CS::set_reg(SegmentSelector::new(
             1,
             PrivilegeLevel::Ring0,
@@ -51,5 +106,8 @@ pub fn init() {
             2,
             PrivilegeLevel::Ring0,
         ));
+
+        // ltr
+        x86_64::instructions::tables::load_tss(tss_selector);
     }
 }
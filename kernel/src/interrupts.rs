@@ -1,14 +1,28 @@
 pub mod apic;
 pub mod idt;
+pub mod irq;
+pub mod msi;
 pub mod pic;
+pub mod softirq;
+
+use crate::boot_profile;
 
 /// Fills IDT, inits IO APIC and bootstrap processor's Local APIC, but it doesn't enable interrupts
 pub fn init() {
     x86_64::instructions::interrupts::disable();
 
+    // Softirqs of the dispatcher
+    irq::init();
+
     // Init and disable PIC
     pic::init_and_disable();
 
+    // IRQ stack and IST stacks of the bootstrap processor, APs create theirs at startup
+    irq::init_stack();
+    crate::gdt::init_interrupt_stacks();
+    idt::use_interrupt_stacks();
+
     // Init Local APIC and IO APIC
+    let _phase = boot_profile::phase("apic::init");
     apic::init();
 }
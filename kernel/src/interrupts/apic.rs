@@ -6,9 +6,9 @@ use crate::memory_management::PAGE_SIZE;
 use acpi_lib::platform::interrupt::{LocalInterruptLine, NmiProcessor};
 use acpi_lib::InterruptModel;
 use bitfield::bitfield;
+use core::sync::atomic::{AtomicBool, Ordering};
 use raw_cpuid::CpuId;
-use x86_64::instructions::tlb;
-use x86_64::structures::paging::page_table::PageTableLevel;
+use x86_64::registers::model_specific::Msr;
 use x86_64::structures::paging::PageTableFlags;
 use x86_64::{PhysAddr, VirtAddr};
 
@@ -32,38 +32,64 @@ const BASE_PHYS_ADDR: PhysAddr = PhysAddr::new(0xFEE00000);
 const BASE_VIRT_ADDR: VirtAddr =
     virtual_memory_manager::virt_addr_in_cpmm_from_phys_addr(BASE_PHYS_ADDR);
 
-// Registers
+/// IA32_APIC_BASE MSR
+const IA32_APIC_BASE_MSR: u32 = 0x1B;
+
+/// IA32_APIC_BASE bit 10, x2APIC mode (bit 11 must be set too)
+const IA32_APIC_BASE_X2APIC_ENABLE: u64 = 1 << 10;
+
+/// IA32_APIC_BASE bit 11, APIC global enable
+const IA32_APIC_BASE_ENABLE: u64 = 1 << 11;
+
+/// In x2APIC mode, the register at MMIO offset X is MSR 0x800 + X / 16
+const X2APIC_MSR_BASE: u32 = 0x800;
+
+/// Local APIC is in x2APIC mode, registers are accessed through MSRs
+///
+/// Set on BSP before any register access, APs switch to the same mode
+static X2APIC_MODE: AtomicBool = AtomicBool::new(false);
+
+// Registers (offsets from local APIC base)
+/// 0x20    Local APIC ID Register
+const ID_REGISTER: u32 = 0x20;
+
 /// 0x30    Local APIC Version Register
-const VERSION_REGISTER: *mut u32 = (BASE_VIRT_ADDR.as_u64() + 0x30) as *mut u32;
+const VERSION_REGISTER: u32 = 0x30;
 
 /// 0xB0    End Of Interrupt Register
-const EOI_REGISTER: *mut u32 = (BASE_VIRT_ADDR.as_u64() + 0xB0) as *mut u32;
+const EOI_REGISTER: u32 = 0xB0;
 
 /// 0xF0    Spurious-Interrupt Vector Register
-const SPURIOUS_INTERRUPT_VECTOR_REGISTER: *mut u32 = (BASE_VIRT_ADDR.as_u64() + 0xF0) as *mut u32;
+const SPURIOUS_INTERRUPT_VECTOR_REGISTER: u32 = 0xF0;
+
+/// 0x300   Interrupt Command Register (bits 0-31), in x2APIC mode the whole 64-bit register
+const INTERRUPT_COMMAND_REGISTER_LOW: u32 = 0x300;
+
+/// 0x310   Interrupt Command Register (bits 32-63), xAPIC only
+const INTERRUPT_COMMAND_REGISTER_HIGH: u32 = 0x310;
 
 /// 0x320   LVT Timer Register
-const LVT_TIMER_REGISTER: *mut u32 = (BASE_VIRT_ADDR.as_u64() + 0x320) as *mut u32;
+const LVT_TIMER_REGISTER: u32 = 0x320;
 
 /// 0x350   LVT LINT0 Register
-const LVT_LINT0_REGISTER: *mut u32 = (BASE_VIRT_ADDR.as_u64() + 0x350) as *mut u32;
+const LVT_LINT0_REGISTER: u32 = 0x350;
 
 /// 0x360   LVT LINT1 Register
-const LVT_LINT1_REGISTER: *mut u32 = (BASE_VIRT_ADDR.as_u64() + 0x360) as *mut u32;
+const LVT_LINT1_REGISTER: u32 = 0x360;
 
 /// 0x370   LVT Error Register
-const LVT_ERROR_REGISTER: *mut u32 = (BASE_VIRT_ADDR.as_u64() + 0x370) as *mut u32;
+const LVT_ERROR_REGISTER: u32 = 0x370;
 
 /// 0x380   Initial Count Register
-const INITIAL_COUNT_REGISTER: *mut u32 = (BASE_VIRT_ADDR.as_u64() + 0x380) as *mut u32;
+const INITIAL_COUNT_REGISTER: u32 = 0x380;
 
 /// 0x390   Current Count Register
-const CURRENT_COUNT_REGISTER: *mut u32 = (BASE_VIRT_ADDR.as_u64() + 0x390) as *mut u32;
+const CURRENT_COUNT_REGISTER: u32 = 0x390;
 
 /// 0x3E0   Divide Configuration Register
-const DIVIDE_CONFIGURATION_REGISTER: *mut u32 = (BASE_VIRT_ADDR.as_u64() + 0x3E0) as *mut u32;
+const DIVIDE_CONFIGURATION_REGISTER: u32 = 0x3E0;
 
-/// Inits Local APIC for this CPU (BSP)
+/// Inits Local APIC for this CPU (BSP) and IO APIC
 pub fn init() {
     // Disable interrupts
     x86_64::instructions::interrupts::disable();
@@ -78,7 +104,7 @@ pub fn init() {
     }
 
     // Check APIC base address from MSR (Intel and AMD supported)
-    let ia32_apic_base_msr = unsafe { x86_64::registers::model_specific::Msr::new(0x1B).read() };
+    let ia32_apic_base_msr = unsafe { Msr::new(IA32_APIC_BASE_MSR).read() };
     let apic_base_page_phys_addr_from_msr =
         x86_64::align_down(ia32_apic_base_msr, PAGE_SIZE as u64);
     assert_eq!(
@@ -87,25 +113,22 @@ pub fn init() {
         "The APIC base address is not on the default page!"
     );
 
-    // Make APIC base mapping page uncacheable
-    // osdev wiki: Section 11.4.1 of 3rd volume of Intel SDM recommends mapping the base address page as strong uncacheable for correct APIC operation.
-    // My SDM (May 2020) in 10.4.1 says:
-    // APIC registers are memory-mapped to a 4-KByte region of the processor’s physical
-    // address space with an initial starting address of FEE00000H. For correct APIC operation, this address space must
-    // be mapped to an area of memory that has been designated as strong uncacheable (UC)
-    virtual_memory_manager::set_flags_in_page_table(
-        BASE_VIRT_ADDR,
-        PageTableLevel::One,
-        PageTableFlags::NO_CACHE | PageTableFlags::WRITE_THROUGH,
-        true,
-    );
-    tlb::flush(BASE_VIRT_ADDR);
+    // x2APIC: MSR access is cheaper than uncached MMIO (especially virtualized) and APIC IDs are 32 bits.
+    // Firmware may have enabled it already, then it can't be disabled without reset
+    let x2apic_mode =
+        cpuid_feature_info.has_x2apic() || ia32_apic_base_msr & IA32_APIC_BASE_X2APIC_ENABLE != 0;
+    X2APIC_MODE.store(x2apic_mode, Ordering::Relaxed);
+    if x2apic_mode {
+        enable_x2apic();
+    } else {
+        make_mmio_page_uncacheable();
+    }
 
     // Determine whether the 82489DX is a discrete APIC or an Integrated APIC using the Local APIC Version Register
     // Version bits 0-7:
     // 0 -           82489DX Discrete
     // 0x10 - 0x15 - Integrated
-    let local_apic_version_register_value = unsafe { *VERSION_REGISTER };
+    let local_apic_version_register_value = read_register(VERSION_REGISTER);
     let version: u8 = local_apic_version_register_value as u8;
     match version {
         0 => LOCAL_APIC_VERSION.call_once(|| LocalApicVersion::Descrete),
@@ -113,8 +136,6 @@ pub fn init() {
         _ => unreachable!("Reserved value"),
     };
 
-    // APIC enabled by default, but interrupts masked, need set vectors and unmask
-    // Fill LVT registers (set and unmask vectors)
     let bsp_uid = PLATFORM_INFO
         .get()
         .expect("Failed to get PlatformInfo")
@@ -123,29 +144,186 @@ pub fn init() {
         .unwrap()
         .boot_processor
         .processor_uid;
-    fill_spurious_interrupt_vector_register();
-    fill_lvt_lint0_register(bsp_uid);
-    fill_lvt_lint1_register(bsp_uid);
-    fill_lvt_error_register();
+    unsafe {
+        let per_cpu = crate::smp::per_cpu::current();
+        per_cpu.processor_uid = bsp_uid;
+        per_cpu.local_apic_id = local_apic_id();
+    }
+    init_local_apic(bsp_uid);
+    super::irq::register_irq_handler(
+        super::idt::LOCAL_APIC_ERROR_IDT_VECTOR,
+        error_interrupt_handler,
+        0,
+    )
+    .expect("Failed to register Local APIC error handler");
 
     // Configure IO APIC for Legacy ISA IRQ's
     ioapic::init();
 }
 
-/// Set and unmasks APIC Timer interrupt vector <br>
+/// Makes APIC base mapping page uncacheable (xAPIC mode)
+fn make_mmio_page_uncacheable() {
+    // osdev wiki: Section 11.4.1 of 3rd volume of Intel SDM recommends mapping the base address page as strong uncacheable for correct APIC operation.
+    // My SDM (May 2020) in 10.4.1 says:
+    // APIC registers are memory-mapped to a 4-KByte region of the processor’s physical
+    // address space with an initial starting address of FEE00000H. For correct APIC operation, this address space must
+    // be mapped to an area of memory that has been designated as strong uncacheable (UC)
+    // CPMM may use a huge page here, protect splits it, so only the APIC page becomes uncacheable
+    let mut tlb_flush_batch = virtual_memory_manager::TlbFlushBatch::new();
+    unsafe {
+        virtual_memory_manager::PageTables::current()
+            .protect(
+                BASE_VIRT_ADDR,
+                PAGE_SIZE,
+                PageTableFlags::NO_CACHE | PageTableFlags::WRITE_THROUGH,
+                PageTableFlags::empty(),
+                &mut tlb_flush_batch,
+            )
+            .expect("Failed to make APIC base page uncacheable");
+    }
+    tlb_flush_batch.flush();
+}
+
+/// Switches Local APIC of the current CPU to x2APIC mode
+///
+/// xAPIC must be enabled before x2APIC (SDM 10.12.5), it's enabled after reset
+fn enable_x2apic() {
+    let mut ia32_apic_base = Msr::new(IA32_APIC_BASE_MSR);
+    unsafe {
+        let value = ia32_apic_base.read();
+        assert!(
+            value & IA32_APIC_BASE_ENABLE != 0,
+            "Local APIC is globally disabled"
+        );
+        ia32_apic_base.write(value | IA32_APIC_BASE_X2APIC_ENABLE);
+    }
+}
+
+/// Local APIC is in x2APIC mode
+#[inline(always)]
+pub fn is_x2apic() -> bool {
+    X2APIC_MODE.load(Ordering::Relaxed)
+}
+
+/// Reads 32-bit register of the current CPU's Local APIC, MSR in x2APIC mode, uncached MMIO otherwise
+#[inline(always)]
+fn read_register(register: u32) -> u32 {
+    if is_x2apic() {
+        unsafe { Msr::new(X2APIC_MSR_BASE + (register >> 4)).read() as u32 }
+    } else {
+        unsafe { ((BASE_VIRT_ADDR.as_u64() + register as u64) as *const u32).read_volatile() }
+    }
+}
+
+/// Writes 32-bit register of the current CPU's Local APIC, MSR in x2APIC mode, uncached MMIO otherwise
+#[inline(always)]
+fn write_register(register: u32, value: u32) {
+    if is_x2apic() {
+        unsafe { Msr::new(X2APIC_MSR_BASE + (register >> 4)).write(value as u64) }
+    } else {
+        unsafe { ((BASE_VIRT_ADDR.as_u64() + register as u64) as *mut u32).write_volatile(value) }
+    }
+}
+
+/// Inits Local APIC for this CPU (AP)
+///
+/// BSP must already be initialized by [init]
+pub fn init_ap() {
+    if is_x2apic() {
+        enable_x2apic();
+    }
+    let per_cpu = unsafe { crate::smp::per_cpu::current() };
+    assert_eq!(
+        local_apic_id(),
+        per_cpu.local_apic_id,
+        "AP's Local APIC ID differs from ACPI"
+    );
+    init_local_apic(per_cpu.processor_uid);
+}
+
+/// Fills LVT registers of the current CPU's Local APIC
+fn init_local_apic(processor_uid: u32) {
+    // APIC enabled by default, but interrupts masked, need set vectors and unmask
+    // Fill LVT registers (set and unmask vectors)
+    fill_spurious_interrupt_vector_register();
+    fill_lvt_lint0_register(processor_uid);
+    fill_lvt_lint1_register(processor_uid);
+    fill_lvt_error_register();
+}
+
+/// Returns Local APIC ID of the current CPU
+///
+/// xAPIC: ID Register bits 24-31, x2APIC: the whole 32 bit register
+#[inline]
+pub fn local_apic_id() -> u32 {
+    let register_value = read_register(ID_REGISTER);
+    if is_x2apic() {
+        register_value
+    } else {
+        register_value >> 24
+    }
+}
+
+/// Local APIC timer modes, LVT Timer Register bits 17-18
+#[derive(Clone, Copy, Debug, PartialEq)]
+pub enum TimerMode {
+    /// Counts down from the Initial Count Register once
+    OneShot = 0b00,
+    /// Reloads from the Initial Count Register
+    Periodic = 0b01,
+    /// Fires when TSC reaches IA32_TSC_DEADLINE MSR
+    TscDeadline = 0b10,
+}
+
+/// Sets APIC Timer interrupt vector and mode <br>
 /// Vector               0-7     = IDT vector <br>
 /// Delivery Status      12      = 0 - (Read Only) <br>
-/// Mask                 16      = 0 - Unmasked <br>
-/// Timer Periodic Mode  17-18   = 00 - Fired only once <br>
-fn fill_lvt_timer_register() {
+/// Mask                 16      = masked <br>
+/// Timer Mode           17-18   = timer_mode <br>
+///
+/// The timer is stopped until it's armed with [set_timer_initial_count] or IA32_TSC_DEADLINE
+pub fn fill_lvt_timer_register(timer_mode: TimerMode, masked: bool) {
     let mut register_value = LvtRegister(0);
     register_value.set_vector(super::idt::LOCAL_APIC_TIMER_IDT_VECTOR as u32);
+    register_value.set_mask(masked);
+    register_value.set_timer_mode(timer_mode as u32);
 
+    write_register(LVT_TIMER_REGISTER, register_value.0);
+    // SDM 10.5.4.1: MMIO write to LVT and following WRMSR of IA32_TSC_DEADLINE are not ordered
+    // (x2APIC MSR writes aren't serializing either)
     unsafe {
-        LVT_TIMER_REGISTER.write_volatile(register_value.0);
+        core::arch::x86_64::_mm_mfence();
     }
 }
 
+/// Sets Divide Configuration Register of the timer (one-shot and periodic modes)
+///
+/// Divider is power of two 1-128
+pub fn set_timer_divider(divider: u32) {
+    assert!(
+        divider.is_power_of_two() && divider <= 128,
+        "Invalid Local APIC timer divider"
+    );
+    // Bits 0, 1, 3: 0b111 - divide by 1, else divide by 2^(value + 1)
+    let value = (divider.trailing_zeros() + 0b111) & 0b111;
+    write_register(
+        DIVIDE_CONFIGURATION_REGISTER,
+        (value & 0b11) | ((value & 0b100) << 1),
+    );
+}
+
+/// Starts the timer countdown (one-shot and periodic modes), 0 stops the timer
+#[inline]
+pub fn set_timer_initial_count(count: u32) {
+    write_register(INITIAL_COUNT_REGISTER, count);
+}
+
+/// Current countdown value of the timer
+#[inline]
+pub fn timer_current_count() -> u32 {
+    read_register(CURRENT_COUNT_REGISTER)
+}
+
 /// Set and unmasks APIC LINT0 interrupt vector <br>
 /// Vector                           0-7 = IDT vector <br>
 /// Delivery Mode                    8-10 = 000 - Fixed <br>
@@ -164,9 +342,7 @@ fn fill_lvt_lint0_register(processor_uid: u32) {
         processor_uid,
     );
 
-    unsafe {
-        LVT_LINT0_REGISTER.write_volatile(register_value.0);
-    }
+    write_register(LVT_LINT0_REGISTER, register_value.0);
 }
 
 /// Set and unmasks APIC LINT1 interrupt vector <br>
@@ -187,9 +363,7 @@ fn fill_lvt_lint1_register(processor_uid: u32) {
         processor_uid,
     );
 
-    unsafe {
-        LVT_LINT1_REGISTER.write_volatile(register_value.0);
-    }
+    write_register(LVT_LINT1_REGISTER, register_value.0);
 }
 
 /// Sets NMI delivery mode for LINT# if it's required by ACPI table
@@ -229,9 +403,11 @@ fn fill_lvt_error_register() {
     let mut register_value = LvtRegister(0);
     register_value.set_vector(super::idt::LOCAL_APIC_ERROR_IDT_VECTOR as u32);
 
-    unsafe {
-        LVT_ERROR_REGISTER.write_volatile(register_value.0);
-    }
+    write_register(LVT_ERROR_REGISTER, register_value.0);
+}
+
+fn error_interrupt_handler(_: usize) -> super::irq::IrqReturn {
+    panic!("LOCAL APIC ERROR interrupt");
 }
 
 /// Sets spurious interrupt vector interrupts, enables APIC interrupts (Enabled by Default) <br>
@@ -250,19 +426,98 @@ fn fill_spurious_interrupt_vector_register() {
     // Set 8 bit (Enabled by default!)
     register_value |= 1 << 8;
 
-    unsafe {
-        SPURIOUS_INTERRUPT_VECTOR_REGISTER.write_volatile(register_value);
-    }
+    write_register(SPURIOUS_INTERRUPT_VECTOR_REGISTER, register_value);
 }
 
 /// ## Don't use for Spurious Interrupt
 #[inline]
 pub fn send_eoi() {
-    unsafe {
-        EOI_REGISTER.write_volatile(0);
+    write_register(EOI_REGISTER, 0);
+}
+
+/// Sends INIT IPI (assert) to the CPU
+pub fn send_init_ipi(destination_apic_id: u32) {
+    let mut register_value = InterruptCommandRegister(0);
+    register_value.set_delivery_mode(0b101); // INIT
+    register_value.set_level(true); // Assert
+    send_ipi(register_value, destination_apic_id);
+}
+
+/// Sends Start-up IPI to the CPU
+///
+/// AP starts executing in real mode at vector * 4096
+pub fn send_startup_ipi(destination_apic_id: u32, vector: u8) {
+    let mut register_value = InterruptCommandRegister(0);
+    register_value.set_vector(vector as u64);
+    register_value.set_delivery_mode(0b110); // Start Up
+    register_value.set_level(true);
+    send_ipi(register_value, destination_apic_id);
+}
+
+/// Sends IPI with the vector to the CPU (Fixed delivery mode)
+pub fn send_fixed_ipi(destination_apic_id: u32, vector: u8) {
+    let mut register_value = InterruptCommandRegister(0);
+    register_value.set_vector(vector as u64);
+    register_value.set_delivery_mode(0b000); // Fixed
+    register_value.set_level(true);
+    send_ipi(register_value, destination_apic_id);
+}
+
+/// Writes Interrupt Command Register with the destination, and waits until the IPI is sent
+///
+/// xAPIC: writing of the low half sends the IPI, so the high half (destination) is written first <br>
+/// x2APIC: single 64-bit MSR write, there is no Delivery Status to wait for
+fn send_ipi(mut register_value: InterruptCommandRegister, destination_apic_id: u32) {
+    if is_x2apic() {
+        register_value.set_x2apic_destination(destination_apic_id as u64);
+        unsafe {
+            // WRMSR to x2APIC registers isn't serializing, memory writes before the IPI must be visible to its handler
+            core::arch::x86_64::_mm_mfence();
+            core::arch::x86_64::_mm_lfence();
+            Msr::new(X2APIC_MSR_BASE + (INTERRUPT_COMMAND_REGISTER_LOW >> 4))
+                .write(register_value.0);
+        }
+        return;
+    }
+
+    assert!(destination_apic_id <= 0xFF, "xAPIC destination is 8 bits");
+    register_value.set_destination(destination_apic_id as u64);
+    write_register(
+        INTERRUPT_COMMAND_REGISTER_HIGH,
+        (register_value.0 >> 32) as u32,
+    );
+    write_register(INTERRUPT_COMMAND_REGISTER_LOW, register_value.0 as u32);
+    // Delivery Status: 0 - Idle, 1 - Send Pending
+    while InterruptCommandRegister(read_register(INTERRUPT_COMMAND_REGISTER_LOW) as u64)
+        .delivery_status()
+    {
+        core::hint::spin_loop();
     }
 }
 
+bitfield! {
+    /// Interrupt Command Register <br>
+    /// Vector                   0-7 = IDT vector (or start page for SIPI) <br>
+    /// Delivery Mode            8-10 = 000 - Fixed, 100 - NMI, 101 - INIT, 110 - Start Up <br>
+    /// Destination Mode         11 = 0 - Physical <br>
+    /// Delivery Status          12 = (Read Only) <br>
+    /// Level                    14 = 0 - De-assert, 1 - Assert <br>
+    /// Trigger Mode             15 = 0 - Edge <br>
+    /// Destination Shorthand    18-19 = 00 - No Shorthand <br>
+    /// Destination              56-63 = APIC ID (xAPIC) <br>
+    /// Destination              32-63 = APIC ID (x2APIC) <br>
+    struct InterruptCommandRegister(u64);
+    vector, set_vector: 7, 0;
+    delivery_mode, set_delivery_mode: 10, 8;
+    destination_mode, set_destination_mode: 11;
+    delivery_status, _: 12;
+    level, set_level: 14;
+    trigger_mode, set_trigger_mode: 15;
+    destination_shorthand, set_destination_shorthand: 19, 18;
+    destination, set_destination: 63, 56;
+    x2apic_destination, set_x2apic_destination: 63, 32;
+}
+
 bitfield! {
     struct LvtRegister(u32);
     vector, set_vector: 7, 0;
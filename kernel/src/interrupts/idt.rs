@@ -1,7 +1,10 @@
-use super::apic;
-use crate::timers;
+use super::irq::dispatch_interrupt;
+use crate::gdt::{DOUBLE_FAULT_IST_INDEX, MACHINE_CHECK_IST_INDEX, NMI_IST_INDEX};
+use crate::memory_management::virtual_memory_manager::vmalloc;
 use core::ops::RangeInclusive;
-use x86_64::structures::idt::{ExceptionVector, InterruptDescriptorTable, InterruptStackFrame};
+use x86_64::structures::idt::{
+    ExceptionVector, InterruptDescriptorTable, InterruptStackFrame, PageFaultErrorCode,
+};
 
 static mut IDT: InterruptDescriptorTable = InterruptDescriptorTable::new();
 
@@ -9,8 +12,40 @@ static mut IDT: InterruptDescriptorTable = InterruptDescriptorTable::new();
 pub fn init() {
     #[allow(static_mut_refs)]
     unsafe {
-        x86_64::set_general_handler!(&mut IDT, general_interrupt_handler);
-        // Loads IDT using lidt
+        x86_64::set_general_handler!(&mut IDT, exception_handler, 0..=31);
+        x86_64::set_general_handler!(&mut IDT, dispatch_interrupt, 32..=255);
+    }
+    load();
+}
+
+/// NMI, double fault and machine check switch to IST stacks
+///
+/// Every CPU must have its IST stacks from now, see [crate::gdt::init_interrupt_stacks]
+pub fn use_interrupt_stacks() {
+    #[allow(static_mut_refs)]
+    unsafe {
+        // Handlers stay the general handler stubs, only the stack is changed
+        let handler_addr = IDT.non_maskable_interrupt.handler_addr();
+        IDT.non_maskable_interrupt
+            .set_handler_addr(handler_addr)
+            .set_stack_index(NMI_IST_INDEX);
+        let handler_addr = IDT.double_fault.handler_addr();
+        IDT.double_fault
+            .set_handler_addr(handler_addr)
+            .set_stack_index(DOUBLE_FAULT_IST_INDEX);
+        let handler_addr = IDT.machine_check.handler_addr();
+        IDT.machine_check
+            .set_handler_addr(handler_addr)
+            .set_stack_index(MACHINE_CHECK_IST_INDEX);
+    }
+}
+
+/// Loads IDT using lidt
+///
+/// IDT is shared by all CPUs, each CPU must load it
+pub fn load() {
+    #[allow(static_mut_refs)]
+    unsafe {
         IDT.load();
     }
 }
@@ -22,9 +57,12 @@ pub const LOCAL_APIC_TIMER_IDT_VECTOR: u8 = 56;
 pub const LOCAL_APIC_LINT0_IDT_VECTOR: u8 = 57;
 pub const LOCAL_APIC_LINT1_IDT_VECTOR: u8 = 58;
 pub const LOCAL_APIC_ERROR_IDT_VECTOR: u8 = 59;
+pub const RESCHEDULE_IPI_IDT_VECTOR: u8 = 60;
+pub const CALL_FUNCTION_IPI_IDT_VECTOR: u8 = 61;
+pub const DYNAMIC_IDT_VECTORS_RANGE: RangeInclusive<u8> = 64..=239;
 pub const LOCAL_APIC_SPURIOUS_IDT_VECTOR: u8 = 255;
 
-/// A general handler function for an interrupt or an exception with the interrupt/exception index and an optional error code
+/// A general handler function for an exception with the exception index and an optional error code
 ///
 /// 0-31    CPU exceptions<br>
 /// 32-47   IO APIC Legacy ISA IRQ's
@@ -33,73 +71,50 @@ pub const LOCAL_APIC_SPURIOUS_IDT_VECTOR: u8 = 255;
 /// 57      Local APIC LINT0<br>
 /// 58      Local APIC LINT1<br>
 /// 59      Local APIC Error<br>
+/// 60      Reschedule IPI<br>
+/// 61      Call Function IPI<br>
+/// 64-239  Per-CPU dynamic vectors (MSI/MSI-X)<br>
 /// 255     Local APIC Spurious-Interrupt (handler must do nothing (and even don't send an EOI))
-pub fn general_interrupt_handler(
+///
+/// Vectors 32-255 are dispatched by [super::irq::dispatch_interrupt]
+pub fn exception_handler(
     interrupt_stack_frame: InterruptStackFrame,
     index: u8,
     error_code: Option<u64>,
 ) {
-    match index {
-        index if CPU_EXCEPTIONS_IDT_VECTORS_RANGE.contains(&index) => {
-            // CPU Exception
-            let exception =
-                ExceptionVector::try_from(index).expect("Invalid exception vector number");
+    let exception = ExceptionVector::try_from(index).expect("Invalid exception vector number");
 
-            match exception {
-                ExceptionVector::Page => {
-                    let cr2_virtual_address =
-                        x86_64::registers::control::Cr2::read().expect("Invalid address in CR2");
-                    panic!(
-                        "Exception: {exception:?}\n\
-                        Error code: {error_code:#?}\n\
-                        CR2: 0x{cr2_virtual_address:X}
-                        {interrupt_stack_frame:#?}"
-                    );
-                }
-                _ => {
-                    panic!(
-                        "Exception: {exception:?}\n\
-                        Error code: {error_code:#?}\n\
-                        {interrupt_stack_frame:#?}"
-                    );
-                }
-            }
-        }
-        index if IO_APIC_24_VECTORS_RANGE.contains(&index) => {
-            if IO_APIC_ISA_IRQ_VECTORS_RANGE.contains(&index) {
-                // PIT interrupt
-                if index == 32 {
-                    timers::pit::tick_interrupt_handler();
-                } else {
-                    crate::serial_println_lock_free!("IO APIC ISA IRQ interrupt: {index}");
-                }
-            } else {
-                crate::serial_println_lock_free!("IO APIC *NOT* ISA IRQ interrupt: {index}");
+    match exception {
+        ExceptionVector::Page => {
+            let cr2_virtual_address =
+                x86_64::registers::control::Cr2::read().expect("Invalid address in CR2");
+            let page_fault_error_code =
+                PageFaultErrorCode::from_bits_truncate(error_code.unwrap_or(0));
+            // Movable page is being migrated, retry the access
+            if vmalloc::wait_for_migration(cr2_virtual_address, page_fault_error_code) {
+                return;
             }
-            apic::send_eoi();
-        }
-        LOCAL_APIC_TIMER_IDT_VECTOR => {
-            crate::serial_println_lock_free!("LOCAL APIC TIMER interrupt");
-            apic::send_eoi();
-        }
-        LOCAL_APIC_LINT0_IDT_VECTOR => {
-            crate::serial_println_lock_free!("LOCAL APIC LINT0 interrupt");
-            apic::send_eoi();
-        }
-        LOCAL_APIC_LINT1_IDT_VECTOR => {
-            crate::serial_println_lock_free!("LOCAL APIC LINT1 interrupt");
-            apic::send_eoi();
-        }
-        LOCAL_APIC_ERROR_IDT_VECTOR => {
-            panic!("LOCAL APIC ERROR interrupt");
-            apic::send_eoi();
+            panic!(
+                "Exception: {exception:?}\n\
+                Error code: {error_code:#?}\n\
+                CR2: 0x{cr2_virtual_address:X}
+                {interrupt_stack_frame:#?}"
+            );
         }
-        LOCAL_APIC_SPURIOUS_IDT_VECTOR => {
-            crate::serial_println_lock_free!("LOCAL APIC SPURIOUS interrupt");
-            return;
+        ExceptionVector::Double => {
+            // Runs on its IST stack, a page fault on an overflowed stack ends here
+            panic!(
+                "Exception: {exception:?} (kernel stack overflow if RSP is just below a stack)\n\
+                Error code: {error_code:#?}\n\
+                {interrupt_stack_frame:#?}"
+            );
         }
         _ => {
-            unreachable!("Unexpected interrupt number: {index}!");
+            panic!(
+                "Exception: {exception:?}\n\
+                Error code: {error_code:#?}\n\
+                {interrupt_stack_frame:#?}"
+            );
         }
     }
 }
@@ -0,0 +1,446 @@
+// Interrupt dispatch
+//
+// Every vector 32-255 has its own IDT stub that indexes a flat table of registered handlers, there is no matching on the vector.
+// Level-triggered lines may be shared, the handlers of a vector are called in turn until one handles the interrupt.
+//
+// Handlers do only the hardware part and defer the rest to softirqs, which run after EOI with interrupts enabled.
+// Unhandled interrupts are counted, they are reported by a softirq, so nothing is printed in the handler.
+//
+// Dynamic vectors (MSI/MSI-X) are allocated per CPU, the same vector has different handlers on different CPUs,
+// so a device interrupt can be bound to any CPU without using a vector on the others.
+//
+// The outermost interrupt switches to the IRQ stack of the CPU: handlers, nested interrupts and softirqs run there,
+// task stacks only take the interrupt frames. Preemption happens after the switch back, on the task stack.
+
+use super::apic;
+use super::idt::{DYNAMIC_IDT_VECTORS_RANGE, LOCAL_APIC_SPURIOUS_IDT_VECTOR};
+use super::softirq::{self, Softirq};
+use crate::memory_management::virtual_memory_manager::vmalloc::vmalloc;
+use crate::smp::per_cpu;
+use crate::sync::Mutex;
+use crate::trace::TraceEvent;
+use core::mem::ManuallyDrop;
+use core::sync::atomic::{AtomicU64, AtomicUsize, Ordering};
+use x86_64::structures::idt::InterruptStackFrame;
+
+/// IRQ stack of each CPU, handlers and softirqs of all nesting levels share it
+const IRQ_STACK_SIZE: usize = 32 * 1024;
+
+/// Max handlers of one shared vector
+const MAX_SHARED_HANDLERS: usize = 4;
+
+/// Number of vectors, exceptions are not dispatched here
+const VECTORS_NUMBER: usize = 256;
+
+const DYNAMIC_VECTORS_NUMBER: usize =
+    (*DYNAMIC_IDT_VECTORS_RANGE.end() - *DYNAMIC_IDT_VECTORS_RANGE.start()) as usize + 1;
+
+static IRQ_HANDLERS: [VectorHandlers; VECTORS_NUMBER] =
+    [const { VectorHandlers::new() }; VECTORS_NUMBER];
+
+/// Serializes registration, dispatch doesn't lock
+static REGISTRATION_LOCK: Mutex<()> = Mutex::new(());
+
+/// Unhandled interrupts of each vector
+static UNHANDLED_COUNTERS: [AtomicU64; VECTORS_NUMBER] =
+    [const { AtomicU64::new(0) }; VECTORS_NUMBER];
+
+/// Unhandled interrupts are reported once per vector
+static UNHANDLED_REPORTED: [AtomicU64; VECTORS_NUMBER / 64] =
+    [const { AtomicU64::new(0) }; VECTORS_NUMBER / 64];
+
+/// Called with interrupts disabled with the data given at registration
+///
+/// Must return [IrqReturn::NotMine] if its device didn't raise the interrupt (shared lines)
+pub type IrqHandler = fn(usize) -> IrqReturn;
+
+#[derive(Clone, Copy, Debug, PartialEq)]
+pub enum IrqReturn {
+    Handled,
+    NotMine,
+}
+
+#[derive(Debug)]
+pub enum IrqError {
+    /// All handler slots of the vector are used
+    NoFreeSlot,
+    /// All dynamic vectors of the CPU are allocated
+    NoFreeVector,
+    /// The handler with the data is already registered
+    AlreadyRegistered,
+    NotRegistered,
+}
+
+/// Handlers of one vector
+///
+/// Handler is stored as usize (0 - free slot), data is written before the handler
+struct VectorHandlers {
+    handlers: [AtomicUsize; MAX_SHARED_HANDLERS],
+    data: [AtomicUsize; MAX_SHARED_HANDLERS],
+}
+
+/// Dynamic vectors of a CPU
+///
+/// Allocated by any CPU, handler is stored as usize (0 - free or being freed)
+pub struct CpuVectors {
+    /// Bit N is set if vector DYNAMIC_IDT_VECTORS_RANGE.start() + N is allocated
+    allocated: [AtomicU64; DYNAMIC_VECTORS_NUMBER.div_ceil(64)],
+    allocated_number: AtomicUsize,
+    handlers: [AtomicUsize; DYNAMIC_VECTORS_NUMBER],
+    data: [AtomicUsize; DYNAMIC_VECTORS_NUMBER],
+}
+
+/// Interrupt state of a CPU
+///
+/// Used only by its CPU with interrupts disabled
+pub struct CpuIrqState {
+    /// Interrupt handlers running on the CPU (nested while softirqs run)
+    nesting: u32,
+    /// Softirqs are running
+    pub(super) in_softirq: bool,
+    /// Bit of each raised softirq
+    pub(super) softirq_pending: u32,
+    /// Top of the IRQ stack, 0 until [init_stack]
+    stack_top: u64,
+    /// The CPU runs on its IRQ stack
+    on_stack: bool,
+}
+
+impl CpuIrqState {
+    pub const fn new() -> Self {
+        Self {
+            nesting: 0,
+            in_softirq: false,
+            softirq_pending: 0,
+            stack_top: 0,
+            on_stack: false,
+        }
+    }
+}
+
+/// Registers softirq that reports unhandled interrupts
+pub fn init() {
+    softirq::register_softirq(Softirq::UnhandledIrq, report_unhandled_irqs);
+}
+
+/// Allocates the IRQ stack of the current CPU, interrupts ran on the current stack before it
+///
+/// Memory manager must be inited
+pub fn init_stack() {
+    // Followed by a guard page, an overflow double faults
+    let stack = vmalloc(IRQ_STACK_SIZE);
+    assert!(!stack.is_null(), "Failed to allocate IRQ stack");
+    x86_64::instructions::interrupts::without_interrupts(|| unsafe {
+        per_cpu::current().irq_state.stack_top = stack as u64 + IRQ_STACK_SIZE as u64;
+    });
+}
+
+/// Adds handler of the vector, the vector may be shared with other handlers
+pub fn register_irq_handler(vector: u8, handler: IrqHandler, data: usize) -> Result<(), IrqError> {
+    assert!(vector >= 32, "Exceptions can't have IRQ handlers");
+    let _registration_lock = REGISTRATION_LOCK.lock();
+    let vector_handlers = &IRQ_HANDLERS[vector as usize];
+    if vector_handlers.position(handler, data).is_some() {
+        return Err(IrqError::AlreadyRegistered);
+    }
+    let slot = vector_handlers
+        .handlers
+        .iter()
+        .position(|handler| handler.load(Ordering::Acquire) == 0)
+        .ok_or(IrqError::NoFreeSlot)?;
+    vector_handlers.data[slot].store(data, Ordering::Release);
+    vector_handlers.handlers[slot].store(handler as usize, Ordering::Release);
+    Ok(())
+}
+
+/// Removes handler of the vector
+///
+/// The handler may still run on other CPUs for an interrupt that came before
+pub fn unregister_irq_handler(
+    vector: u8,
+    handler: IrqHandler,
+    data: usize,
+) -> Result<(), IrqError> {
+    let _registration_lock = REGISTRATION_LOCK.lock();
+    let vector_handlers = &IRQ_HANDLERS[vector as usize];
+    let slot = vector_handlers
+        .position(handler, data)
+        .ok_or(IrqError::NotRegistered)?;
+    vector_handlers.handlers[slot].store(0, Ordering::Release);
+    Ok(())
+}
+
+/// Allocates a dynamic vector on the CPU and sets its handler
+///
+/// The vector isn't shared, interrupts must be delivered only to this CPU
+pub fn allocate_vector(cpu_index: usize, handler: IrqHandler, data: usize) -> Result<u8, IrqError> {
+    let per_cpu = per_cpu::get(cpu_index).expect("CPU is not started");
+    let cpu_vectors = unsafe { &per_cpu.as_ref().irq_vectors };
+    let index = cpu_vectors.allocate().ok_or(IrqError::NoFreeVector)?;
+    cpu_vectors.data[index].store(data, Ordering::Release);
+    cpu_vectors.handlers[index].store(handler as usize, Ordering::Release);
+    Ok(DYNAMIC_IDT_VECTORS_RANGE.start() + index as u8)
+}
+
+/// Frees a dynamic vector of the CPU
+///
+/// The handler may still run for an interrupt that came before
+pub fn free_vector(cpu_index: usize, vector: u8) {
+    assert!(
+        DYNAMIC_IDT_VECTORS_RANGE.contains(&vector),
+        "Vector {vector} is not dynamic"
+    );
+    let per_cpu = per_cpu::get(cpu_index).expect("CPU is not started");
+    let cpu_vectors = unsafe { &per_cpu.as_ref().irq_vectors };
+    let index = (vector - DYNAMIC_IDT_VECTORS_RANGE.start()) as usize;
+    cpu_vectors.handlers[index].store(0, Ordering::Release);
+    let bit = 1 << (index % 64);
+    let previous = cpu_vectors.allocated[index / 64].fetch_and(!bit, Ordering::AcqRel);
+    assert!(previous & bit != 0, "Vector {vector} freed twice");
+    cpu_vectors.allocated_number.fetch_sub(1, Ordering::AcqRel);
+}
+
+/// Number of dynamic vectors allocated on the CPU
+pub fn allocated_vectors_number(cpu_index: usize) -> usize {
+    per_cpu::get(cpu_index).map_or(0, |per_cpu| unsafe {
+        per_cpu
+            .as_ref()
+            .irq_vectors
+            .allocated_number
+            .load(Ordering::Acquire)
+    })
+}
+
+/// Number of unhandled interrupts of the vector
+pub fn unhandled_irqs_number(vector: u8) -> u64 {
+    UNHANDLED_COUNTERS[vector as usize].load(Ordering::Relaxed)
+}
+
+/// IDT handler of vectors 32-255
+///
+/// The stub of each vector passes it as a constant, so this is inlined into a table lookup
+#[inline(always)]
+pub fn dispatch_interrupt(
+    _interrupt_stack_frame: InterruptStackFrame,
+    vector: u8,
+    _error_code: Option<u64>,
+) {
+    // Must do nothing and even don't send EOI
+    if vector == LOCAL_APIC_SPURIOUS_IDT_VECTOR {
+        return;
+    }
+
+    let outermost = on_irq_stack(|| {
+        irq_enter();
+        crate::trace_event!(TraceEvent::IrqEnter, vector);
+        // The vector is a constant in each stub, so only one branch is left
+        let handled = if DYNAMIC_IDT_VECTORS_RANGE.contains(&vector) {
+            unsafe { per_cpu::current().irq_vectors.run(vector) }
+        } else {
+            IRQ_HANDLERS[vector as usize].run()
+        };
+        if !handled {
+            UNHANDLED_COUNTERS[vector as usize].fetch_add(1, Ordering::Relaxed);
+            softirq::raise_softirq(Softirq::UnhandledIrq);
+        }
+        apic::send_eoi();
+        crate::trace_event!(TraceEvent::IrqExit, vector);
+        irq_exit()
+    });
+    // Context switch saves the task stack, it isn't done on the IRQ stack
+    if outermost {
+        crate::scheduler::preempt_if_needed();
+    }
+}
+
+/// Runs the function on the IRQ stack of the CPU, on the current stack if it's already there
+///
+/// Interrupts must be disabled
+#[inline(always)]
+fn on_irq_stack(function: impl FnOnce() -> bool) -> bool {
+    let irq_state = unsafe { &mut per_cpu::current().irq_state };
+    if irq_state.on_stack || irq_state.stack_top == 0 {
+        return function();
+    }
+    irq_state.on_stack = true;
+    let result = unsafe { call_on_stack(irq_state.stack_top, function) };
+    // Nested interrupts have returned, the state is the same
+    unsafe {
+        per_cpu::current().irq_state.on_stack = false;
+    }
+    result
+}
+
+/// Switches RSP to the stack, calls the function and switches back
+///
+/// stack_top must be 16 bytes aligned and not in use
+#[inline(always)]
+unsafe fn call_on_stack<F: FnOnce() -> bool>(stack_top: u64, function: F) -> bool {
+    struct CallData<F> {
+        function: ManuallyDrop<F>,
+        result: bool,
+    }
+
+    extern "C" fn trampoline<F: FnOnce() -> bool>(data: *mut CallData<F>) {
+        let data = unsafe { &mut *data };
+        data.result = unsafe { ManuallyDrop::take(&mut data.function) }();
+    }
+
+    let mut data = CallData {
+        function: ManuallyDrop::new(function),
+        result: false,
+    };
+    // r12 is callee-saved, it keeps the old RSP across the call
+    unsafe {
+        core::arch::asm!(
+            "mov r12, rsp",
+            "mov rsp, {stack_top}",
+            "call {trampoline}",
+            "mov rsp, r12",
+            stack_top = in(reg) stack_top,
+            trampoline = in(reg) trampoline::<F> as usize,
+            in("rdi") &mut data as *mut CallData<F>,
+            out("r12") _,
+            clobber_abi("C"),
+        );
+    }
+    data.result
+}
+
+impl VectorHandlers {
+    const fn new() -> Self {
+        Self {
+            handlers: [const { AtomicUsize::new(0) }; MAX_SHARED_HANDLERS],
+            data: [const { AtomicUsize::new(0) }; MAX_SHARED_HANDLERS],
+        }
+    }
+
+    /// Calls handlers until one handles the interrupt, returns false if nobody did
+    #[inline(always)]
+    fn run(&self) -> bool {
+        for slot in 0..MAX_SHARED_HANDLERS {
+            let handler = self.handlers[slot].load(Ordering::Acquire);
+            if handler == 0 {
+                continue;
+            }
+            let handler: IrqHandler = unsafe { core::mem::transmute(handler) };
+            if handler(self.data[slot].load(Ordering::Acquire)) == IrqReturn::Handled {
+                return true;
+            }
+        }
+        false
+    }
+
+    fn position(&self, handler: IrqHandler, data: usize) -> Option<usize> {
+        (0..MAX_SHARED_HANDLERS).position(|slot| {
+            self.handlers[slot].load(Ordering::Acquire) == handler as usize
+                && self.data[slot].load(Ordering::Acquire) == data
+        })
+    }
+}
+
+impl CpuVectors {
+    pub const fn new() -> Self {
+        Self {
+            allocated: [const { AtomicU64::new(0) }; DYNAMIC_VECTORS_NUMBER.div_ceil(64)],
+            allocated_number: AtomicUsize::new(0),
+            handlers: [const { AtomicUsize::new(0) }; DYNAMIC_VECTORS_NUMBER],
+            data: [const { AtomicUsize::new(0) }; DYNAMIC_VECTORS_NUMBER],
+        }
+    }
+
+    /// Takes the lowest free vector, returns its index
+    fn allocate(&self) -> Option<usize> {
+        for (word_index, word) in self.allocated.iter().enumerate() {
+            let valid_bits = (DYNAMIC_VECTORS_NUMBER - word_index * 64).min(64);
+            let valid_mask = if valid_bits == 64 {
+                u64::MAX
+            } else {
+                (1 << valid_bits) - 1
+            };
+            let mut current = word.load(Ordering::Acquire);
+            loop {
+                let free = !current & valid_mask;
+                if free == 0 {
+                    break;
+                }
+                let bit = 1 << free.trailing_zeros();
+                match word.compare_exchange_weak(
+                    current,
+                    current | bit,
+                    Ordering::AcqRel,
+                    Ordering::Acquire,
+                ) {
+                    Ok(_) => {
+                        self.allocated_number.fetch_add(1, Ordering::AcqRel);
+                        return Some(word_index * 64 + free.trailing_zeros() as usize);
+                    }
+                    Err(actual) => current = actual,
+                }
+            }
+        }
+        None
+    }
+
+    #[inline(always)]
+    fn run(&self, vector: u8) -> bool {
+        let index = (vector - DYNAMIC_IDT_VECTORS_RANGE.start()) as usize;
+        let handler = self.handlers[index].load(Ordering::Acquire);
+        if handler == 0 {
+            return false;
+        }
+        let handler: IrqHandler = unsafe { core::mem::transmute(handler) };
+        handler(self.data[index].load(Ordering::Acquire)) == IrqReturn::Handled
+    }
+}
+
+#[inline(always)]
+fn irq_enter() {
+    unsafe {
+        per_cpu::current().irq_state.nesting += 1;
+    }
+}
+
+/// Runs softirqs when the outermost handler finishes
+///
+/// Returns true if the interrupted code is a task, it may be preempted
+#[inline(always)]
+fn irq_exit() -> bool {
+    let irq_state = unsafe { &mut per_cpu::current().irq_state };
+    irq_state.nesting -= 1;
+    if irq_state.nesting != 0 || irq_state.in_softirq {
+        return false;
+    }
+    if irq_state.softirq_pending != 0 {
+        softirq::run_softirqs();
+    }
+    true
+}
+
+/// Interrupts or softirqs are running on the current CPU
+///
+/// Tasks can't block and yield in interrupts
+#[inline]
+pub fn in_interrupt() -> bool {
+    x86_64::instructions::interrupts::without_interrupts(|| {
+        let irq_state = unsafe { &per_cpu::current().irq_state };
+        irq_state.nesting != 0 || irq_state.in_softirq
+    })
+}
+
+/// Prints the first unhandled interrupt of each vector
+///
+/// Lock free printer, the softirq may interrupt a task that holds COM1 lock
+fn report_unhandled_irqs() {
+    for vector in 0..VECTORS_NUMBER {
+        let bit = 1 << (vector % 64);
+        if UNHANDLED_COUNTERS[vector].load(Ordering::Relaxed) == 0
+            || UNHANDLED_REPORTED[vector / 64].fetch_or(bit, Ordering::AcqRel) & bit != 0
+        {
+            continue;
+        }
+        crate::serial_println_lock_free!(
+            "Unhandled interrupt {vector}, next ones are only counted"
+        );
+    }
+}
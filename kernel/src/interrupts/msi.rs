@@ -0,0 +1,198 @@
+// MSI/MSI-X interrupts
+//
+// A device interrupt gets a dynamic vector on one CPU, the message written to the device targets that CPU's Local APIC,
+// so queue N of a device can interrupt CPU N only.
+// Without a given CPU, vectors are spread to the CPU with the least allocated vectors.
+//
+// This module composes messages and writes MSI-X tables, MSI/MSI-X capabilities are programmed through pci::PciDevice.
+
+use super::irq::{self, IrqError, IrqHandler};
+use crate::smp::{ipi, per_cpu};
+use x86_64::VirtAddr;
+
+/// MSI address bits 20-31, the Local APIC address range
+const MSI_ADDRESS_BASE: u64 = 0xFEE0_0000;
+
+/// Size of MSI-X table entry
+const MSI_X_ENTRY_SIZE: u64 = 16;
+
+/// MSI-X entry Vector Control bit 0
+const MSI_X_VECTOR_CONTROL_MASK: u32 = 1;
+
+/// Address and data the device writes to raise the interrupt
+#[derive(Clone, Copy, Debug, PartialEq)]
+pub struct MsiMessage {
+    /// Destination Local APIC ID           12-19 <br>
+    /// Redirection Hint                    3 = 0 <br>
+    /// Destination Mode                    2 = 0 - Physical <br>
+    pub address: u64,
+    /// Vector                              0-7 <br>
+    /// Delivery Mode                       8-10 = 000 - Fixed <br>
+    /// Trigger Mode                        15 = 0 - Edge <br>
+    pub data: u32,
+}
+
+/// Dynamic vector of a device interrupt on one CPU
+#[derive(Debug)]
+pub struct MsiVector {
+    cpu_index: usize,
+    vector: u8,
+    handler: IrqHandler,
+    data: usize,
+}
+
+/// MSI-X table of a device mapped uncached
+pub struct MsiXTable {
+    base: VirtAddr,
+    entries_number: u16,
+}
+
+/// Allocates a vector for a device interrupt
+///
+/// cpu_index: the CPU that receives the interrupt, [spread_cpu] if None
+pub fn allocate(
+    cpu_index: Option<usize>,
+    handler: IrqHandler,
+    data: usize,
+) -> Result<MsiVector, IrqError> {
+    let cpu_index = cpu_index.unwrap_or_else(spread_cpu);
+    let vector = irq::allocate_vector(cpu_index, handler, data)?;
+    Ok(MsiVector {
+        cpu_index,
+        vector,
+        handler,
+        data,
+    })
+}
+
+/// CPU of the queue, queue N is bound to CPU N (modulo the number of CPUs)
+#[inline]
+pub fn queue_cpu(queue: usize) -> usize {
+    queue % per_cpu::cpus_number()
+}
+
+/// The CPU with the least allocated dynamic vectors
+pub fn spread_cpu() -> usize {
+    (0..per_cpu::cpus_number())
+        .min_by_key(|&cpu_index| irq::allocated_vectors_number(cpu_index))
+        .expect("No CPUs")
+}
+
+impl MsiVector {
+    #[inline]
+    pub fn cpu_index(&self) -> usize {
+        self.cpu_index
+    }
+
+    #[inline]
+    pub fn vector(&self) -> u8 {
+        self.vector
+    }
+
+    /// Message that delivers the vector to its CPU (physical destination, fixed, edge)
+    pub fn message(&self) -> MsiMessage {
+        let per_cpu = per_cpu::get(self.cpu_index).expect("CPU is not started");
+        let apic_id = unsafe { per_cpu.as_ref().local_apic_id };
+        assert!(
+            apic_id <= 0xFF,
+            "MSI destination is 8 bits without interrupt remapping"
+        );
+        MsiMessage {
+            address: MSI_ADDRESS_BASE | (apic_id as u64) << 12,
+            data: self.vector as u32,
+        }
+    }
+
+    /// Moves the interrupt to another CPU
+    ///
+    /// program must write the new message to the device and read a device register back, so the posted write
+    /// reached the device and it doesn't send the old message anymore.
+    /// The old vector is freed after it by a call function IPI to the old CPU. Dynamic vectors have higher
+    /// priority than the IPI, so the old CPU handles interrupts already pending on the old vector before,
+    /// they still have a handler.
+    /// Must not be called with interrupts disabled or holding locks, it waits for the old CPU
+    pub fn set_affinity(
+        &mut self,
+        cpu_index: usize,
+        program: impl FnOnce(MsiMessage),
+    ) -> Result<(), IrqError> {
+        if cpu_index == self.cpu_index {
+            return Ok(());
+        }
+        let new_vector = allocate(Some(cpu_index), self.handler, self.data)?;
+        program(new_vector.message());
+        let old_vector = core::mem::replace(self, new_vector);
+        ipi::call_function_single(
+            old_vector.cpu_index,
+            free_current_cpu_vector,
+            old_vector.vector as usize,
+        );
+        Ok(())
+    }
+
+    /// The device must not send the message anymore
+    pub fn free(self) {
+        irq::free_vector(self.cpu_index, self.vector);
+    }
+}
+
+/// Call function of [MsiVector::set_affinity], frees the vector on the CPU that runs it
+fn free_current_cpu_vector(vector: usize) {
+    irq::free_vector(per_cpu::cpu_index(), vector as u8);
+}
+
+impl MsiXTable {
+    /// # Safety
+    /// base must be the uncached mapping of the table from the BAR given by the MSI-X capability
+    pub unsafe fn new(base: VirtAddr, entries_number: u16) -> Self {
+        Self {
+            base,
+            entries_number,
+        }
+    }
+
+    #[inline]
+    pub fn entries_number(&self) -> u16 {
+        self.entries_number
+    }
+
+    /// Writes the message to the entry and unmasks it
+    ///
+    /// The entry is masked while it's written, so the device never sees a half-written message.
+    /// The entry is read back after it, so the posted writes reached the device
+    pub fn set_entry(&mut self, entry: u16, message: MsiMessage) {
+        self.set_masked(entry, true);
+        unsafe {
+            let entry_ptr = self.entry_ptr(entry);
+            entry_ptr.write_volatile(message.address as u32);
+            entry_ptr
+                .add(1)
+                .write_volatile((message.address >> 32) as u32);
+            entry_ptr.add(2).write_volatile(message.data);
+        }
+        self.set_masked(entry, false);
+        unsafe {
+            self.entry_ptr(entry).add(3).read_volatile();
+        }
+    }
+
+    /// Masked entry doesn't send messages, the device sets its pending bit instead
+    pub fn set_masked(&mut self, entry: u16, masked: bool) {
+        unsafe {
+            let vector_control_ptr = self.entry_ptr(entry).add(3);
+            let vector_control = vector_control_ptr.read_volatile();
+            let vector_control = if masked {
+                vector_control | MSI_X_VECTOR_CONTROL_MASK
+            } else {
+                vector_control & !MSI_X_VECTOR_CONTROL_MASK
+            };
+            vector_control_ptr.write_volatile(vector_control);
+        }
+    }
+
+    /// Entry: Message Address, Message Upper Address, Message Data, Vector Control
+    fn entry_ptr(&self, entry: u16) -> *mut u32 {
+        assert!(entry < self.entries_number, "Invalid MSI-X table entry");
+        (self.base.as_u64() + entry as u64 * MSI_X_ENTRY_SIZE) as *mut u32
+    }
+}
@@ -0,0 +1,81 @@
+// Softirqs (deferred bottom halves of interrupt handlers)
+//
+// A handler raises a softirq on its CPU, raised softirqs run on the same CPU when the outermost interrupt handler exits (after EOI),
+// with interrupts enabled. A softirq doesn't interrupt another softirq on the same CPU.
+// Raised outside interrupts, softirqs run immediately.
+
+use crate::smp::per_cpu;
+use core::sync::atomic::{AtomicUsize, Ordering};
+
+/// Softirqs raised while softirqs run are run again, but not more than this number of times
+/// (the rest waits for the next interrupt)
+const MAX_RESTARTS: usize = 10;
+
+/// Softirqs in order of running
+#[derive(Clone, Copy, Debug, PartialEq)]
+pub enum Softirq {
+    UnhandledIrq = 0,
+    LogWake = 1,
+    CompactionWake = 2,
+}
+
+/// Number of Softirq variants
+const SOFTIRQS_NUMBER: usize = 3;
+
+/// Handler of each softirq stored as usize, 0 - not registered
+static SOFTIRQ_HANDLERS: [AtomicUsize; SOFTIRQS_NUMBER] =
+    [const { AtomicUsize::new(0) }; SOFTIRQS_NUMBER];
+
+/// Sets handler of the softirq
+pub fn register_softirq(softirq: Softirq, handler: fn()) {
+    let previous = SOFTIRQ_HANDLERS[softirq as usize].swap(handler as usize, Ordering::AcqRel);
+    assert_eq!(previous, 0, "Softirq {softirq:?} registered twice");
+}
+
+/// Raises softirq on the current CPU
+pub fn raise_softirq(softirq: Softirq) {
+    let interrupts_were_enabled = x86_64::instructions::interrupts::are_enabled();
+    x86_64::instructions::interrupts::disable();
+    unsafe {
+        per_cpu::current().irq_state.softirq_pending |= 1 << softirq as u32;
+    }
+    // Outside interrupts nobody else would run it soon
+    if interrupts_were_enabled {
+        if !super::irq::in_interrupt() {
+            run_softirqs();
+        }
+        x86_64::instructions::interrupts::enable();
+    }
+}
+
+/// Runs raised softirqs of the current CPU with interrupts enabled
+///
+/// Interrupts must be disabled, they are disabled on return
+pub(super) fn run_softirqs() {
+    // Nested interrupts change the state, so it's not borrowed across handlers
+    let irq_state = || unsafe { &mut per_cpu::current().irq_state };
+    if irq_state().in_softirq {
+        return;
+    }
+    irq_state().in_softirq = true;
+
+    for _ in 0..MAX_RESTARTS {
+        let pending = core::mem::take(&mut irq_state().softirq_pending);
+        if pending == 0 {
+            break;
+        }
+        x86_64::instructions::interrupts::enable();
+        for softirq in 0..SOFTIRQS_NUMBER {
+            if pending & (1 << softirq) == 0 {
+                continue;
+            }
+            let handler = SOFTIRQ_HANDLERS[softirq].load(Ordering::Acquire);
+            assert!(handler != 0, "Raised softirq {softirq} has no handler");
+            let handler: fn() = unsafe { core::mem::transmute(handler) };
+            handler();
+        }
+        x86_64::instructions::interrupts::disable();
+    }
+
+    irq_state().in_softirq = false;
+}
@@ -1,18 +1,35 @@
 #![feature(abi_x86_interrupt)]
 #![feature(allocator_api)]
+#![cfg_attr(feature = "pgo", feature(linkage))]
 #![no_std]
 #![no_main]
 #![allow(unused, dead_code)]
 
+extern crate alloc;
+
 use bootloader_api::config::Mapping;
 
 mod acpi;
+#[cfg(feature = "bench")]
+mod bench;
+mod boot_profile;
 mod com_ports;
 mod gdt;
 mod interrupts;
 mod memory_management;
+mod pci;
+#[cfg(feature = "pgo")]
+mod pgo;
+mod scheduler;
 mod serial_debug;
+mod smp;
+mod sync;
 mod timers;
+mod trace;
+mod virtio;
+
+/// Period of memory statistics in the log
+const MEMORY_STATS_INTERVAL: core::time::Duration = core::time::Duration::from_secs(60);
 
 static BOOTLOADER_CONFIG: bootloader_api::BootloaderConfig = {
     let mut config = bootloader_api::BootloaderConfig::new_default();
@@ -35,6 +52,14 @@ bootloader_api::entry_point!(kmain, config = &BOOTLOADER_CONFIG);
 
 #[no_mangle]
 fn kmain(boot_info: &'static mut bootloader_api::BootInfo) -> ! {
+    // Timestamps of init stages, raw TSC until timers are calibrated
+    boot_profile::init();
+
+    // Per-CPU data of bootstrap processor
+    // Logger writes to per-CPU log ring, locks raise the preempt count in it
+    smp::per_cpu::init_bsp();
+    boot_profile::stage("Per-CPU data and logger");
+
     // Init COM ports and logger
     com_ports::init();
     serial_debug::serial_logger::init();
@@ -44,41 +69,86 @@ fn kmain(boot_info: &'static mut bootloader_api::BootInfo) -> ! {
 
     // Init GDT
     log::info!("GDT initialization");
+    boot_profile::stage("GDT and IDT");
     gdt::init();
 
     // Fill IDT
     interrupts::idt::init();
 
+    // Get ACPI tables
+    // Memory manager needs them for NUMA topology
+    log::info!("Getting ACPI tables");
+    boot_profile::stage("ACPI tables");
+    acpi::init_tables(boot_info);
+
     // Init memory manager
     log::info!("Memory Manager initialization");
+    boot_profile::stage("Memory manager");
     memory_management::init(boot_info);
+    trace::init();
 
-    // Get ACPI tables
-    log::info!("Getting ACPI tables");
-    acpi::init(boot_info);
+    // Collect platform info from ACPI tables
+    boot_profile::stage("ACPI platform info");
+    acpi::init_platform_info();
+
+    // Enumerate PCI devices through ECAM (MCFG), drivers take them later
+    log::info!("PCI enumeration");
+    boot_profile::stage("PCI");
+    pci::init();
 
     // Init IO APIC, Bootstrap Processor Local APIC
     // But it doesn't enable interrupts
     log::info!("APIC interrupts initialization and enabling");
+    boot_profile::stage("APIC");
     interrupts::init();
+    smp::ipi::init();
 
     // Init timers
     log::info!("Timers initialization");
+    boot_profile::stage("Timers");
     timers::init();
 
-    x86_64::instructions::interrupts::disable();
-    // Kernel finish
+    // Init scheduler, BSP's context becomes its idle task
+    log::info!("Scheduler initialization");
+    boot_profile::stage("Scheduler");
+    scheduler::init();
+    serial_debug::serial_logger::start_consumer();
+    memory_management::memory_stats::start_periodic_dump(MEMORY_STATS_INTERVAL);
+
+    // Start application processors
+    log::info!("SMP initialization");
+    boot_profile::stage("SMP");
+    smp::init(boot_info);
+    timers::stop_unused_pit();
+
+    // Virtio drivers create a queue per CPU
+    log::info!("Virtio initialization");
+    boot_profile::stage("Virtio");
+    virtio::init();
+
+    // Rest of HIGH memory is released by all CPUs in background
+    boot_profile::stage("Background memory tasks");
+    memory_management::physical_memory_manager::start_deferred_init();
+    memory_management::physical_memory_manager::start_compaction();
+
+    // Kernel finish, BSP runs tasks from now
     log::info!("--- KERNEL FINISH ---");
-    loop {
-        x86_64::instructions::hlt();
-    }
+    boot_profile::finish();
+    boot_profile::report();
+    #[cfg(feature = "bench")]
+    bench::start();
+    // Boot trace
+    trace::dump();
+    scheduler::run_idle();
 }
 
 #[panic_handler]
 fn panic(info: &core::panic::PanicInfo) -> ! {
     x86_64::instructions::interrupts::disable();
+    serial_debug::serial_logger::drain_on_panic();
     serial_println_lock_free!("PANIC!!!");
     serial_println_lock_free!("{info}");
+    trace::dump();
     loop {
         x86_64::instructions::hlt();
     }
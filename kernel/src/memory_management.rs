@@ -1,22 +1,42 @@
 pub mod general_purpose_allocator;
+pub mod memory_stats;
+pub mod numa;
 pub mod physical_memory_manager;
 pub mod slab_allocator;
 pub mod virtual_memory_manager;
 
+use crate::boot_profile;
+
 /// 4KB
 pub const PAGE_SIZE: usize = 4096;
 
 /// Inits Physical Memory Manager and Virtual Memory Manager
 pub fn init(boot_info: &bootloader_api::BootInfo) {
     log::info!("Physical Memory Manager initialization");
-    physical_memory_manager::init(boot_info);
+    {
+        let _phase = boot_profile::phase("physical_memory_manager::init");
+        physical_memory_manager::init(boot_info);
+    }
 
     log::info!("Virtual Memory Manager initialization");
-    virtual_memory_manager::init();
+    {
+        let _phase = boot_profile::phase("virtual_memory_manager::init");
+        virtual_memory_manager::init();
+    }
 
     log::info!("SLAB allocator initialization");
-    slab_allocator::init();
+    {
+        let _phase = boot_profile::phase("slab_allocator::init");
+        slab_allocator::init();
+    }
+
+    log::info!("Virtual memory allocator initialization");
+    {
+        let _phase = boot_profile::phase("vmalloc::init");
+        virtual_memory_manager::vmalloc::init();
+    }
 
     log::info!("General purpose allocator initialization");
+    let _phase = boot_profile::phase("general_purpose_allocator::init");
     general_purpose_allocator::init();
 }
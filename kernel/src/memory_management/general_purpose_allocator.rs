@@ -1,121 +1,96 @@
-use crate::memory_management::physical_memory_manager::MemoryZoneEnum;
-use crate::memory_management::PAGE_SIZE;
-use core::alloc::{AllocError, Layout};
-use core::ptr::{null_mut, NonNull};
-use spin::{Mutex, Once};
-use x86_64::{PhysAddr, VirtAddr};
+// General purpose allocator
+//
+// Small allocations (up to size_classes::MAX_SIZE_CLASS) go to size class slab caches with per-CPU magazines.
+// Bigger allocations go to per-CPU dlmalloc arenas.
+// The way is chosen by the layout, so alloc and free of the same layout always use the same allocator.
+//
+// It's also the global allocator, alloc crate collections can be used after init.
 
-static DLMALLOC_ALLOCATOR: Once<Mutex<dlmalloc::Dlmalloc<DlmallocSystemAllocator>>> = Once::new();
+mod arena;
+mod size_classes;
 
-/// Inits general purpose allocator (dlmalloc)
+use super::slab_allocator::MagazineCacheStats;
+use core::alloc::{AllocError, GlobalAlloc, Layout};
+use core::ptr::NonNull;
+
+#[global_allocator]
+static GLOBAL_ALLOCATOR: GeneralPurposeAllocator = GeneralPurposeAllocator;
+
+/// Inits general purpose allocator
+///
+/// Slab allocator and vmalloc must be inited
 pub fn init() {
-    DLMALLOC_ALLOCATOR.call_once(|| {
-        Mutex::new(dlmalloc::Dlmalloc::new_with_allocator(
-            DlmallocSystemAllocator,
-        ))
-    });
+    size_classes::init();
 }
 
-/// "System" allocator required for dlmalloc allocator
+/// Passes class size and statistics of each size class cache to the function
+pub fn size_class_stats(function: impl FnMut(usize, MagazineCacheStats)) {
+    size_classes::for_each_stats(function);
+}
+
+/// Allocator that implements the Allocator trait and can be used as a general-purpose allocator, mainly for libraries that require it
 ///
-/// Wrapper over buddy allocator
-struct DlmallocSystemAllocator;
-
-unsafe impl dlmalloc::Allocator for DlmallocSystemAllocator {
-    fn alloc(&self, size: usize) -> (*mut u8, usize, u32) {
-        if !(size >= PAGE_SIZE && size.is_power_of_two()) {
-            unimplemented!(
-                "dlmalloc tries to allocate a memory size not suitable for buddy allocator: {size}"
-            );
-        }
+/// A SLAB allocator should be used for frequent and basic selection of kernel objects of the same size.
+///
+/// Uses size class slab caches and per-CPU dlmalloc arenas.
+#[derive(Copy, Clone, Debug)]
+pub struct GeneralPurposeAllocator;
 
-        let phys_addr = unsafe {
-            super::physical_memory_manager::alloc(
-                &[
-                    MemoryZoneEnum::High,
-                    MemoryZoneEnum::Dma32,
-                    MemoryZoneEnum::IsaDma,
-                ],
-                size,
-            )
+impl GeneralPurposeAllocator {
+    /// Allocs memory for non-zero size layout
+    ///
+    /// Returns null ptr if there is no memory
+    #[inline]
+    fn alloc_nonzero(layout: Layout) -> *mut u8 {
+        debug_assert!(layout.size() != 0);
+        let allocated_ptr = match size_classes::size_class_index(layout) {
+            Some(size_class_index) => size_classes::alloc(size_class_index),
+            None => arena::alloc(layout.size(), layout.align()),
         };
-        if phys_addr.is_null() {
-            return (null_mut(), 0, 0);
-        }
-        let virt_addr = super::virtual_memory_manager::virt_addr_in_cpmm_from_phys_addr(phys_addr);
-        (virt_addr.as_mut_ptr(), size, 0)
+        debug_assert!(
+            allocated_ptr.is_null() || allocated_ptr as usize % layout.align() == 0,
+            "General purpose allocator allocs unaligned ptr"
+        );
+        allocated_ptr
     }
 
-    fn remap(&self, ptr: *mut u8, oldsize: usize, newsize: usize, can_move: bool) -> *mut u8 {
-        debug_assert!(!ptr.is_null(), "dlmalloc tries to remap null ptr");
-        if !(oldsize >= PAGE_SIZE && oldsize.is_power_of_two()) {
-            unimplemented!("dlmalloc tries to remap a memory with oldsize not suitable for buddy allocator: {oldsize}");
-        }
-        if !(newsize >= PAGE_SIZE && newsize.is_power_of_two()) {
-            unimplemented!("dlmalloc tries to remap a memory with newsize not suitable for buddy allocator: {newsize}");
-        }
-
-        if can_move {
-            let virt_addr = VirtAddr::from_ptr(ptr);
-            let phys_addr =
-                super::virtual_memory_manager::phys_addr_from_virt_addr_from_cpmm(virt_addr);
-            unsafe {
-                let new_phys_addr =
-                    super::physical_memory_manager::realloc(phys_addr, newsize, true);
-                if new_phys_addr.is_null() {
-                    return null_mut();
+    /// Allocs zeroed memory for non-zero size layout
+    ///
+    /// Returns null ptr if there is no memory
+    #[inline]
+    fn alloc_zeroed_nonzero(layout: Layout) -> *mut u8 {
+        if size_classes::size_class_index(layout).is_some() {
+            let allocated_ptr = Self::alloc_nonzero(layout);
+            if !allocated_ptr.is_null() {
+                unsafe {
+                    allocated_ptr.write_bytes(0, layout.size());
                 }
-                let new_phys_addr = PhysAddr::new(new_phys_addr as u64);
-                let new_virt_addr =
-                    super::virtual_memory_manager::virt_addr_in_cpmm_from_phys_addr(new_phys_addr);
-                new_virt_addr.as_mut_ptr()
             }
-        } else {
-            null_mut()
+            return allocated_ptr;
         }
+        // dlmalloc knows which chunks are zeroed
+        let allocated_ptr = arena::alloc_zeroed(layout.size(), layout.align());
+        debug_assert!(
+            allocated_ptr.is_null() || allocated_ptr as usize % layout.align() == 0,
+            "General purpose allocator allocs unaligned ptr"
+        );
+        allocated_ptr
     }
 
-    fn free_part(&self, _ptr: *mut u8, _oldsize: usize, _newsize: usize) -> bool {
-        unreachable!("dlmalloc should not call this function");
-    }
-
-    fn free(&self, ptr: *mut u8, size: usize) -> bool {
-        debug_assert!(!ptr.is_null(), "dlmalloc tries to free null ptr");
-        if !(size >= PAGE_SIZE && size.is_power_of_two()) {
-            unimplemented!("dlmalloc tries to free a memory with size not suitable for buddy allocator: {size}");
+    /// Frees memory of non-zero size layout
+    ///
+    /// # Safety
+    /// ptr must be allocated by alloc_nonzero with the same layout
+    #[inline]
+    unsafe fn free_nonzero(ptr: *mut u8, layout: Layout) {
+        debug_assert!(layout.size() != 0);
+        match size_classes::size_class_index(layout) {
+            Some(size_class_index) => unsafe { size_classes::free(size_class_index, ptr) },
+            None => unsafe { arena::free(ptr, layout.size(), layout.align()) },
         }
-
-        let virt_addr = VirtAddr::from_ptr(ptr);
-        let phys_addr =
-            super::virtual_memory_manager::phys_addr_from_virt_addr_from_cpmm(virt_addr);
-        unsafe {
-            super::physical_memory_manager::free(phys_addr);
-        }
-
-        true
-    }
-
-    fn can_release_part(&self, _flags: u32) -> bool {
-        false
-    }
-
-    fn allocates_zeros(&self) -> bool {
-        false
-    }
-
-    fn page_size(&self) -> usize {
-        PAGE_SIZE
     }
 }
 
-/// Allocator that implements the Allocator trait and can be used as a general-purpose allocator, mainly for libraries that require it
-///
-/// A SLAB allocator should be used for frequent and basic selection of kernel objects of the same size.
-///
-/// Uses dlmalloc.
-#[derive(Copy, Clone, Debug)]
-pub struct GeneralPurposeAllocator;
-
 unsafe impl core::alloc::Allocator for GeneralPurposeAllocator {
     fn allocate(&self, layout: Layout) -> Result<NonNull<[u8]>, AllocError> {
         if layout.align() == 0 {
@@ -126,17 +101,10 @@ unsafe impl core::alloc::Allocator for GeneralPurposeAllocator {
             let ptr = layout.align() as *mut u8;
             return Ok(NonNull::slice_from_raw_parts(NonNull::new(ptr).unwrap(), 0));
         }
-        let allocated_ptr = unsafe {
-            DLMALLOC_ALLOCATOR
-                .get()
-                .expect("dlmalloc allocator not set")
-                .lock()
-                .malloc(layout.size(), layout.align())
-        };
+        let allocated_ptr = Self::alloc_nonzero(layout);
         if allocated_ptr.is_null() {
             return Err(AllocError);
         }
-        debug_assert!(allocated_ptr.is_aligned(), "dlmalloc allocs unaligned ptr");
 
         let slice = unsafe {
             NonNull::slice_from_raw_parts(NonNull::new_unchecked(allocated_ptr), layout.size())
@@ -153,11 +121,24 @@ unsafe impl core::alloc::Allocator for GeneralPurposeAllocator {
         }
 
         unsafe {
-            DLMALLOC_ALLOCATOR
-                .get()
-                .expect("dlmalloc allocator not set")
-                .lock()
-                .free(ptr.as_ptr(), layout.size(), layout.align());
+            Self::free_nonzero(ptr.as_ptr(), layout);
+        }
+    }
+}
+
+unsafe impl GlobalAlloc for GeneralPurposeAllocator {
+    unsafe fn alloc(&self, layout: Layout) -> *mut u8 {
+        // GlobalAlloc callers never request zero size
+        Self::alloc_nonzero(layout)
+    }
+
+    unsafe fn alloc_zeroed(&self, layout: Layout) -> *mut u8 {
+        Self::alloc_zeroed_nonzero(layout)
+    }
+
+    unsafe fn dealloc(&self, ptr: *mut u8, layout: Layout) {
+        unsafe {
+            Self::free_nonzero(ptr, layout);
         }
     }
 }
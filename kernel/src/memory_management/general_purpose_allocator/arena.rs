@@ -0,0 +1,367 @@
+// Per-CPU dlmalloc arenas
+//
+// Each CPU allocates from its own arena, so the arena lock is taken only by the owner in the common case.
+// Pages of arena segments are tagged with the arena index in their page descriptors, so free finds the owner.
+// Memory freed by other CPUs is pushed to the owner's lock-free remote free list,
+// the owner frees the whole list in one batch on its next alloc or free.
+//
+// Segments are allocated zeroed (single pages come from the zero page pool), so dlmalloc doesn't clear
+// chunks allocated directly from the system allocator in calloc.
+//
+// Segments in the CPMM are buddy allocator blocks, dlmalloc remaps (big chunks realloc) and trims them
+// with the physical memory manager's realloc. Sizes dlmalloc asks for are rounded up to the block size,
+// so a segment's block is its size rounded up to a power of two.
+
+use crate::memory_management::physical_memory_manager::{self, MemoryZoneEnum, PageDescriptor};
+use crate::memory_management::virtual_memory_manager::{self, vmalloc, PageTables};
+use crate::memory_management::{numa, PAGE_SIZE};
+use crate::smp::{per_cpu, MAX_CPUS};
+use crate::sync::Mutex;
+use core::ptr::null_mut;
+use core::sync::atomic::{AtomicPtr, Ordering};
+use x86_64::{PhysAddr, VirtAddr};
+
+/// Arenas, index is cpu_index, created on the first use by the CPU
+static ARENAS: [AtomicPtr<Arena>; MAX_CPUS] = [const { AtomicPtr::new(null_mut()) }; MAX_CPUS];
+
+struct Arena {
+    dlmalloc: Mutex<dlmalloc::Dlmalloc<DlmallocSystemAllocator>>,
+    /// Memory freed by other CPUs, nodes are written into the freed memory
+    remote_frees: AtomicPtr<RemoteFree>,
+}
+
+/// Node of the remote free list
+struct RemoteFree {
+    next: *mut RemoteFree,
+    size: usize,
+    align: usize,
+}
+
+/// Allocs memory from the current CPU's arena
+///
+/// May return null ptr
+pub fn alloc(size: usize, align: usize) -> *mut u8 {
+    x86_64::instructions::interrupts::without_interrupts(|| {
+        let Some(arena) = local_arena() else {
+            return null_mut();
+        };
+        let mut dlmalloc_lock = arena.dlmalloc.lock();
+        unsafe {
+            arena.free_remote(&mut dlmalloc_lock);
+            dlmalloc_lock.malloc(size, align)
+        }
+    })
+}
+
+/// Allocs zeroed memory from the current CPU's arena
+///
+/// May return null ptr
+pub fn alloc_zeroed(size: usize, align: usize) -> *mut u8 {
+    x86_64::instructions::interrupts::without_interrupts(|| {
+        let Some(arena) = local_arena() else {
+            return null_mut();
+        };
+        let mut dlmalloc_lock = arena.dlmalloc.lock();
+        unsafe {
+            arena.free_remote(&mut dlmalloc_lock);
+            dlmalloc_lock.calloc(size, align)
+        }
+    })
+}
+
+/// Frees memory to its arena
+///
+/// # Safety
+/// ptr must be allocated by [alloc] with the same size and align
+pub unsafe fn free(ptr: *mut u8, size: usize, align: usize) {
+    x86_64::instructions::interrupts::without_interrupts(|| {
+        let arena_index = page_descriptor(VirtAddr::from_ptr(ptr))
+            .arena()
+            .expect("Freeing memory that doesn't belong to an arena");
+        let arena = unsafe { &*ARENAS[arena_index].load(Ordering::Acquire) };
+
+        if arena_index == per_cpu::cpu_index() {
+            let mut dlmalloc_lock = arena.dlmalloc.lock();
+            unsafe {
+                arena.free_remote(&mut dlmalloc_lock);
+                dlmalloc_lock.free(ptr, size, align);
+            }
+            return;
+        }
+
+        // Push to the owner, only the owner takes nodes (the whole list), so there is no ABA
+        debug_assert!(size >= size_of::<RemoteFree>() && align <= PAGE_SIZE);
+        let node = ptr.cast::<RemoteFree>();
+        let mut head = arena.remote_frees.load(Ordering::Relaxed);
+        loop {
+            unsafe {
+                node.write(RemoteFree {
+                    next: head,
+                    size,
+                    align,
+                });
+            }
+            match arena.remote_frees.compare_exchange_weak(
+                head,
+                node,
+                Ordering::Release,
+                Ordering::Relaxed,
+            ) {
+                Ok(_) => break,
+                Err(current_head) => head = current_head,
+            }
+        }
+    });
+}
+
+impl Arena {
+    /// Frees memory freed by other CPUs
+    unsafe fn free_remote(&self, dlmalloc: &mut dlmalloc::Dlmalloc<DlmallocSystemAllocator>) {
+        if self.remote_frees.load(Ordering::Relaxed).is_null() {
+            return;
+        }
+        let mut node = self.remote_frees.swap(null_mut(), Ordering::Acquire);
+        while !node.is_null() {
+            unsafe {
+                let RemoteFree { next, size, align } = node.read();
+                dlmalloc.free(node.cast(), size, align);
+                node = next;
+            }
+        }
+    }
+}
+
+/// Returns arena of the current CPU, creates it on the first use
+///
+/// None if there is no memory for the arena
+///
+/// Interrupts must be disabled
+fn local_arena() -> Option<&'static Arena> {
+    let cpu_index = per_cpu::cpu_index();
+    let arena = ARENAS[cpu_index].load(Ordering::Acquire);
+    if !arena.is_null() {
+        return Some(unsafe { &*arena });
+    }
+
+    // On the CPU's node
+    let arena_size = size_of::<Arena>().next_power_of_two().max(PAGE_SIZE);
+    let memory_zones = [MemoryZoneEnum::High, MemoryZoneEnum::Dma32];
+    let mut phys_addr = unsafe {
+        physical_memory_manager::alloc_on_node(numa::current_node(), &memory_zones, arena_size)
+    };
+    if phys_addr.is_null() {
+        phys_addr = unsafe { physical_memory_manager::alloc(&memory_zones, arena_size) };
+        if phys_addr.is_null() {
+            return None;
+        }
+    }
+    let arena =
+        virtual_memory_manager::virt_addr_in_cpmm_from_phys_addr(phys_addr).as_mut_ptr::<Arena>();
+    unsafe {
+        arena.write(Arena {
+            dlmalloc: Mutex::new(dlmalloc::Dlmalloc::new_with_allocator(
+                DlmallocSystemAllocator {
+                    arena_index: cpu_index,
+                },
+            )),
+            remote_frees: AtomicPtr::new(null_mut()),
+        });
+    }
+    // Only this CPU creates its arena
+    ARENAS[cpu_index].store(arena, Ordering::Release);
+    Some(unsafe { &*arena })
+}
+
+/// Returns descriptor of the page of arena memory (CPMM or vmalloc)
+fn page_descriptor(virt_addr: VirtAddr) -> &'static PageDescriptor {
+    let phys_addr = if vmalloc::is_vmalloc_addr(virt_addr) {
+        PageTables::current()
+            .translate(virt_addr)
+            .expect("Arena memory not mapped")
+            .0
+    } else {
+        virtual_memory_manager::phys_addr_from_virt_addr_from_cpmm(virt_addr)
+    };
+    physical_memory_manager::page_descriptor(phys_addr).expect("Arena memory without descriptor")
+}
+
+/// Tags or untags all pages of the segment
+fn set_segment_arena(ptr: *mut u8, size: usize, arena_index: Option<usize>) {
+    for offset in (0..size).step_by(PAGE_SIZE) {
+        let page_descriptor = page_descriptor(VirtAddr::from_ptr(ptr) + offset as u64);
+        match arena_index {
+            Some(arena_index) => page_descriptor.set_arena(arena_index),
+            None => page_descriptor.clear_arena(),
+        }
+    }
+}
+
+/// "System" allocator required for dlmalloc allocator
+///
+/// Wrapper over buddy allocator, sizes not suitable for it are allocated with vmalloc
+///
+/// Allocated memory is zeroed, grown part of remapped segment isn't (dlmalloc relies on zeroes only for new chunks)
+struct DlmallocSystemAllocator {
+    arena_index: usize,
+}
+
+unsafe impl dlmalloc::Allocator for DlmallocSystemAllocator {
+    fn alloc(&self, size: usize) -> (*mut u8, usize, u32) {
+        let (ptr, size) = if is_buddy_size(size) {
+            let phys_addr = unsafe {
+                physical_memory_manager::alloc_zeroed(
+                    &[
+                        MemoryZoneEnum::High,
+                        MemoryZoneEnum::Dma32,
+                        MemoryZoneEnum::IsaDma,
+                    ],
+                    size,
+                )
+            };
+            if phys_addr.is_null() {
+                return (null_mut(), 0, 0);
+            }
+            let virt_addr = virtual_memory_manager::virt_addr_in_cpmm_from_phys_addr(phys_addr);
+            (virt_addr.as_mut_ptr(), size)
+        } else {
+            let ptr = vmalloc::vzalloc(size);
+            if ptr.is_null() {
+                return (null_mut(), 0, 0);
+            }
+            (
+                ptr,
+                x86_64::align_up(size as u64, PAGE_SIZE as u64) as usize,
+            )
+        };
+        set_segment_arena(ptr, size, Some(self.arena_index));
+        (ptr, size, 0)
+    }
+
+    fn remap(&self, ptr: *mut u8, oldsize: usize, newsize: usize, can_move: bool) -> *mut u8 {
+        debug_assert!(!ptr.is_null(), "dlmalloc tries to remap null ptr");
+        let virt_addr = VirtAddr::from_ptr(ptr);
+        if vmalloc::is_vmalloc_addr(virt_addr) {
+            // dlmalloc allocates, copies and frees itself
+            return null_mut();
+        }
+        let old_block_size = buddy_block_size(oldsize);
+        let new_block_size = buddy_block_size(newsize);
+        if new_block_size == old_block_size {
+            return ptr;
+        }
+        let phys_addr = virtual_memory_manager::phys_addr_from_virt_addr_from_cpmm(virt_addr);
+
+        if !can_move {
+            if new_block_size < old_block_size {
+                return if self.free_part(ptr, oldsize, newsize) {
+                    ptr
+                } else {
+                    null_mut()
+                };
+            }
+            if !unsafe {
+                physical_memory_manager::resize_in_place(phys_addr, old_block_size, new_block_size)
+            } {
+                return null_mut();
+            }
+            set_segment_arena(
+                unsafe { ptr.add(old_block_size) },
+                new_block_size - old_block_size,
+                Some(self.arena_index),
+            );
+            return ptr;
+        }
+
+        // The old pages may be freed and taken by other CPU, their tags are cleared before
+        set_segment_arena(ptr, old_block_size, None);
+        let new_phys_addr = unsafe {
+            physical_memory_manager::realloc(phys_addr, old_block_size, new_block_size, false)
+        };
+        if new_phys_addr.is_null() {
+            set_segment_arena(ptr, old_block_size, Some(self.arena_index));
+            return null_mut();
+        }
+        let new_ptr =
+            virtual_memory_manager::virt_addr_in_cpmm_from_phys_addr(new_phys_addr).as_mut_ptr();
+        set_segment_arena(new_ptr, new_block_size, Some(self.arena_index));
+        new_ptr
+    }
+
+    fn free_part(&self, ptr: *mut u8, oldsize: usize, newsize: usize) -> bool {
+        debug_assert!(!ptr.is_null(), "dlmalloc tries to free part of null ptr");
+        let virt_addr = VirtAddr::from_ptr(ptr);
+        if vmalloc::is_vmalloc_addr(virt_addr) {
+            return false;
+        }
+        let old_block_size = buddy_block_size(oldsize);
+        let new_block_size = buddy_block_size(newsize);
+        if new_block_size >= old_block_size {
+            // Nothing to release, the segment keeps its block
+            return false;
+        }
+
+        let tail = unsafe { ptr.add(new_block_size) };
+        set_segment_arena(tail, old_block_size - new_block_size, None);
+        let resized = unsafe {
+            physical_memory_manager::resize_in_place(
+                virtual_memory_manager::phys_addr_from_virt_addr_from_cpmm(virt_addr),
+                old_block_size,
+                new_block_size,
+            )
+        };
+        if !resized {
+            set_segment_arena(
+                tail,
+                old_block_size - new_block_size,
+                Some(self.arena_index),
+            );
+        }
+        resized
+    }
+
+    fn free(&self, ptr: *mut u8, size: usize) -> bool {
+        debug_assert!(!ptr.is_null(), "dlmalloc tries to free null ptr");
+
+        let virt_addr = VirtAddr::from_ptr(ptr);
+        if vmalloc::is_vmalloc_addr(virt_addr) {
+            set_segment_arena(ptr, size, None);
+            unsafe {
+                virtual_memory_manager::vfree(ptr);
+            }
+            return true;
+        }
+
+        let block_size = buddy_block_size(size);
+        set_segment_arena(ptr, block_size, None);
+        let phys_addr = virtual_memory_manager::phys_addr_from_virt_addr_from_cpmm(virt_addr);
+        unsafe {
+            physical_memory_manager::free(phys_addr, block_size);
+        }
+
+        true
+    }
+
+    fn can_release_part(&self, _flags: u32) -> bool {
+        true
+    }
+
+    fn allocates_zeros(&self) -> bool {
+        true
+    }
+
+    fn page_size(&self) -> usize {
+        PAGE_SIZE
+    }
+}
+
+/// Checks if the size can be allocated by buddy allocator
+#[inline]
+fn is_buddy_size(size: usize) -> bool {
+    size >= PAGE_SIZE && size.is_power_of_two()
+}
+
+/// Buddy allocator block of a segment in the CPMM, remapped and trimmed segments have sizes not suitable for it
+#[inline]
+fn buddy_block_size(size: usize) -> usize {
+    size.next_power_of_two().max(PAGE_SIZE)
+}
@@ -0,0 +1,112 @@
+// Size classes of small allocations
+//
+// Power of two sizes from 8 to 2048 bytes, each class is a slab cache with per-CPU magazines.
+// Objects are aligned to the class size.
+
+use crate::memory_management::slab_allocator::{
+    DefaultMemoryBackend, MagazineCache, MagazineCacheStats,
+};
+use crate::memory_management::PAGE_SIZE;
+use core::alloc::Layout;
+use slab_allocator_lib::{Cache, ObjectSizeType};
+use spin::Once;
+
+/// Smallest class
+const MIN_SIZE_CLASS: usize = 8;
+
+/// Biggest class, bigger allocations go to arenas
+pub const MAX_SIZE_CLASS: usize = 2048;
+
+/// Slab size of classes with large objects
+const LARGE_SLAB_SIZE: usize = 8 * PAGE_SIZE;
+
+macro_rules! size_classes {
+    ($($index:literal => $object:ident, $cache:ident, $size:literal, $object_size_type:ident, $slab_size:expr;)*) => {
+        $(
+            #[repr(C, align($size))]
+            struct $object([u8; $size]);
+
+            static $cache: Once<MagazineCache<$object, DefaultMemoryBackend>> = Once::new();
+        )*
+
+        /// Creates caches of all classes
+        pub fn init() {
+            $(
+                $cache.call_once(|| {
+                    MagazineCache::new(
+                        Cache::new(
+                            $slab_size,
+                            PAGE_SIZE,
+                            ObjectSizeType::$object_size_type,
+                            DefaultMemoryBackend,
+                        )
+                        .unwrap_or_else(|error| {
+                            panic!("Failed to create {} bytes size class cache: {error}", $size)
+                        }),
+                    )
+                });
+            )*
+        }
+
+        /// Passes class size and statistics of each class to the function
+        pub fn for_each_stats(mut function: impl FnMut(usize, MagazineCacheStats)) {
+            $(
+                function(
+                    $size,
+                    $cache.get().expect("Size class caches not set").stats(),
+                );
+            )*
+        }
+
+        /// Allocs object of the class
+        ///
+        /// May return null ptr
+        #[inline]
+        pub fn alloc(index: usize) -> *mut u8 {
+            match index {
+                $($index => $cache.get().expect("Size class caches not set").alloc().cast(),)*
+                _ => unreachable!("Invalid size class {index}"),
+            }
+        }
+
+        /// Frees object of the class
+        ///
+        /// # Safety
+        /// ptr must be allocated from the class
+        #[inline]
+        pub unsafe fn free(index: usize, ptr: *mut u8) {
+            match index {
+                $($index => unsafe {
+                    $cache.get().expect("Size class caches not set").free(ptr.cast())
+                },)*
+                _ => unreachable!("Invalid size class {index}"),
+            }
+        }
+    };
+}
+
+size_classes! {
+    0 => Object8, SIZE_CLASS_8, 8, Small, PAGE_SIZE;
+    1 => Object16, SIZE_CLASS_16, 16, Small, PAGE_SIZE;
+    2 => Object32, SIZE_CLASS_32, 32, Small, PAGE_SIZE;
+    3 => Object64, SIZE_CLASS_64, 64, Small, PAGE_SIZE;
+    4 => Object128, SIZE_CLASS_128, 128, Small, PAGE_SIZE;
+    5 => Object256, SIZE_CLASS_256, 256, Small, PAGE_SIZE;
+    6 => Object512, SIZE_CLASS_512, 512, Large, LARGE_SLAB_SIZE;
+    7 => Object1024, SIZE_CLASS_1024, 1024, Large, LARGE_SLAB_SIZE;
+    8 => Object2048, SIZE_CLASS_2048, 2048, Large, LARGE_SLAB_SIZE;
+}
+
+/// Returns index of the class for the layout, None if the layout is too big
+///
+/// The class is the same for alloc and free of the layout
+#[inline]
+pub fn size_class_index(layout: Layout) -> Option<usize> {
+    let class_size = layout
+        .size()
+        .max(layout.align())
+        .max(MIN_SIZE_CLASS)
+        .next_power_of_two();
+    (class_size <= MAX_SIZE_CLASS)
+        .then(|| (class_size.trailing_zeros() - MIN_SIZE_CLASS.trailing_zeros()) as usize)
+}
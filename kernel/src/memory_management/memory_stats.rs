@@ -0,0 +1,379 @@
+// Memory allocator statistics
+//
+// Counters of zones and slab memory are kept per CPU in PerCpu. Only the owning CPU updates them with a plain
+// load and store, so allocation paths don't bounce cache lines. An interrupt on the same CPU may lose an update,
+// statistics tolerate it.
+// Snapshots sum the counters of all CPUs, values of a running system are approximate.
+//
+// Lock wait and hold times are TSC cycles.
+
+use super::numa::{self, MAX_NUMA_NODES};
+use super::physical_memory_manager::{self, MemoryZoneEnum, Migratetype};
+use super::slab_allocator::MagazineCacheStats;
+use crate::scheduler;
+use crate::smp::per_cpu;
+use core::ptr::NonNull;
+use core::sync::atomic::{AtomicU64, Ordering};
+use core::time::Duration;
+
+/// Orders of per-order counters, the last one also counts bigger blocks (4 MB and more)
+pub const STATS_ORDERS_NUMBER: usize = 11;
+
+/// Lowest priority above idle tasks
+const DUMP_PRIORITY: u8 = scheduler::PRIORITIES as u8 - 1;
+
+/// Memory counters of one CPU
+pub struct CpuMemoryStats {
+    /// [node][zone]
+    zones: [[ZoneCounters; MemoryZoneEnum::NUMBER]; MAX_NUMA_NODES],
+    /// Bytes of slabs taken by slab caches from the PMM
+    slab_allocated_bytes: AtomicU64,
+    /// Bytes of slabs returned by slab caches to the PMM
+    slab_freed_bytes: AtomicU64,
+}
+
+struct ZoneCounters {
+    /// Allocated blocks by order
+    allocs: [AtomicU64; STATS_ORDERS_NUMBER],
+    /// Freed blocks by order
+    frees: [AtomicU64; STATS_ORDERS_NUMBER],
+    /// Allocations served by this zone when the preferred zone or node had no memory
+    fallbacks: AtomicU64,
+    /// Failed allocations that preferred this zone
+    failures: AtomicU64,
+    /// Allocations served by the page frame cache without the zone lock
+    cache_hits: AtomicU64,
+    cache_refills: AtomicU64,
+    cache_drains: AtomicU64,
+    /// Blocks allocated from pageblocks of other migratetype
+    steals: AtomicU64,
+    /// Pages moved by compaction
+    migrated_pages: AtomicU64,
+    /// Pageblocks emptied by compaction
+    compacted_pageblocks: AtomicU64,
+    lock_acquisitions: AtomicU64,
+    /// Acquisitions that had to wait
+    lock_contentions: AtomicU64,
+    lock_wait_cycles: AtomicU64,
+    lock_hold_cycles: AtomicU64,
+}
+
+/// Snapshot of a zone of a NUMA node
+#[derive(Clone, Copy, Debug, Default)]
+pub struct ZoneStats {
+    /// Free bytes in the buddy allocator and split pageblocks, blocks in page frame caches aren't free for them
+    pub free_bytes: usize,
+    /// Pages in the zero page pool, they are counted as used
+    pub zero_pool_pages: usize,
+    /// Pageblocks split to pages by migratetype, zeroes if the zone isn't grouped
+    pub split_pageblocks: [usize; Migratetype::NUMBER],
+    /// Allocated minus freed blocks by order
+    pub used_blocks: [u64; STATS_ORDERS_NUMBER],
+    pub allocs: u64,
+    pub frees: u64,
+    pub fallbacks: u64,
+    pub failures: u64,
+    pub cache_hits: u64,
+    pub cache_refills: u64,
+    pub cache_drains: u64,
+    pub steals: u64,
+    pub migrated_pages: u64,
+    pub compacted_pageblocks: u64,
+    pub lock_acquisitions: u64,
+    pub lock_contentions: u64,
+    pub lock_wait_cycles: u64,
+    pub lock_hold_cycles: u64,
+}
+
+impl CpuMemoryStats {
+    pub const fn new() -> Self {
+        Self {
+            zones: [const { [const { ZoneCounters::new() }; MemoryZoneEnum::NUMBER] };
+                MAX_NUMA_NODES],
+            slab_allocated_bytes: AtomicU64::new(0),
+            slab_freed_bytes: AtomicU64::new(0),
+        }
+    }
+}
+
+impl ZoneCounters {
+    const fn new() -> Self {
+        Self {
+            allocs: [const { AtomicU64::new(0) }; STATS_ORDERS_NUMBER],
+            frees: [const { AtomicU64::new(0) }; STATS_ORDERS_NUMBER],
+            fallbacks: AtomicU64::new(0),
+            failures: AtomicU64::new(0),
+            cache_hits: AtomicU64::new(0),
+            cache_refills: AtomicU64::new(0),
+            cache_drains: AtomicU64::new(0),
+            steals: AtomicU64::new(0),
+            migrated_pages: AtomicU64::new(0),
+            compacted_pageblocks: AtomicU64::new(0),
+            lock_acquisitions: AtomicU64::new(0),
+            lock_contentions: AtomicU64::new(0),
+            lock_wait_cycles: AtomicU64::new(0),
+            lock_hold_cycles: AtomicU64::new(0),
+        }
+    }
+}
+
+/// Adds to a counter of the current CPU
+#[inline(always)]
+fn add(counter: &AtomicU64, value: u64) {
+    counter.store(
+        counter.load(Ordering::Relaxed).wrapping_add(value),
+        Ordering::Relaxed,
+    );
+}
+
+#[inline(always)]
+fn local_zone(node: usize, zone: MemoryZoneEnum) -> &'static ZoneCounters {
+    unsafe { &per_cpu::current().memory_stats.zones[node][zone.index()] }
+}
+
+#[inline]
+pub fn record_alloc(node: usize, zone: MemoryZoneEnum, order: usize, fallback: bool) {
+    let counters = local_zone(node, zone);
+    add(&counters.allocs[order.min(STATS_ORDERS_NUMBER - 1)], 1);
+    if fallback {
+        add(&counters.fallbacks, 1);
+    }
+}
+
+#[inline]
+pub fn record_free(node: usize, zone: MemoryZoneEnum, order: usize) {
+    add(
+        &local_zone(node, zone).frees[order.min(STATS_ORDERS_NUMBER - 1)],
+        1,
+    );
+}
+
+#[inline]
+pub fn record_failure(node: usize, zone: MemoryZoneEnum) {
+    add(&local_zone(node, zone).failures, 1);
+}
+
+#[inline]
+pub fn record_cache_hit(node: usize, zone: MemoryZoneEnum) {
+    add(&local_zone(node, zone).cache_hits, 1);
+}
+
+#[inline]
+pub fn record_cache_refill(node: usize, zone: MemoryZoneEnum) {
+    add(&local_zone(node, zone).cache_refills, 1);
+}
+
+#[inline]
+pub fn record_cache_drain(node: usize, zone: MemoryZoneEnum) {
+    add(&local_zone(node, zone).cache_drains, 1);
+}
+
+/// Block was allocated from a pageblock of other migratetype
+#[inline]
+pub fn record_steal(node: usize, zone: MemoryZoneEnum) {
+    add(&local_zone(node, zone).steals, 1);
+}
+
+#[inline]
+pub fn record_compaction(
+    node: usize,
+    zone: MemoryZoneEnum,
+    migrated_pages: usize,
+    compacted_pageblocks: usize,
+) {
+    let counters = local_zone(node, zone);
+    add(&counters.migrated_pages, migrated_pages as u64);
+    add(&counters.compacted_pageblocks, compacted_pageblocks as u64);
+}
+
+/// Zone lock acquired after waiting wait_cycles
+#[inline]
+pub fn record_lock_wait(node: usize, zone: MemoryZoneEnum, contended: bool, wait_cycles: u64) {
+    let counters = local_zone(node, zone);
+    add(&counters.lock_acquisitions, 1);
+    if contended {
+        add(&counters.lock_contentions, 1);
+        add(&counters.lock_wait_cycles, wait_cycles);
+    }
+}
+
+/// Zone lock released after holding it hold_cycles
+#[inline]
+pub fn record_lock_hold(node: usize, zone: MemoryZoneEnum, hold_cycles: u64) {
+    add(&local_zone(node, zone).lock_hold_cycles, hold_cycles);
+}
+
+#[inline]
+pub fn record_slab_alloc(size: usize) {
+    add(
+        unsafe { &per_cpu::current().memory_stats.slab_allocated_bytes },
+        size as u64,
+    );
+}
+
+#[inline]
+pub fn record_slab_free(size: usize) {
+    add(
+        unsafe { &per_cpu::current().memory_stats.slab_freed_bytes },
+        size as u64,
+    );
+}
+
+/// Snapshot of the zone of the node, None if it doesn't exist
+pub fn zone_stats(node: usize, zone: MemoryZoneEnum) -> Option<ZoneStats> {
+    let free_bytes = physical_memory_manager::zone_free_size(node, zone)?;
+    let mut stats = ZoneStats {
+        free_bytes,
+        zero_pool_pages: physical_memory_manager::zero_pool_size(node, zone),
+        split_pageblocks: physical_memory_manager::zone_split_pageblocks(node, zone)
+            .unwrap_or_default(),
+        ..ZoneStats::default()
+    };
+    let mut allocs = [0u64; STATS_ORDERS_NUMBER];
+    let mut frees = [0u64; STATS_ORDERS_NUMBER];
+    for_each_cpu(|cpu_stats| {
+        let counters = &cpu_stats.zones[node][zone.index()];
+        for order in 0..STATS_ORDERS_NUMBER {
+            allocs[order] += counters.allocs[order].load(Ordering::Relaxed);
+            frees[order] += counters.frees[order].load(Ordering::Relaxed);
+        }
+        stats.fallbacks += counters.fallbacks.load(Ordering::Relaxed);
+        stats.failures += counters.failures.load(Ordering::Relaxed);
+        stats.cache_hits += counters.cache_hits.load(Ordering::Relaxed);
+        stats.cache_refills += counters.cache_refills.load(Ordering::Relaxed);
+        stats.cache_drains += counters.cache_drains.load(Ordering::Relaxed);
+        stats.steals += counters.steals.load(Ordering::Relaxed);
+        stats.migrated_pages += counters.migrated_pages.load(Ordering::Relaxed);
+        stats.compacted_pageblocks += counters.compacted_pageblocks.load(Ordering::Relaxed);
+        stats.lock_acquisitions += counters.lock_acquisitions.load(Ordering::Relaxed);
+        stats.lock_contentions += counters.lock_contentions.load(Ordering::Relaxed);
+        stats.lock_wait_cycles += counters.lock_wait_cycles.load(Ordering::Relaxed);
+        stats.lock_hold_cycles += counters.lock_hold_cycles.load(Ordering::Relaxed);
+    });
+    for order in 0..STATS_ORDERS_NUMBER {
+        // Lost updates may make it negative
+        stats.used_blocks[order] = allocs[order].saturating_sub(frees[order]);
+    }
+    stats.allocs = allocs.iter().sum();
+    stats.frees = frees.iter().sum();
+    Some(stats)
+}
+
+/// Bytes of slabs held by all slab caches
+pub fn slab_bytes() -> u64 {
+    let mut allocated = 0u64;
+    let mut freed = 0u64;
+    for_each_cpu(|cpu_stats| {
+        allocated += cpu_stats.slab_allocated_bytes.load(Ordering::Relaxed);
+        freed += cpu_stats.slab_freed_bytes.load(Ordering::Relaxed);
+    });
+    allocated.saturating_sub(freed)
+}
+
+/// Logs snapshots of all zones and slab caches
+pub fn log_stats() {
+    for node in 0..numa::nodes_number() {
+        for zone in MemoryZoneEnum::ALL {
+            let Some(stats) = zone_stats(node, zone) else {
+                continue;
+            };
+            log::info!(
+                "Node {node} {zone:?}: {} KB free, allocs {}, frees {}, fallbacks {}, failures {}",
+                stats.free_bytes / 1024,
+                stats.allocs,
+                stats.frees,
+                stats.fallbacks,
+                stats.failures,
+            );
+            log::info!("    used blocks by order: {:?}", stats.used_blocks);
+            log::info!(
+                "    cache: hits {}, refills {}, drains {}, zero page pool {} pages",
+                stats.cache_hits,
+                stats.cache_refills,
+                stats.cache_drains,
+                stats.zero_pool_pages,
+            );
+            log::info!(
+                "    pageblocks: split {:?} (unmovable, reclaimable, movable), steals {}, \
+                compaction: {} pages migrated, {} pageblocks freed",
+                stats.split_pageblocks,
+                stats.steals,
+                stats.migrated_pages,
+                stats.compacted_pageblocks,
+            );
+            log::info!(
+                "    lock: acquisitions {}, contentions {}, wait {} cycles, hold {} cycles",
+                stats.lock_acquisitions,
+                stats.lock_contentions,
+                stats.lock_wait_cycles,
+                stats.lock_hold_cycles,
+            );
+        }
+    }
+
+    log::info!("Slabs: {} KB", slab_bytes() / 1024);
+    super::general_purpose_allocator::size_class_stats(|size, stats| {
+        log_cache_stats(format_args!("Size class {size}"), &stats);
+    });
+    log_cache_stats(
+        format_args!("SlabInfo cache"),
+        &super::slab_allocator::slab_info_cache_stats(),
+    );
+}
+
+fn log_cache_stats(name: core::fmt::Arguments, stats: &MagazineCacheStats) {
+    if stats.allocs == 0 {
+        return;
+    }
+    log::info!(
+        "{name}: {} objects used, {} cached in magazines, allocs {}, magazine hits {}%, \
+        depot exchanges {}, depot contentions {}, magazine size {}",
+        stats.used_objects(),
+        stats.cached_objects(),
+        stats.allocs,
+        stats.magazine_hits * 100 / (stats.allocs + stats.frees).max(1),
+        stats.depot_exchanges,
+        stats.depot_contentions,
+        stats.magazine_size,
+    );
+}
+
+/// Starts a task that logs statistics every interval
+///
+/// Scheduler and Local APIC timer must be inited
+pub fn start_periodic_dump(interval: Duration) {
+    scheduler::spawn(
+        "memory stats",
+        DUMP_PRIORITY,
+        dump_task,
+        interval.as_millis() as usize,
+    )
+    .expect("Failed to spawn memory stats task");
+}
+
+fn dump_task(interval_ms: usize) {
+    let interval = Duration::from_millis(interval_ms as u64);
+    loop {
+        crate::timers::lapic_timer::add_timer(
+            interval,
+            interval / 10,
+            wake_dump_task,
+            scheduler::current_task().as_ptr() as usize,
+        )
+        .expect("Failed to add memory stats timer");
+        scheduler::block_current();
+        log_stats();
+    }
+}
+
+fn wake_dump_task(task: usize) {
+    scheduler::wake(NonNull::new(task as *mut _).expect("Null memory stats task"));
+}
+
+fn for_each_cpu(mut function: impl FnMut(&CpuMemoryStats)) {
+    for cpu_index in 0..per_cpu::cpus_number() {
+        if let Some(per_cpu) = per_cpu::get(cpu_index) {
+            function(unsafe { &per_cpu.as_ref().memory_stats });
+        }
+    }
+}
@@ -0,0 +1,428 @@
+// NUMA topology
+//
+// Nodes, their memory ranges and CPUs are taken from ACPI SRAT (System Resource Affinity Table),
+// distances between nodes are taken from ACPI SLIT (System Locality Information Table).
+// ACPI proximity domains are renumbered to dense node indexes 0..nodes_number.
+//
+// Without SRAT the machine has one node 0 with all memory and all CPUs.
+
+use crate::acpi::ACPI_TABLES;
+use crate::smp::MAX_CPUS;
+use acpi_lib::sdt::{SdtHeader, Signature};
+use acpi_lib::AcpiTable;
+use spin::Once;
+use tinyvec::ArrayVec;
+use x86_64::PhysAddr;
+
+/// Max number of supported NUMA nodes
+pub const MAX_NUMA_NODES: usize = 8;
+
+/// Distance from the node to itself (ACPI 6.5, 5.2.17)
+const LOCAL_DISTANCE: u8 = 10;
+
+/// Distance between different nodes when SLIT is not present
+const REMOTE_DISTANCE: u8 = 20;
+
+/// Max 52-bit physical address
+const MAX_PHYS_ADDR: u64 = (1 << 52) - 1;
+
+static TOPOLOGY: Once<NumaTopology> = Once::new();
+
+#[derive(Debug, Copy, Clone, Default)]
+struct NodeMemoryRange {
+    /// First byte
+    start: u64,
+    /// Byte after the last
+    end: u64,
+    node: u8,
+}
+
+struct NumaTopology {
+    /// ACPI proximity domain of each node
+    proximity_domains: ArrayVec<[u32; MAX_NUMA_NODES]>,
+    /// [from][to]
+    distances: [[u8; MAX_NUMA_NODES]; MAX_NUMA_NODES],
+    /// Nodes sorted by distance from the node, the node itself is the first
+    fallback_order: [[u8; MAX_NUMA_NODES]; MAX_NUMA_NODES],
+    /// Sorted by start, not overlapping
+    memory_ranges: ArrayVec<[NodeMemoryRange; 64]>,
+    /// (Local APIC ID, node)
+    cpus: ArrayVec<[(u32, u8); MAX_CPUS]>,
+}
+
+impl NumaTopology {
+    /// One node with everything
+    fn single_node() -> Self {
+        let mut proximity_domains = ArrayVec::new();
+        proximity_domains.push(0);
+        let mut topology = Self {
+            proximity_domains,
+            distances: [[REMOTE_DISTANCE; MAX_NUMA_NODES]; MAX_NUMA_NODES],
+            fallback_order: [[0; MAX_NUMA_NODES]; MAX_NUMA_NODES],
+            memory_ranges: ArrayVec::new(),
+            cpus: ArrayVec::new(),
+        };
+        topology.distances[0][0] = LOCAL_DISTANCE;
+        topology
+    }
+
+    #[inline]
+    fn nodes_number(&self) -> usize {
+        self.proximity_domains.len()
+    }
+
+    fn calculate_fallback_order(&mut self) {
+        let nodes_number = self.nodes_number();
+        for node in 0..nodes_number {
+            let nodes = &mut self.fallback_order[node][..nodes_number];
+            for (i, v) in nodes.iter_mut().enumerate() {
+                *v = i as u8;
+            }
+            // The node itself is the first even if some distance is equal to local
+            let distances = &self.distances[node];
+            nodes.sort_unstable_by_key(|v| (distances[*v as usize], *v != node as u8, *v));
+        }
+    }
+
+    /// Returns node index of the proximity domain, adds new node if it's not known
+    fn node_of_proximity_domain(&mut self, proximity_domain: u32) -> u8 {
+        if let Some(node) = self
+            .proximity_domains
+            .iter()
+            .position(|v| *v == proximity_domain)
+        {
+            return node as u8;
+        }
+        if self.proximity_domains.len() == MAX_NUMA_NODES {
+            log::warn!(
+                "Too many NUMA nodes, proximity domain {proximity_domain} is assigned to node 0"
+            );
+            return 0;
+        }
+        self.proximity_domains.push(proximity_domain);
+        (self.proximity_domains.len() - 1) as u8
+    }
+}
+
+// SRAT
+
+#[repr(C, packed)]
+struct Srat {
+    header: SdtHeader,
+    _reserved1: u32,
+    _reserved2: u64,
+}
+
+unsafe impl AcpiTable for Srat {
+    const SIGNATURE: Signature = Signature::SRAT;
+
+    fn header(&self) -> &SdtHeader {
+        &self.header
+    }
+}
+
+/// Common header of SRAT structures
+#[repr(C, packed)]
+struct SratEntryHeader {
+    entry_type: u8,
+    length: u8,
+}
+
+const SRAT_PROCESSOR_LOCAL_APIC_AFFINITY: u8 = 0;
+const SRAT_MEMORY_AFFINITY: u8 = 1;
+const SRAT_PROCESSOR_LOCAL_X2APIC_AFFINITY: u8 = 2;
+
+/// SRAT structures flag, same for all used types
+const SRAT_ENABLED: u32 = 1 << 0;
+
+#[repr(C, packed)]
+struct SratProcessorLocalApicAffinity {
+    header: SratEntryHeader,
+    proximity_domain_low: u8,
+    apic_id: u8,
+    flags: u32,
+    local_sapic_eid: u8,
+    proximity_domain_high: [u8; 3],
+    clock_domain: u32,
+}
+
+#[repr(C, packed)]
+struct SratMemoryAffinity {
+    header: SratEntryHeader,
+    proximity_domain: u32,
+    _reserved1: u16,
+    base_address_low: u32,
+    base_address_high: u32,
+    length_low: u32,
+    length_high: u32,
+    _reserved2: u32,
+    flags: u32,
+    _reserved3: u64,
+}
+
+#[repr(C, packed)]
+struct SratProcessorLocalX2ApicAffinity {
+    header: SratEntryHeader,
+    _reserved1: u16,
+    proximity_domain: u32,
+    x2apic_id: u32,
+    flags: u32,
+    clock_domain: u32,
+    _reserved2: u32,
+}
+
+// SLIT
+
+#[repr(C, packed)]
+struct Slit {
+    header: SdtHeader,
+    number_of_localities: u64,
+    // Matrix [number_of_localities][number_of_localities] of u8 follows
+}
+
+unsafe impl AcpiTable for Slit {
+    const SIGNATURE: Signature = Signature::SLIT;
+
+    fn header(&self) -> &SdtHeader {
+        &self.header
+    }
+}
+
+/// Parses SRAT and SLIT
+///
+/// ACPI tables must be collected, memory allocators are not required
+///
+/// Sets NUMA node of the bootstrap processor
+pub fn init() {
+    let mut topology = parse_topology();
+    topology.calculate_fallback_order();
+    let topology = TOPOLOGY.call_once(|| topology);
+
+    // BSP
+    let bsp_apic_id = raw_cpuid::CpuId::new()
+        .get_feature_info()
+        .expect("CPUID leaf 1 not supported")
+        .initial_local_apic_id() as u32;
+    unsafe {
+        crate::smp::per_cpu::current().numa_node = node_of_apic_id(bsp_apic_id);
+    }
+
+    for node in 0..topology.nodes_number() {
+        log::info!(
+            "NUMA node {node}: proximity domain {}, distances {:?}",
+            topology.proximity_domains[node],
+            &topology.distances[node][..topology.nodes_number()]
+        );
+    }
+}
+
+fn parse_topology() -> NumaTopology {
+    let acpi_tables = ACPI_TABLES.get().expect("ACPI tables not set").lock();
+    let Ok(srat) = acpi_tables.find_table::<Srat>() else {
+        log::info!("No SRAT, single NUMA node");
+        return NumaTopology::single_node();
+    };
+
+    let mut topology = NumaTopology::single_node();
+    topology.proximity_domains.clear();
+    unsafe {
+        parse_srat(&mut topology, srat.virtual_start().as_ptr());
+    }
+    if topology.nodes_number() == 0 {
+        log::warn!("SRAT has no enabled entries, single NUMA node");
+        return NumaTopology::single_node();
+    }
+
+    // Distances
+    for from in 0..MAX_NUMA_NODES {
+        for to in 0..MAX_NUMA_NODES {
+            topology.distances[from][to] = if from == to {
+                LOCAL_DISTANCE
+            } else {
+                REMOTE_DISTANCE
+            };
+        }
+    }
+    if let Ok(slit) = acpi_tables.find_table::<Slit>() {
+        unsafe {
+            parse_slit(&mut topology, slit.virtual_start().as_ptr());
+        }
+    } else {
+        log::info!("No SLIT, default NUMA distances used");
+    }
+
+    topology
+}
+
+/// # Safety
+/// srat must point to the valid SRAT
+unsafe fn parse_srat(topology: &mut NumaTopology, srat: *const Srat) {
+    unsafe {
+        let table_length = (*srat).header.length as usize;
+        let mut offset = size_of::<Srat>();
+        while offset + size_of::<SratEntryHeader>() <= table_length {
+            let entry = srat.cast::<u8>().add(offset);
+            let entry_header = &*entry.cast::<SratEntryHeader>();
+            if entry_header.length == 0 {
+                log::warn!("SRAT entry with zero length");
+                break;
+            }
+
+            match entry_header.entry_type {
+                SRAT_PROCESSOR_LOCAL_APIC_AFFINITY => {
+                    let affinity = entry
+                        .cast::<SratProcessorLocalApicAffinity>()
+                        .read_unaligned();
+                    if affinity.flags & SRAT_ENABLED != 0 {
+                        let proximity_domain = u32::from_le_bytes([
+                            affinity.proximity_domain_low,
+                            affinity.proximity_domain_high[0],
+                            affinity.proximity_domain_high[1],
+                            affinity.proximity_domain_high[2],
+                        ]);
+                        let node = topology.node_of_proximity_domain(proximity_domain);
+                        add_cpu(topology, affinity.apic_id as u32, node);
+                    }
+                }
+                SRAT_PROCESSOR_LOCAL_X2APIC_AFFINITY => {
+                    let affinity = entry
+                        .cast::<SratProcessorLocalX2ApicAffinity>()
+                        .read_unaligned();
+                    if affinity.flags & SRAT_ENABLED != 0 {
+                        let node = topology.node_of_proximity_domain(affinity.proximity_domain);
+                        add_cpu(topology, affinity.x2apic_id, node);
+                    }
+                }
+                SRAT_MEMORY_AFFINITY => {
+                    let affinity = entry.cast::<SratMemoryAffinity>().read_unaligned();
+                    let start = (affinity.base_address_high as u64) << 32
+                        | affinity.base_address_low as u64;
+                    let length = (affinity.length_high as u64) << 32 | affinity.length_low as u64;
+                    if affinity.flags & SRAT_ENABLED != 0 && length != 0 {
+                        let node = topology.node_of_proximity_domain(affinity.proximity_domain);
+                        add_memory_range(topology, start, start + length, node);
+                    }
+                }
+                _ => {}
+            }
+
+            offset += entry_header.length as usize;
+        }
+    }
+}
+
+fn add_cpu(topology: &mut NumaTopology, apic_id: u32, node: u8) {
+    if topology.cpus.iter().any(|(v, _)| *v == apic_id) {
+        return;
+    }
+    if topology.cpus.try_push((apic_id, node)).is_some() {
+        log::warn!("Too many CPUs in SRAT");
+    }
+}
+
+fn add_memory_range(topology: &mut NumaTopology, start: u64, end: u64, node: u8) {
+    if topology
+        .memory_ranges
+        .iter()
+        .any(|v| start < v.end && v.start < end)
+    {
+        log::warn!("SRAT memory range {start:#X}-{end:#X} overlaps other range, ignored");
+        return;
+    }
+    if topology
+        .memory_ranges
+        .try_push(NodeMemoryRange { start, end, node })
+        .is_some()
+    {
+        log::warn!("Too many SRAT memory ranges, {start:#X}-{end:#X} assigned to node 0");
+        return;
+    }
+    topology
+        .memory_ranges
+        .as_mut_slice()
+        .sort_unstable_by_key(|v| v.start);
+}
+
+/// # Safety
+/// slit must point to the valid SLIT
+unsafe fn parse_slit(topology: &mut NumaTopology, slit: *const Slit) {
+    unsafe {
+        let localities = (*slit).number_of_localities as usize;
+        let table_length = (*slit).header.length as usize;
+        if size_of::<Slit>() + localities * localities > table_length {
+            log::warn!("Invalid SLIT size, default NUMA distances used");
+            return;
+        }
+        let matrix = slit.cast::<u8>().add(size_of::<Slit>());
+        for from in 0..topology.nodes_number() {
+            for to in 0..topology.nodes_number() {
+                let from_locality = topology.proximity_domains[from] as usize;
+                let to_locality = topology.proximity_domains[to] as usize;
+                if from_locality >= localities || to_locality >= localities {
+                    continue;
+                }
+                topology.distances[from][to] =
+                    matrix.add(from_locality * localities + to_locality).read();
+            }
+        }
+    }
+}
+
+/// Number of NUMA nodes
+#[inline]
+pub fn nodes_number() -> usize {
+    TOPOLOGY.get().map_or(1, |v| v.nodes_number())
+}
+
+/// Distance between nodes (10 is local)
+#[inline]
+pub fn distance(from: usize, to: usize) -> u8 {
+    TOPOLOGY.get().expect("NUMA topology not set").distances[from][to]
+}
+
+/// Nodes sorted by distance from the node
+#[inline]
+pub fn fallback_order(node: usize) -> &'static [u8] {
+    let topology = TOPOLOGY.get().expect("NUMA topology not set");
+    &topology.fallback_order[node][..topology.nodes_number()]
+}
+
+/// NUMA node of the CPU with the Local APIC ID
+///
+/// 0 if CPU isn't in SRAT
+pub fn node_of_apic_id(apic_id: u32) -> usize {
+    TOPOLOGY
+        .get()
+        .expect("NUMA topology not set")
+        .cpus
+        .iter()
+        .find(|(v, _)| *v == apic_id)
+        .map_or(0, |(_, node)| *node as usize)
+}
+
+/// NUMA node of the current CPU
+#[inline]
+pub fn current_node() -> usize {
+    unsafe { crate::smp::per_cpu::current().numa_node }
+}
+
+/// Returns node of the physical address and the last address of the same node's memory starting from the address
+///
+/// Memory not described by SRAT belongs to node 0
+pub fn node_span(phys_addr: PhysAddr) -> (usize, PhysAddr) {
+    let memory_ranges = &TOPOLOGY.get().expect("NUMA topology not set").memory_ranges;
+    let addr = phys_addr.as_u64();
+    // First range ending after the address
+    let index = memory_ranges.partition_point(|v| v.end <= addr);
+    match memory_ranges.get(index) {
+        Some(range) if range.start <= addr => (range.node as usize, PhysAddr::new(range.end - 1)),
+        Some(range) => (0, PhysAddr::new(range.start - 1)),
+        None => (0, PhysAddr::new(MAX_PHYS_ADDR)),
+    }
+}
+
+/// NUMA node of the physical address
+#[inline]
+pub fn node_of_phys_addr(phys_addr: PhysAddr) -> usize {
+    node_span(phys_addr).0
+}
@@ -1,11 +1,33 @@
+mod compaction;
+mod deferred_init;
+mod page_descriptor_table;
+mod page_frame_cache;
+mod pageblock;
+mod zero_pool;
+
+pub use compaction::{compact, start as start_compaction};
+pub use deferred_init::{is_finished as deferred_init_finished, start as start_deferred_init};
+
+pub use page_descriptor_table::{page_descriptor, PageDescriptor};
+pub use page_frame_cache::PageFrameCaches;
+pub use pageblock::{Migratetype, PAGEBLOCK_SIZE};
+pub use zero_pool::{
+    needs_refill as zero_pool_needs_refill, pool_size as zero_pool_size, refill as refill_zero_pool,
+};
+
+use super::memory_stats;
+use super::numa::{self, MAX_NUMA_NODES};
 use super::{virtual_memory_manager, PAGE_SIZE};
+use crate::boot_profile;
+use crate::sync::{Mutex, MutexGuard};
+use crate::timers::tsc;
+use crate::trace::TraceEvent;
 use bootloader_api::info::{MemoryRegion, MemoryRegionKind};
 use buddy_alloc::BuddyAlloc;
-use core::mem::MaybeUninit;
-use core::ptr::null_mut;
+use core::ops::{Deref, DerefMut};
 use lazy_static::lazy_static;
-use slab_allocator_lib::SlabInfo;
-use spin::{Mutex, Once};
+use pageblock::Pageblocks;
+use spin::Once;
 use tinyvec::ArrayVec;
 use x86_64::PhysAddr;
 
@@ -15,24 +37,279 @@ use x86_64::PhysAddr;
 ///
 /// DMA32 ZONE (16 MB - 4 GB)
 ///
-/// HIGH DMA ZONE (4 GB - 1 TB)
-// TODO: Implement Debug trait
+/// HIGH DMA ZONE (4 GB - 16 TB)
+///
+/// Each NUMA node has its own set of zones
+///
+/// Blocks smaller than a pageblock are grouped by migratetype, see [pageblock]
+///
+/// Statistics are per-CPU, see [memory_stats]
 struct MemoryZone {
     // Buddy allocator
     pub allocator: BuddyAlloc,
-    // Statistics
+    /// Pageblocks of the zone, None if the zone isn't grouped (ISA DMA)
+    pageblocks: Option<Pageblocks>,
+}
+
+impl MemoryZone {
+    /// Allocs block of the size
+    ///
+    /// Blocks smaller than a pageblock are allocated from pageblocks of the migratetype
+    ///
+    /// # Safety
+    /// Allocated memory is uninitialized
+    #[inline]
+    unsafe fn alloc(&mut self, size: usize, migratetype: Migratetype) -> Option<PhysAddr> {
+        match &mut self.pageblocks {
+            Some(pageblocks) if size < PAGEBLOCK_SIZE => {
+                pageblocks.alloc(&mut self.allocator, size, migratetype)
+            }
+            _ => {
+                let allocated_ptr = unsafe { self.allocator.malloc(size) };
+                debug_assert_eq!(
+                    allocated_ptr as usize % PAGE_SIZE,
+                    0,
+                    "Buddy allocator allocates non aligned address"
+                );
+                (!allocated_ptr.is_null()).then(|| PhysAddr::new(allocated_ptr as u64))
+            }
+        }
+    }
+
+    /// Frees block of the size
+    ///
+    /// # Safety
+    /// Block must be allocated by [Self::alloc] with the same size
+    #[inline]
+    unsafe fn free(&mut self, phys_addr: PhysAddr, size: usize) {
+        match &mut self.pageblocks {
+            Some(pageblocks) if size < PAGEBLOCK_SIZE => unsafe {
+                pageblocks.free(&mut self.allocator, phys_addr, size);
+            },
+            _ => unsafe {
+                self.allocator.free(phys_addr.as_u64() as *mut u8);
+            },
+        }
+    }
+
+    /// Resizes block in place
+    ///
+    /// Only blocks of split pageblocks can be resized in place, see [Pageblocks::resize]
+    ///
+    /// # Safety
+    /// Block must be allocated by [Self::alloc] with the old size
+    #[inline]
+    unsafe fn resize_in_place(
+        &mut self,
+        phys_addr: PhysAddr,
+        old_size: usize,
+        new_size: usize,
+    ) -> bool {
+        match &mut self.pageblocks {
+            Some(pageblocks) if old_size < PAGEBLOCK_SIZE && new_size < PAGEBLOCK_SIZE => unsafe {
+                pageblocks.resize(phys_addr, old_size, new_size)
+            },
+            _ => false,
+        }
+    }
+
+    /// Reallocs block in the zone
+    ///
+    /// Blocks of split pageblocks are resized in place. Buddy allocator blocks are reallocated by the buddy allocator:
+    /// it grows them by merging with the free buddy, splits them to shrink or moves them inside the zone.
+    /// Moved data is copied through the CPMM while the zone lock is held, the buddy allocator keeps its metadata
+    /// outside of the memory it manages, so the old block is intact until the lock is released
+    ///
+    /// Returns None if the block can't be reallocated in the zone's allocator,
+    /// grouped blocks crossing the pageblock size move between the buddy allocator and pageblocks
+    ///
+    /// # Safety
+    /// Block must be allocated by [Self::alloc] with the old size
+    unsafe fn realloc(
+        &mut self,
+        phys_addr: PhysAddr,
+        old_size: usize,
+        new_size: usize,
+        ignore_data: bool,
+    ) -> Option<PhysAddr> {
+        if self.pageblocks.is_some() && (old_size < PAGEBLOCK_SIZE || new_size < PAGEBLOCK_SIZE) {
+            return unsafe { self.resize_in_place(phys_addr, old_size, new_size) }
+                .then_some(phys_addr);
+        }
+
+        let reallocated_ptr = unsafe {
+            self.allocator
+                .realloc(phys_addr.as_u64() as *mut u8, new_size, true)
+        };
+        if reallocated_ptr.is_null() {
+            return None;
+        }
+        let reallocated_addr = PhysAddr::new(reallocated_ptr as u64);
+        if reallocated_addr != phys_addr && !ignore_data {
+            // Blocks may overlap if the old block is merged with its lower buddy
+            unsafe {
+                core::ptr::copy(
+                    virtual_memory_manager::virt_addr_in_cpmm_from_phys_addr(phys_addr)
+                        .as_ptr::<u8>(),
+                    virtual_memory_manager::virt_addr_in_cpmm_from_phys_addr(reallocated_addr)
+                        .as_mut_ptr::<u8>(),
+                    old_size.min(new_size),
+                );
+            }
+        }
+        Some(reallocated_addr)
+    }
+
+    /// Releases usable memory at init
+    ///
+    /// # Safety
+    /// Memory must be usable and reserved in the buddy allocator
+    unsafe fn release_range(&mut self, phys_addr: PhysAddr, size: usize) {
+        match &mut self.pageblocks {
+            Some(pageblocks) => unsafe {
+                pageblocks.release_range(&mut self.allocator, phys_addr, size);
+            },
+            None => unsafe {
+                self.allocator
+                    .unsafe_release_range(phys_addr.as_u64() as *mut u8, size);
+            },
+        }
+    }
+
+    /// Free bytes in the buddy allocator and in split pageblocks
+    #[inline]
+    fn free_size(&self) -> usize {
+        let arena_free_size = unsafe { self.allocator.arena_free_size() };
+        arena_free_size
+            + self
+                .pageblocks
+                .as_ref()
+                .map_or(0, |pageblocks| pageblocks.free_size())
+    }
 }
 
-#[derive(Debug, Copy, Clone)]
+/// Locked zone, lock wait and hold times go to the statistics
+struct ZoneGuard {
+    guard: MutexGuard<'static, MemoryZone>,
+    node: usize,
+    zone: MemoryZoneEnum,
+    /// TSC when the lock was acquired
+    acquired: u64,
+}
+
+#[derive(Debug, Copy, Clone, PartialEq)]
 pub enum MemoryZoneEnum {
     /// (1-16 MB)
     IsaDma,
     /// (16 MB - 4 GB)
     Dma32,
-    /// (4 GB - 1 TB)
+    /// (4 GB - 16 TB)
     High,
 }
 
+impl MemoryZoneEnum {
+    /// Number of zones
+    pub const NUMBER: usize = 3;
+
+    /// All zones
+    pub const ALL: [MemoryZoneEnum; Self::NUMBER] = [
+        MemoryZoneEnum::IsaDma,
+        MemoryZoneEnum::Dma32,
+        MemoryZoneEnum::High,
+    ];
+
+    /// Index of the zone in per-zone arrays
+    #[inline]
+    pub const fn index(self) -> usize {
+        self as usize
+    }
+
+    /// Zone's allocator on the NUMA node
+    #[inline]
+    fn zone(self, node: usize) -> &'static Once<Mutex<MemoryZone>> {
+        &ZONES[node][self.index()]
+    }
+
+    /// Locks zone's allocator on the NUMA node
+    ///
+    /// Zone must exist
+    #[inline]
+    fn lock(self, node: usize) -> ZoneGuard {
+        let memory_zone = self
+            .zone(node)
+            .get()
+            .expect("Trying to lock non-existing zone");
+        let (guard, contended, wait_started) = match memory_zone.try_lock() {
+            Some(guard) => (guard, false, 0),
+            None => {
+                let wait_started = tsc::read();
+                (memory_zone.lock(), true, wait_started)
+            }
+        };
+        let acquired = tsc::read();
+        memory_stats::record_lock_wait(node, self, contended, acquired - wait_started);
+        ZoneGuard {
+            guard,
+            node,
+            zone: self,
+            acquired,
+        }
+    }
+
+    /// Locks zone's allocator on the NUMA node if it isn't locked
+    ///
+    /// For interrupt handlers, the interrupted code may hold the lock
+    #[inline]
+    fn try_lock(self, node: usize) -> Option<ZoneGuard> {
+        let guard = self
+            .zone(node)
+            .get()
+            .expect("Trying to lock non-existing zone")
+            .try_lock()?;
+        let acquired = tsc::read();
+        memory_stats::record_lock_wait(node, self, false, 0);
+        Some(ZoneGuard {
+            guard,
+            node,
+            zone: self,
+            acquired,
+        })
+    }
+
+    /// Usable regions of the zone
+    #[inline]
+    fn usable_regions(self) -> &'static Mutex<ArrayVec<[UsableRegion; 128]>> {
+        match self {
+            MemoryZoneEnum::IsaDma => &ISA_DMA_USABLE_REGIONS,
+            MemoryZoneEnum::Dma32 => &DMA32_USABLE_REGIONS,
+            MemoryZoneEnum::High => &HIGH_USABLE_REGIONS,
+        }
+    }
+}
+
+impl Deref for ZoneGuard {
+    type Target = MemoryZone;
+
+    #[inline]
+    fn deref(&self) -> &MemoryZone {
+        &self.guard
+    }
+}
+
+impl DerefMut for ZoneGuard {
+    #[inline]
+    fn deref_mut(&mut self) -> &mut MemoryZone {
+        &mut self.guard
+    }
+}
+
+impl Drop for ZoneGuard {
+    #[inline]
+    fn drop(&mut self) {
+        memory_stats::record_lock_hold(self.node, self.zone, tsc::read() - self.acquired);
+    }
+}
+
 /// Specifies from which zones memory can be allocated and the priority in which it should be allocated
 ///
 /// Example:<br>
@@ -43,6 +320,12 @@ pub enum MemoryZoneEnum {
 /// Attempts to allocate memory first from Dma32, then from HIGH, but not trying to allocate memory from ISA DMA<br>
 type MemoryZonesAndPrioritySpecifier = [MemoryZoneEnum];
 
+/// Zones of each NUMA node: [node][zone]
+///
+/// Zone isn't inited if the node has no memory in it
+static ZONES: [[Once<Mutex<MemoryZone>>; MemoryZoneEnum::NUMBER]; MAX_NUMA_NODES] =
+    [const { [const { Once::new() }; MemoryZoneEnum::NUMBER] }; MAX_NUMA_NODES];
+
 // ISA DMA
 
 /// ISA DMA zone: 1 MB - 16 GB
@@ -50,12 +333,6 @@ type MemoryZonesAndPrioritySpecifier = [MemoryZoneEnum];
 /// First usable page: 0x100000
 ///
 /// Last usable page: 0xFFF000
-static ISA_DMA_ZONE: Once<Mutex<MemoryZone>> = Once::new();
-
-/// Reserved metadata for ISA DMA allocator
-///
-/// 16 MB with 4 KB pages requires ~3 KB
-static mut ISA_DMA_ALLOCATOR_METADATA: [u8; 1024 * 3] = [0; 1024 * 3];
 
 /// Address of the first page of the ISA DMA memory (first page of 2nd MB)
 const ISA_DMA_ZONE_MIN_FIRST_PAGE_ADDR: PhysAddr = PhysAddr::new(0x100000);
@@ -78,12 +355,6 @@ const ISA_DMA_ZONE_MAX_SIZE: usize = (ISA_DMA_ZONE_MAX_LAST_PAGE_ADDR.as_u64() a
 /// First usable page: 0x1000000
 ///
 /// Last usable page: 0xFFFF_F000
-static DMA32_ZONE: Once<Mutex<MemoryZone>> = Once::new();
-
-/// Reserved metadata for DMA32 allocator
-///
-/// 4 GB with 4 KB pages requires ~513 KB
-static mut DMA32_ALLOCATOR_METADATA: [u8; 1024 * 513] = [0; 1024 * 513];
 
 /// Address of the first page of the DMA32 memory (first page of 16th MB)
 const DMA32_MIN_FIRST_PAGE_ADDR: PhysAddr = PhysAddr::new(0x1000000);
@@ -98,18 +369,19 @@ const DMA32_MAX_SIZE: usize = (DMA32_MAX_LAST_PAGE_ADDR.as_u64() as usize + PAGE
 
 // HIGH
 
-/// HIGH zone: 4 GB - 1 TB
+/// HIGH zone: 4 GB - 16 TB
+///
+/// Limited by the size of the complete physical memory mapping (CPMM)
 ///
 /// First usable page: 0x1_0000_0000
 ///
-/// Last usable page: 0xFF_FFFF_F000
-static HIGH_ZONE: Once<Mutex<MemoryZone>> = Once::new();
+/// Last usable page: 0xFFF_FFFF_F000
 
 /// Address of the first page of the HIGH memory (first page of 5th GB)
 const HIGH_ZONE_MIN_FIRST_PAGE_ADDR: PhysAddr = PhysAddr::new(0x1_0000_0000);
 
-/// Address of the last page of the HIGH memory (last page of 1st TB)
-const HIGH_ZONE_MAX_LAST_PAGE_ADDR: PhysAddr = PhysAddr::new(0xFF_FFFF_F000);
+/// Address of the last page of the HIGH memory (last page of 16th TB)
+const HIGH_ZONE_MAX_LAST_PAGE_ADDR: PhysAddr = PhysAddr::new(0xFFF_FFFF_F000);
 
 /// HIGH memory size
 #[allow(unused)]
@@ -174,118 +446,87 @@ lazy_static! {
 }
 
 /// Inits Physical Memory Manager and allocators
+///
+/// ACPI tables must be collected (NUMA topology)
+///
+/// Only the first part of HIGH memory is released, see [start_deferred_init]
 pub fn init(boot_info: &bootloader_api::BootInfo) {
-    collect_usable_regions(&boot_info.memory_regions);
-    init_slab_info_ptrs_array();
-    init_allocators();
-
-    // Check lists
-    assert!(USABLE_REGIONS
-        .lock()
-        .iter()
-        .is_sorted_by_key(|v| v.first_page));
-    assert!(USABLE_REGIONS
-        .lock()
-        .iter()
-        .is_sorted_by_key(|v| v.last_page));
-    assert!(USABLE_REGIONS
-        .lock()
-        .iter()
-        .is_sorted_by_key(|v| v.size() >= PAGE_SIZE));
-
-    assert!(ISA_DMA_USABLE_REGIONS
-        .lock()
-        .iter()
-        .is_sorted_by_key(|v| v.first_page));
-    assert!(ISA_DMA_USABLE_REGIONS
-        .lock()
-        .iter()
-        .is_sorted_by_key(|v| v.last_page));
-    assert!(ISA_DMA_USABLE_REGIONS
-        .lock()
-        .iter()
-        .is_sorted_by_key(|v| v.size() >= PAGE_SIZE));
+    {
+        let _phase = boot_profile::phase("collect_usable_regions");
+        collect_usable_regions(&boot_info.memory_regions);
+    }
+    {
+        let _phase = boot_profile::phase("numa::init");
+        numa::init();
+    }
+    deferred_init::init();
+    {
+        let _phase = boot_profile::phase("page_descriptor_table::init");
+        page_descriptor_table::init();
+    }
+    {
+        let _phase = boot_profile::phase("init_allocators");
+        init_allocators();
+    }
 
-    assert!(DMA32_USABLE_REGIONS
-        .lock()
-        .iter()
-        .is_sorted_by_key(|v| v.first_page));
-    assert!(DMA32_USABLE_REGIONS
-        .lock()
-        .iter()
-        .is_sorted_by_key(|v| v.last_page));
-    assert!(DMA32_USABLE_REGIONS
-        .lock()
-        .iter()
-        .is_sorted_by_key(|v| v.size() >= PAGE_SIZE));
+    #[cfg(feature = "pmm-checks")]
+    check_usable_regions();
+}
 
-    assert!(HIGH_USABLE_REGIONS
-        .lock()
-        .iter()
-        .is_sorted_by_key(|v| v.first_page));
-    assert!(HIGH_USABLE_REGIONS
-        .lock()
-        .iter()
-        .is_sorted_by_key(|v| v.last_page));
-    assert!(HIGH_USABLE_REGIONS
-        .lock()
-        .iter()
-        .is_sorted_by_key(|v| v.size() >= PAGE_SIZE));
+/// Checks region lists and free memory of allocators
+///
+/// Quadratic in the number of regions, enabled by pmm-checks feature
+#[cfg(feature = "pmm-checks")]
+fn check_usable_regions() {
+    let usable_regions = USABLE_REGIONS.lock();
+    let zones_usable_regions = MemoryZoneEnum::ALL.map(|zone| zone.usable_regions().lock());
+
+    for regions in core::iter::once(&usable_regions).chain(zones_usable_regions.iter()) {
+        assert!(regions.iter().is_sorted_by_key(|v| v.first_page));
+        assert!(regions.iter().is_sorted_by_key(|v| v.last_page));
+        assert!(regions.iter().all(|v| v.size() >= PAGE_SIZE));
+    }
 
     assert_eq!(
-        USABLE_REGIONS.lock().len(),
-        ISA_DMA_USABLE_REGIONS.lock().len()
-            + DMA32_USABLE_REGIONS.lock().len()
-            + HIGH_USABLE_REGIONS.lock().len()
+        usable_regions.len(),
+        zones_usable_regions
+            .iter()
+            .map(|regions| regions.len())
+            .sum::<usize>()
     );
 
     // Checks if the region is in more than in one zone at the same time.
-    for some_region in USABLE_REGIONS.lock().iter() {
-        let mut was_found_n_times = 0;
-        if ISA_DMA_USABLE_REGIONS
-            .lock()
+    for some_region in usable_regions.iter() {
+        let was_found_n_times = zones_usable_regions
             .iter()
-            .any(|dma_region| some_region == dma_region)
-        {
-            was_found_n_times += 1;
-        }
-        if DMA32_USABLE_REGIONS
-            .lock()
-            .iter()
-            .any(|dma32_region| some_region == dma32_region)
-        {
-            was_found_n_times += 1;
-        }
-        if HIGH_USABLE_REGIONS
-            .lock()
-            .iter()
-            .any(|high_region| some_region == high_region)
-        {
-            was_found_n_times += 1;
-        }
+            .filter(|regions| regions.iter().any(|region| some_region == region))
+            .count();
         assert_eq!(was_found_n_times, 1);
     }
 
-    // Check free memory in allocator and regions
-    if let Some(zone) = ISA_DMA_ZONE.get() {
-        let free_memory_size: usize = ISA_DMA_USABLE_REGIONS.lock().iter().map(|v| v.size()).sum();
-        unsafe {
-            assert_eq!(zone.lock().allocator.arena_free_size(), free_memory_size);
-        }
-    }
-
-    if let Some(zone) = DMA32_ZONE.get() {
-        let free_memory_size: usize = DMA32_USABLE_REGIONS.lock().iter().map(|v| v.size()).sum();
-        unsafe {
-            assert_eq!(zone.lock().allocator.arena_free_size(), free_memory_size);
-        }
-    }
-
-    if let Some(zone) = HIGH_ZONE.get() {
-        let free_memory_size: usize = HIGH_USABLE_REGIONS.lock().iter().map(|v| v.size()).sum();
-        unsafe {
-            assert_eq!(zone.lock().allocator.arena_free_size(), free_memory_size);
+    // Check free memory in allocators and regions
+    for zone in MemoryZoneEnum::ALL {
+        let mut free_memory_size: usize = zones_usable_regions[zone.index()]
+            .iter()
+            .map(|v| v.size())
+            .sum();
+        // Deferred memory isn't released yet
+        if let (MemoryZoneEnum::High, Some(deferred_start)) =
+            (zone, deferred_init::deferred_start())
+        {
+            free_memory_size -= zones_usable_regions[zone.index()]
+                .iter()
+                .filter(|v| v.last_page >= deferred_start)
+                .map(|v| {
+                    (v.last_page + PAGE_SIZE as u64 - v.first_page.max(deferred_start)) as usize
+                })
+                .sum::<usize>();
         }
+        let allocators_free_memory_size: usize = (0..numa::nodes_number())
+            .filter_map(|node| zone.zone(node).get())
+            .map(|memory_zone| memory_zone.lock().free_size())
+            .sum();
+        assert_eq!(allocators_free_memory_size, free_memory_size);
     }
 }
 
@@ -431,401 +672,670 @@ fn adjust_usable_region(
     Some(new_usable_region)
 }
 
-/// Inits array of SlabInfo pointers
-fn init_slab_info_ptrs_array() {
-    // Calculate required memory size for store SlabInfo's
-    // SlabInfo per page from first usable to last usable
-    let first_usable_page_addr = USABLE_REGIONS.lock().first().unwrap().first_page.as_u64();
-    let last_usable_page_addr = USABLE_REGIONS.lock().last().unwrap().last_page.as_u64();
-    let number_of_slab_infos =
-        (last_usable_page_addr + PAGE_SIZE as u64 - first_usable_page_addr) as usize / PAGE_SIZE;
-
-    let mut required_memory_size = number_of_slab_infos * size_of::<*mut SlabInfo>();
-    required_memory_size = x86_64::align_up(required_memory_size as u64, PAGE_SIZE as u64) as usize;
-    assert_eq!(required_memory_size % PAGE_SIZE, 0);
-
-    // Reserve required memory in usable region
-    // Physical address of the array
-    let mut required_memory_phys_addr: PhysAddr = PhysAddr::zero();
-    assert!(USABLE_REGIONS.lock().is_sorted_by_key(|v| { v.first_page }));
-    for usable_region in USABLE_REGIONS.lock().iter_mut().rev() {
-        if usable_region.size() >= required_memory_size + PAGE_SIZE {
-            // Use this region
-            required_memory_phys_addr = usable_region.first_page;
-            usable_region.first_page += required_memory_size as u64;
-            assert!(usable_region.first_page.is_aligned(PAGE_SIZE as u64));
-            assert!(usable_region.size() >= PAGE_SIZE);
-
-            // Don't forget to change data in other list
-            for v in ISA_DMA_USABLE_REGIONS.lock().iter_mut() {
-                if v.first_page == usable_region.first_page - required_memory_size as u64 {
-                    v.first_page = usable_region.first_page;
-                    assert!(v.size() >= PAGE_SIZE);
-                    break;
-                }
-            }
-            for v in DMA32_USABLE_REGIONS.lock().iter_mut() {
-                if v.first_page == usable_region.first_page - required_memory_size as u64 {
-                    v.first_page = usable_region.first_page;
-                    assert!(v.size() >= PAGE_SIZE);
-                    break;
-                }
+/// Reserves memory for PMM's own data before allocators initialization
+///
+/// Memory of the NUMA node is taken from the start or the end of the highest usable region that is big enough,
+/// the region shrinks. A region may hold several nodes, so the start may belong to one node and the end to another.
+/// If the node has no such region, memory is taken from the start of the highest big enough region of any node
+///
+/// Returns physical address of the reserved memory, panics if there is no such region
+fn reserve_boot_memory(size: usize, node: usize) -> PhysAddr {
+    assert!(size != 0 && size % PAGE_SIZE == 0);
+    let mut usable_regions = USABLE_REGIONS.lock();
+    assert!(usable_regions.is_sorted_by_key(|v| { v.first_page }));
+
+    let in_node = |first_page: PhysAddr| {
+        let (span_node, span_last_addr) = numa::node_span(first_page);
+        span_node == node && span_last_addr >= first_page + (size - 1) as u64
+    };
+    let big_enough = |usable_region: &UsableRegion| usable_region.size() >= size + PAGE_SIZE;
+    let node_region = usable_regions
+        .iter()
+        .enumerate()
+        .rev()
+        .filter(|(_, usable_region)| big_enough(*usable_region))
+        .find_map(|(index, usable_region)| {
+            if in_node(usable_region.first_page) {
+                Some((index, false))
+            } else if in_node(usable_region.last_page + PAGE_SIZE as u64 - size as u64) {
+                Some((index, true))
+            } else {
+                None
             }
-            for v in HIGH_USABLE_REGIONS.lock().iter_mut() {
-                if v.first_page == usable_region.first_page - required_memory_size as u64 {
-                    v.first_page = usable_region.first_page;
-                    assert!(v.size() >= PAGE_SIZE);
-                    break;
-                }
+        });
+    let (index, from_end) = node_region
+        .or_else(|| {
+            usable_regions
+                .iter()
+                .rposition(big_enough)
+                .map(|index| (index, false))
+        })
+        .unwrap_or_else(|| panic!("Failed to reserve {size} bytes of boot memory"));
+
+    let usable_region = &mut usable_regions[index];
+    let reserved_memory_phys_addr;
+    if from_end {
+        let last_page = usable_region.last_page;
+        usable_region.last_page -= size as u64;
+        reserved_memory_phys_addr = usable_region.last_page + PAGE_SIZE as u64;
+
+        // Don't forget to change data in other list
+        for v in ISA_DMA_USABLE_REGIONS
+            .lock()
+            .iter_mut()
+            .chain(DMA32_USABLE_REGIONS.lock().iter_mut())
+            .chain(HIGH_USABLE_REGIONS.lock().iter_mut())
+        {
+            if v.last_page == last_page {
+                v.last_page = usable_region.last_page;
+                assert!(v.first_page <= v.last_page);
+                break;
             }
+        }
+    } else {
+        reserved_memory_phys_addr = usable_region.first_page;
+        usable_region.first_page += size as u64;
+        assert!(usable_region.first_page.is_aligned(PAGE_SIZE as u64));
+        assert!(usable_region.size() >= PAGE_SIZE);
 
-            break;
+        // Don't forget to change data in other list
+        for v in ISA_DMA_USABLE_REGIONS
+            .lock()
+            .iter_mut()
+            .chain(DMA32_USABLE_REGIONS.lock().iter_mut())
+            .chain(HIGH_USABLE_REGIONS.lock().iter_mut())
+        {
+            if v.first_page == reserved_memory_phys_addr {
+                v.first_page = usable_region.first_page;
+                assert!(v.size() >= PAGE_SIZE);
+                break;
+            }
         }
     }
+    if node_region.is_none() {
+        log::warn!("Boot memory of node {node} reserved on another node");
+    }
     assert!(
-        !required_memory_phys_addr.is_null(),
-        "Failed to find memory for SlabInfo pointers array"
-    );
-    assert!(required_memory_phys_addr.is_aligned(align_of::<SlabInfo>() as u64));
-    assert!(
-        USABLE_REGIONS.lock().is_sorted_by_key(|v| { v.first_page }),
+        usable_regions.is_sorted_by_key(|v| { v.first_page }),
         "Usable regions sort broken, looks like bug (probably the memory map is not quite right)"
     );
-
-    // Memory reserved, make slice
-    // Convert to virtual address
-    let required_memory_virt_addr =
-        virtual_memory_manager::virt_addr_in_cpmm_from_phys_addr(required_memory_phys_addr);
-    // We don't init memory, because it's may be slow operation, there is no UB, because MaybeUninit used.
-    // For example, a machine with 32 gigabytes of memory will need to initialize 64 megabytes.
-    let slice: &'static mut [MaybeUninit<*mut SlabInfo>] = unsafe {
-        core::slice::from_raw_parts_mut(
-            required_memory_virt_addr.as_mut_ptr(),
-            number_of_slab_infos,
-        )
-    };
-    assert_eq!(size_of_val(slice.first().unwrap()), size_of::<*mut u8>());
-
-    #[allow(static_mut_refs)]
-    unsafe {
-        super::slab_allocator::SLAB_INFO_PTRS.call_once(|| slice);
-    }
+    reserved_memory_phys_addr
 }
 
-/// Inits zone allocators
+/// Inits zone allocators of all NUMA nodes
 fn init_allocators() {
-    // Init allocators
     // Allocator initing:
-    // 1. Detect allocator range size: from first usable page, to last usable page
-    // 2. Calculate metadata size
-    // 3. Find place for metadata at usable physical memory chunk
-    // 4. Init allocator with alignment
+    // 1. Detect allocator range size: from first usable page, to last usable page of the zone on the node
+    //    Range of grouped zones is extended to pageblock boundaries
+    // 2. Calculate metadata size: buddy allocator and pageblocks
+    // 3. Reserve memory for metadata in usable memory
+    // 4. Init allocator with alignment and pageblocks
     // 5. Mark all memory as allocated
     // 6. Mark available memory as free
-
-    // Init DMA allocator
-    #[allow(static_mut_refs)]
-    unsafe {
-        let isa_dma_usable_regions_lock = ISA_DMA_USABLE_REGIONS.lock();
-        if isa_dma_usable_regions_lock.len() != 0 {
+    //
+    // Metadata of all zones is reserved before any allocator releases its memory,
+    // otherwise the reserved memory could be already given to an allocator
+
+    // 1-3
+    let mut zones_metadata: [[Option<(PhysAddr, usize, *mut u8, usize)>; MemoryZoneEnum::NUMBER];
+        MAX_NUMA_NODES] = [[None; MemoryZoneEnum::NUMBER]; MAX_NUMA_NODES];
+    for node in 0..numa::nodes_number() {
+        for zone in MemoryZoneEnum::ALL {
+            let usable_regions = node_zone_usable_regions(node, zone);
+            let (Some(first_region), Some(last_region)) =
+                (usable_regions.first(), usable_regions.last())
+            else {
+                continue;
+            };
             // 1
-            let first_page = isa_dma_usable_regions_lock.first().unwrap().first_page;
-            let last_page = isa_dma_usable_regions_lock.last().unwrap().last_page;
-            let range_size = (last_page + PAGE_SIZE as u64 - first_page) as usize;
+            let grouped = zone != MemoryZoneEnum::IsaDma;
+            let mut first_page = first_region.first_page;
+            let mut range_end = last_region.last_page + PAGE_SIZE as u64;
+            if grouped {
+                first_page = first_page.align_down(PAGEBLOCK_SIZE as u64);
+                range_end = range_end.align_up(PAGEBLOCK_SIZE as u64);
+            }
+            let range_size = (range_end - first_page) as usize;
 
             // 2
-            let metadata_size = BuddyAlloc::sizeof_alignment(range_size, PAGE_SIZE)
-                .expect("Failed to calculate metadata size for ISA DMA allocator!");
-            assert!(metadata_size <= ISA_DMA_ALLOCATOR_METADATA.len());
-
-            // 4
-            ISA_DMA_ZONE.call_once(|| {
-                Mutex::new(MemoryZone {
-                    allocator: BuddyAlloc::init_alignment(
-                        ISA_DMA_ALLOCATOR_METADATA.as_mut_ptr(),
-                        first_page.as_u64() as *mut u8,
-                        range_size,
-                        PAGE_SIZE,
-                    )
-                    .expect("Failed to init ISA DMA buddy allocator!"),
-                })
-            });
-
-            // 5
-            ISA_DMA_ZONE
-                .get()
-                .unwrap()
-                .lock()
-                .allocator
-                .reserve_range(first_page.as_u64() as *mut u8, range_size);
-
-            // 6
-            for usable_region in isa_dma_usable_regions_lock.iter() {
-                ISA_DMA_ZONE
-                    .get()
-                    .unwrap()
-                    .lock()
-                    .allocator
-                    .unsafe_release_range(
-                        usable_region.first_page.as_u64() as *mut u8,
-                        usable_region.size(),
-                    );
+            let mut buddy_metadata_size = BuddyAlloc::sizeof_alignment(range_size, PAGE_SIZE)
+                .expect("Failed to calculate metadata size for zone allocator!");
+            buddy_metadata_size =
+                x86_64::align_up(buddy_metadata_size as u64, PAGE_SIZE as u64) as usize;
+            let mut metadata_size = buddy_metadata_size;
+            if grouped {
+                metadata_size += pageblock::memory_size(range_size);
             }
-            log::info!("ISA DMA allocator inited");
-        } else {
-            log::info!("ISA DMA allocator not inited. No memory.")
+            metadata_size = x86_64::align_up(metadata_size as u64, PAGE_SIZE as u64) as usize;
+
+            // 3
+            let metadata = virtual_memory_manager::virt_addr_in_cpmm_from_phys_addr(
+                reserve_boot_memory(metadata_size, node),
+            )
+            .as_mut_ptr::<u8>();
+            log::debug!(
+                "Node {node} {zone:?} allocator metadata: {} KB",
+                metadata_size / 1024
+            );
+
+            zones_metadata[node][zone.index()] =
+                Some((first_page, range_size, metadata, buddy_metadata_size));
         }
     }
 
-    // Init DMA32 allocator
-    #[allow(static_mut_refs)]
-    unsafe {
-        let dma32_usable_regions_lock = DMA32_USABLE_REGIONS.lock();
-        if dma32_usable_regions_lock.len() != 0 {
-            // 1
-            let first_page = dma32_usable_regions_lock.first().unwrap().first_page;
-            let last_page = dma32_usable_regions_lock.last().unwrap().last_page;
-            let range_size = (last_page + PAGE_SIZE as u64 - first_page) as usize;
-
-            // 2
-            let metadata_size = BuddyAlloc::sizeof_alignment(range_size, PAGE_SIZE)
-                .expect("Failed to calculate metadata size for DMA32 allocator!");
-            assert!(metadata_size <= DMA32_ALLOCATOR_METADATA.len());
+    let mut inited_zones_number = 0;
+    for node in 0..numa::nodes_number() {
+        for zone in MemoryZoneEnum::ALL {
+            let Some((first_page, range_size, metadata, buddy_metadata_size)) =
+                zones_metadata[node][zone.index()]
+            else {
+                continue;
+            };
 
             // 4
-            DMA32_ZONE.call_once(|| {
-                Mutex::new(MemoryZone {
-                    allocator: BuddyAlloc::init_alignment(
-                        DMA32_ALLOCATOR_METADATA.as_mut_ptr(),
+            let mut memory_zone = MemoryZone {
+                allocator: unsafe {
+                    BuddyAlloc::init_alignment(
+                        metadata,
                         first_page.as_u64() as *mut u8,
                         range_size,
                         PAGE_SIZE,
                     )
-                    .expect("Failed to init DMA32 buddy allocator!"),
-                })
-            });
-
-            // 5
-            DMA32_ZONE
-                .get()
-                .unwrap()
-                .lock()
-                .allocator
-                .reserve_range(first_page.as_u64() as *mut u8, range_size);
-
-            // 6
-            for usable_region in dma32_usable_regions_lock.iter() {
-                DMA32_ZONE
-                    .get()
-                    .unwrap()
-                    .lock()
-                    .allocator
-                    .unsafe_release_range(
-                        usable_region.first_page.as_u64() as *mut u8,
-                        usable_region.size(),
-                    );
-            }
-            log::info!("DMA32 allocator inited");
-        } else {
-            log::info!("DMA32 allocator not inited. No memory.")
-        }
-    }
-
-    // Init HIGH allocator
-    unsafe {
-        let high_usable_regions_lock = HIGH_USABLE_REGIONS.lock();
-        if high_usable_regions_lock.len() != 0 {
-            // 1
-            let first_page = high_usable_regions_lock.first().unwrap().first_page;
-            let last_page = high_usable_regions_lock.last().unwrap().last_page;
-            let range_size = (last_page + PAGE_SIZE as u64 - first_page) as usize;
-
-            // 2
-            let mut metadata_size = BuddyAlloc::sizeof_alignment(range_size, PAGE_SIZE)
-                .expect("Failed to calculate metadata size for HIGH allocator!");
-            metadata_size = x86_64::align_up(metadata_size as u64, PAGE_SIZE as u64) as usize;
-            assert_eq!(metadata_size % PAGE_SIZE, 0);
-
-            // 3
-            // For 32 GB with 4KB pages ~ 5 MB
-            // Allocate memory from DMA32
-            let mut high_allocator_metadata: *mut u8 = null_mut();
-            for usable_region in DMA32_USABLE_REGIONS.lock().iter_mut() {
-                if usable_region.size() >= metadata_size + PAGE_SIZE {
-                    high_allocator_metadata = usable_region.first_page.as_u64() as *mut u8;
-                    usable_region.first_page += metadata_size as u64;
-                    assert!(usable_region.first_page.is_aligned(PAGE_SIZE as u64));
-                    assert!(usable_region.size() >= PAGE_SIZE);
-
-                    // Don't forget to change data in other list
-                    for v in USABLE_REGIONS.lock().iter_mut() {
-                        if v.first_page == usable_region.first_page - metadata_size as u64 {
-                            v.first_page = usable_region.first_page;
-                            assert!(v.size() >= PAGE_SIZE);
-                            break;
-                        }
-                    }
-
-                    // Mark allocated memory in DMA32 allocator
-                    DMA32_ZONE
-                        .get()
-                        .unwrap()
-                        .lock()
-                        .allocator
-                        .reserve_range(high_allocator_metadata, metadata_size);
-                    break;
                 }
-            }
-
-            // If HIGH allocator initialization has started, it means that memory is more than 4 GB, and therefore we should definitely find memory in DMA32
-            assert!(!high_allocator_metadata.is_null(), "Failed to allocate memory for HIGH allocator's metadata! It's impossible, looks like bug!");
-
-            // Convert physical address to virtual
-            let high_allocator_metadata = high_allocator_metadata
-                .byte_add(virtual_memory_manager::PHYSICAL_MEMORY_MAPPING_OFFSET as usize);
-
-            // 4
-            HIGH_ZONE.call_once(|| {
-                Mutex::new(MemoryZone {
-                    allocator: BuddyAlloc::init_alignment(
-                        high_allocator_metadata,
-                        first_page.as_u64() as *mut u8,
+                .expect("Failed to init zone buddy allocator!"),
+                pageblocks: (zone != MemoryZoneEnum::IsaDma).then(|| unsafe {
+                    Pageblocks::new(
+                        node,
+                        zone,
+                        first_page,
                         range_size,
-                        PAGE_SIZE,
+                        metadata.add(buddy_metadata_size),
                     )
-                    .expect("Failed to init HIGH buddy allocator!"),
-                })
-            });
-
-            // 5
-            HIGH_ZONE
-                .get()
-                .unwrap()
-                .lock()
-                .allocator
-                .reserve_range(first_page.as_u64() as *mut u8, range_size);
-
-            // 6
-            for usable_region in high_usable_regions_lock.iter() {
-                HIGH_ZONE
-                    .get()
-                    .unwrap()
-                    .lock()
+                }),
+            };
+
+            unsafe {
+                // 5
+                memory_zone
                     .allocator
-                    .unsafe_release_range(
-                        usable_region.first_page.as_u64() as *mut u8,
-                        usable_region.size(),
-                    );
+                    .reserve_range(first_page.as_u64() as *mut u8, range_size);
+
+                // 6
+                // Regions are taken again, reserving could change them
+                // Deferred HIGH memory is released later
+                let release_end = match (zone, deferred_init::deferred_start()) {
+                    (MemoryZoneEnum::High, Some(deferred_start)) => deferred_start.as_u64(),
+                    _ => u64::MAX,
+                };
+                for usable_region in node_zone_usable_regions(node, zone).iter() {
+                    let first = usable_region.first_page.as_u64();
+                    let end =
+                        (usable_region.last_page.as_u64() + PAGE_SIZE as u64).min(release_end);
+                    if end <= first {
+                        continue;
+                    }
+                    memory_zone.release_range(PhysAddr::new(first), (end - first) as usize);
+                }
             }
-            log::info!("HIGH allocator inited");
-        } else {
-            log::info!("HIGH allocator not inited. No memory.")
+
+            zone.zone(node).call_once(|| Mutex::new(memory_zone));
+            inited_zones_number += 1;
+            log::info!("Node {node} {zone:?} allocator inited");
         }
     }
 
-    if ISA_DMA_ZONE.get().is_none() && DMA32_ZONE.get().is_none() && HIGH_ZONE.get().is_none() {
+    if inited_zones_number == 0 {
         panic!("Physical memory allocator initialization failed! All buddy allocators not inited!");
     }
 }
 
+/// Returns usable regions of the zone that belong to the NUMA node
+fn node_zone_usable_regions(node: usize, zone: MemoryZoneEnum) -> ArrayVec<[UsableRegion; 128]> {
+    let mut node_zone_usable_regions = ArrayVec::new();
+    for usable_region in zone.usable_regions().lock().iter() {
+        // Region may contain memory of several nodes
+        let mut first_page = usable_region.first_page;
+        loop {
+            let (span_node, span_last_addr) = numa::node_span(first_page);
+            // Page crossing the node boundary belongs to the first node
+            let last_page = usable_region
+                .last_page
+                .min(span_last_addr.align_down(PAGE_SIZE as u64))
+                .max(first_page);
+            if span_node == node && last_page >= first_page {
+                node_zone_usable_regions.push(UsableRegion {
+                    first_page,
+                    last_page,
+                });
+            }
+            if last_page >= usable_region.last_page {
+                break;
+            }
+            first_page = last_page + PAGE_SIZE as u64;
+        }
+    }
+    node_zone_usable_regions
+}
+
 /// Allocs memory from zone using buddy allocators
 ///
 /// request_size must be one or more pages
 ///
 /// MemoryZonesAndPrioritySpecifier specifies from which zones memory can be allocated and the priority in which it should be allocated
 ///
+/// Memory of the current CPU's NUMA node is preferred, other nodes are tried in order of distance (SLIT),
+/// all zones of the specifier are tried on the node before going to the next node.
+///
+/// Small blocks (up to 32 KB) are taken from the current CPU's page frame cache, the zone lock is taken only to refill it.<br>
+/// If there is no memory in the zones, all page frame caches are drained and allocation is retried.
+///
+/// Memory is unmovable, see [alloc_with_migratetype]
+///
 /// May be slow because may wait lock
 ///
 /// # Safety
 /// May return null address<br>
-/// Allocated memory is uninitialized
+/// Allocated memory is uninitialized, see [alloc_zeroed]
+#[inline]
 pub unsafe fn alloc(
     memory_zones_and_priority_specifier: &MemoryZonesAndPrioritySpecifier,
     requested_size: usize,
+) -> PhysAddr {
+    unsafe {
+        alloc_with_migratetype(
+            memory_zones_and_priority_specifier,
+            requested_size,
+            Migratetype::Unmovable,
+        )
+    }
+}
+
+/// Allocs memory of the migratetype
+///
+/// Same as [alloc], blocks smaller than a pageblock are grouped with blocks of the same migratetype.
+/// If blocks bigger than 32 KB can't be allocated, compaction of the first zone of the specifier is requested
+///
+/// # Safety
+/// May return null address<br>
+/// Allocated memory is uninitialized<br>
+/// Movable memory must be mapped by vmalloc_movable, otherwise compaction can't move it
+pub unsafe fn alloc_with_migratetype(
+    memory_zones_and_priority_specifier: &MemoryZonesAndPrioritySpecifier,
+    requested_size: usize,
+    migratetype: Migratetype,
 ) -> PhysAddr {
     debug_assert!(
         requested_size >= PAGE_SIZE && requested_size.is_power_of_two(),
         "Requested size must be one or more pages"
     );
 
-    for requested_memory_zone_specifier in memory_zones_and_priority_specifier.iter() {
-        let requested_memory_zone = match requested_memory_zone_specifier {
-            MemoryZoneEnum::IsaDma => &ISA_DMA_ZONE,
-            MemoryZoneEnum::Dma32 => &DMA32_ZONE,
-            MemoryZoneEnum::High => &HIGH_ZONE,
-        };
+    let current_node = numa::current_node();
+    let alloc_by_distance = || {
+        numa::fallback_order(current_node).iter().find_map(|node| {
+            alloc_from_zones(
+                *node as usize,
+                memory_zones_and_priority_specifier,
+                requested_size,
+                *node as usize != current_node,
+                migratetype,
+            )
+        })
+    };
+
+    if let Some(allocated_addr) = alloc_by_distance() {
+        return allocated_addr;
+    }
+
+    // Memory pressure
+    // Cached blocks may be merged by buddy allocators with their buddies
+    zero_pool::drain_all();
+    page_frame_cache::drain_all();
+    alloc_by_distance().unwrap_or_else(|| {
+        memory_stats::record_failure(current_node, memory_zones_and_priority_specifier[0]);
+        if page_frame_cache::size_to_order(requested_size) > page_frame_cache::MAX_CACHED_ORDER {
+            compaction::request(current_node, memory_zones_and_priority_specifier[0]);
+        }
+        PhysAddr::zero()
+    })
+}
+
+/// Allocs memory only from zones of the NUMA node
+///
+/// Same as [alloc], but without fallback to other nodes, memory is unmovable
+///
+/// # Safety
+/// May return null address<br>
+/// Allocated memory is uninitialized
+pub unsafe fn alloc_on_node(
+    node: usize,
+    memory_zones_and_priority_specifier: &MemoryZonesAndPrioritySpecifier,
+    requested_size: usize,
+) -> PhysAddr {
+    debug_assert!(
+        requested_size >= PAGE_SIZE && requested_size.is_power_of_two(),
+        "Requested size must be one or more pages"
+    );
+    assert!(node < numa::nodes_number(), "Invalid NUMA node");
+
+    if let Some(allocated_addr) = alloc_from_zones(
+        node,
+        memory_zones_and_priority_specifier,
+        requested_size,
+        false,
+        Migratetype::Unmovable,
+    ) {
+        return allocated_addr;
+    }
+
+    zero_pool::drain_all();
+    page_frame_cache::drain_all();
+    alloc_from_zones(
+        node,
+        memory_zones_and_priority_specifier,
+        requested_size,
+        false,
+        Migratetype::Unmovable,
+    )
+    .unwrap_or_else(|| {
+        memory_stats::record_failure(node, memory_zones_and_priority_specifier[0]);
+        PhysAddr::zero()
+    })
+}
+
+/// Allocs zeroed memory
+///
+/// Same as [alloc], but single pages are taken from the zero page pool of the current CPU's NUMA node
+/// (pages zeroed by idle CPUs), other sizes and pool misses are zeroed here
+///
+/// # Safety
+/// May return null address
+pub unsafe fn alloc_zeroed(
+    memory_zones_and_priority_specifier: &MemoryZonesAndPrioritySpecifier,
+    requested_size: usize,
+) -> PhysAddr {
+    if requested_size == PAGE_SIZE {
+        if let Some(phys_addr) =
+            zero_pool::take(numa::current_node(), memory_zones_and_priority_specifier)
+        {
+            return phys_addr;
+        }
+    }
+
+    let phys_addr = unsafe { alloc(memory_zones_and_priority_specifier, requested_size) };
+    if !phys_addr.is_null() {
+        unsafe {
+            virtual_memory_manager::virt_addr_in_cpmm_from_phys_addr(phys_addr)
+                .as_mut_ptr::<u8>()
+                .write_bytes(0, requested_size);
+        }
+    }
+    phys_addr
+}
+
+/// Tries to alloc memory from zones of the node in priority order
+///
+/// other_node: the node isn't the preferred one, any allocation is a fallback
+fn alloc_from_zones(
+    node: usize,
+    memory_zones_and_priority_specifier: &MemoryZonesAndPrioritySpecifier,
+    requested_size: usize,
+    other_node: bool,
+    migratetype: Migratetype,
+) -> Option<PhysAddr> {
+    let order = page_frame_cache::size_to_order(requested_size);
+
+    for (priority, requested_memory_zone_specifier) in
+        memory_zones_and_priority_specifier.iter().enumerate()
+    {
+        let fallback = other_node || priority != 0;
+        if order <= page_frame_cache::MAX_CACHED_ORDER {
+            if let Some(allocated_addr) =
+                page_frame_cache::alloc(node, *requested_memory_zone_specifier, order, migratetype)
+            {
+                memory_stats::record_alloc(node, *requested_memory_zone_specifier, order, fallback);
+                crate::trace_event!(
+                    TraceEvent::PmmAlloc,
+                    allocated_addr.as_u64(),
+                    requested_size
+                );
+                return Some(allocated_addr);
+            }
+            continue;
+        }
+
         // Zone exist?
-        if let Some(requested_memory_zone) = requested_memory_zone.get() {
+        if requested_memory_zone_specifier.zone(node).get().is_some() {
             // Try to alloc memory from zone
-            let allocated_ptr = unsafe {
-                requested_memory_zone
-                    .lock()
-                    .allocator
-                    .malloc(requested_size)
+            let allocated_addr = unsafe {
+                requested_memory_zone_specifier
+                    .lock(node)
+                    .alloc(requested_size, migratetype)
             };
-            if !allocated_ptr.is_null() {
-                debug_assert_eq!(
-                    allocated_ptr as usize % PAGE_SIZE,
-                    0,
-                    "Buddy allocator allocates non aligned address"
+            if let Some(allocated_addr) = allocated_addr {
+                memory_stats::record_alloc(node, *requested_memory_zone_specifier, order, fallback);
+                crate::trace_event!(
+                    TraceEvent::PmmAlloc,
+                    allocated_addr.as_u64(),
+                    requested_size
                 );
-                return PhysAddr::new(allocated_ptr as u64);
+                return Some(allocated_addr);
             }
         }
     }
-    PhysAddr::zero()
+    None
 }
 
 /// Frees memory to buddy allocator
 ///
+/// size must be the size used for allocation
+///
+/// Small blocks (up to 32 KB) are returned to the current CPU's page frame cache
+///
 /// May be slow because may wait lock
 ///
 /// # Safety
 /// Freed memory must be previously allocated memory
-pub unsafe fn free(freed_addr: PhysAddr) {
+pub unsafe fn free(freed_addr: PhysAddr, size: usize) {
     debug_assert!(!freed_addr.is_null(), "Trying to free null address");
     debug_assert!(
         freed_addr.is_aligned(PAGE_SIZE as u64),
         "Trying to free non aligned address"
     );
+    debug_assert!(
+        size >= PAGE_SIZE && size.is_power_of_two(),
+        "Trying to free invalid size"
+    );
+    debug_assert!(
+        page_descriptor(freed_addr)
+            .is_none_or(|descriptor| descriptor.flags() & PageDescriptor::FLAG_ZEROED == 0),
+        "Trying to free page of the zero page pool"
+    );
+    crate::trace_event!(TraceEvent::PmmFree, freed_addr.as_u64(), size);
 
-    let memory_zone = get_zone_allocator_by_addr(freed_addr);
+    let (node, memory_zone) = get_zone_by_addr(freed_addr);
+
+    let order = page_frame_cache::size_to_order(size);
+    memory_stats::record_free(node, memory_zone, order);
+    if order <= page_frame_cache::MAX_CACHED_ORDER {
+        unsafe {
+            page_frame_cache::free(node, memory_zone, order, freed_addr);
+        }
+        return;
+    }
 
+    assert!(
+        memory_zone.zone(node).get().is_some(),
+        "Trying to free memory from non-existing zone"
+    );
     unsafe {
+        memory_zone.lock(node).free(freed_addr, size);
+    }
+}
+
+/// Free bytes in the zone of the node (buddy allocator and split pageblocks), None if the zone doesn't exist
+pub fn zone_free_size(node: usize, zone: MemoryZoneEnum) -> Option<usize> {
+    zone.zone(node).get()?;
+    Some(zone.lock(node).free_size())
+}
+
+/// Number of split pageblocks of the zone of the node by migratetype, None if the zone doesn't exist or isn't grouped
+pub fn zone_split_pageblocks(
+    node: usize,
+    zone: MemoryZoneEnum,
+) -> Option<[usize; Migratetype::NUMBER]> {
+    zone.zone(node).get()?;
+    zone.lock(node)
+        .pageblocks
+        .as_ref()
+        .map(|pageblocks| pageblocks.split_numbers())
+}
+
+/// Resizes block in place, the address doesn't change
+///
+/// Only blocks smaller than a pageblock in grouped zones (High and DMA32) can be resized in place:
+/// shrinking frees the tail, growing takes the following pages if they are free and the block is aligned to the new size.
+/// Returns false if the block wasn't resized, it stays valid with the old size
+///
+/// May be slow because may wait lock
+///
+/// # Safety
+/// Block must be allocated with the old size<br>
+/// Grown part is uninitialized
+pub unsafe fn resize_in_place(phys_addr: PhysAddr, old_size: usize, new_size: usize) -> bool {
+    debug_assert_realloc(phys_addr, old_size, new_size);
+    if old_size == new_size {
+        return true;
+    }
+    let (node, memory_zone) = get_zone_by_addr(phys_addr);
+    let resized = unsafe {
         memory_zone
-            .get()
-            .expect("Trying to free memory from non-existing zone")
-            .lock()
-            .allocator
-            .free(freed_addr.as_u64() as *mut u8);
+            .lock(node)
+            .resize_in_place(phys_addr, old_size, new_size)
+    };
+    if resized {
+        record_realloc(node, memory_zone, phys_addr, old_size, phys_addr, new_size);
     }
+    resized
 }
 
 /// Reallocs memory, like C realloc
-pub unsafe fn realloc(phys_addr: PhysAddr, requested_size: usize, ignore_data: bool) -> *mut u8 {
-    if !ignore_data {
-        unimplemented!("Since the buddy allocator works with physical memory, it will not be able to move data");
+///
+/// The block is resized in place if possible (see [resize_in_place]), buddy allocator blocks are grown by merging
+/// with the free buddy. Otherwise the block moves to a new block of the same zone type and migratetype,
+/// data is copied through the CPMM unless ignore_data
+///
+/// May be slow because may wait lock
+///
+/// # Safety
+/// Block must be allocated with the old size<br>
+/// May return null address, the old block stays valid then<br>
+/// Grown part is uninitialized
+pub unsafe fn realloc(
+    phys_addr: PhysAddr,
+    old_size: usize,
+    requested_size: usize,
+    ignore_data: bool,
+) -> PhysAddr {
+    debug_assert_realloc(phys_addr, old_size, requested_size);
+    if old_size == requested_size {
+        return phys_addr;
+    }
+    let (node, memory_zone) = get_zone_by_addr(phys_addr);
+
+    let reallocated_addr = unsafe {
+        memory_zone
+            .lock(node)
+            .realloc(phys_addr, old_size, requested_size, ignore_data)
+    };
+    if let Some(reallocated_addr) = reallocated_addr {
+        record_realloc(
+            node,
+            memory_zone,
+            phys_addr,
+            old_size,
+            reallocated_addr,
+            requested_size,
+        );
+        return reallocated_addr;
+    }
+
+    // Move, the block keeps its zone (DMA buffers stay addressable) and pageblock grouping
+    let migratetype = pageblock::migratetype_of(node, memory_zone, phys_addr);
+    let new_addr = unsafe { alloc_with_migratetype(&[memory_zone], requested_size, migratetype) };
+    if new_addr.is_null() {
+        return new_addr;
+    }
+    unsafe {
+        if !ignore_data {
+            core::ptr::copy_nonoverlapping(
+                virtual_memory_manager::virt_addr_in_cpmm_from_phys_addr(phys_addr).as_ptr::<u8>(),
+                virtual_memory_manager::virt_addr_in_cpmm_from_phys_addr(new_addr)
+                    .as_mut_ptr::<u8>(),
+                old_size.min(requested_size),
+            );
+        }
+        free(phys_addr, old_size);
     }
-    let memory_zone = get_zone_allocator_by_addr(phys_addr);
+    new_addr
+}
+
+#[inline]
+fn debug_assert_realloc(phys_addr: PhysAddr, old_size: usize, new_size: usize) {
+    debug_assert!(!phys_addr.is_null(), "Trying to realloc null address");
+    debug_assert!(
+        old_size >= PAGE_SIZE
+            && old_size.is_power_of_two()
+            && new_size >= PAGE_SIZE
+            && new_size.is_power_of_two(),
+        "Trying to realloc invalid size"
+    );
+    debug_assert!(
+        page_descriptor(phys_addr).is_none_or(|descriptor| descriptor.flags()
+            & (PageDescriptor::FLAG_ZEROED | PageDescriptor::FLAG_MOVABLE)
+            == 0),
+        "Trying to realloc page of the zero page pool or movable page"
+    );
+}
+
+/// Statistics and trace of realloc without moving to a new block, it works like free and alloc
+#[inline]
+fn record_realloc(
+    node: usize,
+    memory_zone: MemoryZoneEnum,
+    old_addr: PhysAddr,
+    old_size: usize,
+    new_addr: PhysAddr,
+    new_size: usize,
+) {
+    crate::trace_event!(TraceEvent::PmmFree, old_addr.as_u64(), old_size);
+    crate::trace_event!(TraceEvent::PmmAlloc, new_addr.as_u64(), new_size);
+    memory_stats::record_free(node, memory_zone, page_frame_cache::size_to_order(old_size));
+    memory_stats::record_alloc(
+        node,
+        memory_zone,
+        page_frame_cache::size_to_order(new_size),
+        false,
+    );
+}
 
-    memory_zone
-        .get()
-        .expect("Trying to free memory from non-existing zone")
-        .lock()
-        .allocator
-        .realloc(phys_addr.as_u64() as *mut u8, requested_size, ignore_data)
+/// Returns NUMA node and zone of the address
+fn get_zone_by_addr(phys_addr: PhysAddr) -> (usize, MemoryZoneEnum) {
+    (
+        numa::node_of_phys_addr(phys_addr),
+        get_zone_type_by_addr(phys_addr),
+    )
 }
 
-fn get_zone_allocator_by_addr(phys_addr: PhysAddr) -> &'static Once<Mutex<MemoryZone>> {
+fn get_zone_type_by_addr(phys_addr: PhysAddr) -> MemoryZoneEnum {
     if phys_addr >= ISA_DMA_ZONE_MIN_FIRST_PAGE_ADDR && phys_addr <= ISA_DMA_ZONE_MAX_LAST_PAGE_ADDR
     {
-        &ISA_DMA_ZONE
+        MemoryZoneEnum::IsaDma
     } else if phys_addr >= DMA32_MIN_FIRST_PAGE_ADDR && phys_addr <= DMA32_MAX_LAST_PAGE_ADDR {
-        &DMA32_ZONE
+        MemoryZoneEnum::Dma32
     } else if phys_addr >= HIGH_ZONE_MIN_FIRST_PAGE_ADDR
         && phys_addr <= HIGH_ZONE_MAX_LAST_PAGE_ADDR
     {
-        &HIGH_ZONE
+        MemoryZoneEnum::High
     } else {
         unreachable!("Trying to free invalid address");
     }
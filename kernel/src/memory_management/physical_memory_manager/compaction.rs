@@ -0,0 +1,196 @@
+// Compaction of movable pageblocks
+//
+// Pages of sparse movable pageblocks are migrated to the fullest movable pageblocks, emptied pageblocks are returned
+// to the buddy allocator, where they merge into huge pages and big DMA buffers.
+// Only pages mapped by vmalloc_movable can be migrated (FLAG_MOVABLE), a pageblock with other used pages
+// (stolen by other migratetype, cached by page frame caches) is skipped.
+//
+// Failed allocations of blocks bigger than the page frame cache's max order request compaction of the zone,
+// the request wakes the background task through a softirq, it sleeps while nothing is requested.
+// Tasks that can wait may call [compact] directly.
+//
+// The zone lock is held only to isolate pageblocks and to take and return pages,
+// migration itself (TLB shootdown and copy) runs without it.
+
+use super::pageblock::PAGEBLOCK_SIZE;
+use super::{memory_stats, numa, page_descriptor, page_frame_cache, MemoryZone, MemoryZoneEnum};
+use super::{MAX_NUMA_NODES, PAGE_SIZE};
+use crate::interrupts::softirq::{self, Softirq};
+use crate::memory_management::virtual_memory_manager::vmalloc;
+use crate::scheduler::{self, task::Task};
+use crate::sync::Mutex;
+use core::ptr::{null_mut, NonNull};
+use core::sync::atomic::{AtomicBool, AtomicPtr, Ordering};
+use x86_64::PhysAddr;
+
+/// Pageblocks with more used pages aren't compacted, moving them costs more than it gives
+const MAX_MIGRATED_PAGES: usize = PAGEBLOCK_SIZE / PAGE_SIZE / 4;
+
+/// Just above idle tasks
+const COMPACTION_PRIORITY: u8 = scheduler::PRIORITIES as u8 - 1;
+
+/// Zones requested for compaction: [node][zone]
+static REQUESTED: [[AtomicBool; MemoryZoneEnum::NUMBER]; MAX_NUMA_NODES] =
+    [const { [const { AtomicBool::new(false) }; MemoryZoneEnum::NUMBER] }; MAX_NUMA_NODES];
+
+/// Background compaction task, null until started
+static COMPACTION_TASK: AtomicPtr<Task> = AtomicPtr::new(null_mut());
+
+/// One compaction at a time, pageblocks isolated by one don't confuse another
+static COMPACTION_LOCK: Mutex<()> = Mutex::new(());
+
+/// Requests compaction of the zone of the node by the background task
+///
+/// Can be called from any context without locks held.
+/// Requests before the task starts are handled when it starts
+#[inline]
+pub(super) fn request(node: usize, zone: MemoryZoneEnum) {
+    if !REQUESTED[node][zone.index()].swap(true, Ordering::SeqCst)
+        && !COMPACTION_TASK.load(Ordering::Acquire).is_null()
+    {
+        // Waking takes run queue locks, softirq does it when no locks are held
+        softirq::raise_softirq(Softirq::CompactionWake);
+    }
+}
+
+/// Starts the background compaction task
+///
+/// Scheduler must be inited
+pub fn start() {
+    softirq::register_softirq(Softirq::CompactionWake, wake_compaction_task);
+    let task = scheduler::spawn("compaction", COMPACTION_PRIORITY, compaction_task, 0)
+        .expect("Failed to spawn compaction task");
+    COMPACTION_TASK.store(task.as_ptr(), Ordering::Release);
+}
+
+/// Compacts movable pageblocks of the zone of the node
+///
+/// Returns the number of pageblocks returned to the buddy allocator
+///
+/// Spins on the compaction lock and waits for TLB shootdowns, must be called from a task with enabled interrupts
+pub fn compact(node: usize, zone: MemoryZoneEnum) -> usize {
+    if zone.zone(node).get().is_none() {
+        return 0;
+    }
+    let Some(pageblocks_number) = zone
+        .lock(node)
+        .pageblocks
+        .as_ref()
+        .map(|pageblocks| pageblocks.len())
+    else {
+        return 0;
+    };
+    // Cached pages look used and aren't movable
+    // Before the compaction lock, so caches of other CPUs are drained too
+    page_frame_cache::drain_all();
+    let _compaction_lock = COMPACTION_LOCK.lock();
+
+    let mut migrated_pages = 0;
+    let mut compacted_pageblocks = 0;
+    for index in 0..pageblocks_number {
+        let Some(pageblock_addr) = zone
+            .lock(node)
+            .pageblocks
+            .as_mut()
+            .and_then(|pageblocks| pageblocks.isolate_sparse(index, MAX_MIGRATED_PAGES))
+        else {
+            continue;
+        };
+
+        for page in 0..PAGEBLOCK_SIZE / PAGE_SIZE {
+            let phys_addr = pageblock_addr + (page * PAGE_SIZE) as u64;
+            if zone
+                .lock(node)
+                .pageblocks
+                .as_ref()
+                .unwrap()
+                .is_page_free(phys_addr)
+            {
+                continue;
+            }
+            if !migrate_page(node, zone, phys_addr) {
+                break;
+            }
+            migrated_pages += 1;
+        }
+
+        let mut zone_lock = zone.lock(node);
+        let MemoryZone {
+            allocator,
+            pageblocks,
+        } = &mut *zone_lock;
+        if pageblocks.as_mut().unwrap().unisolate(allocator, index) {
+            compacted_pageblocks += 1;
+        }
+    }
+
+    memory_stats::record_compaction(node, zone, migrated_pages, compacted_pageblocks);
+    if compacted_pageblocks != 0 {
+        log::debug!(
+            "Node {node} {zone:?} compaction: {migrated_pages} pages migrated, \
+            {compacted_pageblocks} pageblocks freed"
+        );
+    }
+    compacted_pageblocks
+}
+
+/// Moves used page of the isolated pageblock to other movable pageblock
+///
+/// Returns false if the page isn't movable or there is no free page
+fn migrate_page(node: usize, zone: MemoryZoneEnum, phys_addr: PhysAddr) -> bool {
+    let Some(virt_addr) =
+        page_descriptor(phys_addr).and_then(|descriptor| descriptor.movable_virt_addr())
+    else {
+        return false;
+    };
+    let Some(target_phys_addr) = zone
+        .lock(node)
+        .pageblocks
+        .as_mut()
+        .unwrap()
+        .alloc_migration_target()
+    else {
+        return false;
+    };
+
+    let migrated = unsafe { vmalloc::migrate_page(virt_addr, phys_addr, target_phys_addr) };
+
+    // Old page goes to the isolated pageblock, target back if the page wasn't moved
+    let freed_phys_addr = if migrated {
+        phys_addr
+    } else {
+        target_phys_addr
+    };
+    let mut zone_lock = zone.lock(node);
+    let MemoryZone {
+        allocator,
+        pageblocks,
+    } = &mut *zone_lock;
+    unsafe {
+        pageblocks
+            .as_mut()
+            .unwrap()
+            .free(allocator, freed_phys_addr, PAGE_SIZE);
+    }
+    migrated
+}
+
+fn compaction_task(_: usize) {
+    loop {
+        // A request after its flag is cleared wakes the task again, the next block returns immediately
+        for node in 0..numa::nodes_number() {
+            for zone in MemoryZoneEnum::ALL {
+                if REQUESTED[node][zone.index()].swap(false, Ordering::SeqCst) {
+                    compact(node, zone);
+                }
+            }
+        }
+        scheduler::block_current();
+    }
+}
+
+fn wake_compaction_task() {
+    if let Some(task) = NonNull::new(COMPACTION_TASK.load(Ordering::Acquire)) {
+        scheduler::wake(task);
+    }
+}
@@ -0,0 +1,167 @@
+// Deferred initialization of HIGH memory
+//
+// Zeroing page descriptors and releasing memory to buddy allocators takes time proportional to RAM.
+// At boot only the first BOOT_HIGH_MEMORY_SIZE of HIGH memory (by address) is initialized, the rest is initialized
+// after SMP initialization by background tasks, one per CPU.
+//
+// Deferred memory is split into windows of DEFERRED_WINDOW_SIZE physical addresses, tasks take windows one by one.
+// Windows start at section boundaries, so each page descriptor section is zeroed by one task before its pages are released.
+// Memory is released by pieces of one section, the zone lock isn't held for long, and windows of
+// different NUMA nodes are released in parallel.
+
+use super::page_descriptor_table::{self, SECTION_SIZE};
+use super::{node_zone_usable_regions, numa, MemoryZoneEnum, HIGH_USABLE_REGIONS, PAGE_SIZE};
+use crate::scheduler;
+use crate::smp::per_cpu;
+use core::sync::atomic::{AtomicU64, AtomicUsize, Ordering};
+use x86_64::PhysAddr;
+
+/// HIGH memory initialized at boot
+const BOOT_HIGH_MEMORY_SIZE: usize = 1024 * 1024 * 1024;
+
+/// Physical addresses initialized by one task at once
+const DEFERRED_WINDOW_SIZE: usize = 64 * SECTION_SIZE;
+
+/// Just above idle tasks
+const WORKER_PRIORITY: u8 = scheduler::PRIORITIES as u8 - 1;
+
+const _: () = assert!(BOOT_HIGH_MEMORY_SIZE % SECTION_SIZE == 0);
+
+/// HIGH memory from this address is deferred, u64::MAX if nothing is deferred
+static DEFERRED_START: AtomicU64 = AtomicU64::new(u64::MAX);
+
+static WINDOWS_NUMBER: AtomicUsize = AtomicUsize::new(0);
+
+/// Next window to take
+static NEXT_WINDOW: AtomicUsize = AtomicUsize::new(0);
+
+static DONE_WINDOWS: AtomicUsize = AtomicUsize::new(0);
+
+/// Bytes released by the tasks
+static RELEASED_SIZE: AtomicUsize = AtomicUsize::new(0);
+
+/// Chooses deferred memory
+///
+/// Must be called before page descriptor table and allocators initialization
+pub(super) fn init() {
+    let high_usable_regions = HIGH_USABLE_REGIONS.lock();
+    let Some(last_region) = high_usable_regions.last() else {
+        return;
+    };
+    let mut boot_size = 0;
+    let mut deferred_start = None;
+    for usable_region in high_usable_regions.iter() {
+        if boot_size + usable_region.size() > BOOT_HIGH_MEMORY_SIZE {
+            deferred_start = Some(
+                (usable_region.first_page + (BOOT_HIGH_MEMORY_SIZE - boot_size) as u64)
+                    .align_up(SECTION_SIZE as u64),
+            );
+            break;
+        }
+        boot_size += usable_region.size();
+    }
+    let Some(deferred_start) = deferred_start.filter(|start| *start <= last_region.last_page)
+    else {
+        return;
+    };
+
+    let deferred_range_size = (last_region.last_page + PAGE_SIZE as u64 - deferred_start) as usize;
+    DEFERRED_START.store(deferred_start.as_u64(), Ordering::Relaxed);
+    WINDOWS_NUMBER.store(
+        deferred_range_size.div_ceil(DEFERRED_WINDOW_SIZE),
+        Ordering::Relaxed,
+    );
+}
+
+/// HIGH memory from this address is initialized later, section aligned
+#[inline]
+pub(super) fn deferred_start() -> Option<PhysAddr> {
+    let deferred_start = DEFERRED_START.load(Ordering::Relaxed);
+    (deferred_start != u64::MAX).then(|| PhysAddr::new(deferred_start))
+}
+
+/// Bytes of usable memory that aren't initialized yet
+pub(super) fn deferred_size() -> usize {
+    let Some(deferred_start) = deferred_start() else {
+        return 0;
+    };
+    let released_size = RELEASED_SIZE.load(Ordering::Acquire);
+    HIGH_USABLE_REGIONS
+        .lock()
+        .iter()
+        .filter(|usable_region| usable_region.last_page >= deferred_start)
+        .map(|usable_region| {
+            (usable_region.last_page + PAGE_SIZE as u64
+                - usable_region.first_page.max(deferred_start)) as usize
+        })
+        .sum::<usize>()
+        - released_size
+}
+
+/// All deferred memory is released, true if nothing was deferred
+pub fn is_finished() -> bool {
+    DONE_WINDOWS.load(Ordering::Acquire) == WINDOWS_NUMBER.load(Ordering::Relaxed)
+}
+
+/// Starts tasks that initialize deferred memory
+///
+/// Scheduler must be inited, APs should be started to take part
+pub fn start() {
+    let Some(deferred_start) = deferred_start() else {
+        return;
+    };
+    let windows_number = WINDOWS_NUMBER.load(Ordering::Relaxed);
+    log::info!(
+        "Deferred init of {} MB of HIGH memory from {deferred_start:#x}",
+        deferred_size() / 1024 / 1024,
+    );
+    for _ in 0..per_cpu::cpus_number().min(windows_number) {
+        scheduler::spawn("deferred memory init", WORKER_PRIORITY, worker, 0)
+            .expect("Failed to spawn deferred memory init task");
+    }
+}
+
+fn worker(_: usize) {
+    let windows_number = WINDOWS_NUMBER.load(Ordering::Relaxed);
+    loop {
+        let window = NEXT_WINDOW.fetch_add(1, Ordering::Relaxed);
+        if window >= windows_number {
+            return;
+        }
+        init_window(window);
+        if DONE_WINDOWS.fetch_add(1, Ordering::AcqRel) + 1 == windows_number {
+            log::info!(
+                "Deferred memory init finished: {} MB released",
+                RELEASED_SIZE.load(Ordering::Acquire) / 1024 / 1024
+            );
+        }
+    }
+}
+
+fn init_window(window: usize) {
+    let window_first = deferred_start().expect("Deferred memory not chosen")
+        + (window * DEFERRED_WINDOW_SIZE) as u64;
+    let window_end = window_first + DEFERRED_WINDOW_SIZE as u64;
+
+    // Descriptors first, pages may be used right after release
+    page_descriptor_table::init_sections(window_first, window_end);
+
+    for node in 0..numa::nodes_number() {
+        for usable_region in node_zone_usable_regions(node, MemoryZoneEnum::High).iter() {
+            let first_page = usable_region.first_page.max(window_first);
+            let end = (usable_region.last_page + PAGE_SIZE as u64).min(window_end);
+            let mut piece_first = first_page;
+            while piece_first < end {
+                let piece_end = (piece_first + 1u64).align_up(SECTION_SIZE as u64).min(end);
+                let piece_size = (piece_end - piece_first) as usize;
+                unsafe {
+                    MemoryZoneEnum::High
+                        .lock(node)
+                        .release_range(piece_first, piece_size);
+                }
+                RELEASED_SIZE.fetch_add(piece_size, Ordering::AcqRel);
+                piece_first = piece_end;
+            }
+        }
+    }
+}
@@ -0,0 +1,243 @@
+// Page descriptor table
+//
+// Each physical page has a descriptor (like struct page in Linux) with the per-frame state.
+// The table has two levels: the directory has a pointer for each section (SECTION_SIZE of physical memory),
+// the section is an array of descriptors of its pages.
+// Only sections that contain usable memory are populated, holes in the physical address space cost only a directory entry.
+//
+// All sections are created during PMM initialization and never freed, so lookup is two loads without locks.
+// Sections of deferred HIGH memory are zeroed by deferred init before their pages are released.
+
+use super::{numa, UsableRegion, PAGE_SIZE, USABLE_REGIONS};
+use core::ptr::null_mut;
+use core::sync::atomic::{AtomicPtr, AtomicU32, Ordering};
+use slab_allocator_lib::SlabInfo;
+use spin::Once;
+use x86_64::{PhysAddr, VirtAddr};
+
+/// Number of pages in the section
+const SECTION_PAGES: usize = 4096;
+
+/// 16 MB
+pub(super) const SECTION_SIZE: usize = SECTION_PAGES * PAGE_SIZE;
+
+/// Directory, index is the section number
+static DIRECTORY: Once<&'static [AtomicPtr<PageDescriptor>]> = Once::new();
+
+/// State of the physical page
+///
+/// 16 bytes, 4 descriptors per cache line
+#[repr(C, align(16))]
+pub struct PageDescriptor {
+    /// SlabInfo of the slab this page belongs to (FLAG_SLAB) or virtual address of the movable page (FLAG_MOVABLE),
+    /// null if the page is neither
+    private: AtomicPtr<()>,
+    flags: AtomicU32,
+    refcount: AtomicU32,
+}
+
+impl PageDescriptor {
+    /// Page belongs to a slab
+    pub const FLAG_SLAB: u32 = 1 << 0;
+    /// Page belongs to a segment of general purpose allocator arena, arena index is in ARENA_MASK bits
+    pub const FLAG_ARENA: u32 = 1 << 1;
+    /// Page is in the zero page pool, its content is zeroes
+    pub const FLAG_ZEROED: u32 = 1 << 2;
+    /// Page is mapped by a movable vmalloc area and may be migrated by compaction, its virtual address is stored
+    pub const FLAG_MOVABLE: u32 = 1 << 3;
+
+    const ARENA_SHIFT: u32 = 16;
+    /// 8 bits, enough for MAX_CPUS
+    const ARENA_MASK: u32 = 0xFF << Self::ARENA_SHIFT;
+
+    #[inline]
+    pub fn slab_info(&self) -> *mut SlabInfo {
+        self.private.load(Ordering::Acquire).cast()
+    }
+
+    /// Sets SlabInfo and FLAG_SLAB
+    #[inline]
+    pub fn set_slab_info(&self, slab_info_ptr: *mut SlabInfo) {
+        self.private.store(slab_info_ptr.cast(), Ordering::Release);
+        self.set_flags(Self::FLAG_SLAB);
+    }
+
+    /// Clears SlabInfo and FLAG_SLAB
+    #[inline]
+    pub fn clear_slab_info(&self) {
+        self.clear_flags(Self::FLAG_SLAB);
+        self.private.store(null_mut(), Ordering::Release);
+    }
+
+    /// Virtual address of the page if FLAG_MOVABLE is set
+    #[inline]
+    pub fn movable_virt_addr(&self) -> Option<VirtAddr> {
+        (self.flags() & Self::FLAG_MOVABLE != 0)
+            .then(|| VirtAddr::from_ptr(self.private.load(Ordering::Acquire)))
+    }
+
+    /// Sets virtual address and FLAG_MOVABLE
+    #[inline]
+    pub fn set_movable(&self, virt_addr: VirtAddr) {
+        self.private
+            .store(virt_addr.as_mut_ptr(), Ordering::Release);
+        self.set_flags(Self::FLAG_MOVABLE);
+    }
+
+    /// Clears virtual address and FLAG_MOVABLE
+    #[inline]
+    pub fn clear_movable(&self) {
+        self.clear_flags(Self::FLAG_MOVABLE);
+        self.private.store(null_mut(), Ordering::Release);
+    }
+
+    /// Arena index if FLAG_ARENA is set
+    #[inline]
+    pub fn arena(&self) -> Option<usize> {
+        let flags = self.flags();
+        (flags & Self::FLAG_ARENA != 0)
+            .then_some(((flags & Self::ARENA_MASK) >> Self::ARENA_SHIFT) as usize)
+    }
+
+    /// Sets arena index and FLAG_ARENA
+    ///
+    /// Only the arena owning the page may change it
+    #[inline]
+    pub fn set_arena(&self, arena_index: usize) {
+        debug_assert!(arena_index <= (Self::ARENA_MASK >> Self::ARENA_SHIFT) as usize);
+        self.clear_flags(Self::ARENA_MASK);
+        self.set_flags(Self::FLAG_ARENA | (arena_index as u32) << Self::ARENA_SHIFT);
+    }
+
+    /// Clears arena index and FLAG_ARENA
+    #[inline]
+    pub fn clear_arena(&self) {
+        self.clear_flags(Self::FLAG_ARENA | Self::ARENA_MASK);
+    }
+
+    #[inline]
+    pub fn flags(&self) -> u32 {
+        self.flags.load(Ordering::Acquire)
+    }
+
+    #[inline]
+    pub fn set_flags(&self, flags: u32) {
+        self.flags.fetch_or(flags, Ordering::AcqRel);
+    }
+
+    #[inline]
+    pub fn clear_flags(&self, flags: u32) {
+        self.flags.fetch_and(!flags, Ordering::AcqRel);
+    }
+
+    #[inline]
+    pub fn refcount(&self) -> &AtomicU32 {
+        &self.refcount
+    }
+}
+
+/// Creates directory and sections for all usable memory
+///
+/// Memory is reserved from usable regions, must be called before allocators initialization
+pub(super) fn init() {
+    let deferred_start = super::deferred_init::deferred_start();
+    let last_usable_page_addr = USABLE_REGIONS
+        .lock()
+        .last()
+        .expect("No usable memory")
+        .last_page
+        .as_u64() as usize;
+    let sections_number = last_usable_page_addr / SECTION_SIZE + 1;
+
+    // Directory, read by all nodes, on the BSP's one
+    let directory_size = x86_64::align_up(
+        (sections_number * size_of::<AtomicPtr<PageDescriptor>>()) as u64,
+        PAGE_SIZE as u64,
+    ) as usize;
+    let directory_ptr = super::virtual_memory_manager::virt_addr_in_cpmm_from_phys_addr(
+        super::reserve_boot_memory(directory_size, 0),
+    )
+    .as_mut_ptr::<AtomicPtr<PageDescriptor>>();
+    let directory = unsafe {
+        // Null is zero
+        directory_ptr.write_bytes(0, sections_number);
+        core::slice::from_raw_parts(directory_ptr, sections_number)
+    };
+
+    // Sections
+    // Regions copied because reserving changes them
+    let usable_regions: tinyvec::ArrayVec<[UsableRegion; 128]> = USABLE_REGIONS.lock().clone();
+    let section_memory_size = SECTION_PAGES * size_of::<PageDescriptor>();
+    let mut populated_sections_number = 0;
+    for usable_region in usable_regions.iter() {
+        let first_section = usable_region.first_page.as_u64() as usize / SECTION_SIZE;
+        let last_section = usable_region.last_page.as_u64() as usize / SECTION_SIZE;
+        for section in first_section..=last_section {
+            let section_entry = &directory[section];
+            if !section_entry.load(Ordering::Relaxed).is_null() {
+                continue;
+            }
+            // Descriptors are on the node of their pages
+            let section_node = numa::node_of_phys_addr(
+                usable_region
+                    .first_page
+                    .max(PhysAddr::new((section * SECTION_SIZE) as u64)),
+            );
+            let section_ptr = super::virtual_memory_manager::virt_addr_in_cpmm_from_phys_addr(
+                super::reserve_boot_memory(section_memory_size, section_node),
+            )
+            .as_mut_ptr::<PageDescriptor>();
+            // Deferred sections are zeroed later
+            if deferred_start.is_none_or(|start| ((section * SECTION_SIZE) as u64) < start.as_u64())
+            {
+                unsafe {
+                    // Zeroed descriptor is a free page without state
+                    section_ptr.write_bytes(0, SECTION_PAGES);
+                }
+            }
+            section_entry.store(section_ptr, Ordering::Relaxed);
+            populated_sections_number += 1;
+        }
+    }
+
+    DIRECTORY.call_once(|| directory);
+    log::info!(
+        "Page descriptor table: {populated_sections_number} of {sections_number} sections populated, {} KB",
+        (directory_size + populated_sections_number * section_memory_size) / 1024
+    );
+}
+
+/// Zeroes populated sections of the range of deferred memory
+///
+/// Pages of the range must not be used yet
+pub(super) fn init_sections(first_addr: PhysAddr, end_addr: PhysAddr) {
+    debug_assert!(first_addr.is_aligned(SECTION_SIZE as u64));
+    let directory = DIRECTORY.get().expect("Page descriptor table not set");
+    let first_section = first_addr.as_u64() as usize / SECTION_SIZE;
+    let end_section = (end_addr.as_u64() as usize).div_ceil(SECTION_SIZE);
+    for section_entry in directory.iter().take(end_section).skip(first_section) {
+        let section_ptr = section_entry.load(Ordering::Relaxed);
+        if !section_ptr.is_null() {
+            unsafe {
+                section_ptr.write_bytes(0, SECTION_PAGES);
+            }
+        }
+    }
+}
+
+/// Returns descriptor of the page
+///
+/// None if the page isn't in usable memory
+#[inline]
+pub fn page_descriptor(phys_addr: PhysAddr) -> Option<&'static PageDescriptor> {
+    let page_number = phys_addr.as_u64() as usize / PAGE_SIZE;
+    let section_ptr = DIRECTORY
+        .get()
+        .expect("Page descriptor table not set")
+        .get(page_number / SECTION_PAGES)?
+        .load(Ordering::Relaxed);
+    if section_ptr.is_null() {
+        return None;
+    }
+    unsafe { Some(&*section_ptr.add(page_number % SECTION_PAGES)) }
+}
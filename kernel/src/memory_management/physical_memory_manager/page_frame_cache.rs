@@ -0,0 +1,311 @@
+// Per-CPU page frame caches
+//
+// Small blocks (order 0-3) are allocated and freed very often (slabs, page tables, dlmalloc segments).
+// Instead of taking the zone lock for every such block, each CPU keeps lists of already allocated (from the buddy allocator's point of view) blocks.
+// Only refill and drain of the lists take the zone lock and they move several blocks at once.
+//
+// Hot/cold:
+// Freed blocks were just used and are likely in the CPU cache, they are added to the hot end of the list and reused first.
+// Blocks taken from the buddy allocator during refill are cold, they are added to the cold end.
+// Drain takes blocks from the cold end.
+//
+// Only blocks of the CPU's own NUMA node are cached, blocks of other nodes go directly to their buddy allocators.
+//
+// On memory pressure drain_all drains caches of all CPUs by IPI when the caller can wait for them,
+// otherwise CPUs drain when they see the new DRAIN_GENERATION.
+//
+// Lists are per migratetype, a freed block goes to the list of its pageblock's migratetype,
+// so cached blocks don't mix migratetypes in pageblocks.
+
+use super::pageblock::{self, Migratetype};
+use super::{memory_stats, MemoryZoneEnum, PAGE_SIZE};
+use crate::scheduler;
+use crate::smp::ipi;
+use core::sync::atomic::{AtomicU64, Ordering};
+use x86_64::PhysAddr;
+
+/// Max order of the cached blocks
+///
+/// 0 - 4 KB, 1 - 8 KB, 2 - 16 KB, 3 - 32 KB
+pub const MAX_CACHED_ORDER: usize = 3;
+
+const CACHED_ORDERS_NUMBER: usize = MAX_CACHED_ORDER + 1;
+
+/// Capacity of each frame list
+const FRAME_LIST_CAPACITY: usize = 64;
+
+/// Max number of blocks in the list of the order, list will be drained if exceeded
+const HIGH_WATERMARK: [usize; CACHED_ORDERS_NUMBER] = [64, 32, 16, 8];
+
+/// Number of blocks moved from/to the buddy allocator at once
+const BATCH: [usize; CACHED_ORDERS_NUMBER] = [16, 8, 4, 2];
+
+/// Incremented when the memory is running out, every CPU drains its caches when sees a new value
+static DRAIN_GENERATION: AtomicU64 = AtomicU64::new(0);
+
+/// Ring buffer of blocks of the same order and migratetype from the same zone
+struct FrameList {
+    /// Physical addresses of the blocks
+    frames: [u64; FRAME_LIST_CAPACITY],
+    /// Index of the coldest block
+    cold: usize,
+    len: usize,
+}
+
+impl FrameList {
+    const fn new() -> Self {
+        Self {
+            frames: [0; FRAME_LIST_CAPACITY],
+            cold: 0,
+            len: 0,
+        }
+    }
+
+    #[inline]
+    fn is_empty(&self) -> bool {
+        self.len == 0
+    }
+
+    #[inline]
+    fn is_full(&self) -> bool {
+        self.len == FRAME_LIST_CAPACITY
+    }
+
+    #[inline]
+    fn push_hot(&mut self, phys_addr: u64) {
+        debug_assert!(!self.is_full(), "Frame list overflow");
+        self.frames[(self.cold + self.len) % FRAME_LIST_CAPACITY] = phys_addr;
+        self.len += 1;
+    }
+
+    #[inline]
+    fn push_cold(&mut self, phys_addr: u64) {
+        debug_assert!(!self.is_full(), "Frame list overflow");
+        self.cold = (self.cold + FRAME_LIST_CAPACITY - 1) % FRAME_LIST_CAPACITY;
+        self.frames[self.cold] = phys_addr;
+        self.len += 1;
+    }
+
+    #[inline]
+    fn pop_hot(&mut self) -> Option<u64> {
+        if self.is_empty() {
+            return None;
+        }
+        self.len -= 1;
+        Some(self.frames[(self.cold + self.len) % FRAME_LIST_CAPACITY])
+    }
+
+    #[inline]
+    fn pop_cold(&mut self) -> Option<u64> {
+        if self.is_empty() {
+            return None;
+        }
+        let phys_addr = self.frames[self.cold];
+        self.cold = (self.cold + 1) % FRAME_LIST_CAPACITY;
+        self.len -= 1;
+        Some(phys_addr)
+    }
+}
+
+/// Page frame caches of one CPU
+///
+/// Stored in PerCpu, must be accessed only with disabled interrupts
+///
+/// Contains blocks of the CPU's NUMA node
+pub struct PageFrameCaches {
+    /// [zone][migratetype][order]
+    lists: [[[FrameList; CACHED_ORDERS_NUMBER]; Migratetype::NUMBER]; MemoryZoneEnum::NUMBER],
+    /// Last seen DRAIN_GENERATION
+    drain_generation: u64,
+}
+
+impl PageFrameCaches {
+    pub const fn new() -> Self {
+        Self {
+            lists: [const {
+                [const { [const { FrameList::new() }; CACHED_ORDERS_NUMBER] }; Migratetype::NUMBER]
+            }; MemoryZoneEnum::NUMBER],
+            drain_generation: 0,
+        }
+    }
+
+    /// Returns all cached blocks to the buddy allocators of the node
+    ///
+    /// If wait is false, lists of locked zones are skipped
+    ///
+    /// Returns false if some lists were skipped
+    fn drain(&mut self, node: usize, wait: bool) -> bool {
+        let mut drained = true;
+        for zone in MemoryZoneEnum::ALL {
+            for migratetype in Migratetype::ALL {
+                for order in 0..CACHED_ORDERS_NUMBER {
+                    let list = &mut self.lists[zone.index()][migratetype.index()][order];
+                    if list.is_empty() {
+                        continue;
+                    }
+                    assert!(
+                        zone.zone(node).get().is_some(),
+                        "Cached blocks from non-existing zone, bug"
+                    );
+                    let mut zone_lock = if wait {
+                        zone.lock(node)
+                    } else if let Some(zone_lock) = zone.try_lock(node) {
+                        zone_lock
+                    } else {
+                        drained = false;
+                        continue;
+                    };
+                    while let Some(phys_addr) = list.pop_cold() {
+                        unsafe {
+                            zone_lock.free(PhysAddr::new(phys_addr), PAGE_SIZE << order);
+                        }
+                    }
+                }
+            }
+        }
+        drained
+    }
+
+    /// Drains caches if some CPU requested it
+    ///
+    /// If wait is false, the request stays pending while some zone is locked
+    #[inline]
+    fn drain_if_requested(&mut self, node: usize, wait: bool) {
+        let drain_generation = DRAIN_GENERATION.load(Ordering::Acquire);
+        if self.drain_generation != drain_generation && self.drain(node, wait) {
+            self.drain_generation = drain_generation;
+        }
+    }
+}
+
+/// Returns page frame caches of the current CPU and its NUMA node
+///
+/// # Safety
+/// Interrupts must be disabled while the reference is used
+#[inline]
+unsafe fn local_caches() -> (&'static mut PageFrameCaches, usize) {
+    unsafe {
+        let per_cpu = crate::smp::per_cpu::current();
+        (&mut per_cpu.page_frame_caches, per_cpu.numa_node)
+    }
+}
+
+/// Converts size of the block to order
+#[inline]
+pub fn size_to_order(size: usize) -> usize {
+    debug_assert!(size >= PAGE_SIZE && size.is_power_of_two());
+    (size / PAGE_SIZE).trailing_zeros() as usize
+}
+
+/// Allocs block of the order and migratetype from the current CPU's cache of the zone
+///
+/// Refills the cache from the buddy allocator if it's empty
+///
+/// Blocks of other NUMA nodes are allocated directly from their buddy allocators
+///
+/// Returns None if zone doesn't exist or has no memory
+pub fn alloc(
+    node: usize,
+    zone: MemoryZoneEnum,
+    order: usize,
+    migratetype: Migratetype,
+) -> Option<PhysAddr> {
+    debug_assert!(order <= MAX_CACHED_ORDER);
+    zone.zone(node).get()?;
+    let block_size = PAGE_SIZE << order;
+
+    x86_64::instructions::interrupts::without_interrupts(|| {
+        let (caches, local_node) = unsafe { local_caches() };
+        caches.drain_if_requested(local_node, true);
+
+        if node != local_node {
+            return unsafe { zone.lock(node).alloc(block_size, migratetype) };
+        }
+
+        let list = &mut caches.lists[zone.index()][migratetype.index()][order];
+        if list.is_empty() {
+            // Refill
+            memory_stats::record_cache_refill(node, zone);
+            let mut zone_lock = zone.lock(node);
+            for _ in 0..BATCH[order] {
+                let Some(allocated_addr) = (unsafe { zone_lock.alloc(block_size, migratetype) })
+                else {
+                    break;
+                };
+                list.push_cold(allocated_addr.as_u64());
+            }
+        } else {
+            memory_stats::record_cache_hit(node, zone);
+        }
+        list.pop_hot().map(PhysAddr::new)
+    })
+}
+
+/// Frees block of the order to the current CPU's cache of the zone
+///
+/// If the cache grows above the high watermark, the batch of the coldest blocks is returned to the buddy allocator
+///
+/// Blocks of other NUMA nodes are freed directly to their buddy allocators
+///
+/// Block goes to the list of the migratetype of its pageblock
+///
+/// # Safety
+/// Freed block must be previously allocated block of the order from the zone of the node
+pub unsafe fn free(node: usize, zone: MemoryZoneEnum, order: usize, phys_addr: PhysAddr) {
+    debug_assert!(order <= MAX_CACHED_ORDER);
+    assert!(
+        zone.zone(node).get().is_some(),
+        "Trying to free memory to non-existing zone"
+    );
+
+    x86_64::instructions::interrupts::without_interrupts(|| {
+        let (caches, local_node) = unsafe { local_caches() };
+        caches.drain_if_requested(local_node, true);
+
+        if node != local_node {
+            unsafe {
+                zone.lock(node).free(phys_addr, PAGE_SIZE << order);
+            }
+            return;
+        }
+
+        let migratetype = pageblock::migratetype_of(node, zone, phys_addr);
+        let list = &mut caches.lists[zone.index()][migratetype.index()][order];
+        list.push_hot(phys_addr.as_u64());
+        if list.len > HIGH_WATERMARK[order] || list.is_full() {
+            // Drain
+            memory_stats::record_cache_drain(node, zone);
+            let mut zone_lock = zone.lock(node);
+            for _ in 0..BATCH[order] {
+                let Some(cold_phys_addr) = list.pop_cold() else {
+                    break;
+                };
+                unsafe {
+                    zone_lock.free(PhysAddr::new(cold_phys_addr), PAGE_SIZE << order);
+                }
+            }
+        }
+    });
+}
+
+/// Returns blocks cached by all CPUs to the buddy allocators
+///
+/// Called on memory pressure, the caller retries the allocation after it.
+/// Other CPUs drain in a call function IPI. If the caller holds locks or runs with interrupts disabled,
+/// waiting for them could deadlock, then only the current CPU drains and others do it on their next alloc or free
+pub fn drain_all() {
+    DRAIN_GENERATION.fetch_add(1, Ordering::AcqRel);
+    if scheduler::preemptible() {
+        ipi::call_function_many(&ipi::online_cpus(), drain_requested, 0);
+    }
+    x86_64::instructions::interrupts::without_interrupts(|| {
+        let (caches, local_node) = unsafe { local_caches() };
+        caches.drain_if_requested(local_node, true);
+    });
+}
+
+/// Call function of drain_all, the interrupted code may hold a zone lock
+fn drain_requested(_: usize) {
+    let (caches, local_node) = unsafe { local_caches() };
+    caches.drain_if_requested(local_node, false);
+}
@@ -0,0 +1,639 @@
+// Pageblock grouping by mobility
+//
+// Memory of a zone is split into pageblocks of PAGEBLOCK_SIZE (2 MB, the huge page size).
+// Blocks smaller than a pageblock aren't allocated from the buddy allocator directly: the zone takes a whole pageblock,
+// assigns it the migratetype of the request and allocates pages of that migratetype from it with a bitmap.
+// So unmovable, reclaimable and movable memory doesn't share pageblocks, and a pageblock whose pages are all freed
+// goes back to the buddy allocator, where it merges into huge pages and big DMA buffers.
+//
+// If the buddy allocator has no free pageblock, the request steals from a pageblock of another migratetype
+// (fallback order like in Linux). The pageblock with the most free pages is taken, if at least half of it is free,
+// it's converted to the migratetype of the request, so the next requests don't steal again.
+//
+// Movable pageblocks can be emptied by compaction, see [super::compaction].
+//
+// Pageblocks partially covered by usable memory are split at init and never returned to the buddy allocator.
+// ISA DMA zone is too small to be grouped, it uses the buddy allocator directly.
+
+use super::{memory_stats, MemoryZoneEnum, MAX_NUMA_NODES, PAGE_SIZE};
+use crate::memory_management::virtual_memory_manager::HUGE_PAGE_SIZE;
+use buddy_alloc::BuddyAlloc;
+use core::sync::atomic::{AtomicU8, Ordering};
+use spin::Once;
+use x86_64::PhysAddr;
+
+/// 2 MB
+pub const PAGEBLOCK_SIZE: usize = HUGE_PAGE_SIZE;
+
+const PAGEBLOCK_PAGES: usize = PAGEBLOCK_SIZE / PAGE_SIZE;
+
+const BITMAP_WORDS: usize = PAGEBLOCK_PAGES / 64;
+
+/// End of a pageblock list
+const NONE: u32 = u32::MAX;
+
+/// Migratetypes of pageblocks of grouped zones, readable without the zone lock: [node][zone]
+static MIGRATETYPE_TABLES: [[Once<MigratetypeTable>; MemoryZoneEnum::NUMBER]; MAX_NUMA_NODES] =
+    [const { [const { Once::new() }; MemoryZoneEnum::NUMBER] }; MAX_NUMA_NODES];
+
+/// Mobility of allocated memory
+#[derive(Debug, Copy, Clone, PartialEq)]
+#[repr(u8)]
+pub enum Migratetype {
+    /// Can't be moved or freed on demand: page tables, dlmalloc segments, stacks
+    Unmovable,
+    /// Can be freed on demand: slabs of slab caches
+    Reclaimable,
+    /// Can be moved by compaction: pages mapped by vmalloc_movable
+    Movable,
+}
+
+impl Migratetype {
+    pub const NUMBER: usize = 3;
+
+    pub const ALL: [Migratetype; Self::NUMBER] = [
+        Migratetype::Unmovable,
+        Migratetype::Reclaimable,
+        Migratetype::Movable,
+    ];
+
+    #[inline]
+    pub const fn index(self) -> usize {
+        self as usize
+    }
+
+    /// Migratetypes to steal from when there is no free pageblock, in order
+    #[inline]
+    const fn fallbacks(self) -> [Migratetype; 2] {
+        match self {
+            Migratetype::Unmovable => [Migratetype::Reclaimable, Migratetype::Movable],
+            Migratetype::Reclaimable => [Migratetype::Unmovable, Migratetype::Movable],
+            Migratetype::Movable => [Migratetype::Reclaimable, Migratetype::Unmovable],
+        }
+    }
+
+    #[inline]
+    fn from_u8(value: u8) -> Self {
+        Self::ALL[value as usize]
+    }
+}
+
+struct MigratetypeTable {
+    /// Address of the first pageblock
+    base: u64,
+    migratetypes: &'static [AtomicU8],
+}
+
+#[derive(Debug, Copy, Clone, PartialEq)]
+enum PageblockState {
+    /// Free or allocated as a whole, belongs to the buddy allocator
+    Buddy,
+    /// Taken from the buddy allocator and split to pages
+    Split,
+    /// Split at init, pages outside usable memory are never free, so it's never returned to the buddy allocator
+    SplitAtInit,
+}
+
+/// Pageblock of a grouped zone
+struct Pageblock {
+    /// Set bit is a free page
+    free_map: [u64; BITMAP_WORDS],
+    free_pages: u16,
+    state: PageblockState,
+    /// Compaction empties the pageblock, it isn't in the partial list and isn't released while isolated
+    isolated: bool,
+    /// Links of the partial list of its migratetype
+    prev: u32,
+    next: u32,
+}
+
+/// Pageblocks of a grouped zone
+///
+/// Stored in the zone, protected by the zone lock
+pub(super) struct Pageblocks {
+    node: usize,
+    zone: MemoryZoneEnum,
+    /// Address of the first pageblock, PAGEBLOCK_SIZE aligned
+    base: u64,
+    blocks: &'static mut [Pageblock],
+    migratetypes: &'static [AtomicU8],
+    /// Heads of lists of split pageblocks with free pages, by migratetype
+    partial: [u32; Migratetype::NUMBER],
+    /// Free pages in split pageblocks, by migratetype
+    free_pages: [usize; Migratetype::NUMBER],
+}
+
+/// Bytes of memory for pageblocks of the range
+pub(super) const fn memory_size(range_size: usize) -> usize {
+    range_size.div_ceil(PAGEBLOCK_SIZE) * (size_of::<Pageblock>() + size_of::<AtomicU8>())
+}
+
+impl Pageblocks {
+    /// Creates pageblocks of the range, all belong to the buddy allocator
+    ///
+    /// # Safety
+    /// memory must be [memory_size] bytes of unused memory, aligned like Pageblock
+    pub(super) unsafe fn new(
+        node: usize,
+        zone: MemoryZoneEnum,
+        base: PhysAddr,
+        range_size: usize,
+        memory: *mut u8,
+    ) -> Self {
+        debug_assert!(base.is_aligned(PAGEBLOCK_SIZE as u64));
+        debug_assert!(memory as usize % align_of::<Pageblock>() == 0);
+        let number = range_size.div_ceil(PAGEBLOCK_SIZE);
+        let blocks_ptr = memory.cast::<Pageblock>();
+        let migratetypes_ptr = unsafe { blocks_ptr.add(number) }.cast::<AtomicU8>();
+        let (blocks, migratetypes) = unsafe {
+            for i in 0..number {
+                blocks_ptr.add(i).write(Pageblock {
+                    free_map: [0; BITMAP_WORDS],
+                    free_pages: 0,
+                    state: PageblockState::Buddy,
+                    isolated: false,
+                    prev: NONE,
+                    next: NONE,
+                });
+                migratetypes_ptr
+                    .add(i)
+                    .write(AtomicU8::new(Migratetype::Unmovable as u8));
+            }
+            (
+                core::slice::from_raw_parts_mut(blocks_ptr, number),
+                core::slice::from_raw_parts(migratetypes_ptr, number),
+            )
+        };
+        MIGRATETYPE_TABLES[node][zone.index()].call_once(|| MigratetypeTable {
+            base: base.as_u64(),
+            migratetypes,
+        });
+        Self {
+            node,
+            zone,
+            base: base.as_u64(),
+            blocks,
+            migratetypes,
+            partial: [NONE; Migratetype::NUMBER],
+            free_pages: [0; Migratetype::NUMBER],
+        }
+    }
+
+    /// Number of pageblocks
+    #[inline]
+    pub(super) fn len(&self) -> usize {
+        self.blocks.len()
+    }
+
+    /// Free bytes in split pageblocks
+    #[inline]
+    pub(super) fn free_size(&self) -> usize {
+        self.free_pages.iter().sum::<usize>() * PAGE_SIZE
+    }
+
+    /// Number of split pageblocks by migratetype
+    pub(super) fn split_numbers(&self) -> [usize; Migratetype::NUMBER] {
+        let mut numbers = [0; Migratetype::NUMBER];
+        for (index, block) in self.blocks.iter().enumerate() {
+            if block.state != PageblockState::Buddy {
+                numbers[self.migratetype(index).index()] += 1;
+            }
+        }
+        numbers
+    }
+
+    /// Allocs block of pages smaller than a pageblock
+    ///
+    /// Takes a new pageblock from the buddy allocator or steals if the pageblocks of the migratetype are full
+    pub(super) fn alloc(
+        &mut self,
+        buddy: &mut BuddyAlloc,
+        size: usize,
+        migratetype: Migratetype,
+    ) -> Option<PhysAddr> {
+        debug_assert!(size >= PAGE_SIZE && size < PAGEBLOCK_SIZE && size.is_power_of_two());
+        let pages = size / PAGE_SIZE;
+        if let Some(phys_addr) = self.alloc_from_partial(migratetype, pages) {
+            return Some(phys_addr);
+        }
+
+        // New pageblock
+        let pageblock_ptr = unsafe { buddy.malloc(PAGEBLOCK_SIZE) };
+        if !pageblock_ptr.is_null() {
+            let index = self.index(pageblock_ptr as u64);
+            debug_assert_eq!(
+                pageblock_ptr as u64,
+                self.address(index),
+                "Buddy allocator allocates non aligned pageblock"
+            );
+            let block = &mut self.blocks[index];
+            debug_assert_eq!(block.state, PageblockState::Buddy);
+            block.state = PageblockState::Split;
+            block.free_map = [u64::MAX; BITMAP_WORDS];
+            block.free_pages = PAGEBLOCK_PAGES as u16;
+            self.migratetypes[index].store(migratetype as u8, Ordering::Relaxed);
+            self.free_pages[migratetype.index()] += PAGEBLOCK_PAGES;
+            self.push(migratetype, index);
+            return self.alloc_in(index, pages);
+        }
+
+        // Steal
+        for fallback in migratetype.fallbacks() {
+            let Some(index) = self.find_for_steal(fallback, pages) else {
+                continue;
+            };
+            memory_stats::record_steal(self.node, self.zone);
+            if self.blocks[index].free_pages as usize >= PAGEBLOCK_PAGES / 2 {
+                self.convert(index, migratetype);
+            }
+            return self.alloc_in(index, pages);
+        }
+        None
+    }
+
+    /// Frees block of pages smaller than a pageblock
+    ///
+    /// Pageblock is returned to the buddy allocator if all its pages are free
+    ///
+    /// # Safety
+    /// Block must be allocated by [Self::alloc] with the same size
+    pub(super) unsafe fn free(&mut self, buddy: &mut BuddyAlloc, phys_addr: PhysAddr, size: usize) {
+        let index = self.index(phys_addr.as_u64());
+        assert_ne!(
+            self.blocks[index].state,
+            PageblockState::Buddy,
+            "Freeing block of not split pageblock"
+        );
+        let offset = (phys_addr.as_u64() - self.address(index)) as usize / PAGE_SIZE;
+        self.mark_free(index, offset, size / PAGE_SIZE);
+
+        let block = &self.blocks[index];
+        if block.free_pages as usize == PAGEBLOCK_PAGES
+            && block.state == PageblockState::Split
+            && !block.isolated
+        {
+            self.release(buddy, index);
+        }
+    }
+
+    /// Resizes block of pages smaller than a pageblock in place
+    ///
+    /// Shrinking frees the tail. Growing is possible if the block is aligned to the new size and the following
+    /// pages are free, like merging with the free buddy
+    ///
+    /// Returns false if the block can't grow
+    ///
+    /// # Safety
+    /// Block must be allocated by [Self::alloc] with the old size
+    pub(super) unsafe fn resize(
+        &mut self,
+        phys_addr: PhysAddr,
+        old_size: usize,
+        new_size: usize,
+    ) -> bool {
+        debug_assert!(
+            new_size >= PAGE_SIZE && new_size < PAGEBLOCK_SIZE && new_size.is_power_of_two()
+        );
+        let index = self.index(phys_addr.as_u64());
+        debug_assert_ne!(
+            self.blocks[index].state,
+            PageblockState::Buddy,
+            "Resizing block of not split pageblock"
+        );
+        let offset = (phys_addr.as_u64() - self.address(index)) as usize / PAGE_SIZE;
+        let old_pages = old_size / PAGE_SIZE;
+        let new_pages = new_size / PAGE_SIZE;
+        if new_pages <= old_pages {
+            // The block keeps at least one page, the pageblock isn't released
+            self.mark_free(index, offset + new_pages, old_pages - new_pages);
+            return true;
+        }
+        let free_map = &self.blocks[index].free_map;
+        if offset % new_pages != 0
+            || !(offset + old_pages..offset + new_pages)
+                .all(|page| free_map[page / 64] & (1 << (page % 64)) != 0)
+        {
+            return false;
+        }
+        self.mark_used(index, offset + old_pages, new_pages - old_pages);
+        true
+    }
+
+    /// Releases usable memory at init
+    ///
+    /// Whole pageblocks are released to the buddy allocator, pieces of pageblocks are split
+    ///
+    /// # Safety
+    /// Memory must be usable and not released yet, buddy allocator must have it reserved
+    pub(super) unsafe fn release_range(
+        &mut self,
+        buddy: &mut BuddyAlloc,
+        phys_addr: PhysAddr,
+        size: usize,
+    ) {
+        let first = phys_addr.as_u64();
+        let end = first + size as u64;
+        let whole_first = x86_64::align_up(first, PAGEBLOCK_SIZE as u64).min(end);
+        let whole_end = x86_64::align_down(end, PAGEBLOCK_SIZE as u64).max(whole_first);
+        if whole_end > whole_first {
+            unsafe {
+                buddy.unsafe_release_range(
+                    whole_first as *mut u8,
+                    (whole_end - whole_first) as usize,
+                );
+            }
+        }
+        for (piece_first, piece_end) in [(first, whole_first), (whole_end, end)] {
+            if piece_end <= piece_first {
+                continue;
+            }
+            let index = self.index(piece_first);
+            let block = &mut self.blocks[index];
+            if block.state == PageblockState::Buddy {
+                block.state = PageblockState::SplitAtInit;
+            }
+            debug_assert_eq!(block.state, PageblockState::SplitAtInit);
+            let offset = (piece_first - self.address(index)) as usize / PAGE_SIZE;
+            self.mark_free(
+                index,
+                offset,
+                (piece_end - piece_first) as usize / PAGE_SIZE,
+            );
+        }
+    }
+
+    /// Migratetype of the pageblock
+    #[inline]
+    fn migratetype(&self, index: usize) -> Migratetype {
+        Migratetype::from_u8(self.migratetypes[index].load(Ordering::Relaxed))
+    }
+
+    #[inline]
+    fn index(&self, phys_addr: u64) -> usize {
+        ((phys_addr - self.base) / PAGEBLOCK_SIZE as u64) as usize
+    }
+
+    #[inline]
+    fn address(&self, index: usize) -> u64 {
+        self.base + (index * PAGEBLOCK_SIZE) as u64
+    }
+
+    /// First fit in the partial list of the migratetype
+    fn alloc_from_partial(&mut self, migratetype: Migratetype, pages: usize) -> Option<PhysAddr> {
+        let mut index = self.partial[migratetype.index()];
+        while index != NONE {
+            let block = &self.blocks[index as usize];
+            if block.free_pages as usize >= pages && find_free_run(&block.free_map, pages).is_some()
+            {
+                return self.alloc_in(index as usize, pages);
+            }
+            index = block.next;
+        }
+        None
+    }
+
+    /// Pageblock of the partial list of the migratetype with the most free pages which fits the block
+    fn find_for_steal(&self, migratetype: Migratetype, pages: usize) -> Option<usize> {
+        let mut best: Option<usize> = None;
+        let mut index = self.partial[migratetype.index()];
+        while index != NONE {
+            let block = &self.blocks[index as usize];
+            if best.is_none_or(|best| block.free_pages > self.blocks[best].free_pages)
+                && find_free_run(&block.free_map, pages).is_some()
+            {
+                best = Some(index as usize);
+            }
+            index = block.next;
+        }
+        best
+    }
+
+    /// Allocs pages from the pageblock, it must have a free run
+    fn alloc_in(&mut self, index: usize, pages: usize) -> Option<PhysAddr> {
+        let offset = find_free_run(&self.blocks[index].free_map, pages)?;
+        self.mark_used(index, offset, pages);
+        Some(PhysAddr::new(
+            self.address(index) + (offset * PAGE_SIZE) as u64,
+        ))
+    }
+
+    fn mark_used(&mut self, index: usize, offset: usize, pages: usize) {
+        let migratetype = self.migratetype(index);
+        let block = &mut self.blocks[index];
+        for page in offset..offset + pages {
+            debug_assert!(
+                block.free_map[page / 64] & (1 << (page % 64)) != 0,
+                "Page in pageblock is already used"
+            );
+            block.free_map[page / 64] &= !(1 << (page % 64));
+        }
+        block.free_pages -= pages as u16;
+        let full = block.free_pages == 0 && !block.isolated;
+        self.free_pages[migratetype.index()] -= pages;
+        if full {
+            self.remove(migratetype, index);
+        }
+    }
+
+    fn mark_free(&mut self, index: usize, offset: usize, pages: usize) {
+        let migratetype = self.migratetype(index);
+        let block = &mut self.blocks[index];
+        let was_full = block.free_pages == 0;
+        for page in offset..offset + pages {
+            debug_assert!(
+                block.free_map[page / 64] & (1 << (page % 64)) == 0,
+                "Double free of page in pageblock"
+            );
+            block.free_map[page / 64] |= 1 << (page % 64);
+        }
+        block.free_pages += pages as u16;
+        let isolated = block.isolated;
+        self.free_pages[migratetype.index()] += pages;
+        if was_full && !isolated {
+            self.push(migratetype, index);
+        }
+    }
+
+    /// Returns fully free pageblock to the buddy allocator
+    fn release(&mut self, buddy: &mut BuddyAlloc, index: usize) {
+        let migratetype = self.migratetype(index);
+        if !self.blocks[index].isolated {
+            self.remove(migratetype, index);
+        }
+        self.free_pages[migratetype.index()] -= PAGEBLOCK_PAGES;
+        let block = &mut self.blocks[index];
+        block.state = PageblockState::Buddy;
+        block.free_map = [0; BITMAP_WORDS];
+        block.free_pages = 0;
+        unsafe {
+            buddy.free(self.address(index) as *mut u8);
+        }
+    }
+
+    /// Moves pageblock with its free pages to other migratetype
+    fn convert(&mut self, index: usize, migratetype: Migratetype) {
+        let old_migratetype = self.migratetype(index);
+        let block = &self.blocks[index];
+        let listed = block.free_pages != 0 && !block.isolated;
+        let free_pages = block.free_pages as usize;
+        if listed {
+            self.remove(old_migratetype, index);
+        }
+        self.free_pages[old_migratetype.index()] -= free_pages;
+        self.migratetypes[index].store(migratetype as u8, Ordering::Relaxed);
+        self.free_pages[migratetype.index()] += free_pages;
+        if listed {
+            self.push(migratetype, index);
+        }
+    }
+
+    /// Adds pageblock to the head of the partial list
+    fn push(&mut self, migratetype: Migratetype, index: usize) {
+        let head = self.partial[migratetype.index()];
+        self.blocks[index].prev = NONE;
+        self.blocks[index].next = head;
+        if head != NONE {
+            self.blocks[head as usize].prev = index as u32;
+        }
+        self.partial[migratetype.index()] = index as u32;
+    }
+
+    fn remove(&mut self, migratetype: Migratetype, index: usize) {
+        let Pageblock { prev, next, .. } = self.blocks[index];
+        if prev == NONE {
+            debug_assert_eq!(self.partial[migratetype.index()], index as u32);
+            self.partial[migratetype.index()] = next;
+        } else {
+            self.blocks[prev as usize].next = next;
+        }
+        if next != NONE {
+            self.blocks[next as usize].prev = prev;
+        }
+        self.blocks[index].prev = NONE;
+        self.blocks[index].next = NONE;
+    }
+
+    // Compaction
+
+    /// Isolates sparse movable pageblock for compaction
+    ///
+    /// Pageblock is isolated if it has from 1 to max_used used pages, and other movable pageblocks have room for them
+    ///
+    /// Returns the address of the pageblock
+    pub(super) fn isolate_sparse(&mut self, index: usize, max_used: usize) -> Option<PhysAddr> {
+        let block = &self.blocks[index];
+        let used = PAGEBLOCK_PAGES - block.free_pages as usize;
+        if block.state != PageblockState::Split
+            || block.isolated
+            || self.migratetype(index) != Migratetype::Movable
+            || used == 0
+            || used > max_used
+            || self.free_pages[Migratetype::Movable.index()] - (block.free_pages as usize) < used
+        {
+            return None;
+        }
+        if block.free_pages != 0 {
+            self.remove(Migratetype::Movable, index);
+        }
+        self.blocks[index].isolated = true;
+        Some(PhysAddr::new(self.address(index)))
+    }
+
+    /// Ends isolation of the pageblock
+    ///
+    /// Returns true if the pageblock was emptied and returned to the buddy allocator
+    pub(super) fn unisolate(&mut self, buddy: &mut BuddyAlloc, index: usize) -> bool {
+        debug_assert!(self.blocks[index].isolated);
+        let free_pages = self.blocks[index].free_pages as usize;
+        if free_pages == PAGEBLOCK_PAGES && self.blocks[index].state == PageblockState::Split {
+            // Isolated pageblock isn't in the list, release doesn't remove it
+            self.release(buddy, index);
+            self.blocks[index].isolated = false;
+            return true;
+        }
+        self.blocks[index].isolated = false;
+        if free_pages != 0 {
+            self.push(self.migratetype(index), index);
+        }
+        false
+    }
+
+    /// Checks if the page of the pageblock is free
+    #[inline]
+    pub(super) fn is_page_free(&self, phys_addr: PhysAddr) -> bool {
+        let index = self.index(phys_addr.as_u64());
+        let page = (phys_addr.as_u64() - self.address(index)) as usize / PAGE_SIZE;
+        self.blocks[index].free_map[page / 64] & (1 << (page % 64)) != 0
+    }
+
+    /// Allocs page for a migrated page from the fullest movable pageblock with free pages
+    ///
+    /// New pageblocks aren't taken, compaction must not consume free pageblocks.
+    /// Fullest pageblock is chosen, so pages aren't moved to pageblocks that are emptied next
+    pub(super) fn alloc_migration_target(&mut self) -> Option<PhysAddr> {
+        let mut best: Option<usize> = None;
+        let mut index = self.partial[Migratetype::Movable.index()];
+        while index != NONE {
+            let block = &self.blocks[index as usize];
+            if best.is_none_or(|best| block.free_pages < self.blocks[best].free_pages) {
+                best = Some(index as usize);
+            }
+            index = block.next;
+        }
+        self.alloc_in(best?, 1)
+    }
+}
+
+/// Migratetype of the pageblock of the address
+///
+/// Unmovable if the zone isn't grouped
+///
+/// Without the zone lock, may be stale if the pageblock is converted
+#[inline]
+pub(super) fn migratetype_of(
+    node: usize,
+    zone: MemoryZoneEnum,
+    phys_addr: PhysAddr,
+) -> Migratetype {
+    match MIGRATETYPE_TABLES[node][zone.index()].get() {
+        Some(table) => Migratetype::from_u8(
+            table.migratetypes
+                [((phys_addr.as_u64() - table.base) / PAGEBLOCK_SIZE as u64) as usize]
+                .load(Ordering::Relaxed),
+        ),
+        None => Migratetype::Unmovable,
+    }
+}
+
+/// Finds aligned run of free pages
+///
+/// Returns the index of the first page
+#[inline]
+fn find_free_run(free_map: &[u64; BITMAP_WORDS], pages: usize) -> Option<usize> {
+    if pages >= 64 {
+        let words = pages / 64;
+        return (0..BITMAP_WORDS)
+            .step_by(words)
+            .find(|word| {
+                free_map[*word..*word + words]
+                    .iter()
+                    .all(|bits| *bits == u64::MAX)
+            })
+            .map(|word| word * 64);
+    }
+    let mask = (1u64 << pages) - 1;
+    for (word, bits) in free_map.iter().enumerate() {
+        if *bits == 0 {
+            continue;
+        }
+        if pages == 1 {
+            return Some(word * 64 + bits.trailing_zeros() as usize);
+        }
+        for bit in (0..64).step_by(pages) {
+            if (bits >> bit) & mask == mask {
+                return Some(word * 64 + bit);
+            }
+        }
+    }
+    None
+}
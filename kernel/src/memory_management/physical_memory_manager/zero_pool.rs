@@ -0,0 +1,207 @@
+// Zero page pool
+//
+// Page tables, address spaces and dlmalloc segments need zeroed pages. Instead of zeroing them on allocation,
+// each NUMA node keeps pools of pages zeroed by idle CPUs of the node.
+// Pages are zeroed with non-temporal stores, they don't evict cache lines of the running tasks and
+// aren't in the cache when taken anyway.
+//
+// Pages in the pool are allocated from the buddy allocator's point of view and have FLAG_ZEROED set in their descriptors.
+// They are unmovable, zeroed pages are used for page tables and dlmalloc segments.
+// The flag is cleared when the page leaves the pool.
+//
+// ISA DMA zone is too small to hold pages in the pool.
+// Idle CPUs don't refill pools of zones that are running out of memory, on memory pressure all pools are drained.
+
+use super::{numa, page_descriptor, virtual_memory_manager, MAX_NUMA_NODES, PAGE_SIZE};
+use super::{MemoryZoneEnum, MemoryZonesAndPrioritySpecifier, Migratetype, PageDescriptor};
+use crate::sync::Mutex;
+use x86_64::PhysAddr;
+
+/// Pages in the pool of each zone of each node, 1 MB
+const POOL_CAPACITY: usize = 256;
+
+/// Pool isn't refilled if the zone has less free memory
+const REFILL_MIN_FREE_SIZE: usize = 32 * 1024 * 1024;
+
+/// Zones with pools, in refill order
+const POOLED_ZONES: [MemoryZoneEnum; 2] = [MemoryZoneEnum::High, MemoryZoneEnum::Dma32];
+
+/// [node][zone]
+static POOLS: [[Mutex<ZeroPool>; MemoryZoneEnum::NUMBER]; MAX_NUMA_NODES] =
+    [const { [const { Mutex::new(ZeroPool::new()) }; MemoryZoneEnum::NUMBER] }; MAX_NUMA_NODES];
+
+/// Stack of zeroed pages
+struct ZeroPool {
+    pages: [u64; POOL_CAPACITY],
+    len: usize,
+}
+
+impl ZeroPool {
+    const fn new() -> Self {
+        Self {
+            pages: [0; POOL_CAPACITY],
+            len: 0,
+        }
+    }
+
+    #[inline]
+    fn push(&mut self, phys_addr: PhysAddr) -> bool {
+        if self.len == POOL_CAPACITY {
+            return false;
+        }
+        self.pages[self.len] = phys_addr.as_u64();
+        self.len += 1;
+        true
+    }
+
+    #[inline]
+    fn pop(&mut self) -> Option<PhysAddr> {
+        if self.len == 0 {
+            return None;
+        }
+        self.len -= 1;
+        Some(PhysAddr::new(self.pages[self.len]))
+    }
+}
+
+#[inline]
+fn pool(node: usize, zone: MemoryZoneEnum) -> &'static Mutex<ZeroPool> {
+    &POOLS[node][zone.index()]
+}
+
+/// Takes zeroed page of the first existing zone of the specifier from the pool of the node
+///
+/// None if the pool is empty, lower priority zones aren't tried to not waste their memory
+pub(super) fn take(
+    node: usize,
+    memory_zones_and_priority_specifier: &MemoryZonesAndPrioritySpecifier,
+) -> Option<PhysAddr> {
+    let zone = *memory_zones_and_priority_specifier
+        .iter()
+        .find(|zone| zone.zone(node).get().is_some())?;
+    if !POOLED_ZONES.contains(&zone) {
+        return None;
+    }
+    let phys_addr =
+        x86_64::instructions::interrupts::without_interrupts(|| pool(node, zone).lock().pop())?;
+    leave_pool(phys_addr);
+    Some(phys_addr)
+}
+
+/// Checks if some pool of the current CPU's NUMA node can be refilled
+///
+/// Called by the idle loop with disabled interrupts
+pub fn needs_refill() -> bool {
+    refillable_zone(numa::current_node()).is_some()
+}
+
+/// Zeroes one page and puts it to the pool of the current CPU's NUMA node
+///
+/// Called by the idle loop, one page at a time to check the run queue between pages
+pub fn refill() {
+    let node = numa::current_node();
+    let Some(zone) = refillable_zone(node) else {
+        return;
+    };
+    let Some(phys_addr) =
+        super::alloc_from_zones(node, &[zone], PAGE_SIZE, false, Migratetype::Unmovable)
+    else {
+        return;
+    };
+    unsafe {
+        zero_nontemporal(
+            virtual_memory_manager::virt_addr_in_cpmm_from_phys_addr(phys_addr).as_mut_ptr(),
+            PAGE_SIZE,
+        );
+    }
+    descriptor(phys_addr).set_flags(PageDescriptor::FLAG_ZEROED);
+    let pushed = x86_64::instructions::interrupts::without_interrupts(|| {
+        pool(node, zone).lock().push(phys_addr)
+    });
+    if !pushed {
+        // Other CPU filled the pool
+        leave_pool(phys_addr);
+        unsafe {
+            super::free(phys_addr, PAGE_SIZE);
+        }
+    }
+}
+
+/// Returns pages of all pools to the buddy allocators
+///
+/// Called on memory pressure
+pub(super) fn drain_all() {
+    for node in 0..numa::nodes_number() {
+        for zone in POOLED_ZONES {
+            while let Some(phys_addr) = x86_64::instructions::interrupts::without_interrupts(|| {
+                pool(node, zone).lock().pop()
+            }) {
+                leave_pool(phys_addr);
+                unsafe {
+                    super::free(phys_addr, PAGE_SIZE);
+                }
+            }
+        }
+    }
+}
+
+/// Pages in the pool of the zone of the node
+pub fn pool_size(node: usize, zone: MemoryZoneEnum) -> usize {
+    x86_64::instructions::interrupts::without_interrupts(|| pool(node, zone).lock().len)
+}
+
+/// First pooled zone of the node which pool isn't full and which has enough free memory
+fn refillable_zone(node: usize) -> Option<MemoryZoneEnum> {
+    POOLED_ZONES.into_iter().find(|zone| {
+        zone.zone(node).get().is_some()
+            && x86_64::instructions::interrupts::without_interrupts(|| {
+                pool(node, *zone).lock().len < POOL_CAPACITY
+            })
+            && zone.lock(node).free_size() >= REFILL_MIN_FREE_SIZE
+    })
+}
+
+#[inline]
+fn descriptor(phys_addr: PhysAddr) -> &'static PageDescriptor {
+    page_descriptor(phys_addr).expect("Zeroed page without descriptor")
+}
+
+#[inline]
+fn leave_pool(phys_addr: PhysAddr) {
+    let descriptor = descriptor(phys_addr);
+    debug_assert!(
+        descriptor.flags() & PageDescriptor::FLAG_ZEROED != 0,
+        "Page in the zero page pool isn't zeroed"
+    );
+    descriptor.clear_flags(PageDescriptor::FLAG_ZEROED);
+}
+
+/// Zeroes memory bypassing the cache
+///
+/// # Safety
+/// ptr must be 64 bytes aligned, size must be non-zero multiple of 64
+unsafe fn zero_nontemporal(ptr: *mut u8, size: usize) {
+    debug_assert!(ptr as usize % 64 == 0 && size % 64 == 0 && size != 0);
+    unsafe {
+        core::arch::asm!(
+            "2:",
+            "movnti [{ptr}], {zero}",
+            "movnti [{ptr} + 8], {zero}",
+            "movnti [{ptr} + 16], {zero}",
+            "movnti [{ptr} + 24], {zero}",
+            "movnti [{ptr} + 32], {zero}",
+            "movnti [{ptr} + 40], {zero}",
+            "movnti [{ptr} + 48], {zero}",
+            "movnti [{ptr} + 56], {zero}",
+            "add {ptr}, 64",
+            "sub {size}, 64",
+            "jnz 2b",
+            // Non-temporal stores are weakly ordered
+            "sfence",
+            ptr = inout(reg) ptr => _,
+            size = inout(reg) size => _,
+            zero = in(reg) 0u64,
+            options(nostack),
+        );
+    }
+}
@@ -1,29 +1,28 @@
-use crate::memory_management::physical_memory_manager::MemoryZoneEnum;
+mod magazine;
+
+pub use magazine::{MagazineCache, MagazineCacheStats};
+
+use crate::memory_management::memory_stats;
+use crate::memory_management::physical_memory_manager::{
+    self, MemoryZoneEnum, Migratetype, PageDescriptor,
+};
 use crate::memory_management::PAGE_SIZE;
-use core::mem::MaybeUninit;
+use crate::trace::TraceEvent;
 use core::ptr::null_mut;
 use slab_allocator_lib::{Cache, MemoryBackend, ObjectSizeType, SlabInfo};
-use spin::{Mutex, Once};
+use spin::Once;
 use x86_64::VirtAddr;
 
-/// Array of saved SlabInfo's pointers for each page. Used by Slab Allocator's
-///
-/// Mutex is not required because a properly working SlabAllocator and his MemoryBackend will not touch data that is not its own
-// But the hash table approach has the disadvantage that
-// it requires expanding the hash table (doubling its size), and it doesn't fit well with SlabAllocator (you'll have to create a many of caches of double size)
-// This array approach wastes memory. Thus, we have to store 262144 pointers(2097152 bytes, 2MB) for 1 GB of memory
-//
-// MaybeUninit is used because initializing the entire array memory before creating a slice is a heavy operation
-pub static mut SLAB_INFO_PTRS: Once<&'static mut [MaybeUninit<*mut SlabInfo>]> = Once::new();
-
 /// Cache with SlabInfo's
-static SLAB_INFO_CACHE: Once<Mutex<Cache<SlabInfo, SlabInfoCacheMemoryBackend>>> = Once::new();
+static SLAB_INFO_CACHE: Once<MagazineCache<SlabInfo, SlabInfoCacheMemoryBackend>> = Once::new();
 
 /// Inits slab caches
 pub fn init() {
+    magazine::init();
+
     // Init SlabInfo cache
     SLAB_INFO_CACHE.call_once(|| {
-        Mutex::new(
+        MagazineCache::new(
             Cache::new(
                 4096,
                 PAGE_SIZE,
@@ -35,8 +34,16 @@ pub fn init() {
     });
 }
 
+/// Statistics of the SlabInfo cache
+pub fn slab_info_cache_stats() -> MagazineCacheStats {
+    SLAB_INFO_CACHE
+        .get()
+        .expect("SlabInfo cache not set")
+        .stats()
+}
+
 /// MemoryBackend suitable for any cache
-struct DefaultMemoryBackend;
+pub struct DefaultMemoryBackend;
 
 impl MemoryBackend for DefaultMemoryBackend {
     unsafe fn alloc_slab(&mut self, slab_size: usize, page_size: usize) -> *mut u8 {
@@ -45,18 +52,24 @@ impl MemoryBackend for DefaultMemoryBackend {
             "Slab allocator tries to allocate invalid slab size"
         );
         // Alloc physical frame with slab size
-        let phys_addr = super::physical_memory_manager::alloc(
+        // Empty slabs are returned by caches, slabs are grouped as reclaimable
+        let phys_addr = super::physical_memory_manager::alloc_with_migratetype(
             &[
                 MemoryZoneEnum::High,
                 MemoryZoneEnum::Dma32,
                 MemoryZoneEnum::IsaDma,
             ],
             slab_size,
+            Migratetype::Reclaimable,
         );
         if phys_addr.is_null() {
             return null_mut();
         }
-        super::virtual_memory_manager::virt_addr_in_cpmm_from_phys_addr(phys_addr).as_mut_ptr()
+        let slab_ptr: *mut u8 =
+            super::virtual_memory_manager::virt_addr_in_cpmm_from_phys_addr(phys_addr).as_mut_ptr();
+        memory_stats::record_slab_alloc(slab_size);
+        crate::trace_event!(TraceEvent::SlabAlloc, slab_ptr, slab_size);
+        slab_ptr
     }
 
     unsafe fn free_slab(&mut self, slab_ptr: *mut u8, slab_size: usize, page_size: usize) {
@@ -65,17 +78,18 @@ impl MemoryBackend for DefaultMemoryBackend {
             slab_size != 0 && slab_size.is_power_of_two() && slab_size % page_size == 0,
             "Slab allocator tries to free invalid slab size"
         );
+        memory_stats::record_slab_free(slab_size);
+        crate::trace_event!(TraceEvent::SlabFree, slab_ptr, slab_size);
         let virt_addr = VirtAddr::from_ptr(slab_ptr);
         let phys_addr =
             super::virtual_memory_manager::phys_addr_from_virt_addr_from_cpmm(virt_addr);
-        super::physical_memory_manager::free(phys_addr);
+        super::physical_memory_manager::free(phys_addr, slab_size);
     }
 
     unsafe fn alloc_slab_info(&mut self) -> *mut SlabInfo {
         let slab_info_ptr = SLAB_INFO_CACHE
             .get()
             .expect("SlabInfo cache not set")
-            .lock()
             .alloc();
         slab_info_ptr
     }
@@ -88,7 +102,6 @@ impl MemoryBackend for DefaultMemoryBackend {
         SLAB_INFO_CACHE
             .get()
             .expect("SlabInfo cache not set")
-            .lock()
             .free(slab_info_ptr);
     }
 
@@ -101,16 +114,7 @@ impl MemoryBackend for DefaultMemoryBackend {
             !slab_info_ptr.is_null(),
             "Slab allocator tries to save SlabInfo with null ptr"
         );
-        let virt_addr = VirtAddr::new(object_page_addr as u64);
-        let phys_addr =
-            super::virtual_memory_manager::phys_addr_from_virt_addr_from_cpmm(virt_addr);
-
-        // OMG
-        #[allow(static_mut_refs)]
-        let slab_info_ptr_array_ref: &mut &mut [MaybeUninit<*mut SlabInfo>] = SLAB_INFO_PTRS
-            .get_mut()
-            .expect("SlabInfo ptr array not set");
-        slab_info_ptr_array_ref[phys_addr.as_u64() as usize / PAGE_SIZE].write(slab_info_ptr);
+        page_descriptor_by_cpmm_addr(object_page_addr).set_slab_info(slab_info_ptr);
     }
 
     unsafe fn get_slab_info_ptr(&mut self, object_page_addr: usize) -> *mut SlabInfo {
@@ -119,14 +123,7 @@ impl MemoryBackend for DefaultMemoryBackend {
             "Slab allocator tries to get SlabInfo for zero page"
         );
 
-        let virt_addr = VirtAddr::new(object_page_addr as u64);
-        let phys_addr =
-            super::virtual_memory_manager::phys_addr_from_virt_addr_from_cpmm(virt_addr);
-
-        #[allow(static_mut_refs)]
-        let slab_info_ptr_array_ref: &&mut [MaybeUninit<*mut SlabInfo>] =
-            SLAB_INFO_PTRS.get().expect("SlabInfo ptr array not set");
-        slab_info_ptr_array_ref[phys_addr.as_u64() as usize / PAGE_SIZE].assume_init_read()
+        page_descriptor_by_cpmm_addr(object_page_addr).slab_info()
     }
 
     unsafe fn delete_slab_info_ptr(&mut self, page_addr: usize) {
@@ -134,10 +131,20 @@ impl MemoryBackend for DefaultMemoryBackend {
             page_addr != 0,
             "Slab allocator tries delete zero SlabInfo addr"
         );
-        // Don't need to do anything
+        page_descriptor_by_cpmm_addr(page_addr).clear_slab_info();
     }
 }
 
+/// Returns descriptor of the page mapped in CPMM
+#[inline]
+fn page_descriptor_by_cpmm_addr(page_addr: usize) -> &'static PageDescriptor {
+    let phys_addr = super::virtual_memory_manager::phys_addr_from_virt_addr_from_cpmm(
+        VirtAddr::new(page_addr as u64),
+    );
+    physical_memory_manager::page_descriptor(phys_addr)
+        .expect("Slab allocator uses page without descriptor")
+}
+
 struct SlabInfoCacheMemoryBackend;
 
 impl MemoryBackend for SlabInfoCacheMemoryBackend {
@@ -147,13 +154,14 @@ impl MemoryBackend for SlabInfoCacheMemoryBackend {
             "SlabInfo allocator tries to allocate invalid slab size"
         );
         // Alloc physical frame with slab size
-        let phys_addr = super::physical_memory_manager::alloc(
+        let phys_addr = super::physical_memory_manager::alloc_with_migratetype(
             &[
                 MemoryZoneEnum::High,
                 MemoryZoneEnum::Dma32,
                 MemoryZoneEnum::IsaDma,
             ],
             slab_size,
+            Migratetype::Reclaimable,
         );
         if phys_addr.is_null() {
             return null_mut();
@@ -170,7 +178,7 @@ impl MemoryBackend for SlabInfoCacheMemoryBackend {
         let virt_addr = VirtAddr::from_ptr(slab_ptr);
         let phys_addr =
             super::virtual_memory_manager::phys_addr_from_virt_addr_from_cpmm(virt_addr);
-        super::physical_memory_manager::free(phys_addr);
+        super::physical_memory_manager::free(phys_addr, slab_size);
     }
 
     unsafe fn alloc_slab_info(&mut self) -> *mut SlabInfo {
@@ -0,0 +1,483 @@
+// Magazine layer over slab caches (Bonwick, Adams: "Magazines and Vmem", 2001)
+//
+// Each CPU has two magazines (loaded and previous) of free objects of the cache.
+// alloc/free work with the loaded magazine without any lock, if it's empty/full the previous one is tried.
+// Only when both are empty/full the CPU goes to the depot (the lock) and exchanges a whole magazine.
+// If the depot has nothing, the slab cache itself is used (the second lock).
+//
+// Depot is adaptive: the depot lock contention is counted, if it's high the size of new magazines grows
+// and the depot is allowed to keep more full magazines. Excess full magazines are returned to the slab cache.
+//
+// Statistics are counted per CPU next to its magazines, stats sums them.
+
+use crate::memory_management::PAGE_SIZE;
+use crate::smp::{per_cpu, MAX_CPUS};
+use crate::sync::{Mutex, MutexGuard};
+use core::cell::UnsafeCell;
+use core::ptr::null_mut;
+use core::sync::atomic::{AtomicU64, AtomicUsize, Ordering};
+use slab_allocator_lib::{Cache, MemoryBackend, ObjectSizeType};
+use spin::Once;
+
+/// Max number of objects in a magazine (magazine is 256 bytes)
+const MAGAZINE_MAX_ROUNDS: usize = 30;
+
+/// Initial number of objects in a magazine
+const MAGAZINE_MIN_ROUNDS: usize = 6;
+
+/// Magazine size is increased by this number of rounds
+const MAGAZINE_ROUNDS_STEP: usize = 4;
+
+/// Initial max number of full magazines in the depot
+const DEPOT_MIN_FULL_MAGAZINES: usize = 4;
+
+/// Max number of full magazines in the depot
+const DEPOT_MAX_FULL_MAGAZINES: usize = 64;
+
+/// Contention is checked every this number of depot operations
+const CONTENTION_CHECK_INTERVAL: usize = 256;
+
+/// Magazine size grows if the depot lock was contended more times during the interval
+const CONTENTION_THRESHOLD: usize = CONTENTION_CHECK_INTERVAL / 16;
+
+/// Cache of empty magazines
+static MAGAZINES_CACHE: Once<Mutex<Cache<Magazine, super::DefaultMemoryBackend>>> = Once::new();
+
+/// Inits cache of magazines
+///
+/// Must be called before any MagazineCache use
+pub fn init() {
+    MAGAZINES_CACHE.call_once(|| {
+        Mutex::new(
+            Cache::new(
+                PAGE_SIZE,
+                PAGE_SIZE,
+                ObjectSizeType::Small,
+                super::DefaultMemoryBackend,
+            )
+            .unwrap_or_else(|error| panic!("Failed to create magazines cache: {error}")),
+        )
+    });
+}
+
+/// Stack of free objects
+#[repr(C)]
+struct Magazine {
+    /// Next magazine in the depot list
+    next: *mut Magazine,
+    /// Max number of objects in this magazine
+    capacity: u32,
+    /// Number of objects
+    rounds: u32,
+    objects: [*mut u8; MAGAZINE_MAX_ROUNDS],
+}
+
+impl Magazine {
+    /// Allocs an empty magazine
+    fn alloc(capacity: usize) -> *mut Magazine {
+        debug_assert!(capacity <= MAGAZINE_MAX_ROUNDS);
+        let magazine = MAGAZINES_CACHE
+            .get()
+            .expect("Magazines cache not set")
+            .lock()
+            .alloc();
+        if !magazine.is_null() {
+            unsafe {
+                (*magazine).next = null_mut();
+                (*magazine).capacity = capacity as u32;
+                (*magazine).rounds = 0;
+            }
+        }
+        magazine
+    }
+
+    /// Frees an empty magazine
+    unsafe fn free(magazine: *mut Magazine) {
+        debug_assert_eq!(
+            unsafe { (*magazine).rounds },
+            0,
+            "Freeing non empty magazine"
+        );
+        MAGAZINES_CACHE
+            .get()
+            .expect("Magazines cache not set")
+            .lock()
+            .free(magazine);
+    }
+
+    #[inline]
+    fn is_empty(&self) -> bool {
+        self.rounds == 0
+    }
+
+    #[inline]
+    fn is_full(&self) -> bool {
+        self.rounds == self.capacity
+    }
+
+    #[inline]
+    fn pop(&mut self) -> *mut u8 {
+        debug_assert!(!self.is_empty());
+        self.rounds -= 1;
+        self.objects[self.rounds as usize]
+    }
+
+    #[inline]
+    fn push(&mut self, object: *mut u8) {
+        debug_assert!(!self.is_full());
+        self.objects[self.rounds as usize] = object;
+        self.rounds += 1;
+    }
+}
+
+/// Intrusive list of magazines
+struct MagazineList {
+    head: *mut Magazine,
+    len: usize,
+}
+
+impl MagazineList {
+    const fn new() -> Self {
+        Self {
+            head: null_mut(),
+            len: 0,
+        }
+    }
+
+    fn push(&mut self, magazine: *mut Magazine) {
+        unsafe {
+            (*magazine).next = self.head;
+        }
+        self.head = magazine;
+        self.len += 1;
+    }
+
+    fn pop(&mut self) -> Option<*mut Magazine> {
+        if self.head.is_null() {
+            return None;
+        }
+        let magazine = self.head;
+        unsafe {
+            self.head = (*magazine).next;
+        }
+        self.len -= 1;
+        Some(magazine)
+    }
+}
+
+/// Global magazine storage of the cache
+struct Depot {
+    full: MagazineList,
+    empty: MagazineList,
+}
+
+/// Magazines of one CPU
+struct CpuMagazines {
+    loaded: *mut Magazine,
+    previous: *mut Magazine,
+    stats: CpuCacheCounters,
+}
+
+/// Counters of one CPU, updated only by it with disabled interrupts
+struct CpuCacheCounters {
+    allocs: AtomicU64,
+    frees: AtomicU64,
+    /// Allocs and frees served by the CPU's magazines without locks
+    magazine_hits: AtomicU64,
+    /// Magazines taken from or given to the depot
+    depot_exchanges: AtomicU64,
+    /// Objects taken from the slab cache
+    slab_allocs: AtomicU64,
+    /// Objects returned to the slab cache
+    slab_frees: AtomicU64,
+}
+
+/// Snapshot of a MagazineCache
+#[derive(Clone, Copy, Debug, Default)]
+pub struct MagazineCacheStats {
+    pub object_size: usize,
+    pub allocs: u64,
+    pub frees: u64,
+    pub magazine_hits: u64,
+    pub depot_exchanges: u64,
+    pub slab_allocs: u64,
+    pub slab_frees: u64,
+    /// Capacity of new magazines
+    pub magazine_size: usize,
+    /// Depot lock contentions in the current check interval
+    pub depot_contentions: usize,
+}
+
+impl MagazineCacheStats {
+    /// Objects used by callers
+    pub fn used_objects(&self) -> u64 {
+        self.allocs.saturating_sub(self.frees)
+    }
+
+    /// Objects taken from the slab cache, but free in magazines
+    pub fn cached_objects(&self) -> u64 {
+        self.slab_allocs
+            .saturating_sub(self.slab_frees)
+            .saturating_sub(self.used_objects())
+    }
+}
+
+impl CpuCacheCounters {
+    const fn new() -> Self {
+        Self {
+            allocs: AtomicU64::new(0),
+            frees: AtomicU64::new(0),
+            magazine_hits: AtomicU64::new(0),
+            depot_exchanges: AtomicU64::new(0),
+            slab_allocs: AtomicU64::new(0),
+            slab_frees: AtomicU64::new(0),
+        }
+    }
+
+    #[inline(always)]
+    fn record_alloc(&self, magazine_hit: bool) {
+        add(&self.allocs, 1);
+        if magazine_hit {
+            add(&self.magazine_hits, 1);
+        }
+    }
+}
+
+/// Adds to a counter of the current CPU, interrupts must be disabled
+#[inline(always)]
+fn add(counter: &AtomicU64, value: u64) {
+    counter.store(
+        counter.load(Ordering::Relaxed).wrapping_add(value),
+        Ordering::Relaxed,
+    );
+}
+
+/// Slab cache with per-CPU magazines
+///
+/// alloc and free don't take locks in the common case
+pub struct MagazineCache<T, M: MemoryBackend> {
+    cache: Mutex<Cache<T, M>>,
+    depot: Mutex<Depot>,
+    /// Index is cpu_index, each CPU uses only its own entry with disabled interrupts
+    cpus: [UnsafeCell<CpuMagazines>; MAX_CPUS],
+    /// Capacity of new magazines
+    magazine_size: AtomicUsize,
+    /// Max number of full magazines in the depot
+    depot_full_limit: AtomicUsize,
+    depot_operations: AtomicUsize,
+    depot_contentions: AtomicUsize,
+}
+
+unsafe impl<T, M: MemoryBackend> Sync for MagazineCache<T, M> {}
+unsafe impl<T, M: MemoryBackend> Send for MagazineCache<T, M> {}
+
+impl<T, M: MemoryBackend> MagazineCache<T, M> {
+    pub fn new(cache: Cache<T, M>) -> Self {
+        Self {
+            cache: Mutex::new(cache),
+            depot: Mutex::new(Depot {
+                full: MagazineList::new(),
+                empty: MagazineList::new(),
+            }),
+            cpus: [const {
+                UnsafeCell::new(CpuMagazines {
+                    loaded: null_mut(),
+                    previous: null_mut(),
+                    stats: CpuCacheCounters::new(),
+                })
+            }; MAX_CPUS],
+            magazine_size: AtomicUsize::new(MAGAZINE_MIN_ROUNDS),
+            depot_full_limit: AtomicUsize::new(DEPOT_MIN_FULL_MAGAZINES),
+            depot_operations: AtomicUsize::new(0),
+            depot_contentions: AtomicUsize::new(0),
+        }
+    }
+
+    /// Allocs object
+    ///
+    /// May return null ptr
+    pub fn alloc(&self) -> *mut T {
+        x86_64::instructions::interrupts::without_interrupts(|| {
+            let cpu_magazines = unsafe { &mut *self.cpus[per_cpu::cpu_index()].get() };
+
+            unsafe {
+                if !cpu_magazines.loaded.is_null() && !(*cpu_magazines.loaded).is_empty() {
+                    cpu_magazines.stats.record_alloc(true);
+                    return (*cpu_magazines.loaded).pop().cast();
+                }
+                if !cpu_magazines.previous.is_null() && (*cpu_magazines.previous).is_full() {
+                    cpu_magazines.stats.record_alloc(true);
+                    core::mem::swap(&mut cpu_magazines.loaded, &mut cpu_magazines.previous);
+                    return (*cpu_magazines.loaded).pop().cast();
+                }
+            }
+
+            // Exchange empty magazine for a full one
+            let full_magazine = self.lock_depot().full.pop();
+            if let Some(full_magazine) = full_magazine {
+                cpu_magazines.stats.record_alloc(false);
+                add(&cpu_magazines.stats.depot_exchanges, 1);
+                let empty_magazine = cpu_magazines.previous;
+                cpu_magazines.previous = cpu_magazines.loaded;
+                cpu_magazines.loaded = full_magazine;
+                if !empty_magazine.is_null() {
+                    self.lock_depot().empty.push(empty_magazine);
+                }
+                return unsafe { (*full_magazine).pop().cast() };
+            }
+
+            let object = self.cache.lock().alloc();
+            if !object.is_null() {
+                cpu_magazines.stats.record_alloc(false);
+                add(&cpu_magazines.stats.slab_allocs, 1);
+            }
+            object
+        })
+    }
+
+    /// Frees object
+    ///
+    /// # Safety
+    /// Object must be allocated from this cache
+    pub unsafe fn free(&self, object: *mut T) {
+        debug_assert!(!object.is_null(), "Trying to free null ptr");
+        x86_64::instructions::interrupts::without_interrupts(|| {
+            let cpu_magazines = unsafe { &mut *self.cpus[per_cpu::cpu_index()].get() };
+            add(&cpu_magazines.stats.frees, 1);
+
+            unsafe {
+                if !cpu_magazines.loaded.is_null() && !(*cpu_magazines.loaded).is_full() {
+                    add(&cpu_magazines.stats.magazine_hits, 1);
+                    (*cpu_magazines.loaded).push(object.cast());
+                    return;
+                }
+                if !cpu_magazines.previous.is_null() && (*cpu_magazines.previous).is_empty() {
+                    add(&cpu_magazines.stats.magazine_hits, 1);
+                    core::mem::swap(&mut cpu_magazines.loaded, &mut cpu_magazines.previous);
+                    (*cpu_magazines.loaded).push(object.cast());
+                    return;
+                }
+            }
+
+            // Exchange full magazine for an empty one
+            let empty_magazine = match self.lock_depot().empty.pop() {
+                Some(empty_magazine) => empty_magazine,
+                None => Magazine::alloc(self.magazine_size.load(Ordering::Relaxed)),
+            };
+            if empty_magazine.is_null() {
+                // No memory for magazine
+                unsafe {
+                    self.cache.lock().free(object);
+                }
+                add(&cpu_magazines.stats.slab_frees, 1);
+                return;
+            }
+            add(&cpu_magazines.stats.depot_exchanges, 1);
+            let full_magazine = cpu_magazines.previous;
+            cpu_magazines.previous = cpu_magazines.loaded;
+            cpu_magazines.loaded = empty_magazine;
+            if !full_magazine.is_null() {
+                let mut depot_lock = self.lock_depot();
+                if depot_lock.full.len < self.depot_full_limit.load(Ordering::Relaxed) {
+                    depot_lock.full.push(full_magazine);
+                } else {
+                    // Depot is full, return the objects to the slab cache
+                    drop(depot_lock);
+                    add(&cpu_magazines.stats.slab_frees, unsafe {
+                        (*full_magazine).rounds as u64
+                    });
+                    self.flush_magazine(full_magazine);
+                    self.lock_depot().empty.push(full_magazine);
+                }
+            }
+            unsafe {
+                (*empty_magazine).push(object.cast());
+            }
+        });
+    }
+
+    /// Returns all objects of the magazine to the slab cache
+    fn flush_magazine(&self, magazine: *mut Magazine) {
+        let mut cache_lock = self.cache.lock();
+        unsafe {
+            while !(*magazine).is_empty() {
+                cache_lock.free((*magazine).pop().cast());
+            }
+        }
+    }
+
+    /// Returns all objects from the depot's magazines to the slab cache and frees the magazines
+    ///
+    /// Per-CPU magazines are not touched
+    pub fn reap(&self) {
+        let mut depot_lock = self.depot.lock();
+        while let Some(magazine) = depot_lock.full.pop() {
+            x86_64::instructions::interrupts::without_interrupts(|| {
+                let cpu_magazines = unsafe { &*self.cpus[per_cpu::cpu_index()].get() };
+                add(&cpu_magazines.stats.slab_frees, unsafe {
+                    (*magazine).rounds as u64
+                });
+            });
+            self.flush_magazine(magazine);
+            unsafe {
+                Magazine::free(magazine);
+            }
+        }
+        while let Some(magazine) = depot_lock.empty.pop() {
+            unsafe {
+                Magazine::free(magazine);
+            }
+        }
+    }
+
+    /// Sums counters of all CPUs, values of a running system are approximate
+    pub fn stats(&self) -> MagazineCacheStats {
+        let mut stats = MagazineCacheStats {
+            object_size: size_of::<T>(),
+            magazine_size: self.magazine_size.load(Ordering::Relaxed),
+            depot_contentions: self.depot_contentions.load(Ordering::Relaxed),
+            ..MagazineCacheStats::default()
+        };
+        for cpu_magazines in &self.cpus {
+            // Only atomic counters are read
+            let counters = unsafe { &(*cpu_magazines.get()).stats };
+            stats.allocs += counters.allocs.load(Ordering::Relaxed);
+            stats.frees += counters.frees.load(Ordering::Relaxed);
+            stats.magazine_hits += counters.magazine_hits.load(Ordering::Relaxed);
+            stats.depot_exchanges += counters.depot_exchanges.load(Ordering::Relaxed);
+            stats.slab_allocs += counters.slab_allocs.load(Ordering::Relaxed);
+            stats.slab_frees += counters.slab_frees.load(Ordering::Relaxed);
+        }
+        stats
+    }
+
+    /// Locks depot, counts contention and adapts magazine size
+    fn lock_depot(&self) -> MutexGuard<'_, Depot> {
+        let depot_lock = match self.depot.try_lock() {
+            Some(depot_lock) => depot_lock,
+            None => {
+                self.depot_contentions.fetch_add(1, Ordering::Relaxed);
+                self.depot.lock()
+            }
+        };
+
+        let depot_operations = self.depot_operations.fetch_add(1, Ordering::Relaxed) + 1;
+        if depot_operations % CONTENTION_CHECK_INTERVAL == 0 {
+            let depot_contentions = self.depot_contentions.swap(0, Ordering::Relaxed);
+            if depot_contentions > CONTENTION_THRESHOLD {
+                // Bigger magazines mean less depot operations
+                let magazine_size = self.magazine_size.load(Ordering::Relaxed);
+                self.magazine_size.store(
+                    (magazine_size + MAGAZINE_ROUNDS_STEP).min(MAGAZINE_MAX_ROUNDS),
+                    Ordering::Relaxed,
+                );
+                let depot_full_limit = self.depot_full_limit.load(Ordering::Relaxed);
+                self.depot_full_limit.store(
+                    (depot_full_limit * 2).min(DEPOT_MAX_FULL_MAGAZINES),
+                    Ordering::Relaxed,
+                );
+            }
+        }
+        depot_lock
+    }
+}
@@ -1,6 +1,22 @@
+pub mod address_space;
+mod page_tables;
+pub mod pat;
+mod tlb_flush_batch;
+pub mod vmalloc;
+
+pub use address_space::AddressSpace;
+pub use page_tables::{
+    preallocate_kernel_pml4_entries, MapError, MappingSize, PageTables, GIANT_PAGE_SIZE,
+};
+pub use pat::CacheMode;
+pub use tlb_flush_batch::{
+    flush_all_cpus_including_global, flush_all_including_global, TlbFlushBatch,
+};
+pub use vmalloc::{ioremap, iounmap, vfree, vmalloc, vmalloc_movable, vzalloc};
+
+use super::PAGE_SIZE;
 use x86_64::instructions::tlb;
-use x86_64::structures::paging::page_table::PageTableLevel;
-use x86_64::structures::paging::{PageTable, PageTableFlags};
+use x86_64::structures::paging::PageTable;
 use x86_64::{PhysAddr, VirtAddr};
 
 // TODO: Idea: Add different wrapper types for virtual addresses belonging to different areas,
@@ -13,6 +29,9 @@ use x86_64::{PhysAddr, VirtAddr};
 /// doc/virtual_memory_layout.txt
 pub const PHYSICAL_MEMORY_MAPPING_OFFSET: u64 = 0xFFFF_A000_0000_0000;
 
+/// 2 MB
+pub const HUGE_PAGE_SIZE: usize = 512 * PAGE_SIZE;
+
 /// Setting up some virtual memory things
 pub fn init() {
     // Unmap all pages in userspace (lower half)
@@ -30,7 +49,11 @@ pub fn init() {
             (*pml4)[i].set_unused();
         }
     }
+    // Application processors are not started yet, they start with the new tables
     tlb::flush_all();
+
+    address_space::init();
+    pat::init();
 }
 
 /// Converts physical address to virtual address in Complete Physical Memory Mapping area
@@ -48,40 +71,3 @@ pub const fn virt_addr_in_cpmm_from_phys_addr(phys_addr: PhysAddr) -> VirtAddr {
 pub const fn phys_addr_from_virt_addr_from_cpmm(virt_addr: VirtAddr) -> PhysAddr {
     PhysAddr::new(virt_addr.as_u64() - PHYSICAL_MEMORY_MAPPING_OFFSET)
 }
-
-/// Sets flags to value in selected page table level by virtual addr
-///
-/// If the selected page table level does not exist due to huge (2MB or 1GB) page using, the flags will be applied to the existing level above.
-///
-/// Doesn't flush TLB
-pub fn set_flags_in_page_table(
-    virt_addr: VirtAddr,
-    page_table_level: PageTableLevel,
-    page_table_flags: PageTableFlags,
-    value: bool,
-) {
-    let mut current_level = PageTableLevel::Four;
-    let mut page_table_phys_addr = x86_64::registers::control::Cr3::read().0.start_address();
-    loop {
-        let page_table_virt_addr = virt_addr_in_cpmm_from_phys_addr(page_table_phys_addr);
-        let page_table = page_table_virt_addr.as_mut_ptr::<PageTable>();
-        debug_assert!(!page_table.is_null(), "Page table null ptr");
-        debug_assert!(page_table.is_aligned(), "Not aligned page table address");
-
-        unsafe {
-            let index = virt_addr.page_table_index(current_level);
-            if current_level == page_table_level
-                || (*page_table)[index]
-                    .flags()
-                    .contains(PageTableFlags::HUGE_PAGE)
-            {
-                let mut flags = (*page_table)[index].flags();
-                flags.set(page_table_flags, value);
-                (*page_table)[index].set_flags(flags);
-                return;
-            }
-            current_level = current_level.next_lower_level().unwrap();
-            page_table_phys_addr = (*page_table)[index].addr();
-        }
-    }
-}
@@ -0,0 +1,429 @@
+// Address spaces with PCID
+//
+// Every address space has its own PML4, the kernel half entries are copied from the kernel PML4 and shared.
+// Kernel half pages are global, so they survive CR3 writes.
+//
+// With PCID TLB entries are tagged by the 12 bit PCID of CR3, and switching CR3 with the no-flush bit keeps them.
+// PCIDs are per CPU: each CPU gives its own PCIDs to address spaces as they are switched to on that CPU.
+// The address space remembers the ASID (generation and PCID) it got on each CPU.
+// When the CPU runs out of PCIDs, its generation is increased and the whole TLB is flushed,
+// all ASIDs of older generations become invalid and get new PCIDs on the next switch.
+// PCID 0 is the kernel address space.
+//
+// When user mappings are removed or changed, other CPUs' ASIDs of the address space are dropped,
+// so the next switch there gets a new PCID and flushes stale entries.
+// CPUs that have the address space loaded right now are flushed with TLB shootdown, the others are not interrupted.
+
+use super::page_tables::{MapError, PageTables, KERNEL_HALF_START};
+use super::tlb_flush_batch::{flush_all_including_global, TlbFlushBatch};
+use super::virt_addr_in_cpmm_from_phys_addr;
+use crate::memory_management::physical_memory_manager::{self, MemoryZoneEnum};
+use crate::memory_management::PAGE_SIZE;
+use crate::smp::cpu_mask::CpuMask;
+use crate::smp::{per_cpu, MAX_CPUS};
+use core::ptr::null;
+use core::sync::atomic::{AtomicBool, AtomicU64, Ordering};
+use spin::Once;
+use x86_64::registers::control::{Cr4, Cr4Flags};
+use x86_64::structures::paging::page_table::PageTableLevel;
+use x86_64::structures::paging::{PageTable, PageTableFlags};
+use x86_64::{PhysAddr, VirtAddr};
+
+/// Max PCID (12 bits)
+const MAX_PCID: u64 = 4095;
+
+/// CR3 bit 63, TLB entries of the PCID are not flushed
+const CR3_NO_FLUSH: u64 = 1 << 63;
+
+/// INVPCID types
+const INVPCID_SINGLE_CONTEXT: u64 = 1;
+const INVPCID_ALL_CONTEXTS_INCLUDING_GLOBAL: u64 = 2;
+
+static PCID_SUPPORTED: AtomicBool = AtomicBool::new(false);
+static INVPCID_SUPPORTED: AtomicBool = AtomicBool::new(false);
+
+/// PML4 of the kernel address space (from bootloader)
+static KERNEL_PML4: Once<PhysAddr> = Once::new();
+
+/// Per-CPU ASID allocation state
+pub struct CpuAsidState {
+    /// Generation of PCIDs given on this CPU, starts from 1 (0 ASID is none)
+    generation: u64,
+    next_pcid: u64,
+    /// Address space loaded on this CPU, null is the kernel address space
+    current: *const AddressSpace,
+}
+
+impl CpuAsidState {
+    pub const fn new() -> Self {
+        Self {
+            generation: 1,
+            next_pcid: 1,
+            current: null(),
+        }
+    }
+}
+
+/// Inits address spaces on BSP
+///
+/// Makes kernel half pages global and enables PCID if supported
+pub fn init() {
+    let cpuid = raw_cpuid::CpuId::new();
+    let pcid_supported = cpuid
+        .get_feature_info()
+        .is_some_and(|feature_info| feature_info.has_pcid());
+    let invpcid_supported = pcid_supported
+        && cpuid
+            .get_extended_feature_info()
+            .is_some_and(|extended_feature_info| extended_feature_info.has_invpcid());
+    PCID_SUPPORTED.store(pcid_supported, Ordering::Release);
+    INVPCID_SUPPORTED.store(invpcid_supported, Ordering::Release);
+
+    let page_tables = PageTables::current();
+    KERNEL_PML4.call_once(|| page_tables.pml4());
+
+    // Global kernel half, the last page is skipped to avoid range overflow
+    let mut tlb_flush_batch = TlbFlushBatch::new();
+    unsafe {
+        Cr4::update(|cr4| cr4.insert(Cr4Flags::PAGE_GLOBAL));
+        page_tables
+            .protect(
+                VirtAddr::new(KERNEL_HALF_START),
+                (u64::MAX - KERNEL_HALF_START + 1) as usize - PAGE_SIZE,
+                PageTableFlags::GLOBAL,
+                PageTableFlags::empty(),
+                &mut tlb_flush_batch,
+            )
+            .expect("Failed to make kernel half global");
+    }
+    tlb_flush_batch.flush();
+
+    enable_pcid();
+    log::info!("PCID: {pcid_supported}, INVPCID: {invpcid_supported}");
+}
+
+/// Inits address spaces on AP
+///
+/// PGE is copied from BSP by the trampoline, PCIDE can't be enabled there
+pub fn init_ap() {
+    enable_pcid();
+}
+
+fn enable_pcid() {
+    if pcid_supported() {
+        // CR3 PCID bits must be zero, the kernel PML4 is loaded with PCID 0
+        unsafe {
+            Cr4::update(|cr4| cr4.insert(Cr4Flags::PCID));
+        }
+    }
+}
+
+#[inline]
+pub fn pcid_supported() -> bool {
+    PCID_SUPPORTED.load(Ordering::Relaxed)
+}
+
+#[inline]
+pub fn invpcid_supported() -> bool {
+    INVPCID_SUPPORTED.load(Ordering::Relaxed)
+}
+
+/// User address space
+///
+/// Must not be moved or dropped while it is loaded on any CPU
+pub struct AddressSpace {
+    page_tables: PageTables,
+    /// ASID (generation << 12 | PCID) on each CPU, 0 is none
+    cpu_asids: [AtomicU64; MAX_CPUS],
+    /// CPUs with the address space loaded
+    active_cpus: [AtomicU64; MAX_CPUS / 64],
+}
+
+impl AddressSpace {
+    /// Creates address space with empty lower half
+    ///
+    /// None if there is no memory
+    pub fn new() -> Option<Self> {
+        let pml4_phys_addr = unsafe {
+            physical_memory_manager::alloc_zeroed(
+                &[
+                    MemoryZoneEnum::High,
+                    MemoryZoneEnum::Dma32,
+                    MemoryZoneEnum::IsaDma,
+                ],
+                PAGE_SIZE,
+            )
+        };
+        if pml4_phys_addr.is_null() {
+            return None;
+        }
+        unsafe {
+            let kernel_pml4 = &*virt_addr_in_cpmm_from_phys_addr(
+                *KERNEL_PML4.get().expect("Address spaces not inited"),
+            )
+            .as_ptr::<PageTable>();
+            let pml4 = virt_addr_in_cpmm_from_phys_addr(pml4_phys_addr).as_mut_ptr::<PageTable>();
+            // Kernel half is shared, all its PML4 entries must be preallocated
+            for i in 256..512 {
+                (*pml4)[i] = kernel_pml4[i].clone();
+            }
+        }
+
+        Some(Self {
+            page_tables: unsafe { PageTables::from_pml4(pml4_phys_addr) },
+            cpu_asids: [const { AtomicU64::new(0) }; MAX_CPUS],
+            active_cpus: [const { AtomicU64::new(0) }; MAX_CPUS / 64],
+        })
+    }
+
+    #[inline]
+    pub fn page_tables(&self) -> &PageTables {
+        &self.page_tables
+    }
+
+    /// Maps range of the lower half, see [PageTables::map]
+    ///
+    /// # Safety
+    /// Changes of the address space must be serialized
+    pub unsafe fn map(
+        &self,
+        virt_addr: VirtAddr,
+        phys_addr: PhysAddr,
+        size: usize,
+        flags: PageTableFlags,
+    ) -> Result<(), MapError> {
+        debug_assert!(virt_addr.as_u64() < KERNEL_HALF_START);
+        unsafe { self.page_tables.map(virt_addr, phys_addr, size, flags) }
+    }
+
+    /// Unmaps range of the lower half and flushes TLB, see [PageTables::unmap]
+    ///
+    /// # Safety
+    /// Changes of the address space must be serialized, nobody must use the range
+    pub unsafe fn unmap(
+        &self,
+        virt_addr: VirtAddr,
+        size: usize,
+        unmapped: impl FnMut(PhysAddr, super::MappingSize),
+    ) -> Result<(), MapError> {
+        debug_assert!(virt_addr.as_u64() < KERNEL_HALF_START);
+        let mut tlb_flush_batch = TlbFlushBatch::new();
+        let result = unsafe {
+            self.page_tables
+                .unmap(virt_addr, size, &mut tlb_flush_batch, unmapped)
+        };
+        self.flush(tlb_flush_batch);
+        result
+    }
+
+    /// Changes flags of range of the lower half and flushes TLB, see [PageTables::protect]
+    ///
+    /// # Safety
+    /// Changes of the address space must be serialized, new flags must not break memory safety
+    pub unsafe fn protect(
+        &self,
+        virt_addr: VirtAddr,
+        size: usize,
+        set: PageTableFlags,
+        clear: PageTableFlags,
+    ) -> Result<(), MapError> {
+        debug_assert!(virt_addr.as_u64() < KERNEL_HALF_START);
+        let mut tlb_flush_batch = TlbFlushBatch::new();
+        let result = unsafe {
+            self.page_tables
+                .protect(virt_addr, size, set, clear, &mut tlb_flush_batch)
+        };
+        self.flush(tlb_flush_batch);
+        result
+    }
+
+    /// Flushes changed entries of the address space
+    ///
+    /// CPUs with the address space loaded flush the batch,
+    /// ASIDs of other CPUs are dropped, so they get new PCID with clean TLB on the next switch
+    fn flush(&self, mut tlb_flush_batch: TlbFlushBatch) {
+        if tlb_flush_batch.is_empty() {
+            return;
+        }
+        x86_64::instructions::interrupts::without_interrupts(|| {
+            let current_cpu_index = per_cpu::cpu_index();
+            for (cpu_index, cpu_asid) in self.cpu_asids.iter().enumerate() {
+                if cpu_index != current_cpu_index {
+                    // The ASID is dropped before the active check, see switch_to
+                    cpu_asid.store(0, Ordering::SeqCst);
+                }
+            }
+            if !self.is_active_on(current_cpu_index) {
+                self.cpu_asids[current_cpu_index].store(0, Ordering::SeqCst);
+            }
+            // A CPU that switches away before the IPI comes has its ASID dropped already
+            tlb_flush_batch.flush_cpus(&CpuMask::load(&self.active_cpus));
+        });
+    }
+
+    #[inline]
+    fn is_active_on(&self, cpu_index: usize) -> bool {
+        self.active_cpus[cpu_index / 64].load(Ordering::SeqCst) & (1 << (cpu_index % 64)) != 0
+    }
+
+    /// Loads the address space on the current CPU
+    ///
+    /// TLB entries of the address space are kept if its ASID is still valid on this CPU
+    ///
+    /// # Safety
+    /// The address space must not be moved or dropped while it is loaded
+    pub unsafe fn switch_to(&self) {
+        x86_64::instructions::interrupts::without_interrupts(|| unsafe {
+            let per_cpu = per_cpu::current();
+            let state = &mut per_cpu.asid_state;
+            if state.current == self as *const AddressSpace {
+                return;
+            }
+            set_active(state.current, per_cpu.cpu_index, false);
+            state.current = self;
+            // Must be visible before ASID load, otherwise flush could drop the ASID after it was loaded
+            set_active(self, per_cpu.cpu_index, true);
+
+            if !pcid_supported() {
+                write_cr3(self.page_tables.pml4(), 0, false);
+                return;
+            }
+
+            let cpu_asid = &self.cpu_asids[per_cpu.cpu_index];
+            let asid = cpu_asid.load(Ordering::SeqCst);
+            if asid != 0 && asid >> 12 == state.generation {
+                write_cr3(self.page_tables.pml4(), asid & MAX_PCID, true);
+                return;
+            }
+
+            // New ASID
+            if state.next_pcid > MAX_PCID {
+                state.generation += 1;
+                state.next_pcid = 1;
+                // TLB has entries of all PCIDs of the old generation
+                flush_all_including_global();
+            }
+            let pcid = state.next_pcid;
+            state.next_pcid += 1;
+            cpu_asid.store(state.generation << 12 | pcid, Ordering::SeqCst);
+            // PCID could be used by an address space of the old generation, flush its entries
+            write_cr3(self.page_tables.pml4(), pcid, false);
+        });
+    }
+}
+
+impl Drop for AddressSpace {
+    /// Frees page tables of the lower half, mapped frames are freed by the owner
+    fn drop(&mut self) {
+        assert!(
+            self.active_cpus
+                .iter()
+                .all(|cpu_mask| cpu_mask.load(Ordering::SeqCst) == 0),
+            "Dropping loaded address space"
+        );
+        unsafe {
+            free_page_tables(self.page_tables.pml4(), PageTableLevel::Four, 0..256);
+        }
+    }
+}
+
+/// Loads the kernel address space (PCID 0) on the current CPU
+pub fn switch_to_kernel() {
+    x86_64::instructions::interrupts::without_interrupts(|| unsafe {
+        let per_cpu = per_cpu::current();
+        let state = &mut per_cpu.asid_state;
+        if state.current.is_null() {
+            return;
+        }
+        set_active(state.current, per_cpu.cpu_index, false);
+        state.current = null();
+        // Kernel PML4 has no user mappings, so PCID 0 has no stale entries
+        write_cr3(
+            *KERNEL_PML4.get().expect("Address spaces not inited"),
+            0,
+            pcid_supported(),
+        );
+    });
+}
+
+/// Flushes the local TLB entries of all address spaces including global ones
+///
+/// Returns false if INVPCID is not supported
+#[inline]
+pub(super) fn invpcid_flush_all_including_global() -> bool {
+    if !invpcid_supported() {
+        return false;
+    }
+    unsafe {
+        invpcid(INVPCID_ALL_CONTEXTS_INCLUDING_GLOBAL, 0, 0);
+    }
+    true
+}
+
+/// Flushes non-global local TLB entries of the PCID
+///
+/// # Safety
+/// INVPCID must be supported
+#[inline]
+pub unsafe fn invpcid_flush_pcid(pcid: u64) {
+    unsafe {
+        invpcid(INVPCID_SINGLE_CONTEXT, pcid, 0);
+    }
+}
+
+#[inline]
+unsafe fn invpcid(invpcid_type: u64, pcid: u64, addr: u64) {
+    let descriptor: [u64; 2] = [pcid, addr];
+    unsafe {
+        core::arch::asm!(
+            "invpcid {}, [{}]",
+            in(reg) invpcid_type,
+            in(reg) &descriptor,
+            options(nostack, preserves_flags)
+        );
+    }
+}
+
+#[inline]
+unsafe fn write_cr3(pml4: PhysAddr, pcid: u64, no_flush: bool) {
+    let mut cr3 = pml4.as_u64() | pcid;
+    if no_flush {
+        cr3 |= CR3_NO_FLUSH;
+    }
+    unsafe {
+        core::arch::asm!("mov cr3, {}", in(reg) cr3, options(nostack, preserves_flags));
+    }
+}
+
+#[inline]
+unsafe fn set_active(address_space: *const AddressSpace, cpu_index: usize, active: bool) {
+    if address_space.is_null() {
+        return;
+    }
+    let cpu_mask = unsafe { &(*address_space).active_cpus[cpu_index / 64] };
+    if active {
+        cpu_mask.fetch_or(1 << (cpu_index % 64), Ordering::SeqCst);
+    } else {
+        cpu_mask.fetch_and(!(1 << (cpu_index % 64)), Ordering::SeqCst);
+    }
+}
+
+/// Frees page tables under the entries of the table
+unsafe fn free_page_tables(
+    table_phys_addr: PhysAddr,
+    level: PageTableLevel,
+    entries: core::ops::Range<usize>,
+) {
+    unsafe {
+        let table = &*virt_addr_in_cpmm_from_phys_addr(table_phys_addr).as_ptr::<PageTable>();
+        if let Some(lower_level) = level.next_lower_level() {
+            for entry in table.iter().skip(entries.start).take(entries.len()) {
+                if entry.is_unused() || entry.flags().contains(PageTableFlags::HUGE_PAGE) {
+                    continue;
+                }
+                free_page_tables(entry.addr(), lower_level, 0..512);
+            }
+        }
+        physical_memory_manager::free(table_phys_addr, PAGE_SIZE);
+    }
+}
@@ -0,0 +1,518 @@
+// Page tables mapping API
+//
+// map, unmap and protect work on ranges: the range is walked once from PML4, and each level handles all entries
+// covered by the range, so mapping of N pages doesn't do N walks from CR3.
+// The biggest page that fits alignment of both addresses is used: 1 GB (if supported), 2 MB, 4 KB.
+// Huge pages are split when only a part of them is unmapped or protected.
+//
+// Invalidations are collected in TlbFlushBatch, the caller decides when to flush.
+// Page tables are not freed on unmap.
+
+use super::tlb_flush_batch::TlbFlushBatch;
+use super::{virt_addr_in_cpmm_from_phys_addr, HUGE_PAGE_SIZE};
+use crate::memory_management::physical_memory_manager::{self, MemoryZoneEnum};
+use crate::memory_management::PAGE_SIZE;
+use crate::sync::{Mutex, MutexGuard};
+use spin::Once;
+use x86_64::structures::paging::page_table::{PageTableEntry, PageTableLevel};
+use x86_64::structures::paging::{PageTable, PageTableFlags};
+use x86_64::{PhysAddr, VirtAddr};
+
+/// 1 GB
+pub const GIANT_PAGE_SIZE: usize = 512 * HUGE_PAGE_SIZE;
+
+/// Start of the kernel half
+pub(super) const KERNEL_HALF_START: u64 = 0xFFFF_8000_0000_0000;
+
+/// Serializes changes of the kernel half of page tables
+///
+/// Kernel half is shared by all address spaces, two CPUs mapping neighboring pages could create the same missing page table
+static KERNEL_PAGE_TABLES_LOCK: Mutex<()> = Mutex::new(());
+
+/// 1 GB pages support (CPUID)
+static GIANT_PAGES_SUPPORTED: Once<bool> = Once::new();
+
+/// Size of the mapped page
+#[derive(Debug, Copy, Clone, PartialEq)]
+pub enum MappingSize {
+    /// 4 KB, PT entry
+    Normal,
+    /// 2 MB, PD entry with HUGE_PAGE flag
+    Huge,
+    /// 1 GB, PDPT entry with HUGE_PAGE flag
+    Giant,
+}
+
+impl MappingSize {
+    #[inline]
+    pub const fn size(self) -> usize {
+        match self {
+            MappingSize::Normal => PAGE_SIZE,
+            MappingSize::Huge => HUGE_PAGE_SIZE,
+            MappingSize::Giant => GIANT_PAGE_SIZE,
+        }
+    }
+
+    #[inline]
+    const fn from_level(level: PageTableLevel) -> Self {
+        match level {
+            PageTableLevel::One => MappingSize::Normal,
+            PageTableLevel::Two => MappingSize::Huge,
+            PageTableLevel::Three => MappingSize::Giant,
+            PageTableLevel::Four => panic!("PML4 entry can't map a page"),
+        }
+    }
+}
+
+/// Errors of page tables changes
+///
+/// The part of the range before the error is already changed, the caller should undo it
+#[derive(Debug, Copy, Clone, PartialEq)]
+pub enum MapError {
+    /// Address is already mapped
+    AlreadyMapped(VirtAddr),
+    /// No memory for page table
+    NoMemory,
+}
+
+/// Page tables of the address space
+#[derive(Debug, Copy, Clone)]
+pub struct PageTables {
+    pml4: PhysAddr,
+}
+
+impl PageTables {
+    /// Page tables with the PML4 at the physical address
+    ///
+    /// # Safety
+    /// Address must be a valid PML4, changes of its lower half must be serialized by the owner
+    #[inline]
+    pub const unsafe fn from_pml4(pml4: PhysAddr) -> Self {
+        Self { pml4 }
+    }
+
+    /// Page tables loaded in CR3
+    ///
+    /// Kernel half is shared by all address spaces, so it can be changed through any of them
+    #[inline]
+    pub fn current() -> Self {
+        Self {
+            pml4: x86_64::registers::control::Cr3::read().0.start_address(),
+        }
+    }
+
+    #[inline]
+    pub fn pml4(&self) -> PhysAddr {
+        self.pml4
+    }
+
+    /// Maps the range of virtual memory to physically contiguous memory
+    ///
+    /// PRESENT is added to flags. 2 MB and 1 GB pages are used if both addresses are aligned
+    ///
+    /// Doesn't flush TLB (the range was not mapped)
+    ///
+    /// # Safety
+    /// Mapped memory must not break memory safety of existing references
+    pub unsafe fn map(
+        &self,
+        virt_addr: VirtAddr,
+        phys_addr: PhysAddr,
+        size: usize,
+        flags: PageTableFlags,
+    ) -> Result<(), MapError> {
+        let (start, end) = page_range(virt_addr, size);
+        debug_assert!(phys_addr.is_aligned(PAGE_SIZE as u64));
+        let _lock = lock_for(virt_addr);
+        unsafe {
+            map_in_table(
+                table_at(self.pml4),
+                PageTableLevel::Four,
+                start,
+                end,
+                phys_addr.as_u64(),
+                flags,
+            )
+        }
+    }
+
+    /// Unmaps the range
+    ///
+    /// unmapped is called with physical address and size of each unmapped page, not mapped pages are skipped
+    ///
+    /// Huge pages are split if they are partially in the range, it can fail without memory
+    ///
+    /// # Safety
+    /// Nobody must use the range
+    pub unsafe fn unmap(
+        &self,
+        virt_addr: VirtAddr,
+        size: usize,
+        tlb_flush_batch: &mut TlbFlushBatch,
+        mut unmapped: impl FnMut(PhysAddr, MappingSize),
+    ) -> Result<(), MapError> {
+        let (start, end) = page_range(virt_addr, size);
+        let _lock = lock_for(virt_addr);
+        unsafe {
+            unmap_in_table(
+                table_at(self.pml4),
+                PageTableLevel::Four,
+                start,
+                end,
+                tlb_flush_batch,
+                &mut unmapped,
+            )
+        }
+    }
+
+    /// Sets and clears flags of mapped pages in the range
+    ///
+    /// Not mapped pages are skipped. Huge pages are split if they are partially in the range, it can fail without memory
+    ///
+    /// # Safety
+    /// New flags must not break memory safety
+    pub unsafe fn protect(
+        &self,
+        virt_addr: VirtAddr,
+        size: usize,
+        set: PageTableFlags,
+        clear: PageTableFlags,
+        tlb_flush_batch: &mut TlbFlushBatch,
+    ) -> Result<(), MapError> {
+        debug_assert!(
+            !(set | clear).intersects(PageTableFlags::PRESENT | PageTableFlags::HUGE_PAGE),
+            "protect can't change PRESENT and HUGE_PAGE"
+        );
+        let (start, end) = page_range(virt_addr, size);
+        let _lock = lock_for(virt_addr);
+        unsafe {
+            protect_in_table(
+                table_at(self.pml4),
+                PageTableLevel::Four,
+                start,
+                end,
+                set,
+                clear,
+                tlb_flush_batch,
+            )
+        }
+    }
+
+    /// Returns physical address and page size of the mapped virtual address
+    pub fn translate(&self, virt_addr: VirtAddr) -> Option<(PhysAddr, MappingSize)> {
+        let _lock = lock_for(virt_addr);
+        let mut level = PageTableLevel::Four;
+        let mut table = unsafe { table_at(self.pml4) };
+        loop {
+            let entry = &table[virt_addr.page_table_index(level)];
+            if entry.is_unused() {
+                return None;
+            }
+            if level == PageTableLevel::One || entry.flags().contains(PageTableFlags::HUGE_PAGE) {
+                let mapping_size = MappingSize::from_level(level);
+                let offset = virt_addr.as_u64() & (mapping_size.size() as u64 - 1);
+                return Some((entry.addr() + offset, mapping_size));
+            }
+            table = unsafe { table_at(entry.addr()) };
+            level = level.next_lower_level().unwrap();
+        }
+    }
+}
+
+/// Creates missing PML4 entries of the kernel half range
+///
+/// Kernel half entries of PML4 are copied to every address space, so they must exist before any copy
+pub fn preallocate_kernel_pml4_entries(start: VirtAddr, size: usize) {
+    assert!(start.as_u64() >= KERNEL_HALF_START);
+    let _lock = KERNEL_PAGE_TABLES_LOCK.lock();
+    let pml4 = unsafe { table_at(PageTables::current().pml4) };
+    let (start, end) = page_range(start, size);
+    let mut virt_addr = start;
+    while virt_addr < end {
+        unsafe {
+            child_table(
+                &mut pml4[page_table_index(virt_addr, PageTableLevel::Four)],
+                PageTableFlags::empty(),
+            )
+            .expect("Failed to allocate kernel PML4 entry");
+        }
+        virt_addr += level_size(PageTableLevel::Four);
+    }
+}
+
+/// Takes kernel page tables lock for kernel half addresses
+#[inline]
+fn lock_for(virt_addr: VirtAddr) -> Option<MutexGuard<'static, ()>> {
+    (virt_addr.as_u64() >= KERNEL_HALF_START).then(|| KERNEL_PAGE_TABLES_LOCK.lock())
+}
+
+/// Checks and converts range to [start, end)
+#[inline]
+fn page_range(virt_addr: VirtAddr, size: usize) -> (u64, u64) {
+    assert!(
+        virt_addr.is_aligned(PAGE_SIZE as u64) && size % PAGE_SIZE == 0,
+        "Not aligned page range {virt_addr:?} {size}"
+    );
+    let end = virt_addr
+        .as_u64()
+        .checked_add(size as u64)
+        .expect("Page range overflow");
+    (virt_addr.as_u64(), end)
+}
+
+/// Virtual memory size covered by an entry of the level
+#[inline]
+const fn level_size(level: PageTableLevel) -> u64 {
+    PAGE_SIZE as u64 * 512u64.pow(level as u32 - 1)
+}
+
+#[inline]
+fn page_table_index(virt_addr: u64, level: PageTableLevel) -> usize {
+    (virt_addr >> (12 + 9 * (level as u32 - 1))) as usize & 511
+}
+
+/// End of the part of [virt_addr, end) covered by the entry of virt_addr
+#[inline]
+fn entry_chunk_end(virt_addr: u64, end: u64, level: PageTableLevel) -> u64 {
+    let entry_end =
+        x86_64::align_down(virt_addr, level_size(level)).wrapping_add(level_size(level));
+    if entry_end == 0 {
+        end
+    } else {
+        entry_end.min(end)
+    }
+}
+
+/// Leaf entries are allowed at the level
+#[inline]
+fn leaf_level(level: PageTableLevel) -> bool {
+    match level {
+        PageTableLevel::One | PageTableLevel::Two => true,
+        PageTableLevel::Three => *GIANT_PAGES_SUPPORTED.call_once(|| {
+            raw_cpuid::CpuId::new()
+                .get_extended_processor_and_feature_identifiers()
+                .is_some_and(|features| features.has_1gib_pages())
+        }),
+        PageTableLevel::Four => false,
+    }
+}
+
+#[inline]
+unsafe fn table_at(phys_addr: PhysAddr) -> &'static mut PageTable {
+    unsafe { &mut *virt_addr_in_cpmm_from_phys_addr(phys_addr).as_mut_ptr::<PageTable>() }
+}
+
+/// Flags of the entry that points to the page table
+///
+/// Access is restricted by leaves, upper levels only allow it
+#[inline]
+fn table_entry_flags(leaf_flags: PageTableFlags) -> PageTableFlags {
+    PageTableFlags::PRESENT
+        | PageTableFlags::WRITABLE
+        | (leaf_flags & PageTableFlags::USER_ACCESSIBLE)
+}
+
+/// Allocates zeroed page table
+fn alloc_page_table() -> Result<PhysAddr, MapError> {
+    // Zeroed page is an empty table
+    let phys_addr = unsafe {
+        physical_memory_manager::alloc_zeroed(
+            &[
+                MemoryZoneEnum::High,
+                MemoryZoneEnum::Dma32,
+                MemoryZoneEnum::IsaDma,
+            ],
+            PAGE_SIZE,
+        )
+    };
+    if phys_addr.is_null() {
+        return Err(MapError::NoMemory);
+    }
+    Ok(phys_addr)
+}
+
+/// Returns page table the entry points to, missing table is allocated
+///
+/// Error if the entry is a huge page
+unsafe fn child_table(
+    entry: &mut PageTableEntry,
+    leaf_flags: PageTableFlags,
+) -> Result<&'static mut PageTable, MapError> {
+    if entry.is_unused() {
+        entry.set_addr(alloc_page_table()?, table_entry_flags(leaf_flags));
+    } else if entry.flags().contains(PageTableFlags::HUGE_PAGE) {
+        return Err(MapError::AlreadyMapped(VirtAddr::zero()));
+    } else if !entry.flags().contains(table_entry_flags(leaf_flags)) {
+        entry.set_flags(entry.flags() | table_entry_flags(leaf_flags));
+    }
+    Ok(unsafe { table_at(entry.addr()) })
+}
+
+/// Replaces huge page entry with the table of smaller pages with the same mapping
+///
+/// Returns the new table
+unsafe fn split_huge_entry(
+    entry: &mut PageTableEntry,
+    level: PageTableLevel,
+    entry_virt_addr: u64,
+    tlb_flush_batch: &mut TlbFlushBatch,
+) -> Result<&'static mut PageTable, MapError> {
+    let lower_level = level.next_lower_level().unwrap();
+    let table_phys_addr = alloc_page_table()?;
+    let table = unsafe { table_at(table_phys_addr) };
+    // PAT bit of huge entries isn't preserved, PAT is not configured
+    let flags = if lower_level == PageTableLevel::One {
+        entry.flags() - PageTableFlags::HUGE_PAGE
+    } else {
+        entry.flags()
+    };
+    for (i, lower_entry) in table.iter_mut().enumerate() {
+        lower_entry.set_addr(entry.addr() + i as u64 * level_size(lower_level), flags);
+    }
+    entry.set_addr(table_phys_addr, table_entry_flags(flags));
+    // Same translation, but TLB must not have both sizes of the page
+    tlb_flush_batch.add(VirtAddr::new(entry_virt_addr));
+    Ok(table)
+}
+
+unsafe fn map_in_table(
+    table: &mut PageTable,
+    level: PageTableLevel,
+    start: u64,
+    end: u64,
+    phys_start: u64,
+    flags: PageTableFlags,
+) -> Result<(), MapError> {
+    let mut virt_addr = start;
+    while virt_addr < end {
+        let chunk_end = entry_chunk_end(virt_addr, end, level);
+        let phys_addr = phys_start + (virt_addr - start);
+        let entry = &mut table[page_table_index(virt_addr, level)];
+
+        let whole_entry =
+            chunk_end - virt_addr == level_size(level) && phys_addr % level_size(level) == 0;
+        if level == PageTableLevel::One || (whole_entry && leaf_level(level)) {
+            if !entry.is_unused() {
+                return Err(MapError::AlreadyMapped(VirtAddr::new(virt_addr)));
+            }
+            let flags = if level == PageTableLevel::One {
+                flags | PageTableFlags::PRESENT
+            } else {
+                flags | PageTableFlags::PRESENT | PageTableFlags::HUGE_PAGE
+            };
+            entry.set_addr(PhysAddr::new(phys_addr), flags);
+        } else {
+            let child = unsafe { child_table(entry, flags) }.map_err(|error| match error {
+                MapError::AlreadyMapped(_) => MapError::AlreadyMapped(VirtAddr::new(virt_addr)),
+                error => error,
+            })?;
+            unsafe {
+                map_in_table(
+                    child,
+                    level.next_lower_level().unwrap(),
+                    virt_addr,
+                    chunk_end,
+                    phys_addr,
+                    flags,
+                )?;
+            }
+        }
+        virt_addr = chunk_end;
+    }
+    Ok(())
+}
+
+unsafe fn unmap_in_table(
+    table: &mut PageTable,
+    level: PageTableLevel,
+    start: u64,
+    end: u64,
+    tlb_flush_batch: &mut TlbFlushBatch,
+    unmapped: &mut dyn FnMut(PhysAddr, MappingSize),
+) -> Result<(), MapError> {
+    let mut virt_addr = start;
+    while virt_addr < end {
+        let chunk_end = entry_chunk_end(virt_addr, end, level);
+        let entry = &mut table[page_table_index(virt_addr, level)];
+        if entry.is_unused() {
+            virt_addr = chunk_end;
+            continue;
+        }
+
+        let leaf =
+            level == PageTableLevel::One || entry.flags().contains(PageTableFlags::HUGE_PAGE);
+        if leaf && chunk_end - virt_addr == level_size(level) {
+            let phys_addr = entry.addr();
+            entry.set_unused();
+            tlb_flush_batch.add(VirtAddr::new(virt_addr));
+            unmapped(phys_addr, MappingSize::from_level(level));
+        } else {
+            let child = if leaf {
+                unsafe { split_huge_entry(entry, level, virt_addr, tlb_flush_batch)? }
+            } else {
+                unsafe { table_at(entry.addr()) }
+            };
+            unsafe {
+                unmap_in_table(
+                    child,
+                    level.next_lower_level().unwrap(),
+                    virt_addr,
+                    chunk_end,
+                    tlb_flush_batch,
+                    unmapped,
+                )?;
+            }
+        }
+        virt_addr = chunk_end;
+    }
+    Ok(())
+}
+
+unsafe fn protect_in_table(
+    table: &mut PageTable,
+    level: PageTableLevel,
+    start: u64,
+    end: u64,
+    set: PageTableFlags,
+    clear: PageTableFlags,
+    tlb_flush_batch: &mut TlbFlushBatch,
+) -> Result<(), MapError> {
+    let mut virt_addr = start;
+    while virt_addr < end {
+        let chunk_end = entry_chunk_end(virt_addr, end, level);
+        let entry = &mut table[page_table_index(virt_addr, level)];
+        if entry.is_unused() {
+            virt_addr = chunk_end;
+            continue;
+        }
+
+        let leaf =
+            level == PageTableLevel::One || entry.flags().contains(PageTableFlags::HUGE_PAGE);
+        if leaf && chunk_end - virt_addr == level_size(level) {
+            let flags = (entry.flags() | set) - clear;
+            if flags != entry.flags() {
+                entry.set_flags(flags);
+                tlb_flush_batch.add(VirtAddr::new(virt_addr));
+            }
+        } else {
+            let child = if leaf {
+                unsafe { split_huge_entry(entry, level, virt_addr, tlb_flush_batch)? }
+            } else {
+                unsafe { child_table(entry, set)? }
+            };
+            unsafe {
+                protect_in_table(
+                    child,
+                    level.next_lower_level().unwrap(),
+                    virt_addr,
+                    chunk_end,
+                    set,
+                    clear,
+                    tlb_flush_batch,
+                )?;
+            }
+        }
+        virt_addr = chunk_end;
+    }
+    Ok(())
+}
@@ -0,0 +1,75 @@
+// Page Attribute Table
+//
+// Memory type of a 4 KB page is selected by its PAT, PCD and PWT bits (PAT index = PAT << 2 | PCD << 1 | PWT).
+// The default PAT is WB, WT, UC-, UC for both halves. Entry 1 (PWT only) is reprogrammed to write-combining,
+// so WC mappings (framebuffers, prefetchable BARs) don't need the PAT bit, whose position differs in huge page entries.
+// Entry 3 (PCD and PWT) stays strong uncacheable, existing uncached mappings (Local APIC page) are unchanged.
+//
+// PAT must be the same on all CPUs (SDM 11.12.4), every CPU programs it before touching MMIO mappings.
+
+use super::flush_all_including_global;
+use core::sync::atomic::{AtomicBool, Ordering};
+use x86_64::registers::model_specific::Msr;
+use x86_64::structures::paging::PageTableFlags;
+
+const IA32_PAT_MSR: u32 = 0x277;
+
+/// WB, WC, UC-, UC, WB, WT, UC-, UC
+const PAT_VALUE: u64 = 0x0007_0406_0007_0106;
+
+static PAT_SUPPORTED: AtomicBool = AtomicBool::new(false);
+
+/// Memory type of a mapping
+#[derive(Debug, Copy, Clone, PartialEq)]
+pub enum CacheMode {
+    /// Normal memory
+    WriteBack,
+    /// Writes are combined in buffers and reads are not cached, for framebuffers
+    ///
+    /// Uncached if PAT isn't supported
+    WriteCombining,
+    /// Strong uncacheable, for device registers
+    Uncached,
+}
+
+impl CacheMode {
+    /// Page table flags of the memory type, valid for entries of all sizes
+    #[inline]
+    pub fn flags(self) -> PageTableFlags {
+        match self {
+            CacheMode::WriteBack => PageTableFlags::empty(),
+            CacheMode::WriteCombining if PAT_SUPPORTED.load(Ordering::Relaxed) => {
+                PageTableFlags::WRITE_THROUGH
+            }
+            CacheMode::WriteCombining | CacheMode::Uncached => {
+                PageTableFlags::NO_CACHE | PageTableFlags::WRITE_THROUGH
+            }
+        }
+    }
+}
+
+/// Programs PAT of BSP
+///
+/// Must be called before any WC mapping
+pub fn init() {
+    let pat_supported = raw_cpuid::CpuId::new()
+        .get_feature_info()
+        .is_some_and(|feature_info| feature_info.has_pat());
+    PAT_SUPPORTED.store(pat_supported, Ordering::Release);
+    init_cpu();
+    log::info!("PAT: {pat_supported}");
+}
+
+/// Programs PAT of the current CPU
+pub fn init_cpu() {
+    if !PAT_SUPPORTED.load(Ordering::Acquire) {
+        return;
+    }
+    // SDM 11.12.4: caches and TLBs must not keep lines and translations of the old memory type
+    unsafe {
+        core::arch::asm!("wbinvd", options(nostack, preserves_flags));
+        Msr::new(IA32_PAT_MSR).write(PAT_VALUE);
+        core::arch::asm!("wbinvd", options(nostack, preserves_flags));
+    }
+    flush_all_including_global();
+}
@@ -0,0 +1,160 @@
+// TLB flush batch
+//
+// Page table changes collect invalidations in the batch, and they are flushed together when the change is done.
+// Few pages are flushed with invlpg, many pages with one full flush, which is cheaper than hundreds of invlpg.
+//
+// Other CPUs are flushed with one call-function IPI per batch (TLB shootdown), the batch itself is the list of pages,
+// so many invalidations cost one IPI. Only CPUs that may cache the entries are interrupted.
+
+use super::page_tables::KERNEL_HALF_START;
+use crate::smp::cpu_mask::CpuMask;
+use crate::smp::{ipi, per_cpu};
+use tinyvec::ArrayVec;
+use x86_64::instructions::tlb;
+use x86_64::registers::control::{Cr4, Cr4Flags};
+use x86_64::VirtAddr;
+
+/// Max number of pages flushed with invlpg, more pages are flushed with full flush
+///
+/// Linux uses 33 (tlb_single_page_flush_ceiling)
+const INVLPG_CEILING: usize = 32;
+
+/// Invalidations of changed page table entries
+///
+/// Flushed on drop if not flushed explicitly
+pub struct TlbFlushBatch {
+    pages: ArrayVec<[u64; INVLPG_CEILING]>,
+    /// Too many pages for invlpg
+    flush_all: bool,
+    /// Batch has kernel half pages, full flush must remove global pages too
+    ///
+    /// Lower half full flush is CR3 reload, it flushes the current PCID only
+    kernel_half: bool,
+}
+
+impl TlbFlushBatch {
+    pub fn new() -> Self {
+        Self {
+            pages: ArrayVec::new(),
+            flush_all: false,
+            kernel_half: false,
+        }
+    }
+
+    /// Adds page whose entry was changed or removed
+    ///
+    /// One invlpg of any address of the page is enough for huge pages
+    #[inline]
+    pub fn add(&mut self, virt_addr: VirtAddr) {
+        self.kernel_half |= virt_addr.as_u64() >= KERNEL_HALF_START;
+        if self.flush_all {
+            return;
+        }
+        if self.pages.try_push(virt_addr.as_u64()).is_some() {
+            self.flush_all = true;
+        }
+    }
+
+    #[inline]
+    pub fn is_empty(&self) -> bool {
+        !self.flush_all && self.pages.is_empty()
+    }
+
+    /// Flushes collected pages from the local TLB
+    pub fn flush(&mut self) {
+        self.flush_local();
+        self.clear();
+    }
+
+    /// Flushes collected pages from TLBs of the CPUs (the current one too if it's in the mask)
+    ///
+    /// Waits until all CPUs flush, see [ipi::call_function_many]
+    pub fn flush_cpus(&mut self, cpus: &CpuMask) {
+        if self.is_empty() {
+            return;
+        }
+        x86_64::instructions::interrupts::without_interrupts(|| {
+            if cpus.contains(per_cpu::cpu_index()) {
+                self.flush_local();
+            }
+            ipi::call_function_many(cpus, remote_flush, self as *const TlbFlushBatch as usize);
+        });
+        self.clear();
+    }
+
+    /// Flushes collected pages from TLBs of all CPUs, for kernel half changes
+    pub fn flush_all_cpus(&mut self) {
+        self.flush_cpus(&ipi::online_cpus());
+    }
+
+    fn flush_local(&self) {
+        if self.flush_all {
+            if self.kernel_half {
+                flush_all_including_global();
+            } else {
+                tlb::flush_all();
+            }
+        } else {
+            for &virt_addr in self.pages.iter() {
+                tlb::flush(VirtAddr::new(virt_addr));
+            }
+        }
+    }
+
+    /// Drops collected invalidations without flush
+    ///
+    /// The caller must flush TLB before the pages are reused, e.g. lazily for many batches
+    pub fn forget(mut self) {
+        self.clear();
+    }
+
+    fn clear(&mut self) {
+        self.pages.clear();
+        self.flush_all = false;
+        self.kernel_half = false;
+    }
+}
+
+impl Default for TlbFlushBatch {
+    fn default() -> Self {
+        Self::new()
+    }
+}
+
+impl Drop for TlbFlushBatch {
+    fn drop(&mut self) {
+        if !self.is_empty() {
+            self.flush();
+        }
+    }
+}
+
+/// Call-function IPI handler of [TlbFlushBatch::flush_cpus], data points to the batch
+fn remote_flush(tlb_flush_batch: usize) {
+    unsafe {
+        (*(tlb_flush_batch as *const TlbFlushBatch)).flush_local();
+    }
+}
+
+/// Flushes TLBs of all CPUs including global pages
+pub fn flush_all_cpus_including_global() {
+    ipi::call_function_all(|_| flush_all_including_global(), 0);
+}
+
+/// Flushes the local TLB including global pages (of all PCIDs)
+///
+/// CR3 reload doesn't remove global pages, INVPCID or toggling CR4.PGE does
+pub fn flush_all_including_global() {
+    if super::address_space::invpcid_flush_all_including_global() {
+        return;
+    }
+    let cr4 = Cr4::read();
+    if cr4.contains(Cr4Flags::PAGE_GLOBAL) {
+        unsafe {
+            Cr4::write(cr4 - Cr4Flags::PAGE_GLOBAL);
+            Cr4::write(cr4);
+        }
+    } else {
+        tlb::flush_all();
+    }
+}
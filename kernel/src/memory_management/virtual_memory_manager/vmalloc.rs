@@ -0,0 +1,856 @@
+// Virtual memory allocator for the Virtual Memory Allocations region (doc/virtual_memory_layout.txt)
+//
+// Allocates virtually contiguous memory backed by physical frames that are not necessarily contiguous.
+// Large buffers don't require large physically contiguous blocks and don't fragment buddy allocators.
+//
+// Free virtual ranges are kept in an AA tree sorted by address, each node also stores the max range size of its subtree,
+// so the first fitting range is found in O(log n).
+// Allocated areas are kept in the second tree, vfree finds the area size there.
+//
+// Freed areas are unmapped, and their frames are freed immediately, but the virtual range is not reused until TLB is flushed.
+// Ranges are collected in the lazy list and the TLB is flushed once for many areas when the list grows above LAZY_PURGE_THRESHOLD.
+// The shootdown waits for all CPUs, so it is done without the allocator lock.
+//
+// If the area has 2 MB aligned parts, 2 MB blocks are tried for them and mapped with huge pages.
+//
+// ioremap maps physically contiguous MMIO ranges (BARs, ECAM) into areas of the region with the requested memory type,
+// their frames aren't owned by the area and aren't freed by iounmap.
+//
+// Pages of movable areas (vmalloc_movable) are allocated as movable and may be migrated by compaction.
+// Their descriptors have FLAG_MOVABLE and the virtual address. Migration unmaps the page, flushes TLBs of all CPUs,
+// copies it and maps the new page. Page fault on the page in the meantime waits until migration finishes.
+
+use super::{CacheMode, MappingSize, PageTables, TlbFlushBatch, HUGE_PAGE_SIZE};
+use crate::memory_management::physical_memory_manager::{
+    self, page_descriptor, MemoryZoneEnum, Migratetype, PageDescriptor,
+};
+use crate::memory_management::slab_allocator::DefaultMemoryBackend;
+use crate::memory_management::PAGE_SIZE;
+use crate::sync::{Mutex, MutexGuard};
+use core::ptr::null_mut;
+use core::sync::atomic::{AtomicU64, Ordering};
+use slab_allocator_lib::{Cache, ObjectSizeType};
+use spin::Once;
+use x86_64::structures::idt::PageFaultErrorCode;
+use x86_64::structures::paging::PageTableFlags;
+use x86_64::{PhysAddr, VirtAddr};
+
+/// Start of the Virtual Memory Allocations region
+pub const VMALLOC_START: u64 = 0xFFFF_B000_0000_0000;
+
+/// 16 TB
+pub const VMALLOC_SIZE: usize = 16 * 1024 * 1024 * 1024 * 1024;
+
+/// Lazily freed virtual memory size that causes TLB flush
+const LAZY_PURGE_THRESHOLD: usize = 32 * 1024 * 1024;
+
+/// Flags of vmalloc mappings
+const VMALLOC_PAGE_FLAGS: PageTableFlags = PageTableFlags::WRITABLE
+    .union(PageTableFlags::NO_EXECUTE)
+    .union(PageTableFlags::GLOBAL);
+
+static VMALLOC: Once<Mutex<Vmalloc>> = Once::new();
+
+/// Serializes page migration and unmapping of areas, so a page isn't migrated while its area is freed
+static MIGRATION_LOCK: Mutex<()> = Mutex::new(());
+
+/// Virtual address of the page being migrated, 0 if none
+static MIGRATING_PAGE: AtomicU64 = AtomicU64::new(0);
+
+/// Inits virtual memory allocator
+///
+/// Slab allocator must be inited
+pub fn init() {
+    // Page tables of the region must be shared by all future address spaces
+    super::preallocate_kernel_pml4_entries(VirtAddr::new(VMALLOC_START), VMALLOC_SIZE);
+
+    VMALLOC.call_once(|| {
+        let mut vmalloc = Vmalloc {
+            free: RangeTree::new(),
+            busy: RangeTree::new(),
+            lazy: null_mut(),
+            lazy_size: 0,
+            nodes: Cache::new(
+                PAGE_SIZE,
+                PAGE_SIZE,
+                ObjectSizeType::Small,
+                DefaultMemoryBackend,
+            )
+            .unwrap_or_else(|error| panic!("Failed to create vmalloc nodes cache: {error}")),
+        };
+        let whole_region = vmalloc
+            .new_node(VMALLOC_START, VMALLOC_SIZE as u64)
+            .expect("Failed to allocate vmalloc node");
+        unsafe {
+            vmalloc.free.insert(whole_region);
+        }
+        Mutex::new(vmalloc)
+    });
+}
+
+/// Allocs virtually contiguous memory
+///
+/// Size is rounded up to pages, the area is followed by unmapped guard page
+///
+/// Returns null ptr if there is no memory
+///
+/// Allocated memory is uninitialized
+pub fn vmalloc(size: usize) -> *mut u8 {
+    alloc_mapped(size, false, false)
+}
+
+/// Allocs zeroed virtually contiguous memory
+///
+/// Same as [vmalloc], pages are allocated from the PMM zeroed
+pub fn vzalloc(size: usize) -> *mut u8 {
+    alloc_mapped(size, true, false)
+}
+
+/// Allocs virtually contiguous memory which physical pages may be migrated by compaction
+///
+/// Same as [vmalloc], pages not mapped by huge pages are movable.
+/// A page being migrated is unmapped for a moment, access to it waits in the page fault handler,
+/// so the memory must not be accessed from interrupt handlers and must not be used for DMA
+pub fn vmalloc_movable(size: usize) -> *mut u8 {
+    alloc_mapped(size, false, true)
+}
+
+fn alloc_mapped(size: usize, zeroed: bool, movable: bool) -> *mut u8 {
+    if size == 0 {
+        return null_mut();
+    }
+    let size = x86_64::align_up(size as u64, PAGE_SIZE as u64) as usize;
+    let align = if size >= HUGE_PAGE_SIZE {
+        HUGE_PAGE_SIZE
+    } else {
+        PAGE_SIZE
+    };
+
+    let Some(start) = alloc_virtual((size + PAGE_SIZE) as u64, align as u64) else {
+        return null_mut();
+    };
+
+    if !map_area(start, size, zeroed, movable) {
+        unmap_area(start, size);
+        free_virtual(start);
+        return null_mut();
+    }
+    start as *mut u8
+}
+
+/// Frees memory allocated by [vmalloc]
+///
+/// # Safety
+/// ptr must be returned by vmalloc, the memory must not be used after
+pub unsafe fn vfree(ptr: *mut u8) {
+    if ptr.is_null() {
+        return;
+    }
+    let start = ptr as u64;
+    assert!(
+        is_vmalloc_addr(VirtAddr::from_ptr(ptr)),
+        "vfree of address outside vmalloc region"
+    );
+
+    let area_size = VMALLOC
+        .get()
+        .expect("vmalloc not inited")
+        .lock()
+        .area_size(start)
+        .expect("vfree of not allocated address");
+    // Without guard page
+    unmap_area(start, area_size as usize - PAGE_SIZE);
+    free_virtual(start);
+}
+
+/// Maps physically contiguous MMIO range with the memory type
+///
+/// The area is followed by unmapped guard page, offset of phys_addr in its page is kept in the returned ptr.
+/// Huge pages are used for 2 MB aligned parts
+///
+/// Returns null ptr if there is no virtual memory or no memory for page tables
+///
+/// # Safety
+/// The range must be device memory, RAM mapped with other memory type than WB breaks its CPMM mapping
+pub unsafe fn ioremap(phys_addr: PhysAddr, size: usize, cache_mode: CacheMode) -> *mut u8 {
+    if size == 0 {
+        return null_mut();
+    }
+    let first_page = phys_addr.align_down(PAGE_SIZE as u64);
+    let offset = phys_addr - first_page;
+    let size = x86_64::align_up(offset + size as u64, PAGE_SIZE as u64) as usize;
+    let align = if size >= HUGE_PAGE_SIZE && first_page.is_aligned(HUGE_PAGE_SIZE as u64) {
+        HUGE_PAGE_SIZE
+    } else {
+        PAGE_SIZE
+    };
+
+    let Some(start) = alloc_virtual((size + PAGE_SIZE) as u64, align as u64) else {
+        return null_mut();
+    };
+    let flags = VMALLOC_PAGE_FLAGS | cache_mode.flags();
+    if unsafe { PageTables::current().map(VirtAddr::new(start), first_page, size, flags) }.is_err()
+    {
+        unmap_io_area(start, size);
+        free_virtual(start);
+        return null_mut();
+    }
+    (start + offset) as *mut u8
+}
+
+/// Unmaps the range mapped by [ioremap], the frames aren't freed
+///
+/// # Safety
+/// ptr must be returned by ioremap, the mapping must not be used after
+pub unsafe fn iounmap(ptr: *mut u8) {
+    let start = (ptr as u64) & !(PAGE_SIZE as u64 - 1);
+    assert!(
+        is_vmalloc_addr(VirtAddr::new(start)),
+        "iounmap of address outside vmalloc region"
+    );
+
+    let area_size = VMALLOC
+        .get()
+        .expect("vmalloc not inited")
+        .lock()
+        .area_size(start)
+        .expect("iounmap of not mapped address");
+    unmap_io_area(start, area_size as usize - PAGE_SIZE);
+    free_virtual(start);
+}
+
+/// Allocs virtual range, purges lazily freed ranges if nothing fits
+fn alloc_virtual(size: u64, align: u64) -> Option<u64> {
+    let vmalloc = VMALLOC.get().expect("vmalloc not inited");
+    if let Some(start) = vmalloc.lock().alloc_area(size, align) {
+        return Some(start);
+    }
+    // Lazily freed ranges may be merged into the fitting range
+    if purge_lazy() {
+        vmalloc.lock().alloc_area(size, align)
+    } else {
+        None
+    }
+}
+
+/// Frees virtual range of the unmapped area, purges lazily freed ranges above the threshold
+fn free_virtual(start: u64) {
+    if VMALLOC.get().unwrap().lock().free_area(start) {
+        purge_lazy();
+    }
+}
+
+/// Flushes TLB and returns lazily freed ranges to the free tree
+///
+/// The list is detached under the lock and the shootdown is done without it: it waits for all CPUs,
+/// and a CPU may wait for the lock with interrupts disabled (arenas alloc and free with them disabled)
+///
+/// Returns false if there was nothing to purge
+fn purge_lazy() -> bool {
+    let vmalloc = VMALLOC.get().unwrap();
+    let lazy = {
+        let mut vmalloc = vmalloc.lock();
+        vmalloc.lazy_size = 0;
+        core::mem::replace(&mut vmalloc.lazy, null_mut())
+    };
+    if lazy.is_null() {
+        return false;
+    }
+
+    // vmalloc mappings are global and may be cached by any CPU
+    super::flush_all_cpus_including_global();
+
+    let mut vmalloc = vmalloc.lock();
+    let mut node = lazy;
+    while !node.is_null() {
+        unsafe {
+            let next = (*node).right;
+            vmalloc.insert_free_coalescing(node);
+            node = next;
+        }
+    }
+    true
+}
+
+/// Checks if address belongs to the Virtual Memory Allocations region
+#[inline]
+pub fn is_vmalloc_addr(virt_addr: VirtAddr) -> bool {
+    virt_addr.as_u64() >= VMALLOC_START && virt_addr.as_u64() - VMALLOC_START < VMALLOC_SIZE as u64
+}
+
+/// Maps new frames to the area
+///
+/// Returns false if there is no memory, already mapped part must be unmapped by the caller
+fn map_area(start: u64, size: usize, zeroed: bool, movable: bool) -> bool {
+    let memory_zones = [MemoryZoneEnum::High, MemoryZoneEnum::Dma32];
+    let alloc_frame = |size| unsafe {
+        if zeroed {
+            physical_memory_manager::alloc_zeroed(&memory_zones, size)
+        } else if movable {
+            physical_memory_manager::alloc_with_migratetype(
+                &memory_zones,
+                size,
+                Migratetype::Movable,
+            )
+        } else {
+            physical_memory_manager::alloc(&memory_zones, size)
+        }
+    };
+    let page_tables = PageTables::current();
+    let mut try_huge = true;
+    let mut offset = 0;
+    while offset < size {
+        let virt_addr = VirtAddr::new(start + offset as u64);
+
+        // Huge page if the block is available
+        let mut mapping_size = PAGE_SIZE;
+        let mut phys_addr = PhysAddr::zero();
+        if try_huge
+            && virt_addr.is_aligned(HUGE_PAGE_SIZE as u64)
+            && size - offset >= HUGE_PAGE_SIZE
+        {
+            phys_addr = alloc_frame(HUGE_PAGE_SIZE);
+            if phys_addr.is_null() {
+                // Memory is fragmented, don't try again (failed allocation drains all page frame caches)
+                try_huge = false;
+            } else {
+                mapping_size = HUGE_PAGE_SIZE;
+            }
+        }
+        if phys_addr.is_null() {
+            phys_addr = alloc_frame(PAGE_SIZE);
+            if phys_addr.is_null() {
+                return false;
+            }
+        }
+
+        if unsafe { page_tables.map(virt_addr, phys_addr, mapping_size, VMALLOC_PAGE_FLAGS) }
+            .is_err()
+        {
+            unsafe {
+                physical_memory_manager::free(phys_addr, mapping_size);
+            }
+            return false;
+        }
+        if movable && mapping_size == PAGE_SIZE {
+            descriptor(phys_addr).set_movable(virt_addr);
+        }
+        offset += mapping_size;
+    }
+    true
+}
+
+/// Unmaps the area and frees its frames
+///
+/// Doesn't flush TLB, it is done by the lazy purge
+fn unmap_area(start: u64, size: usize) {
+    let mut tlb_flush_batch = TlbFlushBatch::new();
+    // Unmapping takes the kernel page tables lock anyway, the migration lock doesn't serialize more
+    let _migration_lock = lock_migration();
+    unsafe {
+        PageTables::current()
+            .unmap(
+                VirtAddr::new(start),
+                size,
+                &mut tlb_flush_batch,
+                |phys_addr, mapping_size| {
+                    if mapping_size == MappingSize::Normal {
+                        let descriptor = descriptor(phys_addr);
+                        if descriptor.flags() & PageDescriptor::FLAG_MOVABLE != 0 {
+                            descriptor.clear_movable();
+                        }
+                    }
+                    physical_memory_manager::free(phys_addr, mapping_size.size());
+                },
+            )
+            .expect("vmalloc area unmap failed");
+    }
+    tlb_flush_batch.forget();
+}
+
+/// Unmaps the MMIO area without freeing frames
+///
+/// Doesn't flush TLB, it is done by the lazy purge
+fn unmap_io_area(start: u64, size: usize) {
+    let mut tlb_flush_batch = TlbFlushBatch::new();
+    unsafe {
+        PageTables::current()
+            .unmap(VirtAddr::new(start), size, &mut tlb_flush_batch, |_, _| {})
+            .expect("ioremap area unmap failed");
+    }
+    tlb_flush_batch.forget();
+}
+
+/// Moves the movable page mapped at virt_addr from old_phys_addr to new_phys_addr
+///
+/// Returns false if the page is no longer mapped there (the area was freed)
+///
+/// Called by compaction, waits for TLB shootdown
+///
+/// # Safety
+/// new_phys_addr must be an allocated page not used by anyone
+pub unsafe fn migrate_page(
+    virt_addr: VirtAddr,
+    old_phys_addr: PhysAddr,
+    new_phys_addr: PhysAddr,
+) -> bool {
+    let _migration_lock = lock_migration();
+    let old_descriptor = descriptor(old_phys_addr);
+    let page_tables = PageTables::current();
+    if old_descriptor.movable_virt_addr() != Some(virt_addr)
+        || page_tables.translate(virt_addr) != Some((old_phys_addr, MappingSize::Normal))
+    {
+        return false;
+    }
+
+    MIGRATING_PAGE.store(virt_addr.as_u64(), Ordering::Release);
+    let mut tlb_flush_batch = TlbFlushBatch::new();
+    unsafe {
+        page_tables
+            .unmap(virt_addr, PAGE_SIZE, &mut tlb_flush_batch, |_, _| {})
+            .expect("Movable page unmap failed");
+    }
+    // Nobody can write the page after the flush
+    tlb_flush_batch.flush_all_cpus();
+    unsafe {
+        core::ptr::copy_nonoverlapping(
+            super::virt_addr_in_cpmm_from_phys_addr(old_phys_addr).as_ptr::<u8>(),
+            super::virt_addr_in_cpmm_from_phys_addr(new_phys_addr).as_mut_ptr::<u8>(),
+            PAGE_SIZE,
+        );
+        // Page table of the page exists, map doesn't allocate
+        page_tables
+            .map(virt_addr, new_phys_addr, PAGE_SIZE, VMALLOC_PAGE_FLAGS)
+            .expect("Movable page map failed");
+    }
+    MIGRATING_PAGE.store(0, Ordering::Release);
+
+    old_descriptor.clear_movable();
+    descriptor(new_phys_addr).set_movable(virt_addr);
+    true
+}
+
+/// Takes the migration lock
+///
+/// The holder may wait for TLB shootdown of all CPUs, and vfree is called with interrupts disabled (by arenas),
+/// so call requests queued to this CPU are run while waiting
+fn lock_migration() -> MutexGuard<'static, ()> {
+    loop {
+        if let Some(guard) = MIGRATION_LOCK.try_lock() {
+            return guard;
+        }
+        crate::smp::ipi::run_pending_calls();
+        core::hint::spin_loop();
+    }
+}
+
+/// Waits until migration of the page finishes, called by the page fault handler
+///
+/// Returns true if the fault is caused by migration and the access should be retried.
+/// Only not-present faults are, protection faults are real errors
+pub fn wait_for_migration(virt_addr: VirtAddr, error_code: PageFaultErrorCode) -> bool {
+    if !is_vmalloc_addr(virt_addr)
+        || error_code.intersects(
+            PageFaultErrorCode::PROTECTION_VIOLATION | PageFaultErrorCode::MALFORMED_TABLE,
+        )
+    {
+        return false;
+    }
+    let page = virt_addr.align_down(PAGE_SIZE as u64).as_u64();
+    if MIGRATING_PAGE.load(Ordering::Acquire) == page {
+        while MIGRATING_PAGE.load(Ordering::Acquire) == page {
+            // The fault may come with disabled interrupts, the migrating CPU may wait for our TLB flush
+            crate::smp::ipi::run_pending_calls();
+            core::hint::spin_loop();
+        }
+        return true;
+    }
+    // Migration could finish before the check, maybe followed by migration of other pages.
+    // An unmapped page stays unmapped, so a page mapped now was migrated
+    PageTables::current().translate(virt_addr).is_some()
+}
+
+#[inline]
+fn descriptor(phys_addr: PhysAddr) -> &'static PageDescriptor {
+    page_descriptor(phys_addr).expect("vmalloc page without descriptor")
+}
+
+struct Vmalloc {
+    /// Free virtual ranges
+    free: RangeTree,
+    /// Allocated areas (with guard page)
+    busy: RangeTree,
+    /// Freed areas waiting for TLB flush, linked through right
+    lazy: *mut VmRange,
+    lazy_size: usize,
+    /// Cache of tree nodes
+    nodes: Cache<VmRange, DefaultMemoryBackend>,
+}
+
+unsafe impl Send for Vmalloc {}
+
+impl Vmalloc {
+    fn new_node(&mut self, start: u64, size: u64) -> Option<*mut VmRange> {
+        let node = self.nodes.alloc();
+        if node.is_null() {
+            return None;
+        }
+        unsafe {
+            node.write(VmRange {
+                start,
+                size,
+                max_size: size,
+                level: 1,
+                left: null_mut(),
+                right: null_mut(),
+            });
+        }
+        Some(node)
+    }
+
+    fn free_node(&mut self, node: *mut VmRange) {
+        unsafe {
+            self.nodes.free(node);
+        }
+    }
+
+    /// Allocs virtual range
+    fn alloc_area(&mut self, size: u64, align: u64) -> Option<u64> {
+        // Nodes for the allocated area and for the rest of the split free range
+        let busy_node = self.new_node(0, 0)?;
+        let Some(split_node) = self.new_node(0, 0) else {
+            self.free_node(busy_node);
+            return None;
+        };
+
+        let Some((range_start, area_start)) = (unsafe { self.free.first_fit(size, align) }) else {
+            self.free_node(busy_node);
+            self.free_node(split_node);
+            return None;
+        };
+
+        unsafe {
+            let range = self.free.remove(range_start);
+            let range_end = (*range).start + (*range).size;
+            let area_end = area_start + size;
+
+            // Space before the area (alignment) stays in range node, space after goes to split node
+            let mut spare_nodes = [Some(split_node), None];
+            if area_start > range_start {
+                (*range).size = area_start - range_start;
+                self.free.insert(range);
+            } else {
+                spare_nodes[1] = Some(range);
+            }
+            if area_end < range_end {
+                let node = spare_nodes[0].take().or(spare_nodes[1].take()).unwrap();
+                (*node).start = area_end;
+                (*node).size = range_end - area_end;
+                self.free.insert(node);
+            }
+            for node in spare_nodes.into_iter().flatten() {
+                self.free_node(node);
+            }
+
+            (*busy_node).start = area_start;
+            (*busy_node).size = size;
+            self.busy.insert(busy_node);
+        }
+        Some(area_start)
+    }
+
+    /// Size of the allocated area
+    fn area_size(&self, start: u64) -> Option<u64> {
+        let node = unsafe { self.busy.find(start) };
+        (!node.is_null()).then(|| unsafe { (*node).size })
+    }
+
+    /// Moves the area to the lazy list
+    ///
+    /// The area must be unmapped
+    ///
+    /// Returns true if the lazy list grew above the threshold and should be purged
+    fn free_area(&mut self, start: u64) -> bool {
+        let node = unsafe { self.busy.remove(start) };
+        assert!(!node.is_null(), "Freeing not allocated vmalloc area");
+        unsafe {
+            self.lazy_size += (*node).size as usize;
+            (*node).left = null_mut();
+            (*node).right = self.lazy;
+        }
+        self.lazy = node;
+        self.lazy_size >= LAZY_PURGE_THRESHOLD
+    }
+
+    /// Inserts free range merging it with the neighbors
+    unsafe fn insert_free_coalescing(&mut self, node: *mut VmRange) {
+        unsafe {
+            // Removal moves data between nodes and frees other node than the removed one,
+            // so the neighbors are remembered by start and each one is removed by its key
+            let (predecessor, successor) = self.free.neighbors((*node).start);
+            let node_end = (*node).start + (*node).size;
+            let predecessor_start = (!predecessor.is_null()
+                && (*predecessor).start + (*predecessor).size == (*node).start)
+                .then(|| (*predecessor).start);
+            let successor_start = (!successor.is_null() && (*successor).start == node_end)
+                .then(|| (*successor).start);
+            if let Some(predecessor_start) = predecessor_start {
+                let predecessor = self.free.remove(predecessor_start);
+                (*node).start = (*predecessor).start;
+                (*node).size += (*predecessor).size;
+                self.free_node(predecessor);
+            }
+            if let Some(successor_start) = successor_start {
+                let successor = self.free.remove(successor_start);
+                (*node).size += (*successor).size;
+                self.free_node(successor);
+            }
+            self.free.insert(node);
+        }
+    }
+}
+
+/// Node of the range tree
+struct VmRange {
+    start: u64,
+    size: u64,
+    /// Max size in the subtree
+    max_size: u64,
+    /// AA tree level, leaves are 1
+    level: u32,
+    left: *mut VmRange,
+    right: *mut VmRange,
+}
+
+/// AA tree of non-overlapping ranges sorted by start, augmented with the max size of the subtree
+///
+/// Nodes are owned by the caller
+struct RangeTree {
+    root: *mut VmRange,
+}
+
+impl RangeTree {
+    const fn new() -> Self {
+        Self { root: null_mut() }
+    }
+
+    unsafe fn insert(&mut self, node: *mut VmRange) {
+        unsafe {
+            (*node).level = 1;
+            (*node).left = null_mut();
+            (*node).right = null_mut();
+            (*node).max_size = (*node).size;
+            self.root = tree_insert(self.root, node);
+        }
+    }
+
+    /// Removes range with the start
+    ///
+    /// Returns the node that is no longer in the tree with data of the removed range, null if there is no such range
+    unsafe fn remove(&mut self, start: u64) -> *mut VmRange {
+        let mut removed = null_mut();
+        unsafe {
+            self.root = tree_remove(self.root, start, &mut removed);
+        }
+        removed
+    }
+
+    /// Finds range with the start
+    unsafe fn find(&self, start: u64) -> *mut VmRange {
+        let mut node = self.root;
+        unsafe {
+            while !node.is_null() && (*node).start != start {
+                node = if start < (*node).start {
+                    (*node).left
+                } else {
+                    (*node).right
+                };
+            }
+        }
+        node
+    }
+
+    /// Finds the lowest range that can contain size bytes aligned to align
+    ///
+    /// Returns start of the range and aligned start of the area
+    unsafe fn first_fit(&self, size: u64, align: u64) -> Option<(u64, u64)> {
+        unsafe { tree_first_fit(self.root, size, align) }
+    }
+
+    /// Returns ranges before and after the address
+    unsafe fn neighbors(&self, addr: u64) -> (*mut VmRange, *mut VmRange) {
+        let mut predecessor = null_mut();
+        let mut successor = null_mut();
+        let mut node = self.root;
+        unsafe {
+            while !node.is_null() {
+                if (*node).start < addr {
+                    predecessor = node;
+                    node = (*node).right;
+                } else {
+                    successor = node;
+                    node = (*node).left;
+                }
+            }
+        }
+        (predecessor, successor)
+    }
+}
+
+#[inline]
+unsafe fn level(node: *mut VmRange) -> u32 {
+    if node.is_null() {
+        0
+    } else {
+        unsafe { (*node).level }
+    }
+}
+
+#[inline]
+unsafe fn max_size(node: *mut VmRange) -> u64 {
+    if node.is_null() {
+        0
+    } else {
+        unsafe { (*node).max_size }
+    }
+}
+
+/// Recalculates max_size of the node from its children
+#[inline]
+unsafe fn update(node: *mut VmRange) {
+    unsafe {
+        (*node).max_size = (*node)
+            .size
+            .max(max_size((*node).left))
+            .max(max_size((*node).right));
+    }
+}
+
+/// Removes left horizontal link
+unsafe fn skew(node: *mut VmRange) -> *mut VmRange {
+    unsafe {
+        if node.is_null() || (*node).left.is_null() || (*(*node).left).level != (*node).level {
+            return node;
+        }
+        let left = (*node).left;
+        (*node).left = (*left).right;
+        (*left).right = node;
+        update(node);
+        update(left);
+        left
+    }
+}
+
+/// Removes two consecutive right horizontal links
+unsafe fn split(node: *mut VmRange) -> *mut VmRange {
+    unsafe {
+        if node.is_null()
+            || (*node).right.is_null()
+            || (*(*node).right).right.is_null()
+            || (*(*(*node).right).right).level != (*node).level
+        {
+            return node;
+        }
+        let right = (*node).right;
+        (*node).right = (*right).left;
+        (*right).left = node;
+        (*right).level += 1;
+        update(node);
+        update(right);
+        right
+    }
+}
+
+unsafe fn tree_insert(root: *mut VmRange, node: *mut VmRange) -> *mut VmRange {
+    unsafe {
+        if root.is_null() {
+            return node;
+        }
+        if (*node).start < (*root).start {
+            (*root).left = tree_insert((*root).left, node);
+        } else {
+            (*root).right = tree_insert((*root).right, node);
+        }
+        update(root);
+        split(skew(root))
+    }
+}
+
+unsafe fn tree_remove(root: *mut VmRange, start: u64, removed: &mut *mut VmRange) -> *mut VmRange {
+    unsafe {
+        if root.is_null() {
+            return root;
+        }
+        if start < (*root).start {
+            (*root).left = tree_remove((*root).left, start, removed);
+        } else if start > (*root).start {
+            (*root).right = tree_remove((*root).right, start, removed);
+        } else if (*root).left.is_null() && (*root).right.is_null() {
+            *removed = root;
+            return null_mut();
+        } else {
+            // Replace data with the in-order neighbor and remove the neighbor's node
+            let neighbor = if (*root).left.is_null() {
+                let mut successor = (*root).right;
+                while !(*successor).left.is_null() {
+                    successor = (*successor).left;
+                }
+                (*root).right = tree_remove((*root).right, (*successor).start, removed);
+                successor
+            } else {
+                let mut predecessor = (*root).left;
+                while !(*predecessor).right.is_null() {
+                    predecessor = (*predecessor).right;
+                }
+                (*root).left = tree_remove((*root).left, (*predecessor).start, removed);
+                predecessor
+            };
+            debug_assert_eq!(neighbor, *removed);
+            let (neighbor_start, neighbor_size) = ((*neighbor).start, (*neighbor).size);
+            (**removed).start = (*root).start;
+            (**removed).size = (*root).size;
+            (*root).start = neighbor_start;
+            (*root).size = neighbor_size;
+        }
+
+        // Rebalance
+        let should_be = level((*root).left).min(level((*root).right)) + 1;
+        if should_be < (*root).level {
+            (*root).level = should_be;
+            if should_be < level((*root).right) {
+                (*(*root).right).level = should_be;
+            }
+        }
+        update(root);
+        let mut root = skew(root);
+        (*root).right = skew((*root).right);
+        if !(*root).right.is_null() {
+            (*(*root).right).right = skew((*(*root).right).right);
+        }
+        root = split(root);
+        (*root).right = split((*root).right);
+        if !(*root).right.is_null() {
+            update((*root).right);
+        }
+        update(root);
+        root
+    }
+}
+
+unsafe fn tree_first_fit(node: *mut VmRange, size: u64, align: u64) -> Option<(u64, u64)> {
+    unsafe {
+        if node.is_null() || (*node).max_size < size {
+            return None;
+        }
+        if let Some(found) = tree_first_fit((*node).left, size, align) {
+            return Some(found);
+        }
+        if (*node).size >= size {
+            let area_start = x86_64::align_up((*node).start, align);
+            if area_start + size <= (*node).start + (*node).size {
+                return Some(((*node).start, area_start));
+            }
+        }
+        tree_first_fit((*node).right, size, align)
+    }
+}
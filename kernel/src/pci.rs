@@ -0,0 +1,480 @@
+// PCI/PCIe enumeration through ECAM
+//
+// ACPI MCFG gives the physical base of the memory-mapped configuration space (ECAM) of each PCI segment group
+// and its bus range: 4 KB of config space per function, bus << 20 | device << 15 | function << 12.
+// The config space of each MCFG entry is mapped uncached into the vmalloc region once, port I/O (0xCF8) isn't used.
+//
+// All buses of the MCFG range are scanned at init (8 functions of multi-function devices),
+// BARs are sized and capabilities are collected, devices live in a static list for drivers.
+// BARs are mapped with ioremap: prefetchable BARs of display controllers (framebuffers) write-combining,
+// everything else uncached.
+
+mod capability;
+
+pub use capability::{MsiCapability, MsiXCapability, PcieLink};
+
+use crate::acpi::ACPI_TABLES;
+use crate::memory_management::virtual_memory_manager::{self, CacheMode};
+use acpi_lib::AcpiError;
+use alloc::vec::Vec;
+use core::fmt;
+use spin::Once;
+use x86_64::{PhysAddr, VirtAddr};
+
+/// Config space size of a function in ECAM
+const FUNCTION_CONFIG_SIZE: u64 = 4096;
+
+/// Config space size of a bus in ECAM (32 devices, 8 functions)
+const BUS_CONFIG_SIZE: u64 = 256 * FUNCTION_CONFIG_SIZE;
+
+/// MCFG: 36 bytes SDT header, 8 bytes reserved, then 16 bytes entries
+const MCFG_ENTRIES_OFFSET: usize = 44;
+const MCFG_ENTRY_SIZE: usize = 16;
+
+/// Config space header registers
+const REGISTER_VENDOR_ID: u16 = 0x00;
+const REGISTER_DEVICE_ID: u16 = 0x02;
+const REGISTER_COMMAND: u16 = 0x04;
+const REGISTER_STATUS: u16 = 0x06;
+const REGISTER_REVISION_ID: u16 = 0x08;
+const REGISTER_HEADER_TYPE: u16 = 0x0E;
+const REGISTER_BAR0: u16 = 0x10;
+const REGISTER_CAPABILITIES_POINTER: u16 = 0x34;
+
+pub const COMMAND_IO_SPACE: u16 = 1 << 0;
+pub const COMMAND_MEMORY_SPACE: u16 = 1 << 1;
+pub const COMMAND_BUS_MASTER: u16 = 1 << 2;
+pub const COMMAND_INTERRUPT_DISABLE: u16 = 1 << 10;
+
+const STATUS_CAPABILITIES_LIST: u16 = 1 << 4;
+
+const HEADER_TYPE_MULTI_FUNCTION: u8 = 1 << 7;
+const HEADER_TYPE_MASK: u8 = 0x7F;
+
+/// Display controller, framebuffers are in its prefetchable BARs
+const CLASS_DISPLAY: u8 = 0x03;
+
+static ECAM_REGIONS: Once<Vec<EcamRegion>> = Once::new();
+
+static DEVICES: Once<Vec<PciDevice>> = Once::new();
+
+/// Config space of the buses of one MCFG entry
+struct EcamRegion {
+    segment_group: u16,
+    bus_start: u8,
+    bus_end: u8,
+    /// Config space of bus_start
+    base: VirtAddr,
+}
+
+/// Segment group, bus, device, function
+#[derive(Debug, Copy, Clone, PartialEq)]
+pub struct PciAddress {
+    pub segment_group: u16,
+    pub bus: u8,
+    pub device: u8,
+    pub function: u8,
+}
+
+impl fmt::Display for PciAddress {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        write!(
+            f,
+            "{:04x}:{:02x}:{:02x}.{}",
+            self.segment_group, self.bus, self.device, self.function
+        )
+    }
+}
+
+/// Memory-mapped config space of a function
+#[derive(Debug, Copy, Clone)]
+pub struct ConfigSpace {
+    base: VirtAddr,
+}
+
+impl ConfigSpace {
+    #[inline]
+    pub fn read_u8(&self, offset: u16) -> u8 {
+        unsafe { self.register_ptr::<u8>(offset).read_volatile() }
+    }
+
+    #[inline]
+    pub fn read_u16(&self, offset: u16) -> u16 {
+        unsafe { self.register_ptr::<u16>(offset).read_volatile() }
+    }
+
+    #[inline]
+    pub fn read_u32(&self, offset: u16) -> u32 {
+        unsafe { self.register_ptr::<u32>(offset).read_volatile() }
+    }
+
+    #[inline]
+    pub fn write_u16(&self, offset: u16, value: u16) {
+        unsafe { self.register_ptr::<u16>(offset).write_volatile(value) }
+    }
+
+    #[inline]
+    pub fn write_u32(&self, offset: u16, value: u32) {
+        unsafe { self.register_ptr::<u32>(offset).write_volatile(value) }
+    }
+
+    /// ECAM requires naturally aligned accesses
+    #[inline]
+    fn register_ptr<T>(&self, offset: u16) -> *mut T {
+        debug_assert!((offset as u64) < FUNCTION_CONFIG_SIZE);
+        debug_assert_eq!(
+            offset as usize % size_of::<T>(),
+            0,
+            "Unaligned config access"
+        );
+        (self.base.as_u64() + offset as u64) as *mut T
+    }
+}
+
+/// Base Address Register
+#[derive(Debug, Copy, Clone, PartialEq)]
+pub enum Bar {
+    Memory {
+        address: PhysAddr,
+        size: u64,
+        prefetchable: bool,
+        is_64_bit: bool,
+    },
+    Io {
+        port: u32,
+        size: u32,
+    },
+}
+
+/// Capability of the capabilities list
+#[derive(Debug, Copy, Clone, PartialEq)]
+pub struct Capability {
+    pub id: u8,
+    /// Offset in the config space
+    pub offset: u8,
+}
+
+/// PCI function
+#[derive(Debug)]
+pub struct PciDevice {
+    pub address: PciAddress,
+    pub vendor_id: u16,
+    pub device_id: u16,
+    pub class: u8,
+    pub subclass: u8,
+    pub prog_if: u8,
+    pub revision: u8,
+    /// Without the multi-function bit, 0 is a device, 1 is a PCI-to-PCI bridge
+    pub header_type: u8,
+    /// The upper half of a 64-bit BAR is None
+    pub bars: [Option<Bar>; 6],
+    pub capabilities: Vec<Capability>,
+    config: ConfigSpace,
+}
+
+/// Maps ECAM of MCFG entries and enumerates all functions
+///
+/// ACPI tables and vmalloc must be inited
+pub fn init() {
+    let ecam_regions = map_ecam_regions();
+    let mut devices = Vec::new();
+    for ecam_region in &ecam_regions {
+        for bus in ecam_region.bus_start..=ecam_region.bus_end {
+            scan_bus(ecam_region, bus, &mut devices);
+        }
+    }
+
+    for device in &devices {
+        log::info!(
+            "PCI {} {:04x}:{:04x} class {:02x}.{:02x}.{:02x}",
+            device.address,
+            device.vendor_id,
+            device.device_id,
+            device.class,
+            device.subclass,
+            device.prog_if
+        );
+        if let Some(link) = device.pcie_link() {
+            log::debug!("PCI {} {link}", device.address);
+        }
+    }
+    log::info!("PCI: {} functions", devices.len());
+
+    ECAM_REGIONS.call_once(|| ecam_regions);
+    DEVICES.call_once(|| devices);
+}
+
+/// All enumerated functions, empty before init or without MCFG
+#[inline]
+pub fn devices() -> &'static [PciDevice] {
+    DEVICES.get().map_or(&[], |devices| devices.as_slice())
+}
+
+/// Functions with the vendor and device IDs
+pub fn find(vendor_id: u16, device_id: u16) -> impl Iterator<Item = &'static PciDevice> {
+    devices()
+        .iter()
+        .filter(move |device| device.vendor_id == vendor_id && device.device_id == device_id)
+}
+
+/// Functions of the class and subclass
+pub fn find_by_class(class: u8, subclass: u8) -> impl Iterator<Item = &'static PciDevice> {
+    devices()
+        .iter()
+        .filter(move |device| device.class == class && device.subclass == subclass)
+}
+
+/// Config space of the function, None if its bus isn't in MCFG
+pub fn config_space(address: PciAddress) -> Option<ConfigSpace> {
+    ECAM_REGIONS
+        .get()?
+        .iter()
+        .find(|ecam_region| {
+            ecam_region.segment_group == address.segment_group
+                && (ecam_region.bus_start..=ecam_region.bus_end).contains(&address.bus)
+        })
+        .map(|ecam_region| ecam_region.config_space(address.bus, address.device, address.function))
+}
+
+/// Reads MCFG and maps config space of its entries uncached
+fn map_ecam_regions() -> Vec<EcamRegion> {
+    let acpi_tables = ACPI_TABLES.get().expect("ACPI tables not set").lock();
+    let mcfg = match unsafe { acpi_tables.find_table::<acpi_lib::mcfg::Mcfg>() } {
+        Ok(mcfg) => mcfg,
+        Err(AcpiError::TableMissing(_)) => {
+            log::info!("PCIe ECAM not supported, MCFG missing");
+            return Vec::new();
+        }
+        Err(err) => panic!("Failed to get MCFG: {err:?}"),
+    };
+
+    // Entries of the library are private, the table is parsed through the pointer like HPET
+    let mcfg_ptr = mcfg.virtual_start().as_ptr() as *const u8;
+    let mcfg_length = unsafe { (mcfg_ptr.add(4) as *const u32).read_unaligned() } as usize;
+    let entries_number = mcfg_length.saturating_sub(MCFG_ENTRIES_OFFSET) / MCFG_ENTRY_SIZE;
+
+    let mut ecam_regions = Vec::with_capacity(entries_number);
+    for entry in 0..entries_number {
+        let (base_address, segment_group, bus_start, bus_end) = unsafe {
+            let entry_ptr = mcfg_ptr.add(MCFG_ENTRIES_OFFSET + entry * MCFG_ENTRY_SIZE);
+            (
+                (entry_ptr as *const u64).read_unaligned(),
+                (entry_ptr.add(8) as *const u16).read_unaligned(),
+                entry_ptr.add(10).read(),
+                entry_ptr.add(11).read(),
+            )
+        };
+        if bus_end < bus_start {
+            log::warn!("Invalid MCFG entry {entry}: buses {bus_start}-{bus_end}");
+            continue;
+        }
+        // The base address is the config space of bus 0 even if the range starts later
+        let phys_addr = PhysAddr::new(base_address + bus_start as u64 * BUS_CONFIG_SIZE);
+        let size = (bus_end - bus_start) as usize + 1;
+        let base = unsafe {
+            virtual_memory_manager::ioremap(
+                phys_addr,
+                size * BUS_CONFIG_SIZE as usize,
+                CacheMode::Uncached,
+            )
+        };
+        assert!(!base.is_null(), "Failed to map ECAM");
+        log::info!(
+            "PCIe ECAM: segment group {segment_group}, buses {bus_start}-{bus_end} at {:#x}",
+            phys_addr.as_u64()
+        );
+        ecam_regions.push(EcamRegion {
+            segment_group,
+            bus_start,
+            bus_end,
+            base: VirtAddr::from_ptr(base),
+        });
+    }
+    ecam_regions
+}
+
+fn scan_bus(ecam_region: &EcamRegion, bus: u8, devices: &mut Vec<PciDevice>) {
+    for device in 0..32 {
+        let config = ecam_region.config_space(bus, device, 0);
+        if config.read_u16(REGISTER_VENDOR_ID) == 0xFFFF {
+            continue;
+        }
+        let functions = if config.read_u8(REGISTER_HEADER_TYPE) & HEADER_TYPE_MULTI_FUNCTION != 0 {
+            8
+        } else {
+            1
+        };
+        for function in 0..functions {
+            let config = ecam_region.config_space(bus, device, function);
+            if config.read_u16(REGISTER_VENDOR_ID) == 0xFFFF {
+                continue;
+            }
+            let address = PciAddress {
+                segment_group: ecam_region.segment_group,
+                bus,
+                device,
+                function,
+            };
+            devices.push(PciDevice::probe(address, config));
+        }
+    }
+}
+
+impl EcamRegion {
+    #[inline]
+    fn config_space(&self, bus: u8, device: u8, function: u8) -> ConfigSpace {
+        debug_assert!(bus >= self.bus_start && bus <= self.bus_end);
+        debug_assert!(device < 32 && function < 8);
+        ConfigSpace {
+            base: self.base
+                + (bus - self.bus_start) as u64 * BUS_CONFIG_SIZE
+                + (device as u64 * 8 + function as u64) * FUNCTION_CONFIG_SIZE,
+        }
+    }
+}
+
+impl PciDevice {
+    /// Reads the header, sizes BARs and walks the capabilities list
+    fn probe(address: PciAddress, config: ConfigSpace) -> Self {
+        let class_register = config.read_u32(REGISTER_REVISION_ID);
+        let header_type = config.read_u8(REGISTER_HEADER_TYPE) & HEADER_TYPE_MASK;
+        let mut device = Self {
+            address,
+            vendor_id: config.read_u16(REGISTER_VENDOR_ID),
+            device_id: config.read_u16(REGISTER_DEVICE_ID),
+            class: (class_register >> 24) as u8,
+            subclass: (class_register >> 16) as u8,
+            prog_if: (class_register >> 8) as u8,
+            revision: class_register as u8,
+            header_type,
+            bars: [None; 6],
+            capabilities: Vec::new(),
+            config,
+        };
+        let bars_number = match header_type {
+            0 => 6,
+            1 => 2,
+            _ => 0,
+        };
+        device.size_bars(bars_number);
+        device.capabilities = capability::walk(&config);
+        device
+    }
+
+    /// Sizes BARs by writing all ones, decoding is disabled meanwhile
+    fn size_bars(&mut self, bars_number: usize) {
+        let command = self.config.read_u16(REGISTER_COMMAND);
+        self.config.write_u16(
+            REGISTER_COMMAND,
+            command & !(COMMAND_IO_SPACE | COMMAND_MEMORY_SPACE),
+        );
+
+        let mut index = 0;
+        while index < bars_number {
+            let offset = REGISTER_BAR0 + index as u16 * 4;
+            let value = self.config.read_u32(offset);
+            self.config.write_u32(offset, u32::MAX);
+            let mask = self.config.read_u32(offset);
+            self.config.write_u32(offset, value);
+
+            if value & 1 != 0 {
+                // I/O space, bits 0-1 are flags
+                let size = (!(mask & !0x3)).wrapping_add(1) & 0xFFFF;
+                if mask != 0 && size != 0 {
+                    self.bars[index] = Some(Bar::Io {
+                        port: value & !0x3,
+                        size,
+                    });
+                }
+                index += 1;
+                continue;
+            }
+
+            // Memory space, bits 0-3 are flags, type 2 is 64-bit
+            let is_64_bit = (value >> 1) & 0x3 == 0x2 && index + 1 < bars_number;
+            let prefetchable = value & (1 << 3) != 0;
+            let mut address = (value & !0xF) as u64;
+            let implemented = mask & !0xF != 0;
+            let mut mask = (mask & !0xF) as u64;
+            if is_64_bit {
+                let upper_offset = offset + 4;
+                let upper_value = self.config.read_u32(upper_offset);
+                self.config.write_u32(upper_offset, u32::MAX);
+                let upper_mask = self.config.read_u32(upper_offset);
+                self.config.write_u32(upper_offset, upper_value);
+                address |= (upper_value as u64) << 32;
+                mask |= (upper_mask as u64) << 32;
+            } else {
+                mask |= 0xFFFF_FFFF_0000_0000;
+            }
+            if implemented || mask >> 32 != 0 {
+                self.bars[index] = Some(Bar::Memory {
+                    address: PhysAddr::new(address),
+                    size: (!mask).wrapping_add(1),
+                    prefetchable,
+                    is_64_bit,
+                });
+            }
+            index += if is_64_bit { 2 } else { 1 };
+        }
+
+        self.config.write_u16(REGISTER_COMMAND, command);
+    }
+
+    #[inline]
+    pub fn config(&self) -> &ConfigSpace {
+        &self.config
+    }
+
+    /// Sets and clears bits of the command register
+    pub fn update_command(&self, set: u16, clear: u16) {
+        let command = self.config.read_u16(REGISTER_COMMAND);
+        self.config
+            .write_u16(REGISTER_COMMAND, (command & !clear) | set);
+    }
+
+    /// Enables memory space decoding and DMA
+    pub fn enable_bus_master(&self) {
+        self.update_command(COMMAND_MEMORY_SPACE | COMMAND_BUS_MASTER, 0);
+    }
+
+    /// Offset of the first capability with the ID
+    #[inline]
+    pub fn capability(&self, id: u8) -> Option<u8> {
+        self.capabilities
+            .iter()
+            .find(|capability| capability.id == id)
+            .map(|capability| capability.offset)
+    }
+
+    /// Memory type of the BAR: write-combining for framebuffers, uncached for registers
+    pub fn bar_cache_mode(&self, index: usize) -> CacheMode {
+        match self.bars[index] {
+            Some(Bar::Memory {
+                prefetchable: true, ..
+            }) if self.class == CLASS_DISPLAY => CacheMode::WriteCombining,
+            _ => CacheMode::Uncached,
+        }
+    }
+
+    /// Maps the memory BAR with [Self::bar_cache_mode]
+    ///
+    /// Returns None if the BAR isn't a memory BAR, isn't assigned or there is no virtual memory.
+    /// The mapping must be unmapped by [virtual_memory_manager::iounmap]
+    pub fn map_bar(&self, index: usize) -> Option<VirtAddr> {
+        self.map_bar_with(index, self.bar_cache_mode(index))
+    }
+
+    /// Maps the memory BAR with the memory type
+    pub fn map_bar_with(&self, index: usize, cache_mode: CacheMode) -> Option<VirtAddr> {
+        let Some(Bar::Memory { address, size, .. }) = self.bars[index] else {
+            return None;
+        };
+        if address.is_null() {
+            return None;
+        }
+        self.update_command(COMMAND_MEMORY_SPACE, 0);
+        let ptr = unsafe { virtual_memory_manager::ioremap(address, size as usize, cache_mode) };
+        (!ptr.is_null()).then(|| VirtAddr::from_ptr(ptr))
+    }
+}
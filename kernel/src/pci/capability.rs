@@ -0,0 +1,208 @@
+// Capabilities of the config space: MSI, MSI-X and PCI Express link
+//
+// Only the standard capabilities list (config space 0x40-0xFF) is walked, extended capabilities aren't needed yet.
+// Vectors and messages come from interrupts::msi, here they are written to the device.
+
+use super::{
+    Bar, Capability, ConfigSpace, PciDevice, COMMAND_INTERRUPT_DISABLE,
+    REGISTER_CAPABILITIES_POINTER, REGISTER_STATUS, STATUS_CAPABILITIES_LIST,
+};
+use crate::interrupts::msi::{MsiMessage, MsiXTable};
+use crate::memory_management::virtual_memory_manager::CacheMode;
+use alloc::vec::Vec;
+use core::fmt;
+
+pub const CAPABILITY_MSI: u8 = 0x05;
+pub const CAPABILITY_PCIE: u8 = 0x10;
+pub const CAPABILITY_MSI_X: u8 = 0x11;
+
+/// 48 capabilities of 4 bytes fit into 0x40-0xFF, more means a loop in the list
+const MAX_CAPABILITIES: usize = 48;
+
+/// MSI Message Control
+const MSI_CONTROL_ENABLE: u16 = 1 << 0;
+const MSI_CONTROL_64_BIT: u16 = 1 << 7;
+const MSI_CONTROL_PER_VECTOR_MASKING: u16 = 1 << 8;
+/// Multiple Message Enable, bits 4-6
+const MSI_CONTROL_MULTIPLE_MESSAGE_ENABLE: u16 = 0x7 << 4;
+
+/// MSI-X Message Control
+const MSI_X_CONTROL_TABLE_SIZE: u16 = 0x7FF;
+const MSI_X_CONTROL_FUNCTION_MASK: u16 = 1 << 14;
+const MSI_X_CONTROL_ENABLE: u16 = 1 << 15;
+
+/// PCI Express capability registers
+const PCIE_LINK_CAPABILITIES: u16 = 0x0C;
+const PCIE_LINK_STATUS: u16 = 0x12;
+
+/// MSI capability
+#[derive(Debug, Copy, Clone, PartialEq)]
+pub struct MsiCapability {
+    offset: u8,
+    pub is_64_bit: bool,
+    pub per_vector_masking: bool,
+    /// Requested vectors, power of two up to 32
+    pub vectors_capable: u8,
+}
+
+/// MSI-X capability
+#[derive(Debug, Copy, Clone, PartialEq)]
+pub struct MsiXCapability {
+    offset: u8,
+    pub table_size: u16,
+    pub table_bar: u8,
+    pub table_offset: u32,
+    pub pba_bar: u8,
+    pub pba_offset: u32,
+}
+
+/// Link of the PCI Express capability, speed is the generation (1 is 2.5 GT/s, 2 is 5 GT/s, 3 is 8 GT/s...)
+#[derive(Debug, Copy, Clone, PartialEq)]
+pub struct PcieLink {
+    pub max_speed: u8,
+    pub max_width: u8,
+    pub speed: u8,
+    pub width: u8,
+}
+
+impl fmt::Display for PcieLink {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        write!(
+            f,
+            "PCIe link Gen{} x{} (max Gen{} x{})",
+            self.speed, self.width, self.max_speed, self.max_width
+        )
+    }
+}
+
+/// Collects the capabilities list
+pub(super) fn walk(config: &ConfigSpace) -> Vec<Capability> {
+    let mut capabilities = Vec::new();
+    if config.read_u16(REGISTER_STATUS) & STATUS_CAPABILITIES_LIST == 0 {
+        return capabilities;
+    }
+    let mut offset = config.read_u8(REGISTER_CAPABILITIES_POINTER) & 0xFC;
+    while offset != 0 && capabilities.len() < MAX_CAPABILITIES {
+        let header = config.read_u16(offset as u16);
+        capabilities.push(Capability {
+            id: header as u8,
+            offset,
+        });
+        offset = (header >> 8) as u8 & 0xFC;
+    }
+    capabilities
+}
+
+impl PciDevice {
+    pub fn msi(&self) -> Option<MsiCapability> {
+        let offset = self.capability(CAPABILITY_MSI)?;
+        let control = self.config.read_u16(offset as u16 + 2);
+        Some(MsiCapability {
+            offset,
+            is_64_bit: control & MSI_CONTROL_64_BIT != 0,
+            per_vector_masking: control & MSI_CONTROL_PER_VECTOR_MASKING != 0,
+            vectors_capable: 1 << ((control >> 1) & 0x7).min(5),
+        })
+    }
+
+    pub fn msi_x(&self) -> Option<MsiXCapability> {
+        let offset = self.capability(CAPABILITY_MSI_X)?;
+        let control = self.config.read_u16(offset as u16 + 2);
+        let table = self.config.read_u32(offset as u16 + 4);
+        let pba = self.config.read_u32(offset as u16 + 8);
+        Some(MsiXCapability {
+            offset,
+            table_size: (control & MSI_X_CONTROL_TABLE_SIZE) + 1,
+            table_bar: (table & 0x7) as u8,
+            table_offset: table & !0x7,
+            pba_bar: (pba & 0x7) as u8,
+            pba_offset: pba & !0x7,
+        })
+    }
+
+    /// Link of the PCI Express capability, None for conventional PCI
+    pub fn pcie_link(&self) -> Option<PcieLink> {
+        let offset = self.capability(CAPABILITY_PCIE)? as u16;
+        let link_capabilities = self.config.read_u32(offset + PCIE_LINK_CAPABILITIES);
+        let link_status = self.config.read_u16(offset + PCIE_LINK_STATUS);
+        Some(PcieLink {
+            max_speed: (link_capabilities & 0xF) as u8,
+            max_width: ((link_capabilities >> 4) & 0x3F) as u8,
+            speed: (link_status & 0xF) as u8,
+            width: ((link_status >> 4) & 0x3F) as u8,
+        })
+    }
+
+    /// Programs single-vector MSI with the message and enables it, legacy INTx is disabled
+    ///
+    /// The control register is read back, so the device uses the message when this returns.
+    /// Returns false if the device has no MSI capability
+    pub fn enable_msi(&self, message: MsiMessage) -> bool {
+        let Some(msi) = self.msi() else {
+            return false;
+        };
+        let offset = msi.offset as u16;
+        let control = self.config.read_u16(offset + 2);
+        self.config
+            .write_u16(offset + 2, control & !MSI_CONTROL_ENABLE);
+
+        self.config.write_u32(offset + 4, message.address as u32);
+        let data_offset = if msi.is_64_bit {
+            self.config
+                .write_u32(offset + 8, (message.address >> 32) as u32);
+            offset + 12
+        } else {
+            offset + 8
+        };
+        self.config.write_u16(data_offset, message.data as u16);
+
+        self.update_command(COMMAND_INTERRUPT_DISABLE, 0);
+        self.config.write_u16(
+            offset + 2,
+            (control & !MSI_CONTROL_MULTIPLE_MESSAGE_ENABLE) | MSI_CONTROL_ENABLE,
+        );
+        self.config.read_u16(offset + 2);
+        true
+    }
+
+    /// Maps MSI-X table uncached
+    ///
+    /// Returns None if the device has no MSI-X capability or its BAR can't be mapped.
+    /// The whole BAR is mapped, the mapping is never unmapped
+    pub fn map_msi_x_table(&self) -> Option<MsiXTable> {
+        let msi_x = self.msi_x()?;
+        let table_bar = msi_x.table_bar as usize;
+        if !matches!(self.bars.get(table_bar), Some(Some(Bar::Memory { .. }))) {
+            return None;
+        }
+        let bar_virt_addr = self.map_bar_with(table_bar, CacheMode::Uncached)?;
+        Some(unsafe { MsiXTable::new(bar_virt_addr + msi_x.table_offset as u64, msi_x.table_size) })
+    }
+
+    /// Enables MSI-X with all entries masked by the function mask, legacy INTx is disabled
+    ///
+    /// Entries are programmed through [MsiXTable], then [Self::unmask_msi_x] lets them fire
+    pub fn enable_msi_x(&self) -> bool {
+        let Some(msi_x) = self.msi_x() else {
+            return false;
+        };
+        let offset = msi_x.offset as u16 + 2;
+        let control = self.config.read_u16(offset);
+        self.update_command(COMMAND_INTERRUPT_DISABLE, 0);
+        self.config.write_u16(
+            offset,
+            control | MSI_X_CONTROL_ENABLE | MSI_X_CONTROL_FUNCTION_MASK,
+        );
+        true
+    }
+
+    /// Clears the MSI-X function mask, entries are masked individually after it
+    pub fn unmask_msi_x(&self) {
+        if let Some(msi_x) = self.msi_x() {
+            let offset = msi_x.offset as u16 + 2;
+            let control = self.config.read_u16(offset);
+            self.config
+                .write_u16(offset, control & !MSI_X_CONTROL_FUNCTION_MASK);
+        }
+    }
+}
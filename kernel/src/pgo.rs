@@ -0,0 +1,168 @@
+// PGO profile dump, built with the pgo feature (just pgo-profile)
+//
+// The instrumented kernel is built with -Cprofile-generate -Zno-profiler-runtime. There is no profiler runtime
+// in no_std, so this module writes the LLVM raw profile (.profraw) itself: a header followed by the
+// __llvm_prf_data, __llvm_prf_cnts, __llvm_prf_bits and __llvm_prf_names sections, found by the linker's
+// __start_/__stop_ symbols.
+// Only raw profile version 10 (LLVM 19, the pinned toolchain) is written, other versions have other headers.
+// Value profiling (indirect call targets, memcpy sizes) needs the runtime, its hooks do nothing,
+// so the optimized build gets counters only.
+//
+// The profile is written to QEMU debugcon (-debugcon file:kernel.profraw) after the benchmarks, llvm-profdata
+// merges it into the profile of the optimized build.
+// Counters are updated without atomics by all CPUs, lost increments only make the profile less precise.
+
+use x86_64::instructions::port::Port;
+
+/// QEMU debugcon port
+const DEBUGCON_PORT: u16 = 0xE9;
+
+/// INSTR_PROF_RAW_MAGIC_64, "\xFFlprofr\x81"
+const RAW_MAGIC: u64 = (255 << 56)
+    | ((b'l' as u64) << 48)
+    | ((b'p' as u64) << 40)
+    | ((b'r' as u64) << 32)
+    | ((b'o' as u64) << 24)
+    | ((b'f' as u64) << 16)
+    | ((b'r' as u64) << 8)
+    | 129;
+
+/// INSTR_PROF_RAW_VERSION of the header layout below
+const RAW_VERSION: u64 = 10;
+
+/// High half of the version holds variant flags (IR instrumentation, entry counters...)
+const VERSION_VARIANT_MASK: u64 = 0xFFFF_FFFF_0000_0000;
+
+/// IPVK_Last, value kinds are indirect call target, memop size and vtable target
+const VALUE_KIND_LAST: u64 = 2;
+
+/// sizeof(__llvm_profile_data)
+const DATA_RECORD_SIZE: usize = 64;
+
+/// Counters are u64 in IR instrumentation without single byte coverage
+const COUNTER_SIZE: usize = 8;
+
+extern "C" {
+    /// Version with variant flags, emitted by the compiler into every instrumented binary
+    #[linkage = "extern_weak"]
+    static __llvm_profile_raw_version: *const u64;
+    #[linkage = "extern_weak"]
+    static __start___llvm_prf_data: *const u8;
+    #[linkage = "extern_weak"]
+    static __stop___llvm_prf_data: *const u8;
+    #[linkage = "extern_weak"]
+    static __start___llvm_prf_cnts: *const u8;
+    #[linkage = "extern_weak"]
+    static __stop___llvm_prf_cnts: *const u8;
+    #[linkage = "extern_weak"]
+    static __start___llvm_prf_bits: *const u8;
+    #[linkage = "extern_weak"]
+    static __stop___llvm_prf_bits: *const u8;
+    #[linkage = "extern_weak"]
+    static __start___llvm_prf_names: *const u8;
+    #[linkage = "extern_weak"]
+    static __stop___llvm_prf_names: *const u8;
+}
+
+/// Referenced by instrumented code to link the runtime, which initializes it on hosted targets
+#[no_mangle]
+#[used]
+static __llvm_profile_runtime: i32 = 0;
+
+/// Value profiling hook of indirect calls
+#[no_mangle]
+extern "C" fn __llvm_profile_instrument_target(_target: u64, _data: *mut u8, _site: u32) {}
+
+/// Value profiling hook of memcpy/memset sizes
+#[no_mangle]
+extern "C" fn __llvm_profile_instrument_memop(_size: u64, _data: *mut u8, _site: u32) {}
+
+/// Writes the raw profile to QEMU debugcon
+pub fn dump() {
+    let raw_version = unsafe { __llvm_profile_raw_version };
+    if raw_version.is_null() {
+        log::error!("PGO profile not written, the kernel isn't instrumented (-Cprofile-generate)");
+        return;
+    }
+    let version = unsafe { raw_version.read() };
+    if version & !VERSION_VARIANT_MASK != RAW_VERSION {
+        log::error!(
+            "PGO profile not written, raw profile version {} isn't supported",
+            version & !VERSION_VARIANT_MASK
+        );
+        return;
+    }
+
+    let (data, counters, bitmap, names) = unsafe {
+        (
+            section(__start___llvm_prf_data, __stop___llvm_prf_data),
+            section(__start___llvm_prf_cnts, __stop___llvm_prf_cnts),
+            section(__start___llvm_prf_bits, __stop___llvm_prf_bits),
+            section(__start___llvm_prf_names, __stop___llvm_prf_names),
+        )
+    };
+    // Data records point to their counters and bitmaps relative to themselves
+    let data_begin = data.as_ptr() as u64;
+    let header = [
+        RAW_MAGIC,
+        version,
+        // Binary IDs size
+        0,
+        data.len().div_ceil(DATA_RECORD_SIZE) as u64,
+        // Padding before counters, only the continuous mode pads
+        0,
+        (counters.len() / COUNTER_SIZE) as u64,
+        padding(counters.len()) as u64,
+        bitmap.len() as u64,
+        padding(bitmap.len()) as u64,
+        names.len() as u64,
+        (counters.as_ptr() as u64).wrapping_sub(data_begin),
+        (bitmap.as_ptr() as u64).wrapping_sub(data_begin),
+        names.as_ptr() as u64,
+        // VTables and their names aren't profiled
+        0,
+        0,
+        VALUE_KIND_LAST,
+    ];
+
+    let mut debugcon = Port::<u8>::new(DEBUGCON_PORT);
+    let mut write = |bytes: &[u8]| {
+        for &byte in bytes {
+            unsafe {
+                debugcon.write(byte);
+            }
+        }
+    };
+    for field in header {
+        write(&field.to_le_bytes());
+    }
+    write(data);
+    write(counters);
+    write(&[0; COUNTER_SIZE][..padding(counters.len())]);
+    write(bitmap);
+    write(&[0; 8][..padding(bitmap.len())]);
+    write(names);
+    write(&[0; 8][..padding(names.len())]);
+    log::info!(
+        "PGO profile written to debugcon: {} functions, {} counters",
+        header[3],
+        header[5]
+    );
+}
+
+/// Bytes between the linker's section bounds, empty if the section doesn't exist
+///
+/// # Safety
+/// start and stop must be the bounds of one section
+unsafe fn section(start: *const u8, stop: *const u8) -> &'static [u8] {
+    if start.is_null() || stop < start {
+        return &[];
+    }
+    unsafe { core::slice::from_raw_parts(start, stop as usize - start as usize) }
+}
+
+/// Padding of the size to 8 bytes
+#[inline]
+fn padding(size: usize) -> usize {
+    size.next_multiple_of(8) - size
+}
@@ -0,0 +1,585 @@
+// Preemptive scheduler of kernel tasks
+//
+// Every CPU has its own run queue: FIFO list of ready tasks for each priority and a bitmap of non-empty lists,
+// so the next task is found in O(1) (like Linux O(1) scheduler). Tasks of the same priority share the CPU by time slices.
+// The time slice timer is armed only if there is another task to run, so a CPU with one task or idle takes no timer interrupts.
+//
+// Woken task goes to the run queue of its last CPU (caches are warm there), the CPU is kicked with reschedule IPI if the task must preempt.
+// Idle CPUs steal tasks from busy ones, the nearest first: CPUs sharing last level cache, then the same NUMA node, then by NUMA distance.
+// Idle CPU sleeps in hlt, so the CPU that queues a task to a busy CPU kicks the nearest idle CPU.
+//
+// Context switch is done only with interrupts disabled, preemption happens when the outermost interrupt exits.
+// Dead tasks are freed by the reaper task, not in the switch path: freeing the stack may wait for locks and
+// TLB shootdown.
+// Held locks (crate::sync::Mutex) raise the preempt count of the CPU, while it isn't 0 preemption is delayed
+// until the last lock is released.
+
+mod run_queue;
+pub mod task;
+
+use crate::interrupts::idt::RESCHEDULE_IPI_IDT_VECTOR;
+use crate::interrupts::irq::{self, IrqReturn};
+use crate::memory_management::{numa, physical_memory_manager};
+use crate::smp::{ipi, per_cpu, MAX_CPUS};
+use crate::timers::lapic_timer::{self, TimerId};
+use core::ptr::{null_mut, NonNull};
+use core::sync::atomic::{AtomicPtr, AtomicU32, AtomicU64, Ordering};
+use core::time::Duration;
+use raw_cpuid::CpuId;
+use run_queue::CpuRunQueue;
+use task::{Task, TaskState};
+
+/// Number of priorities, 0 is the highest
+pub const PRIORITIES: usize = 64;
+
+/// Priority of tasks without special requirements
+pub const DEFAULT_PRIORITY: u8 = 32;
+
+/// Priority of idle tasks, lower than any other
+const IDLE_PRIORITY: u8 = PRIORITIES as u8;
+
+/// Time slice of tasks with the same priority
+const TIME_SLICE: Duration = Duration::from_millis(10);
+
+/// Time slice may be longer to share the timer interrupt with other timers
+const TIME_SLICE_SLACK: Duration = Duration::from_millis(1);
+
+/// Offset of the preempt count in PerCpu
+const PREEMPT_COUNT_OFFSET: usize = core::mem::offset_of!(per_cpu::PerCpu, scheduler)
+    + core::mem::offset_of!(CpuScheduler, preempt_count);
+
+/// Run queues, index is cpu_index
+static RUN_QUEUES: [CpuRunQueue; MAX_CPUS] = [const { CpuRunQueue::new() }; MAX_CPUS];
+
+/// Bit is set if the CPU runs its idle task
+static IDLE_CPUS: [AtomicU64; MAX_CPUS / 64] = [const { AtomicU64::new(0) }; MAX_CPUS / 64];
+
+/// Dead tasks waiting for the reaper, linked through next
+static DEAD_TASKS: AtomicPtr<Task> = AtomicPtr::new(null_mut());
+
+/// Task that frees dead tasks, null until it is spawned
+static REAPER: AtomicPtr<Task> = AtomicPtr::new(null_mut());
+
+/// CPUs with the same Local APIC ID >> shift share the last level cache
+static LLC_APIC_ID_SHIFT: AtomicU32 = AtomicU32::new(0);
+
+/// Scheduler state of a CPU
+///
+/// Used only by its CPU with interrupts disabled
+pub struct CpuScheduler {
+    current: *mut Task,
+    idle: *mut Task,
+    /// Task switched from, the switch is finished by the next task
+    previous: *mut Task,
+    need_resched: bool,
+    slice_timer: Option<TimerId>,
+    /// Preemption is disabled while not 0, changed only by gs-relative instructions of its CPU
+    preempt_count: usize,
+}
+
+impl CpuScheduler {
+    pub const fn new() -> Self {
+        Self {
+            current: null_mut(),
+            idle: null_mut(),
+            previous: null_mut(),
+            need_resched: false,
+            slice_timer: None,
+            preempt_count: 0,
+        }
+    }
+}
+
+/// Reads cache topology, creates BSP's idle task and the reaper task
+///
+/// Memory manager and Local APIC timer must be inited
+pub fn init() {
+    // The last level cache is shared by "max cores for cache" APIC IDs (CPUID leaf 4)
+    let llc_apic_id_shift = CpuId::new()
+        .get_cache_parameters()
+        .and_then(|caches| caches.max_by_key(|cache| cache.level()))
+        .map(|cache| {
+            cache
+                .max_cores_for_cache()
+                .next_power_of_two()
+                .trailing_zeros()
+        })
+        .unwrap_or(0);
+    LLC_APIC_ID_SHIFT.store(llc_apic_id_shift, Ordering::Release);
+    irq::register_irq_handler(RESCHEDULE_IPI_IDT_VECTOR, reschedule_ipi_handler, 0)
+        .expect("Failed to register reschedule IPI handler");
+    log::info!(
+        "Scheduler: {} APIC IDs share last level cache",
+        1 << llc_apic_id_shift
+    );
+
+    init_cpu();
+
+    let reaper =
+        spawn("reaper", DEFAULT_PRIORITY, reaper_task, 0).expect("Failed to spawn reaper task");
+    REAPER.store(reaper.as_ptr(), Ordering::Release);
+}
+
+/// Creates idle task of the current CPU from the current context
+///
+/// BSP must be inited by [init]
+pub fn init_cpu() {
+    let cpu_index = per_cpu::cpu_index();
+    let idle = Task::new_idle(cpu_index, IDLE_PRIORITY).as_ptr();
+    x86_64::instructions::interrupts::without_interrupts(|| {
+        let scheduler = unsafe { &mut per_cpu::current().scheduler };
+        scheduler.current = idle;
+        scheduler.idle = idle;
+    });
+}
+
+/// Becomes idle task of the current CPU, runs tasks while there are any, sleeps otherwise
+pub fn run_idle() -> ! {
+    let cpu_index = per_cpu::cpu_index();
+    set_idle(cpu_index, true);
+    loop {
+        x86_64::instructions::interrupts::disable();
+        if RUN_QUEUES[cpu_index].queued() != 0 || steal(cpu_index) {
+            schedule();
+        } else if physical_memory_manager::zero_pool_needs_refill() {
+            // One page at a time, the run queue is checked again after it
+            x86_64::instructions::interrupts::enable();
+            physical_memory_manager::refill_zero_pool();
+        } else {
+            // Wake ups are sent by IPI, sti delays it until hlt
+            x86_64::instructions::interrupts::enable_and_hlt();
+        }
+    }
+}
+
+/// Creates task on the current CPU, idle CPUs may steal it
+///
+/// None if there is no memory for the task
+pub fn spawn(
+    name: &'static str,
+    priority: u8,
+    entry: fn(usize),
+    argument: usize,
+) -> Option<NonNull<Task>> {
+    assert!((priority as usize) < PRIORITIES, "Invalid task priority");
+    let task = Task::new(name, priority, entry, argument, task_entry)?;
+    x86_64::instructions::interrupts::without_interrupts(|| unsafe {
+        enqueue(task.as_ptr(), per_cpu::cpu_index());
+    });
+    Some(task)
+}
+
+/// Task running on the current CPU
+#[inline]
+pub fn current_task() -> NonNull<Task> {
+    x86_64::instructions::interrupts::without_interrupts(|| {
+        NonNull::new(unsafe { per_cpu::current().scheduler.current })
+            .expect("Scheduler is not inited")
+    })
+}
+
+/// Gives the CPU to the next ready task of the same or higher priority
+pub fn yield_now() {
+    debug_assert_eq!(preempt_count(), 0, "Yield while holding a lock");
+    x86_64::instructions::interrupts::without_interrupts(schedule);
+}
+
+/// Blocks the current task until [wake]
+///
+/// If the task was woken after the previous block, returns immediately (like thread::park)
+pub fn block_current() {
+    debug_assert_eq!(preempt_count(), 0, "Block while holding a lock");
+    x86_64::instructions::interrupts::without_interrupts(|| {
+        let current = unsafe { &*current_task().as_ptr() };
+        if current.wake_pending.swap(false, Ordering::SeqCst) {
+            return;
+        }
+        current.set_state(TaskState::Blocked);
+        // Woken between the check and the block
+        if current.wake_pending.swap(false, Ordering::SeqCst)
+            && current.compare_exchange_state(TaskState::Blocked, TaskState::Running)
+        {
+            return;
+        }
+        // If the waker has already queued the task, schedule may pick it again
+        schedule();
+    });
+}
+
+/// Wakes the blocked task, it continues on its last CPU or is stolen by an idle one
+///
+/// If the task isn't blocked, its next [block_current] returns immediately
+///
+/// Task must not be dead
+pub fn wake(task: NonNull<Task>) {
+    let task = unsafe { &*task.as_ptr() };
+    assert!(
+        task.state() != TaskState::Dead,
+        "Waking dead task {}",
+        task.name
+    );
+    x86_64::instructions::interrupts::without_interrupts(|| {
+        task.wake_pending.store(true, Ordering::SeqCst);
+        if task.compare_exchange_state(TaskState::Blocked, TaskState::Ready) {
+            task.wake_pending.store(false, Ordering::SeqCst);
+            unsafe {
+                enqueue(
+                    task as *const Task as *mut Task,
+                    task.cpu.load(Ordering::Acquire),
+                );
+            }
+        }
+    });
+}
+
+/// Finishes the current task
+pub fn exit() -> ! {
+    x86_64::instructions::interrupts::disable();
+    unsafe {
+        (*current_task().as_ptr()).set_state(TaskState::Dead);
+    }
+    schedule();
+    unreachable!("Dead task is scheduled");
+}
+
+/// Switches to the next task if the current one must be preempted and preemption is enabled
+///
+/// Called when the outermost interrupt handler exits, and when the last lock is released
+///
+/// Interrupts must be disabled
+#[inline]
+pub fn preempt_if_needed() {
+    let scheduler = unsafe { &per_cpu::current().scheduler };
+    if scheduler.need_resched && scheduler.preempt_count == 0 {
+        schedule();
+    }
+}
+
+/// Disables preemption of the current task until [preempt_enable], calls nest
+///
+/// Per-CPU data must be loaded
+#[inline(always)]
+pub fn preempt_disable() {
+    // One instruction, so the task can't be moved to other CPU in the middle
+    unsafe {
+        core::arch::asm!(
+            "inc qword ptr gs:[{offset}]",
+            offset = const PREEMPT_COUNT_OFFSET,
+            options(nostack)
+        );
+    }
+}
+
+/// Enables preemption disabled by [preempt_disable], preempts the task if it was requested meanwhile
+#[inline(always)]
+pub fn preempt_enable() {
+    unsafe {
+        core::arch::asm!(
+            "dec qword ptr gs:[{offset}]",
+            offset = const PREEMPT_COUNT_OFFSET,
+            options(nostack)
+        );
+    }
+    // Interrupt handlers and code with disabled interrupts are preempted later, when they finish
+    if preemptible() {
+        x86_64::instructions::interrupts::without_interrupts(preempt_if_needed);
+    }
+}
+
+/// The current task may be preempted: it holds no locks, interrupts are enabled and it isn't in an interrupt
+///
+/// Code that waits for other CPUs (call function IPIs) can't deadlock with them then
+#[inline]
+pub fn preemptible() -> bool {
+    preempt_count() == 0 && x86_64::instructions::interrupts::are_enabled() && !irq::in_interrupt()
+}
+
+/// Preempt count of the current CPU
+#[inline(always)]
+fn preempt_count() -> usize {
+    let preempt_count: usize;
+    unsafe {
+        core::arch::asm!(
+            "mov {}, gs:[{offset}]",
+            out(reg) preempt_count,
+            offset = const PREEMPT_COUNT_OFFSET,
+            options(nostack, preserves_flags, readonly)
+        );
+    }
+    preempt_count
+}
+
+/// Reschedule IPI handler, the CPU got a task
+///
+/// The switch is done when the interrupt exits
+fn reschedule_ipi_handler(_: usize) -> IrqReturn {
+    check_preempt(per_cpu::cpu_index());
+    IrqReturn::Handled
+}
+
+/// First code of a new task
+extern "C" fn task_entry() -> ! {
+    finish_switch();
+    let (entry, argument) = unsafe { (*current_task().as_ptr()).entry() };
+    x86_64::instructions::interrupts::enable();
+    entry(argument);
+    exit();
+}
+
+/// Adds ready task to the CPU's run queue and kicks the CPU if the task must preempt its current task
+///
+/// # Safety
+/// Interrupts must be disabled, the task must be ready and not queued
+unsafe fn enqueue(task: *mut Task, cpu_index: usize) {
+    let run_queue = &RUN_QUEUES[cpu_index];
+    let priority = unsafe {
+        (*task).cpu.store(cpu_index, Ordering::Release);
+        run_queue.lock().push(task);
+        (*task).priority
+    };
+
+    let current_priority = run_queue.current_priority.load(Ordering::Acquire);
+    if priority < current_priority
+        || (priority == current_priority && !run_queue.slice_armed.load(Ordering::Acquire))
+    {
+        kick(cpu_index);
+    }
+    if current_priority != IDLE_PRIORITY {
+        kick_nearest_idle_cpu(cpu_index);
+    }
+}
+
+/// Switches to the next task of the current CPU's run queue, or to the idle task
+///
+/// Running current task goes to the tail of its priority list
+///
+/// Interrupts must be disabled
+fn schedule() {
+    let cpu_index = per_cpu::cpu_index();
+    let run_queue = &RUN_QUEUES[cpu_index];
+    let scheduler = unsafe { &mut per_cpu::current().scheduler };
+    scheduler.need_resched = false;
+    if let Some(slice_timer) = scheduler.slice_timer.take() {
+        lapic_timer::cancel_timer(slice_timer);
+        run_queue.slice_armed.store(false, Ordering::Release);
+    }
+
+    let previous = scheduler.current;
+    let idle = scheduler.idle;
+    let next = {
+        let mut queue = run_queue.lock();
+        let previous_ref = unsafe { &*previous };
+        if previous != idle
+            && previous_ref.compare_exchange_state(TaskState::Running, TaskState::Ready)
+        {
+            unsafe {
+                queue.push(previous);
+            }
+        }
+        queue.pop().unwrap_or(idle)
+    };
+
+    let next_ref = unsafe { &*next };
+    if next != idle {
+        next_ref.set_state(TaskState::Running);
+    }
+    if next == previous {
+        arm_slice_if_needed(cpu_index);
+        return;
+    }
+
+    // The CPU the task was stolen from may still be saving its context
+    while next_ref.on_cpu.load(Ordering::Acquire) {
+        core::hint::spin_loop();
+    }
+    next_ref.on_cpu.store(true, Ordering::Relaxed);
+    next_ref.cpu.store(cpu_index, Ordering::Release);
+    scheduler.current = next;
+    scheduler.previous = previous;
+    run_queue
+        .current_priority
+        .store(next_ref.priority, Ordering::Release);
+    set_idle(cpu_index, next == idle);
+    arm_slice_if_needed(cpu_index);
+
+    unsafe {
+        task::switch_context(previous, next);
+    }
+    // The task may continue on other CPU
+    finish_switch();
+}
+
+/// Releases the previous task of the current CPU after the switch, passes it to the reaper if it's dead
+fn finish_switch() {
+    let scheduler = unsafe { &mut per_cpu::current().scheduler };
+    let previous = core::mem::replace(&mut scheduler.previous, null_mut());
+    if previous.is_null() {
+        return;
+    }
+    let previous_ref = unsafe { &*previous };
+    let dead = previous_ref.state() == TaskState::Dead;
+    previous_ref.on_cpu.store(false, Ordering::Release);
+    if dead {
+        // Not in any run queue, next is free
+        let mut head = DEAD_TASKS.load(Ordering::Relaxed);
+        loop {
+            unsafe {
+                (*previous).next = head;
+            }
+            match DEAD_TASKS.compare_exchange_weak(
+                head,
+                previous,
+                Ordering::Release,
+                Ordering::Relaxed,
+            ) {
+                Ok(_) => break,
+                Err(current_head) => head = current_head,
+            }
+        }
+        if let Some(reaper) = NonNull::new(REAPER.load(Ordering::Acquire)) {
+            wake(reaper);
+        }
+    }
+}
+
+/// Frees dead tasks, tasks that died before it started are freed at its start
+fn reaper_task(_: usize) {
+    loop {
+        let mut task = DEAD_TASKS.swap(null_mut(), Ordering::Acquire);
+        while !task.is_null() {
+            unsafe {
+                let next = (*task).next;
+                Task::free(task);
+                task = next;
+            }
+        }
+        block_current();
+    }
+}
+
+/// Sets need_resched if a queued task must preempt the current one, or arms the time slice for equal priority
+///
+/// Interrupts must be disabled
+fn check_preempt(cpu_index: usize) {
+    let scheduler = unsafe { &mut per_cpu::current().scheduler };
+    if scheduler.current.is_null() {
+        return;
+    }
+    let Some(highest_priority) = RUN_QUEUES[cpu_index].lock().highest_priority() else {
+        return;
+    };
+    if highest_priority < unsafe { (*scheduler.current).priority } {
+        scheduler.need_resched = true;
+    } else {
+        arm_slice_if_needed(cpu_index);
+    }
+}
+
+/// Arms time slice of the current task if other tasks are waiting
+///
+/// Interrupts must be disabled
+fn arm_slice_if_needed(cpu_index: usize) {
+    let scheduler = unsafe { &mut per_cpu::current().scheduler };
+    if scheduler.current == scheduler.idle
+        || scheduler.slice_timer.is_some()
+        || RUN_QUEUES[cpu_index].queued() == 0
+    {
+        return;
+    }
+    // With all timers of the CPU used the slice isn't armed, the next schedule tries again
+    scheduler.slice_timer =
+        lapic_timer::add_timer(TIME_SLICE, TIME_SLICE_SLACK, slice_expired, 0).ok();
+    if scheduler.slice_timer.is_none() {
+        return;
+    }
+    RUN_QUEUES[cpu_index]
+        .slice_armed
+        .store(true, Ordering::Release);
+}
+
+/// Time slice timer callback
+fn slice_expired(_: usize) {
+    let scheduler = unsafe { &mut per_cpu::current().scheduler };
+    scheduler.slice_timer = None;
+    scheduler.need_resched = true;
+    RUN_QUEUES[per_cpu::cpu_index()]
+        .slice_armed
+        .store(false, Ordering::Release);
+}
+
+/// Moves one task from the nearest busy CPU to the current CPU's run queue
+///
+/// Interrupts must be disabled
+fn steal(cpu_index: usize) -> bool {
+    let victim = (0..per_cpu::cpus_number())
+        .filter(|&victim| victim != cpu_index && RUN_QUEUES[victim].queued() != 0)
+        .min_by_key(|&victim| {
+            (
+                cpu_distance(cpu_index, victim),
+                usize::MAX - RUN_QUEUES[victim].queued(),
+            )
+        });
+    let Some(victim) = victim else {
+        return false;
+    };
+    // Locks are not nested, so CPUs can steal from each other
+    let Some(task) = RUN_QUEUES[victim].lock().pop() else {
+        return false;
+    };
+    unsafe {
+        (*task).cpu.store(cpu_index, Ordering::Release);
+        RUN_QUEUES[cpu_index].lock().push(task);
+    }
+    true
+}
+
+/// Sends reschedule IPI to the nearest idle CPU, it will steal work
+fn kick_nearest_idle_cpu(from_cpu_index: usize) {
+    let nearest_idle_cpu = (0..per_cpu::cpus_number())
+        .filter(|&cpu_index| {
+            cpu_index != from_cpu_index
+                && IDLE_CPUS[cpu_index / 64].load(Ordering::Acquire) & (1 << (cpu_index % 64)) != 0
+        })
+        .min_by_key(|&cpu_index| cpu_distance(from_cpu_index, cpu_index));
+    if let Some(cpu_index) = nearest_idle_cpu {
+        kick(cpu_index);
+    }
+}
+
+/// Sends reschedule IPI, the current CPU sends it to itself, so preemption happens when interrupts are enabled
+#[inline]
+fn kick(cpu_index: usize) {
+    ipi::send_reschedule(cpu_index);
+}
+
+#[inline]
+fn set_idle(cpu_index: usize, idle: bool) {
+    let bit = 1 << (cpu_index % 64);
+    if idle {
+        IDLE_CPUS[cpu_index / 64].fetch_or(bit, Ordering::AcqRel);
+    } else {
+        IDLE_CPUS[cpu_index / 64].fetch_and(!bit, Ordering::AcqRel);
+    }
+}
+
+/// 0 if the CPUs share last level cache, otherwise NUMA distance of their nodes
+fn cpu_distance(from_cpu_index: usize, to_cpu_index: usize) -> u32 {
+    let (from, to) = unsafe {
+        (
+            per_cpu::get(from_cpu_index)
+                .expect("CPU isn't started")
+                .as_ref(),
+            per_cpu::get(to_cpu_index)
+                .expect("CPU isn't started")
+                .as_ref(),
+        )
+    };
+    let llc_apic_id_shift = LLC_APIC_ID_SHIFT.load(Ordering::Acquire);
+    if from.numa_node == to.numa_node
+        && from.local_apic_id >> llc_apic_id_shift == to.local_apic_id >> llc_apic_id_shift
+    {
+        0
+    } else {
+        numa::distance(from.numa_node, to.numa_node) as u32
+    }
+}
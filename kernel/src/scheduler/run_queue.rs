@@ -0,0 +1,118 @@
+// Per-CPU run queue
+//
+// FIFO list of ready tasks for each priority and a bitmap of non-empty lists,
+// push, pop and the highest priority lookup are O(1).
+
+use super::task::Task;
+use super::{IDLE_PRIORITY, PRIORITIES};
+use crate::sync::{Mutex, MutexGuard};
+use core::ptr::null_mut;
+use core::sync::atomic::{AtomicBool, AtomicU8, AtomicUsize, Ordering};
+
+const _: () = assert!(PRIORITIES <= u64::BITS as usize, "Bitmap is u64");
+
+/// Run queue of a CPU and its state visible to other CPUs without the lock
+pub struct CpuRunQueue {
+    queue: Mutex<RunQueue>,
+    /// Number of queued tasks, used by other CPUs to find a busy CPU without the lock
+    queued: AtomicUsize,
+    /// Priority of the running task, IDLE_PRIORITY if the CPU is idle
+    pub current_priority: AtomicU8,
+    /// The time slice timer is armed
+    pub slice_armed: AtomicBool,
+}
+
+pub struct RunQueue {
+    /// Bit N is set if the list of priority N is not empty
+    bitmap: u64,
+    heads: [*mut Task; PRIORITIES],
+    tails: [*mut Task; PRIORITIES],
+}
+
+// Tasks are accessed only under the lock
+unsafe impl Send for RunQueue {}
+
+impl CpuRunQueue {
+    pub const fn new() -> Self {
+        Self {
+            queue: Mutex::new(RunQueue::new()),
+            queued: AtomicUsize::new(0),
+            current_priority: AtomicU8::new(IDLE_PRIORITY),
+            slice_armed: AtomicBool::new(false),
+        }
+    }
+
+    /// Interrupts must be disabled
+    #[inline]
+    pub fn lock(&self) -> RunQueueGuard {
+        RunQueueGuard {
+            queue: self.queue.lock(),
+            queued: &self.queued,
+        }
+    }
+
+    #[inline]
+    pub fn queued(&self) -> usize {
+        self.queued.load(Ordering::Acquire)
+    }
+}
+
+/// Locked run queue, keeps the queued counter in sync
+pub struct RunQueueGuard<'a> {
+    queue: MutexGuard<'a, RunQueue>,
+    queued: &'a AtomicUsize,
+}
+
+impl RunQueueGuard<'_> {
+    /// Adds the task to the tail of its priority list
+    ///
+    /// # Safety
+    /// The task must not be in any run queue
+    pub unsafe fn push(&mut self, task: *mut Task) {
+        unsafe {
+            let priority = (*task).priority as usize;
+            (*task).next = null_mut();
+            let tail = self.queue.tails[priority];
+            if tail.is_null() {
+                self.queue.heads[priority] = task;
+            } else {
+                (*tail).next = task;
+            }
+            self.queue.tails[priority] = task;
+        }
+        self.queue.bitmap |= 1 << (unsafe { (*task).priority });
+        self.queued.fetch_add(1, Ordering::AcqRel);
+    }
+
+    /// Removes the first task of the highest priority
+    pub fn pop(&mut self) -> Option<*mut Task> {
+        let priority = self.highest_priority()? as usize;
+        let task = self.queue.heads[priority];
+        unsafe {
+            self.queue.heads[priority] = (*task).next;
+            (*task).next = null_mut();
+        }
+        if self.queue.heads[priority].is_null() {
+            self.queue.tails[priority] = null_mut();
+            self.queue.bitmap &= !(1 << priority);
+        }
+        self.queued.fetch_sub(1, Ordering::AcqRel);
+        Some(task)
+    }
+
+    /// 0 is the highest
+    #[inline]
+    pub fn highest_priority(&self) -> Option<u8> {
+        (self.queue.bitmap != 0).then(|| self.queue.bitmap.trailing_zeros() as u8)
+    }
+}
+
+impl RunQueue {
+    const fn new() -> Self {
+        Self {
+            bitmap: 0,
+            heads: [null_mut(); PRIORITIES],
+            tails: [null_mut(); PRIORITIES],
+        }
+    }
+}
@@ -0,0 +1,223 @@
+// Kernel tasks
+//
+// Task context (callee-saved registers and RFLAGS) is saved on the task's own stack, Task keeps only the saved RSP.
+// Stack of a new task is prepared so the first switch to it "returns" into the entry trampoline.
+
+use crate::memory_management::virtual_memory_manager::{vfree, vmalloc};
+use alloc::boxed::Box;
+use core::ptr::{null_mut, NonNull};
+use core::sync::atomic::{AtomicBool, AtomicU8, AtomicUsize, Ordering};
+
+/// Stack size of tasks, vmalloc adds a guard page
+///
+/// Interrupts take only their frames from it, handlers and softirqs run on the IRQ stack of the CPU
+pub const TASK_STACK_SIZE: usize = 16 * 1024;
+
+/// RFLAGS of a new task, reserved bit 1 set, interrupts disabled (context switch is done with interrupts disabled)
+const INITIAL_RFLAGS: u64 = 0x2;
+
+core::arch::global_asm!(
+    r#"
+.global scheduler_switch_context
+scheduler_switch_context:
+    # RDI - where to save RSP of the previous task, RSI - RSP of the next task
+    pushfq
+    push %rbp
+    push %rbx
+    push %r12
+    push %r13
+    push %r14
+    push %r15
+    mov %rsp, (%rdi)
+    mov %rsi, %rsp
+    pop %r15
+    pop %r14
+    pop %r13
+    pop %r12
+    pop %rbx
+    pop %rbp
+    popfq
+    ret
+"#,
+    options(att_syntax)
+);
+
+extern "C" {
+    fn scheduler_switch_context(previous_rsp: *mut u64, next_rsp: u64);
+}
+
+/// Must match pushes of scheduler_switch_context
+#[repr(C)]
+struct InitialContext {
+    r15: u64,
+    r14: u64,
+    r13: u64,
+    r12: u64,
+    rbx: u64,
+    rbp: u64,
+    rflags: u64,
+    return_address: u64,
+    /// Return address of the entry trampoline, aligns RSP like after call
+    null_return_address: u64,
+}
+
+#[repr(u8)]
+#[derive(Clone, Copy, Debug, PartialEq)]
+pub enum TaskState {
+    Running = 0,
+    /// In a run queue
+    Ready = 1,
+    Blocked = 2,
+    Dead = 3,
+}
+
+impl TaskState {
+    #[inline]
+    fn from_raw(state: u8) -> Self {
+        match state {
+            0 => TaskState::Running,
+            1 => TaskState::Ready,
+            2 => TaskState::Blocked,
+            3 => TaskState::Dead,
+            state => unreachable!("Invalid task state {state}"),
+        }
+    }
+}
+
+pub struct Task {
+    /// Saved RSP while the task is not running
+    rsp: u64,
+    /// Bottom of the stack, null for idle tasks (they use the CPU's boot stack)
+    stack: *mut u8,
+    pub name: &'static str,
+    /// 0 is the highest
+    pub priority: u8,
+    state: AtomicU8,
+    /// Woken while not blocked, the next block returns immediately
+    pub(super) wake_pending: AtomicBool,
+    /// Some CPU still runs on the task's stack, cleared when the switch from the task is finished
+    pub(super) on_cpu: AtomicBool,
+    /// CPU of the task's run queue, or the CPU it runs on
+    pub(super) cpu: AtomicUsize,
+    entry: fn(usize),
+    argument: usize,
+    /// Next task in the run queue list
+    pub(super) next: *mut Task,
+}
+
+impl Task {
+    /// Creates task with its stack, the task starts in entry_trampoline
+    ///
+    /// None if there is no memory for the stack
+    pub(super) fn new(
+        name: &'static str,
+        priority: u8,
+        entry: fn(usize),
+        argument: usize,
+        entry_trampoline: extern "C" fn() -> !,
+    ) -> Option<NonNull<Task>> {
+        let stack = vmalloc(TASK_STACK_SIZE);
+        if stack.is_null() {
+            return None;
+        }
+        let stack_top = stack as usize + TASK_STACK_SIZE;
+        let initial_context = (stack_top - size_of::<InitialContext>()) as *mut InitialContext;
+        // RSP + 8 must be 16 bytes aligned at the trampoline entry
+        debug_assert_eq!((initial_context as usize + 8) % 16, 0);
+        unsafe {
+            initial_context.write(InitialContext {
+                r15: 0,
+                r14: 0,
+                r13: 0,
+                r12: 0,
+                rbx: 0,
+                rbp: 0,
+                rflags: INITIAL_RFLAGS,
+                return_address: entry_trampoline as usize as u64,
+                null_return_address: 0,
+            });
+        }
+
+        let task = Box::new(Task {
+            rsp: initial_context as u64,
+            stack,
+            name,
+            priority,
+            state: AtomicU8::new(TaskState::Ready as u8),
+            wake_pending: AtomicBool::new(false),
+            on_cpu: AtomicBool::new(false),
+            cpu: AtomicUsize::new(0),
+            entry,
+            argument,
+            next: null_mut(),
+        });
+        Some(NonNull::from(Box::leak(task)))
+    }
+
+    /// Creates idle task of the CPU, it represents the context the CPU booted with
+    pub(super) fn new_idle(cpu_index: usize, priority: u8) -> NonNull<Task> {
+        let task = Box::new(Task {
+            rsp: 0,
+            stack: null_mut(),
+            name: "idle",
+            priority,
+            state: AtomicU8::new(TaskState::Running as u8),
+            wake_pending: AtomicBool::new(false),
+            on_cpu: AtomicBool::new(true),
+            cpu: AtomicUsize::new(cpu_index),
+            entry: |_| unreachable!("Idle task has no entry"),
+            argument: 0,
+            next: null_mut(),
+        });
+        NonNull::from(Box::leak(task))
+    }
+
+    /// Frees dead task and its stack
+    ///
+    /// # Safety
+    /// The task must be dead and no CPU may use its stack
+    pub(super) unsafe fn free(task: *mut Task) {
+        unsafe {
+            debug_assert_eq!((*task).state(), TaskState::Dead);
+            let task = Box::from_raw(task);
+            if !task.stack.is_null() {
+                vfree(task.stack);
+            }
+        }
+    }
+
+    #[inline]
+    pub fn state(&self) -> TaskState {
+        TaskState::from_raw(self.state.load(Ordering::SeqCst))
+    }
+
+    #[inline]
+    pub(super) fn set_state(&self, state: TaskState) {
+        self.state.store(state as u8, Ordering::SeqCst);
+    }
+
+    #[inline]
+    pub(super) fn compare_exchange_state(&self, current: TaskState, new: TaskState) -> bool {
+        self.state
+            .compare_exchange(current as u8, new as u8, Ordering::SeqCst, Ordering::SeqCst)
+            .is_ok()
+    }
+
+    #[inline]
+    pub(super) fn entry(&self) -> (fn(usize), usize) {
+        (self.entry, self.argument)
+    }
+}
+
+/// Saves context of the previous task and loads context of the next task
+///
+/// Returns when some CPU switches back to the previous task
+///
+/// # Safety
+/// Interrupts must be disabled, next must not run on any CPU
+#[inline]
+pub(super) unsafe fn switch_context(previous: *mut Task, next: *mut Task) {
+    unsafe {
+        scheduler_switch_context(&raw mut (*previous).rsp, (*next).rsp);
+    }
+}
@@ -1,2 +1,3 @@
+pub mod log_ring;
 pub mod serial_logger;
 pub mod serial_printer;
@@ -0,0 +1,160 @@
+// Lock free log ring
+//
+// Each CPU has its own ring of log records. Producers (tasks and nested interrupts) reserve space by CAS on the head,
+// copy the record and commit it by writing its header. The single consumer reads committed records in order from the tail,
+// a reserved but not yet committed record stops it until the producer finishes.
+// If the ring is full, the record is dropped and counted, producers never wait.
+//
+// Record: u32 header (length | COMMITTED, 0 - not committed), bytes, padding to 4 bytes.
+// Positions only grow, the buffer offset is position % LOG_RING_SIZE, headers never wrap.
+// The consumer zeroes consumed records, so a reserved header is 0 until the producer commits it.
+
+use core::cell::UnsafeCell;
+use core::sync::atomic::{AtomicU32, AtomicU64, AtomicUsize, Ordering};
+
+/// Bytes of records of one CPU
+pub const LOG_RING_SIZE: usize = 8 * 1024;
+
+/// Longer records are truncated
+pub const MAX_RECORD_SIZE: usize = 256;
+
+const HEADER_SIZE: usize = size_of::<u32>();
+
+/// Header bit 31, the record is written
+const COMMITTED: u32 = 1 << 31;
+
+const _: () = assert!(LOG_RING_SIZE.is_power_of_two() && LOG_RING_SIZE >= 4 * MAX_RECORD_SIZE);
+
+#[repr(C, align(4))]
+struct Buffer([u8; LOG_RING_SIZE]);
+
+pub struct LogRing {
+    /// Reserved bytes
+    head: AtomicUsize,
+    /// Consumed bytes
+    tail: AtomicUsize,
+    /// Records dropped because the ring was full
+    dropped: AtomicU64,
+    buffer: UnsafeCell<Buffer>,
+}
+
+// Bytes between tail and head belong to producers or the consumer by the protocol above
+unsafe impl Sync for LogRing {}
+
+impl LogRing {
+    pub const fn new() -> Self {
+        Self {
+            head: AtomicUsize::new(0),
+            tail: AtomicUsize::new(0),
+            dropped: AtomicU64::new(0),
+            buffer: UnsafeCell::new(Buffer([0; LOG_RING_SIZE])),
+        }
+    }
+
+    /// Adds the record, returns false if it was dropped
+    ///
+    /// Any CPU may push, but pushing from the ring's CPU with interrupts disabled keeps the consumer from waiting
+    pub fn push(&self, record: &[u8]) -> bool {
+        let record = &record[..record.len().min(MAX_RECORD_SIZE)];
+        let total_size = record_size(record.len());
+        let mut head = self.head.load(Ordering::Relaxed);
+        loop {
+            let tail = self.tail.load(Ordering::Acquire);
+            if head + total_size - tail > LOG_RING_SIZE {
+                self.dropped.fetch_add(1, Ordering::Relaxed);
+                return false;
+            }
+            match self.head.compare_exchange_weak(
+                head,
+                head + total_size,
+                Ordering::AcqRel,
+                Ordering::Relaxed,
+            ) {
+                Ok(_) => break,
+                Err(actual) => head = actual,
+            }
+        }
+
+        self.copy_in(head + HEADER_SIZE, record);
+        self.header(head)
+            .store(record.len() as u32 | COMMITTED, Ordering::Release);
+        true
+    }
+
+    /// Passes committed records to the function in order and frees them
+    ///
+    /// # Safety
+    /// Only one consumer at a time
+    pub unsafe fn consume(&self, mut function: impl FnMut(&[u8])) {
+        let mut record = [0; MAX_RECORD_SIZE];
+        loop {
+            let tail = self.tail.load(Ordering::Relaxed);
+            if tail == self.head.load(Ordering::Acquire) {
+                return;
+            }
+            let header = self.header(tail).load(Ordering::Acquire);
+            if header & COMMITTED == 0 {
+                return;
+            }
+            let length = (header & !COMMITTED) as usize;
+            self.copy_out(tail + HEADER_SIZE, &mut record[..length]);
+            // Headers of the next lap may be anywhere in the record
+            self.zero(tail, record_size(length));
+            self.tail
+                .store(tail + record_size(length), Ordering::Release);
+            function(&record[..length]);
+        }
+    }
+
+    /// There are no reserved records
+    #[inline]
+    pub fn is_empty(&self) -> bool {
+        self.tail.load(Ordering::Acquire) == self.head.load(Ordering::Acquire)
+    }
+
+    #[inline]
+    pub fn dropped(&self) -> u64 {
+        self.dropped.load(Ordering::Relaxed)
+    }
+
+    #[inline]
+    fn header(&self, position: usize) -> &AtomicU32 {
+        unsafe {
+            let header_ptr = (self.buffer.get() as *mut u8).add(position % LOG_RING_SIZE);
+            AtomicU32::from_ptr(header_ptr as *mut u32)
+        }
+    }
+
+    fn copy_in(&self, position: usize, bytes: &[u8]) {
+        let buffer = self.buffer.get() as *mut u8;
+        for (i, &byte) in bytes.iter().enumerate() {
+            unsafe {
+                buffer.add((position + i) % LOG_RING_SIZE).write(byte);
+            }
+        }
+    }
+
+    fn zero(&self, position: usize, size: usize) {
+        let buffer = self.buffer.get() as *mut u8;
+        for i in 0..size {
+            unsafe {
+                buffer.add((position + i) % LOG_RING_SIZE).write(0);
+            }
+        }
+    }
+
+    fn copy_out(&self, position: usize, bytes: &mut [u8]) {
+        let buffer = self.buffer.get() as *const u8;
+        for (i, byte) in bytes.iter_mut().enumerate() {
+            unsafe {
+                *byte = buffer.add((position + i) % LOG_RING_SIZE).read();
+            }
+        }
+    }
+}
+
+/// Header, bytes and padding
+#[inline]
+fn record_size(length: usize) -> usize {
+    HEADER_SIZE + length.next_multiple_of(HEADER_SIZE)
+}
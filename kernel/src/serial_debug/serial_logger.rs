@@ -1,27 +1,214 @@
+// Asynchronous serial logger
+//
+// log macros format the record and push it to the log ring of the current CPU, they never wait for the UART,
+// so they can be used in interrupts. A low priority task drains the rings of all CPUs to COM1.
+// Records are dropped when a ring is full, the consumer reports how many.
+//
+// Until the consumer task is started, the producer drains the rings itself if COM1 is free.
+// Panic handler drains the rings synchronously with the lock free printer.
+
+use super::log_ring::{LogRing, MAX_RECORD_SIZE};
+use crate::com_ports;
+use crate::interrupts::softirq::{self, Softirq};
+use crate::scheduler::{self, task::Task};
+use crate::smp::per_cpu;
+use crate::sync::Mutex;
+use core::ptr::{null_mut, NonNull};
+use core::sync::atomic::{AtomicBool, AtomicPtr, AtomicU64, Ordering};
 use log::{LevelFilter, Metadata, Record};
 
+/// Just above idle tasks
+const CONSUMER_PRIORITY: u8 = scheduler::PRIORITIES as u8 - 1;
+
 #[allow(dead_code)]
 static SERIAL_LOGGER: SerialLogger = SerialLogger;
 
+/// Single consumer of the rings
+static DRAIN_LOCK: Mutex<()> = Mutex::new(());
+
+/// Consumer task, null until it's started
+static CONSUMER: AtomicPtr<Task> = AtomicPtr::new(null_mut());
+
+/// The consumer found the rings empty and is going to block
+static CONSUMER_SLEEPING: AtomicBool = AtomicBool::new(false);
+
+/// Dropped records already reported by the consumer
+static REPORTED_DROPPED: AtomicU64 = AtomicU64::new(0);
+
 struct SerialLogger;
 
+/// Formats the record into a fixed buffer, the rest is truncated
+struct RecordWriter {
+    buffer: [u8; MAX_RECORD_SIZE],
+    length: usize,
+}
+
 impl log::Log for SerialLogger {
     fn enabled(&self, metadata: &Metadata) -> bool {
         metadata.level() <= log::max_level()
     }
 
     fn log(&self, record: &Record) {
-        if self.enabled(record.metadata()) {
-            crate::serial_println!("{}: {}", record.level(), record.args());
+        if !self.enabled(record.metadata()) {
+            return;
+        }
+        let mut record_writer = RecordWriter {
+            buffer: [0; MAX_RECORD_SIZE],
+            length: 0,
+        };
+        let _ = core::fmt::Write::write_fmt(
+            &mut record_writer,
+            format_args!("{}: {}", record.level(), record.args()),
+        );
+        // Record must end with newline even if it's truncated
+        record_writer.buffer[record_writer.length.min(MAX_RECORD_SIZE - 1)] = b'\n';
+        let length = (record_writer.length + 1).min(MAX_RECORD_SIZE);
+        let record = &record_writer.buffer[..length];
+
+        // Not moved to another CPU while pushing, so the consumer doesn't wait for a preempted producer
+        x86_64::instructions::interrupts::without_interrupts(|| unsafe {
+            per_cpu::current().log_ring.push(record);
+        });
+
+        if CONSUMER.load(Ordering::Acquire).is_null() {
+            drain(false);
+            return;
         }
+        // Pairs with the recheck of the consumer before it blocks
+        core::sync::atomic::fence(Ordering::SeqCst);
+        if CONSUMER_SLEEPING.load(Ordering::Relaxed)
+            && CONSUMER_SLEEPING.swap(false, Ordering::SeqCst)
+        {
+            // Waking takes run queue locks, softirq does it when no locks are held
+            softirq::raise_softirq(Softirq::LogWake);
+        }
+    }
+
+    fn flush(&self) {
+        drain(true);
     }
+}
 
-    fn flush(&self) {}
+impl core::fmt::Write for RecordWriter {
+    fn write_str(&mut self, s: &str) -> core::fmt::Result {
+        // Newline is added after the record
+        let free = MAX_RECORD_SIZE - 1 - self.length;
+        let bytes = &s.as_bytes()[..s.len().min(free)];
+        self.buffer[self.length..self.length + bytes.len()].copy_from_slice(bytes);
+        self.length += bytes.len();
+        Ok(())
+    }
 }
 
 /// Inits logger
+///
+/// Per-CPU data of BSP must be inited, records go to its log ring
 pub fn init() {
     log::set_logger(&SERIAL_LOGGER)
         .map(|()| log::set_max_level(LevelFilter::Trace))
         .expect("Failed to init logger");
 }
+
+/// Starts the consumer task, log macros don't print synchronously after it
+///
+/// Scheduler must be inited
+pub fn start_consumer() {
+    softirq::register_softirq(Softirq::LogWake, wake_consumer);
+    let consumer = scheduler::spawn("serial logger", CONSUMER_PRIORITY, consumer_task, 0)
+        .expect("Failed to spawn serial logger task");
+    CONSUMER.store(consumer.as_ptr(), Ordering::Release);
+}
+
+/// Records dropped because log rings were full
+pub fn dropped_records() -> u64 {
+    (0..per_cpu::cpus_number())
+        .filter_map(per_cpu::get)
+        .map(|per_cpu| unsafe { per_cpu.as_ref().log_ring.dropped() })
+        .sum()
+}
+
+/// Prints records of all CPUs with the lock free printer
+///
+/// Only for panic handler, the consumer may be stopped in the middle of a record
+pub fn drain_on_panic() {
+    for_each_ring(|log_ring| unsafe {
+        log_ring.consume(|record| {
+            crate::serial_print_lock_free!("{}", RecordBytes(record));
+        });
+    });
+}
+
+fn consumer_task(_: usize) {
+    loop {
+        drain(true);
+        CONSUMER_SLEEPING.store(true, Ordering::SeqCst);
+        let mut empty = true;
+        for_each_ring(|log_ring| empty &= log_ring.is_empty());
+        if empty {
+            scheduler::block_current();
+        }
+        CONSUMER_SLEEPING.store(false, Ordering::SeqCst);
+    }
+}
+
+fn wake_consumer() {
+    if let Some(consumer) = NonNull::new(CONSUMER.load(Ordering::Acquire)) {
+        scheduler::wake(consumer);
+    }
+}
+
+/// Prints committed records of all CPUs to COM1
+///
+/// wait: wait for COM1, otherwise the records are left in the rings if COM1 or the rings are busy
+fn drain(wait: bool) {
+    let Some(_drain_lock) = DRAIN_LOCK.try_lock() else {
+        return;
+    };
+    let mut com1_port = if wait {
+        com_ports::COM1_PORT.lock()
+    } else {
+        match com_ports::COM1_PORT.try_lock() {
+            Some(com1_port) => com1_port,
+            None => return,
+        }
+    };
+
+    let dropped = dropped_records();
+    let reported_dropped = REPORTED_DROPPED.swap(dropped, Ordering::Relaxed);
+    if dropped != reported_dropped {
+        let _ = core::fmt::Write::write_fmt(
+            &mut *com1_port,
+            format_args!("WARN: {} log records dropped\n", dropped - reported_dropped),
+        );
+    }
+
+    for_each_ring(|log_ring| unsafe {
+        log_ring.consume(|record| {
+            for &byte in record {
+                if !byte.is_ascii_control() || byte == b'\n' {
+                    com1_port.send(byte);
+                }
+            }
+        });
+    });
+}
+
+fn for_each_ring(mut function: impl FnMut(&LogRing)) {
+    for cpu_index in 0..per_cpu::cpus_number() {
+        if let Some(per_cpu) = per_cpu::get(cpu_index) {
+            function(unsafe { &per_cpu.as_ref().log_ring });
+        }
+    }
+}
+
+/// Record as text, invalid UTF-8 of a truncated record is skipped
+struct RecordBytes<'a>(&'a [u8]);
+
+impl core::fmt::Display for RecordBytes<'_> {
+    fn fmt(&self, f: &mut core::fmt::Formatter<'_>) -> core::fmt::Result {
+        for chunk in self.0.utf8_chunks() {
+            f.write_str(chunk.valid())?;
+        }
+        Ok(())
+    }
+}
@@ -0,0 +1,298 @@
+// Symmetric multiprocessing
+// Starts application processors using INIT-SIPI-SIPI sequence (Intel SDM Vol. 3, 8.4.4.1)
+
+mod ap_trampoline;
+pub mod cpu_mask;
+pub mod ipi;
+pub mod per_cpu;
+
+use crate::acpi::PLATFORM_INFO;
+use crate::memory_management::physical_memory_manager::{self, MemoryZoneEnum};
+use crate::memory_management::{numa, virtual_memory_manager, PAGE_SIZE};
+use acpi_lib::platform::{Processor, ProcessorState};
+use bootloader_api::info::{MemoryRegion, MemoryRegionKind};
+use core::sync::atomic::{AtomicBool, AtomicU8, Ordering};
+use core::time::Duration;
+use per_cpu::PerCpu;
+use x86_64::structures::paging::{PageTable, PageTableFlags};
+use x86_64::PhysAddr;
+
+/// Max number of supported CPUs
+pub const MAX_CPUS: usize = 256;
+
+/// Stack size of application processors
+///
+/// Same as bootstrap processor's stack (BOOTLOADER_CONFIG)
+const AP_STACK_SIZE: usize = 128 * 1024;
+
+/// Set by AP when it has started
+static AP_STARTED: AtomicBool = AtomicBool::new(false);
+
+/// State of the AP being started, AP_WAITING until it enters ap_entry or BSP gives up on it
+static AP_STATE: AtomicU8 = AtomicU8::new(AP_WAITING);
+const AP_WAITING: u8 = 0;
+/// The AP runs ap_entry, it will finish its init
+const AP_ENTERED: u8 = 1;
+/// Timed out, the AP is parked by INIT, if it enters ap_entry before INIT arrives it halts
+const AP_ABANDONED: u8 = 2;
+
+/// Starts application processors
+///
+/// Memory manager, ACPI, APIC and timers must be initialized
+pub fn init(boot_info: &bootloader_api::BootInfo) {
+    let processor_info = PLATFORM_INFO
+        .get()
+        .expect("Failed to get PlatformInfo")
+        .processor_info
+        .as_ref()
+        .expect("No processor info in ACPI tables");
+    if processor_info.application_processors.is_empty() {
+        log::info!("No application processors");
+        return;
+    }
+
+    // Trampoline
+    let trampoline_phys_addr = find_trampoline_page(&boot_info.memory_regions)
+        .expect("Failed to find free page below 1 MB for AP trampoline");
+    let trampoline_params = unsafe { ap_trampoline::install(trampoline_phys_addr) };
+    let temporary_pml4_phys_addr = create_temporary_page_tables();
+
+    // APs use the same control registers as BSP
+    // PCIDE can't be set before long mode activation, LMA is set by CPU
+    trampoline_params.temporary_cr3 = temporary_pml4_phys_addr.as_u64() as u32;
+    trampoline_params.cr0 = x86_64::registers::control::Cr0::read_raw() as u32;
+    trampoline_params.cr4 = (x86_64::registers::control::Cr4::read_raw() as u32) & !(1 << 17);
+    trampoline_params.efer = x86_64::registers::model_specific::Efer::read_raw() & !(1 << 10);
+    trampoline_params.kernel_cr3 = x86_64::registers::control::Cr3::read()
+        .0
+        .start_address()
+        .as_u64();
+    trampoline_params.entry = ap_entry as usize as u64;
+
+    let mut cpu_index = 1;
+    for processor in processor_info.application_processors.iter() {
+        if matches!(processor.state, ProcessorState::Disabled) {
+            continue;
+        }
+        if cpu_index >= MAX_CPUS {
+            log::warn!("Too many CPUs, only {MAX_CPUS} used");
+            break;
+        }
+        if start_ap(
+            trampoline_params,
+            processor,
+            cpu_index,
+            trampoline_phys_addr,
+        ) {
+            crate::timers::tsc::check_warp_bsp(cpu_index);
+            cpu_index += 1;
+        } else {
+            log::warn!(
+                "Failed to start AP with Local APIC ID {}",
+                processor.local_apic_id
+            );
+        }
+    }
+
+    free_temporary_page_tables(temporary_pml4_phys_addr);
+    log::info!("{} CPUs online", per_cpu::cpus_number());
+}
+
+/// Starts one AP and waits for it
+fn start_ap(
+    trampoline_params: &mut ap_trampoline::TrampolineParams,
+    processor: &Processor,
+    cpu_index: usize,
+    trampoline_phys_addr: u64,
+) -> bool {
+    // PerCpu and stack on the CPU's node
+    let numa_node = numa::node_of_apic_id(processor.local_apic_id);
+    let alloc_on_cpu_node = |size| unsafe {
+        let phys_addr = physical_memory_manager::alloc_on_node(
+            numa_node,
+            &[MemoryZoneEnum::High, MemoryZoneEnum::Dma32],
+            size,
+        );
+        if phys_addr.is_null() {
+            physical_memory_manager::alloc(&[MemoryZoneEnum::High, MemoryZoneEnum::Dma32], size)
+        } else {
+            phys_addr
+        }
+    };
+
+    // PerCpu
+    let per_cpu_size = size_of::<PerCpu>().next_power_of_two().max(PAGE_SIZE);
+    let per_cpu_phys_addr = alloc_on_cpu_node(per_cpu_size);
+    assert!(!per_cpu_phys_addr.is_null(), "Failed to allocate PerCpu");
+    let per_cpu = virtual_memory_manager::virt_addr_in_cpmm_from_phys_addr(per_cpu_phys_addr)
+        .as_mut_ptr::<PerCpu>();
+    unsafe {
+        per_cpu.write(PerCpu::new(cpu_index));
+        (*per_cpu).local_apic_id = processor.local_apic_id;
+        (*per_cpu).processor_uid = processor.processor_uid;
+        (*per_cpu).numa_node = numa_node;
+    }
+
+    // Stack
+    let stack_phys_addr = alloc_on_cpu_node(AP_STACK_SIZE);
+    assert!(!stack_phys_addr.is_null(), "Failed to allocate AP stack");
+    let stack_top = virtual_memory_manager::virt_addr_in_cpmm_from_phys_addr(stack_phys_addr)
+        + AP_STACK_SIZE as u64;
+
+    trampoline_params.per_cpu = per_cpu as u64;
+    trampoline_params.stack_top = stack_top.as_u64();
+    AP_STARTED.store(false, Ordering::Release);
+    AP_STATE.store(AP_WAITING, Ordering::Release);
+
+    // INIT-SIPI-SIPI
+    let sipi_vector = (trampoline_phys_addr / PAGE_SIZE as u64) as u8;
+    crate::interrupts::apic::send_init_ipi(processor.local_apic_id);
+    crate::timers::sleep(Duration::from_millis(10));
+    for _ in 0..2 {
+        crate::interrupts::apic::send_startup_ipi(processor.local_apic_id, sipi_vector);
+        crate::timers::sleep(Duration::from_micros(200));
+        if AP_STARTED.load(Ordering::Acquire) {
+            return true;
+        }
+    }
+
+    // Some CPUs are slow
+    for _ in 0..100 {
+        if AP_STARTED.load(Ordering::Acquire) {
+            return true;
+        }
+        crate::timers::sleep(Duration::from_millis(1));
+    }
+
+    if AP_STATE
+        .compare_exchange(
+            AP_WAITING,
+            AP_ABANDONED,
+            Ordering::AcqRel,
+            Ordering::Acquire,
+        )
+        .is_err()
+    {
+        // Entered ap_entry, it only finishes init
+        while !AP_STARTED.load(Ordering::Acquire) {
+            core::hint::spin_loop();
+        }
+        return true;
+    }
+    // A late AP would read trampoline params of the next AP, or run on freed temporary page tables.
+    // INIT puts it into wait-for-SIPI state, only SIPI wakes it again
+    crate::interrupts::apic::send_init_ipi(processor.local_apic_id);
+    crate::timers::sleep(Duration::from_millis(10));
+    // PerCpu and stack are not freed, the AP may have been using them when INIT arrived
+    false
+}
+
+/// Entry point of application processor, called by trampoline
+extern "sysv64" fn ap_entry(per_cpu: *mut PerCpu, kernel_cr3: u64) -> ! {
+    // BSP gave up on this AP, INIT is on its way
+    if AP_STATE
+        .compare_exchange(AP_WAITING, AP_ENTERED, Ordering::AcqRel, Ordering::Acquire)
+        .is_err()
+    {
+        loop {
+            x86_64::instructions::interrupts::disable();
+            x86_64::instructions::hlt();
+        }
+    }
+    unsafe {
+        // Identity mapping of the trampoline is not needed anymore
+        core::arch::asm!("mov cr3, {}", in(reg) kernel_cr3, options(nostack));
+        per_cpu::register(per_cpu);
+        per_cpu::load(per_cpu);
+    }
+    virtual_memory_manager::address_space::init_ap();
+    virtual_memory_manager::pat::init_cpu();
+    crate::gdt::init();
+    // IDT entries of NMI, double fault and machine check use IST stacks
+    crate::gdt::init_interrupt_stacks();
+    crate::interrupts::idt::load();
+    crate::interrupts::irq::init_stack();
+    crate::interrupts::apic::init_ap();
+    ipi::init_cpu();
+    crate::trace::init_cpu();
+    crate::timers::lapic_timer::init_cpu();
+    crate::scheduler::init_cpu();
+
+    AP_STARTED.store(true, Ordering::Release);
+    crate::timers::tsc::check_warp_ap();
+
+    crate::scheduler::run_idle();
+}
+
+/// Finds free page below 1 MB (but not zero page) for the trampoline
+fn find_trampoline_page(memory_regions: &[MemoryRegion]) -> Option<u64> {
+    memory_regions
+        .iter()
+        .filter(|memory_region| memory_region.kind == MemoryRegionKind::Usable)
+        .find_map(|memory_region| {
+            let first_page =
+                x86_64::align_up(memory_region.start.max(PAGE_SIZE as u64), PAGE_SIZE as u64);
+            let end = memory_region.end.min(0x100000);
+            if first_page + PAGE_SIZE as u64 <= end {
+                Some(first_page)
+            } else {
+                None
+            }
+        })
+}
+
+/// Creates page tables used by AP to enable long mode
+///
+/// Kernel half of the current PML4 and identity mapping of the first 2 MB (trampoline),
+/// all tables are below 4 GB because CR3 is loaded in protected mode
+fn create_temporary_page_tables() -> PhysAddr {
+    let alloc_table = || unsafe {
+        let phys_addr = physical_memory_manager::alloc(
+            &[MemoryZoneEnum::Dma32, MemoryZoneEnum::IsaDma],
+            PAGE_SIZE,
+        );
+        assert!(
+            !phys_addr.is_null(),
+            "Failed to allocate AP temporary page table"
+        );
+        let table = virtual_memory_manager::virt_addr_in_cpmm_from_phys_addr(phys_addr)
+            .as_mut_ptr::<PageTable>();
+        table.write(PageTable::new());
+        (phys_addr, &mut *table)
+    };
+
+    let (pml4_phys_addr, pml4) = alloc_table();
+    let (pdpt_phys_addr, pdpt) = alloc_table();
+    let (pd_phys_addr, pd) = alloc_table();
+
+    let current_pml4 = virtual_memory_manager::virt_addr_in_cpmm_from_phys_addr(
+        x86_64::registers::control::Cr3::read().0.start_address(),
+    )
+    .as_ptr::<PageTable>();
+    for i in 256..512 {
+        pml4[i] = unsafe { (*current_pml4)[i].clone() };
+    }
+
+    let flags = PageTableFlags::PRESENT | PageTableFlags::WRITABLE;
+    pml4[0].set_addr(pdpt_phys_addr, flags);
+    pdpt[0].set_addr(pd_phys_addr, flags);
+    pd[0].set_addr(PhysAddr::zero(), flags | PageTableFlags::HUGE_PAGE);
+
+    pml4_phys_addr
+}
+
+/// Frees page tables created by [create_temporary_page_tables]
+fn free_temporary_page_tables(pml4_phys_addr: PhysAddr) {
+    unsafe {
+        let pml4 = &*virtual_memory_manager::virt_addr_in_cpmm_from_phys_addr(pml4_phys_addr)
+            .as_ptr::<PageTable>();
+        let pdpt_phys_addr = pml4[0].addr();
+        let pdpt = &*virtual_memory_manager::virt_addr_in_cpmm_from_phys_addr(pdpt_phys_addr)
+            .as_ptr::<PageTable>();
+        let pd_phys_addr = pdpt[0].addr();
+
+        physical_memory_manager::free(pd_phys_addr, PAGE_SIZE);
+        physical_memory_manager::free(pdpt_phys_addr, PAGE_SIZE);
+        physical_memory_manager::free(pml4_phys_addr, PAGE_SIZE);
+    }
+}
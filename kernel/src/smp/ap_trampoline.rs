@@ -0,0 +1,202 @@
+// Application processor start-up code
+//
+// AP starts in real mode at physical address vector * 4096 (below 1 MB), so the code is copied to a low page.
+// Real mode -> Protected mode -> Long mode (using temporary page tables) -> jump to the kernel (ap_entry)
+//
+// The code doesn't know its address, EBX/RBX holds the physical address of the trampoline page and it's used as base.
+// Parameters (TrampolineParams) are filled by BSP before sending SIPI.
+
+use crate::memory_management::PAGE_SIZE;
+use core::ptr::addr_of;
+use x86_64::VirtAddr;
+
+core::arch::global_asm!(
+    r#"
+.pushsection .rodata.ap_trampoline, "a"
+.code16
+.global ap_trampoline_start
+ap_trampoline_start:
+    cli
+    cld
+    # Executed at CS:0, DS = CS
+    mov %cs, %ax
+    mov %ax, %ds
+    # Physical address of the trampoline
+    xor %ebx, %ebx
+    mov %ax, %bx
+    shl $4, %ebx
+
+    lgdtl ap_trampoline_gdt_pointer - ap_trampoline_start
+    # Protection Enable
+    mov %cr0, %eax
+    or $1, %eax
+    mov %eax, %cr0
+    ljmpl *ap_trampoline_protected_mode_far_pointer - ap_trampoline_start
+
+.code32
+.global ap_trampoline_protected_mode
+ap_trampoline_protected_mode:
+    mov $0x10, %ax
+    mov %ax, %ds
+    mov %ax, %es
+    mov %ax, %ss
+    # CR4 with PAE
+    mov ap_trampoline_cr4 - ap_trampoline_start(%ebx), %eax
+    mov %eax, %cr4
+    # Temporary PML4 (must be below 4 GB)
+    mov ap_trampoline_temporary_cr3 - ap_trampoline_start(%ebx), %eax
+    mov %eax, %cr3
+    # EFER with LME and NXE
+    mov $0xC0000080, %ecx
+    mov ap_trampoline_efer - ap_trampoline_start(%ebx), %eax
+    mov ap_trampoline_efer + 4 - ap_trampoline_start(%ebx), %edx
+    wrmsr
+    # CR0 with PG
+    mov ap_trampoline_cr0 - ap_trampoline_start(%ebx), %eax
+    mov %eax, %cr0
+    ljmpl *ap_trampoline_long_mode_far_pointer - ap_trampoline_start(%ebx)
+
+.code64
+.global ap_trampoline_long_mode
+ap_trampoline_long_mode:
+    # Upper half of RBX is undefined
+    mov %ebx, %ebx
+    mov ap_trampoline_stack_top - ap_trampoline_start(%rbx), %rsp
+    mov ap_trampoline_per_cpu - ap_trampoline_start(%rbx), %rdi
+    mov ap_trampoline_kernel_cr3 - ap_trampoline_start(%rbx), %rsi
+    mov ap_trampoline_entry - ap_trampoline_start(%rbx), %rax
+    xor %ebp, %ebp
+    call *%rax
+    ud2
+
+.balign 8
+.global ap_trampoline_gdt
+ap_trampoline_gdt:
+    .quad 0
+    # 0x08 32-bit code
+    .quad 0x00CF9A000000FFFF
+    # 0x10 32-bit data
+    .quad 0x00CF92000000FFFF
+    # 0x18 64-bit code
+    .quad 0x00AF9A000000FFFF
+.global ap_trampoline_gdt_end
+ap_trampoline_gdt_end:
+
+# TrampolineParams
+.global ap_trampoline_params
+ap_trampoline_params:
+ap_trampoline_gdt_pointer:
+    .word 0
+    .long 0
+ap_trampoline_protected_mode_far_pointer:
+    .long 0
+    .word 0
+ap_trampoline_long_mode_far_pointer:
+    .long 0
+    .word 0
+ap_trampoline_temporary_cr3:
+    .long 0
+ap_trampoline_cr0:
+    .long 0
+ap_trampoline_cr4:
+    .long 0
+ap_trampoline_efer:
+    .quad 0
+ap_trampoline_kernel_cr3:
+    .quad 0
+ap_trampoline_stack_top:
+    .quad 0
+ap_trampoline_per_cpu:
+    .quad 0
+ap_trampoline_entry:
+    .quad 0
+.global ap_trampoline_end
+ap_trampoline_end:
+.popsection
+"#,
+    options(att_syntax)
+);
+
+extern "C" {
+    static ap_trampoline_start: u8;
+    static ap_trampoline_protected_mode: u8;
+    static ap_trampoline_long_mode: u8;
+    static ap_trampoline_gdt: u8;
+    static ap_trampoline_gdt_end: u8;
+    static ap_trampoline_params: u8;
+    static ap_trampoline_end: u8;
+}
+
+/// Must match parameters layout in the assembly
+#[repr(C, packed)]
+pub struct TrampolineParams {
+    gdt_limit: u16,
+    gdt_base: u32,
+    protected_mode_entry_offset: u32,
+    protected_mode_entry_selector: u16,
+    long_mode_entry_offset: u32,
+    long_mode_entry_selector: u16,
+    /// Physical address of the temporary PML4, must be below 4 GB
+    pub temporary_cr3: u32,
+    pub cr0: u32,
+    pub cr4: u32,
+    pub efer: u64,
+    /// Physical address of the kernel PML4, loaded by ap_entry
+    pub kernel_cr3: u64,
+    pub stack_top: u64,
+    pub per_cpu: u64,
+    /// extern "sysv64" fn(per_cpu: *mut PerCpu, kernel_cr3: u64) -> !
+    pub entry: u64,
+}
+
+/// Offset of the symbol from the trampoline start
+#[inline]
+fn offset_of_symbol(symbol: *const u8) -> usize {
+    symbol as usize - unsafe { addr_of!(ap_trampoline_start) } as usize
+}
+
+/// Copies trampoline to the low page and fills the addresses depending on the page
+///
+/// Returns the parameters located in the copied trampoline
+///
+/// # Safety
+/// trampoline_phys_addr must be a free page below 1 MB
+pub unsafe fn install(trampoline_phys_addr: u64) -> &'static mut TrampolineParams {
+    assert!(trampoline_phys_addr % PAGE_SIZE as u64 == 0);
+    assert!(
+        trampoline_phys_addr < 0x100000,
+        "Trampoline must be below 1 MB"
+    );
+
+    unsafe {
+        let trampoline_size = offset_of_symbol(addr_of!(ap_trampoline_end));
+        assert!(trampoline_size <= PAGE_SIZE, "Trampoline is too big");
+
+        let trampoline_virt_addr: VirtAddr =
+            crate::memory_management::virtual_memory_manager::virt_addr_in_cpmm_from_phys_addr(
+                x86_64::PhysAddr::new(trampoline_phys_addr),
+            );
+        core::ptr::copy_nonoverlapping(
+            addr_of!(ap_trampoline_start),
+            trampoline_virt_addr.as_mut_ptr::<u8>(),
+            trampoline_size,
+        );
+
+        let params = &mut *(trampoline_virt_addr.as_mut_ptr::<u8>())
+            .add(offset_of_symbol(addr_of!(ap_trampoline_params)))
+            .cast::<TrampolineParams>();
+        let gdt_offset = offset_of_symbol(addr_of!(ap_trampoline_gdt));
+        let gdt_end_offset = offset_of_symbol(addr_of!(ap_trampoline_gdt_end));
+        params.gdt_limit = (gdt_end_offset - gdt_offset - 1) as u16;
+        params.gdt_base = (trampoline_phys_addr as usize + gdt_offset) as u32;
+        params.protected_mode_entry_offset = (trampoline_phys_addr as usize
+            + offset_of_symbol(addr_of!(ap_trampoline_protected_mode)))
+            as u32;
+        params.protected_mode_entry_selector = 0x08;
+        params.long_mode_entry_offset = (trampoline_phys_addr as usize
+            + offset_of_symbol(addr_of!(ap_trampoline_long_mode)))
+            as u32;
+        params.long_mode_entry_selector = 0x18;
+        params
+    }
+}
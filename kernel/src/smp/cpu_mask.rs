@@ -0,0 +1,73 @@
+// Set of CPUs by cpu_index
+
+use super::MAX_CPUS;
+use core::sync::atomic::{AtomicU64, Ordering};
+
+const WORDS: usize = MAX_CPUS / 64;
+
+#[derive(Clone, Copy, Debug, Default, PartialEq)]
+pub struct CpuMask {
+    words: [u64; WORDS],
+}
+
+impl CpuMask {
+    pub const fn new() -> Self {
+        Self { words: [0; WORDS] }
+    }
+
+    /// Snapshot of a mask updated atomically by CPUs
+    pub fn load(atomic_words: &[AtomicU64; WORDS]) -> Self {
+        let mut mask = Self::new();
+        for (word, atomic_word) in mask.words.iter_mut().zip(atomic_words) {
+            *word = atomic_word.load(Ordering::SeqCst);
+        }
+        mask
+    }
+
+    #[inline]
+    pub fn set(&mut self, cpu_index: usize) {
+        self.words[cpu_index / 64] |= 1 << (cpu_index % 64);
+    }
+
+    #[inline]
+    pub fn clear(&mut self, cpu_index: usize) {
+        self.words[cpu_index / 64] &= !(1 << (cpu_index % 64));
+    }
+
+    #[inline]
+    pub fn contains(&self, cpu_index: usize) -> bool {
+        self.words[cpu_index / 64] & (1 << (cpu_index % 64)) != 0
+    }
+
+    #[inline]
+    pub fn is_empty(&self) -> bool {
+        self.words.iter().all(|&word| word == 0)
+    }
+
+    /// CPUs in both masks
+    pub fn and(&self, other: &CpuMask) -> CpuMask {
+        let mut mask = *self;
+        for (word, other_word) in mask.words.iter_mut().zip(other.words) {
+            *word &= other_word;
+        }
+        mask
+    }
+
+    /// Indices of the CPUs in ascending order
+    pub fn iter(&self) -> impl Iterator<Item = usize> + '_ {
+        self.words
+            .iter()
+            .enumerate()
+            .flat_map(|(word_index, &word)| {
+                let mut word = word;
+                core::iter::from_fn(move || {
+                    if word == 0 {
+                        return None;
+                    }
+                    let bit = word.trailing_zeros() as usize;
+                    word &= word - 1;
+                    Some(word_index * 64 + bit)
+                })
+            })
+    }
+}
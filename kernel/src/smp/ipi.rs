@@ -0,0 +1,176 @@
+// Inter-processor interrupts
+//
+// Call-function IPIs run a function on other CPUs in their interrupt context, the caller waits until all of them finish.
+// Each CPU has a queue of call requests, the IPI is sent only when the queue was empty, so requests that come
+// before the target handles them share one IPI.
+// The caller waits with interrupts disabled, so it isn't moved to another CPU, and runs requests queued to its own CPU,
+// so two CPUs calling each other don't deadlock.
+//
+// IPIs are sent only to online CPUs, a CPU becomes online when its Local APIC is enabled and its IPI handlers are set.
+
+use super::cpu_mask::CpuMask;
+use super::{per_cpu, MAX_CPUS};
+use crate::interrupts::apic;
+use crate::interrupts::idt::{CALL_FUNCTION_IPI_IDT_VECTOR, RESCHEDULE_IPI_IDT_VECTOR};
+use crate::interrupts::irq::{self, IrqReturn};
+use crate::sync::Mutex;
+use core::sync::atomic::{AtomicU64, AtomicUsize, Ordering};
+use tinyvec::ArrayVec;
+
+/// Max queued call requests of a CPU, callers wait for free space
+const CALL_QUEUE_SIZE: usize = 32;
+
+/// Queued call requests of each CPU, pointers to CallRequest
+static CALL_QUEUES: [Mutex<ArrayVec<[usize; CALL_QUEUE_SIZE]>>; MAX_CPUS] =
+    [const { Mutex::new(ArrayVec::from_array_empty([0; CALL_QUEUE_SIZE])) }; MAX_CPUS];
+
+/// CPUs that handle IPIs
+static ONLINE_CPUS: [AtomicU64; MAX_CPUS / 64] = [const { AtomicU64::new(0) }; MAX_CPUS / 64];
+
+/// Function called on other CPUs with interrupts disabled
+///
+/// Must be short and must not block, it runs in interrupt context
+pub type CallFunction = fn(usize);
+
+/// Call request on the caller's stack, it lives until all targets finish
+struct CallRequest {
+    function: CallFunction,
+    data: usize,
+    /// Targets that haven't finished yet
+    remaining: AtomicUsize,
+}
+
+/// Registers IPI handlers, the bootstrap processor becomes online
+pub fn init() {
+    irq::register_irq_handler(CALL_FUNCTION_IPI_IDT_VECTOR, call_function_ipi_handler, 0)
+        .expect("Failed to register call function IPI handler");
+    init_cpu();
+}
+
+/// The current CPU becomes online
+///
+/// Its Local APIC must be initialized, interrupts may be still disabled, IPIs wait for them
+pub fn init_cpu() {
+    let cpu_index = per_cpu::cpu_index();
+    ONLINE_CPUS[cpu_index / 64].fetch_or(1 << (cpu_index % 64), Ordering::SeqCst);
+}
+
+/// CPUs that handle IPIs
+#[inline]
+pub fn online_cpus() -> CpuMask {
+    CpuMask::load(&ONLINE_CPUS)
+}
+
+/// Sends reschedule IPI to the CPU, the current CPU may send it to itself
+pub fn send_reschedule(cpu_index: usize) {
+    send(cpu_index, RESCHEDULE_IPI_IDT_VECTOR);
+}
+
+/// Runs the function on the CPU and waits until it finishes
+///
+/// The current CPU calls it directly with interrupts disabled
+pub fn call_function_single(cpu_index: usize, function: CallFunction, data: usize) {
+    x86_64::instructions::interrupts::without_interrupts(|| {
+        if cpu_index == per_cpu::cpu_index() {
+            function(data);
+            return;
+        }
+        let mut cpus = CpuMask::new();
+        cpus.set(cpu_index);
+        call_function_many(&cpus, function, data);
+    });
+}
+
+/// Runs the function on the CPUs except the current one, and waits until all of them finish
+///
+/// Offline CPUs are skipped.
+/// Must not be called while holding a lock that the targets may wait for with interrupts disabled.
+pub fn call_function_many(cpus: &CpuMask, function: CallFunction, data: usize) {
+    x86_64::instructions::interrupts::without_interrupts(|| {
+        call_function_many_locked(cpus, function, data)
+    });
+}
+
+/// Runs the function on all online CPUs including the current one, and waits until all of them finish
+pub fn call_function_all(function: CallFunction, data: usize) {
+    x86_64::instructions::interrupts::without_interrupts(|| {
+        call_function_many_locked(&online_cpus(), function, data);
+        function(data);
+    });
+}
+
+/// Interrupts must be disabled
+fn call_function_many_locked(cpus: &CpuMask, function: CallFunction, data: usize) {
+    let mut targets = cpus.and(&online_cpus());
+    let current_cpu_index = per_cpu::cpu_index();
+    targets.clear(current_cpu_index);
+    if targets.is_empty() {
+        return;
+    }
+
+    let request = CallRequest {
+        function,
+        data,
+        remaining: AtomicUsize::new(targets.iter().count()),
+    };
+    for cpu_index in targets.iter() {
+        loop {
+            let queued = {
+                let mut queue = CALL_QUEUES[cpu_index].lock();
+                let was_empty = queue.is_empty();
+                queue
+                    .try_push(&request as *const CallRequest as usize)
+                    .is_none()
+                    .then_some(was_empty)
+            };
+            match queued {
+                Some(was_empty) => {
+                    if was_empty {
+                        send(cpu_index, CALL_FUNCTION_IPI_IDT_VECTOR);
+                    }
+                    break;
+                }
+                None => run_call_requests(current_cpu_index),
+            }
+        }
+    }
+
+    // The request is on the stack, it must not be dropped until all targets finish
+    while request.remaining.load(Ordering::Acquire) != 0 {
+        run_call_requests(current_cpu_index);
+        core::hint::spin_loop();
+    }
+}
+
+/// Runs call requests queued to the current CPU
+///
+/// For waits that may happen with disabled interrupts, while other CPU waits for this one
+pub fn run_pending_calls() {
+    x86_64::instructions::interrupts::without_interrupts(|| {
+        run_call_requests(per_cpu::cpu_index());
+    });
+}
+
+fn send(cpu_index: usize, vector: u8) {
+    let per_cpu = per_cpu::get(cpu_index).expect("Sending IPI to CPU that isn't started");
+    let local_apic_id = unsafe { per_cpu.as_ref().local_apic_id };
+    apic::send_fixed_ipi(local_apic_id, vector);
+}
+
+fn call_function_ipi_handler(_: usize) -> IrqReturn {
+    run_call_requests(per_cpu::cpu_index());
+    IrqReturn::Handled
+}
+
+/// Runs call requests queued to the CPU
+///
+/// Interrupts must be disabled
+fn run_call_requests(cpu_index: usize) {
+    let requests = core::mem::take(&mut *CALL_QUEUES[cpu_index].lock());
+    for &request in requests.iter() {
+        let request = unsafe { &*(request as *const CallRequest) };
+        (request.function)(request.data);
+        // The caller may drop the request right after this
+        request.remaining.fetch_sub(1, Ordering::Release);
+    }
+}
@@ -0,0 +1,165 @@
+// Per-CPU data
+//
+// Each CPU has its own PerCpu block, GS base of the CPU points to it.
+// The first field of PerCpu is a pointer to the block itself, so the block can be found with a single gs:[0] read.
+
+use super::MAX_CPUS;
+use crate::gdt::CpuDescriptorTables;
+use crate::interrupts::irq::{CpuIrqState, CpuVectors};
+use crate::memory_management::memory_stats::CpuMemoryStats;
+use crate::memory_management::physical_memory_manager::PageFrameCaches;
+use crate::memory_management::virtual_memory_manager::address_space::CpuAsidState;
+use crate::scheduler::CpuScheduler;
+use crate::serial_debug::log_ring::LogRing;
+use crate::timers::lapic_timer::CpuTimerQueue;
+use core::ptr::{null_mut, NonNull};
+use core::sync::atomic::{AtomicPtr, AtomicUsize, Ordering};
+use x86_64::VirtAddr;
+
+/// PerCpu block of the bootstrap processor
+///
+/// It's static because BSP needs it before memory manager initialization
+static mut BSP_PER_CPU: PerCpu = PerCpu::new(0);
+
+/// PerCpu blocks of all started CPUs, index is cpu_index
+static CPUS: [AtomicPtr<PerCpu>; MAX_CPUS] = [const { AtomicPtr::new(null_mut()) }; MAX_CPUS];
+
+/// Number of registered PerCpu blocks
+static CPUS_NUMBER: AtomicUsize = AtomicUsize::new(0);
+
+#[repr(C)]
+pub struct PerCpu {
+    /// Pointer to this block
+    ///
+    /// ## Must be the first field (read through gs:[0])
+    self_ptr: *mut PerCpu,
+    /// Sequential CPU index, BSP is 0
+    pub cpu_index: usize,
+    /// Local APIC ID
+    pub local_apic_id: u32,
+    /// ACPI Processor UID
+    pub processor_uid: u32,
+    /// NUMA node of the CPU
+    pub numa_node: usize,
+    /// Current, idle and time slice state of the scheduler
+    pub scheduler: CpuScheduler,
+    /// Interrupt nesting and raised softirqs
+    pub irq_state: CpuIrqState,
+    /// Dynamic vectors allocated on this CPU and their handlers
+    pub irq_vectors: CpuVectors,
+    /// GDT and TSS
+    pub descriptor_tables: CpuDescriptorTables,
+    /// Physical memory manager's page frame caches
+    pub page_frame_caches: PageFrameCaches,
+    /// Counters of memory allocators
+    pub memory_stats: CpuMemoryStats,
+    /// PCIDs given on this CPU and the loaded address space
+    pub asid_state: CpuAsidState,
+    /// Log records waiting for the serial logger
+    pub log_ring: LogRing,
+    /// Local APIC timers of this CPU
+    pub timer_queue: CpuTimerQueue,
+}
+
+impl PerCpu {
+    pub const fn new(cpu_index: usize) -> Self {
+        Self {
+            self_ptr: null_mut(),
+            cpu_index,
+            local_apic_id: 0,
+            processor_uid: 0,
+            numa_node: 0,
+            scheduler: CpuScheduler::new(),
+            irq_state: CpuIrqState::new(),
+            irq_vectors: CpuVectors::new(),
+            descriptor_tables: CpuDescriptorTables::new(),
+            page_frame_caches: PageFrameCaches::new(),
+            memory_stats: CpuMemoryStats::new(),
+            asid_state: CpuAsidState::new(),
+            log_ring: LogRing::new(),
+            timer_queue: CpuTimerQueue::new(),
+        }
+    }
+}
+
+/// Sets GS base of the bootstrap processor to its PerCpu block
+///
+/// Must be called before any use of per-CPU data
+pub fn init_bsp() {
+    #[allow(static_mut_refs)]
+    unsafe {
+        let per_cpu = &raw mut BSP_PER_CPU;
+        register(per_cpu);
+        load(per_cpu);
+    }
+}
+
+/// Registers PerCpu block of application processor
+///
+/// # Safety
+/// per_cpu must point to initialized 'static PerCpu with unique cpu_index
+pub unsafe fn register(per_cpu: *mut PerCpu) {
+    unsafe {
+        (*per_cpu).self_ptr = per_cpu;
+        let cpu_index = (*per_cpu).cpu_index;
+        assert!(cpu_index < MAX_CPUS, "Too many CPUs");
+        let previous = CPUS[cpu_index].swap(per_cpu, Ordering::AcqRel);
+        assert!(previous.is_null(), "PerCpu block registered twice");
+    }
+    CPUS_NUMBER.fetch_add(1, Ordering::AcqRel);
+}
+
+/// Sets GS base of the current CPU to the PerCpu block
+///
+/// # Safety
+/// per_cpu must be registered
+pub unsafe fn load(per_cpu: *mut PerCpu) {
+    unsafe {
+        debug_assert_eq!((*per_cpu).self_ptr, per_cpu, "PerCpu block not registered");
+        x86_64::registers::model_specific::GsBase::write(VirtAddr::from_ptr(per_cpu));
+    }
+}
+
+/// Returns PerCpu block of the current CPU
+///
+/// # Safety
+/// Interrupts must be disabled while the reference is used if an interrupt handler may touch the same data
+#[inline]
+pub unsafe fn current() -> &'static mut PerCpu {
+    let per_cpu: *mut PerCpu;
+    unsafe {
+        core::arch::asm!(
+            "mov {}, gs:[0]",
+            out(reg) per_cpu,
+            options(nostack, preserves_flags, readonly)
+        );
+        &mut *per_cpu
+    }
+}
+
+/// Returns index of the current CPU
+#[inline]
+pub fn cpu_index() -> usize {
+    let cpu_index: usize;
+    unsafe {
+        core::arch::asm!(
+            "mov {}, gs:[{offset}]",
+            out(reg) cpu_index,
+            offset = const core::mem::offset_of!(PerCpu, cpu_index),
+            options(nostack, preserves_flags, readonly)
+        );
+    }
+    cpu_index
+}
+
+/// Returns PerCpu block of the CPU by index
+#[inline]
+pub fn get(cpu_index: usize) -> Option<NonNull<PerCpu>> {
+    NonNull::new(CPUS.get(cpu_index)?.load(Ordering::Acquire))
+}
+
+/// Number of registered CPUs
+#[inline]
+pub fn cpus_number() -> usize {
+    CPUS_NUMBER.load(Ordering::Acquire)
+}
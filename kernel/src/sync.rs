@@ -0,0 +1,85 @@
+// Spin lock that disables preemption while it is held
+//
+// The scheduler preempts tasks when the outermost interrupt exits. A task preempted while holding a lock
+// would make other tasks of its CPU spin on the lock, forever if they spin with interrupts disabled.
+// So the guard raises the preempt count of the CPU, and a preemption requested meanwhile happens on unlock.
+//
+// Preemption is disabled before waiting for the lock, so the waiter isn't preempted between taking it and raising
+// the count.
+//
+// Tasks must not block or yield while holding a lock.
+
+use crate::scheduler;
+use core::mem::ManuallyDrop;
+use core::ops::{Deref, DerefMut};
+
+/// [spin::Mutex] that disables preemption on its CPU while locked
+pub struct Mutex<T: ?Sized> {
+    inner: spin::Mutex<T>,
+}
+
+/// Unlocks the mutex and enables preemption when dropped
+pub struct MutexGuard<'a, T: ?Sized + 'a> {
+    guard: ManuallyDrop<spin::MutexGuard<'a, T>>,
+}
+
+impl<T> Mutex<T> {
+    #[inline(always)]
+    pub const fn new(value: T) -> Self {
+        Self {
+            inner: spin::Mutex::new(value),
+        }
+    }
+}
+
+impl<T: ?Sized> Mutex<T> {
+    #[inline]
+    pub fn lock(&self) -> MutexGuard<'_, T> {
+        scheduler::preempt_disable();
+        MutexGuard {
+            guard: ManuallyDrop::new(self.inner.lock()),
+        }
+    }
+
+    /// Returns None if the mutex is locked
+    #[inline]
+    pub fn try_lock(&self) -> Option<MutexGuard<'_, T>> {
+        scheduler::preempt_disable();
+        match self.inner.try_lock() {
+            Some(guard) => Some(MutexGuard {
+                guard: ManuallyDrop::new(guard),
+            }),
+            None => {
+                scheduler::preempt_enable();
+                None
+            }
+        }
+    }
+}
+
+impl<T: ?Sized> Deref for MutexGuard<'_, T> {
+    type Target = T;
+
+    #[inline(always)]
+    fn deref(&self) -> &T {
+        &self.guard
+    }
+}
+
+impl<T: ?Sized> DerefMut for MutexGuard<'_, T> {
+    #[inline(always)]
+    fn deref_mut(&mut self) -> &mut T {
+        &mut self.guard
+    }
+}
+
+impl<T: ?Sized> Drop for MutexGuard<'_, T> {
+    #[inline]
+    fn drop(&mut self) {
+        // Unlocked first, the task may be preempted by preempt_enable
+        unsafe {
+            ManuallyDrop::drop(&mut self.guard);
+        }
+        scheduler::preempt_enable();
+    }
+}
@@ -1,10 +1,14 @@
 use crate::acpi::ACPI_TABLES;
+use crate::boot_profile;
 use acpi_lib::hpet::HpetTable;
 use acpi_lib::{AcpiError, AcpiResult};
+use core::time::Duration;
 use spin::Once;
 
 pub mod hpet;
+pub mod lapic_timer;
 pub mod pit;
+pub mod tsc;
 
 enum TimerName {
     PIT,
@@ -23,31 +27,81 @@ enum TimerName {
 // 2. HPET - To calibrate ITSC and Local APIC Timer, as a system-wide timer
 // (to time and measure time or generate interrupts in one-shot mode) if ITSC is not available.
 // 3. Invariant TSC - As a system-wide timer to time and measure time.
-// 4. Local APIC Timer - To generate scheduler interrupts for each core.
+// 4. Local APIC Timer - Tickless per-CPU timer engine (TSC-deadline or one-shot mode).
 
-/// Inits PIT, HPET, Invariant TSC and bootstrap processor's Local APIC Timer
+/// Inits HPET, PIT if HPET is not available, Invariant TSC and bootstrap processor's Local APIC Timer
+///
+/// Local APIC must be inited
 pub fn init() {
     x86_64::instructions::interrupts::disable();
 
+    // Detect and init HPET
+    {
+        let _phase = boot_profile::phase("hpet::init");
+        hpet::init();
+    }
+
     // PIT is only used in the role of calibration timer if HPET is not available
-    pit::init(1);
+    if !hpet::is_supported() {
+        let _phase = boot_profile::phase("pit::init");
+        pit::init(1);
+    }
 
-    // Detect and init HPET
-    hpet::init();
-
-    // Check Invariant TSC support using cpuid (works on Intel and AMD)
-    // TODO: add ITSC
-    let cpuid = raw_cpuid::CpuId::new();
-    let has_invariant_tsc = cpuid
-        .get_advanced_power_mgmt_info()
-        .expect("Failed to get cpuid advanced power management info")
-        .has_invariant_tsc();
-    match has_invariant_tsc {
-        true => {
-            log::info!("Invariant TSC supported");
-        }
-        false => {
-            log::info!("Invariant TSC not supported");
+    // Detect and calibrate Invariant TSC
+    {
+        let _phase = boot_profile::phase("tsc::init (calibration)");
+        tsc::init();
+    }
+
+    // Calibrate Local APIC Timer against the clocksource
+    let _phase = boot_profile::phase("lapic_timer::init (calibration)");
+    lapic_timer::init();
+}
+
+/// Stops PIT if it isn't needed as the clocksource anymore
+///
+/// Called after SMP init, TSC may be found unsynchronized during it
+pub fn stop_unused_pit() {
+    if !hpet::is_supported() && tsc::is_used() {
+        log::info!("Stop PIT");
+        pit::stop();
+    }
+}
+
+/// Time since boot of the used clocksource
+///
+/// Invariant TSC (single rdtsc), or HPET, or PIT (milliseconds)
+#[inline]
+pub fn now() -> Duration {
+    if tsc::is_used() {
+        Duration::from_nanos(tsc::now())
+    } else if hpet::is_supported() {
+        hpet::get_current_ticks_as_duration()
+    } else {
+        Duration::from_nanos(pit::get_ticks_counter() * pit::tick_period_in_nanoseconds())
+    }
+}
+
+/// Busy-waits using Invariant TSC, or HPET, or PIT
+///
+/// PIT ticks are counted by IRQ0 handler, so interrupts are enabled while waiting on PIT
+pub fn sleep(duration: Duration) {
+    if tsc::is_used() {
+        let end = tsc::now() + duration.as_nanos() as u64;
+        while tsc::now() < end {
+            core::hint::spin_loop();
         }
+        return;
+    }
+    if hpet::is_supported() {
+        hpet::sleep(duration);
+        return;
+    }
+
+    let interrupts_were_enabled = x86_64::instructions::interrupts::are_enabled();
+    x86_64::instructions::interrupts::enable();
+    pit::sleep(duration.as_millis().max(1) as u32);
+    if !interrupts_were_enabled {
+        x86_64::instructions::interrupts::disable();
     }
 }
@@ -0,0 +1,464 @@
+// Local APIC timer, tickless per-CPU timer engine
+//
+// Every CPU has its own timer queue. The Local APIC timer is armed only for the nearest expiry of the queue,
+// and it's not armed at all when the queue is empty (dynamic tick), so idle CPUs are not woken up periodically.
+// TSC-deadline mode is used if supported, otherwise one-shot mode with frequency calibrated against timers::now().
+//
+// A timer may fire anywhere in [deadline, deadline + slack] (like Linux hrtimer soft and hard expiry).
+// The queue is a min-heap by deadline + slack, the timer is armed for the top, and the interrupt runs
+// all timers from the top whose deadline has already passed, so timers with overlapping windows share one interrupt.
+// The queue has fixed capacity in the CPU's PerCpu block, timers are added with interrupts disabled (by the scheduler
+// and timer callbacks), so adding never allocates.
+use super::tsc;
+use crate::interrupts::apic::{self, TimerMode};
+use crate::interrupts::idt::LOCAL_APIC_TIMER_IDT_VECTOR;
+use crate::interrupts::irq::{self, IrqReturn};
+use crate::smp::per_cpu;
+use crate::sync::{Mutex, MutexGuard};
+use core::sync::atomic::{AtomicU64, Ordering};
+use core::time::Duration;
+use raw_cpuid::CpuId;
+use spin::Once;
+use tinyvec::ArrayVec;
+use x86_64::registers::model_specific::Msr;
+
+/// Duration of one calibration (one-shot mode)
+const CALIBRATION_DURATION: Duration = Duration::from_millis(10);
+
+/// Number of calibrations, median is used
+const CALIBRATIONS_NUMBER: usize = 3;
+
+/// Divider of the timer in one-shot mode
+///
+/// With 1 GHz bus the max one-shot interval is ~68 s, longer intervals are armed in several steps
+const TIMER_DIVIDER: u32 = 16;
+
+const IA32_TSC_DEADLINE_MSR: u32 = 0x6E0;
+
+/// Not in the heap
+const NOT_QUEUED: usize = usize::MAX;
+
+/// Capacity of the timer queue of one CPU
+const MAX_TIMERS: usize = 64;
+
+static TIMER_MODE: Once<TimerMode> = Once::new();
+
+/// Timer ticks per second after the divider, one-shot mode only
+static FREQUENCY: AtomicU64 = AtomicU64::new(0);
+
+/// Called in the timer interrupt on the CPU of the timer, with the data given to [add_timer]
+///
+/// Longer work should be deferred to a softirq
+pub type TimerCallback = fn(usize);
+
+#[derive(Debug)]
+pub enum TimerError {
+    /// All MAX_TIMERS timers of the CPU are added
+    QueueFull,
+}
+
+/// Handle of the added timer, see [cancel_timer]
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub struct TimerId {
+    cpu_index: u32,
+    slot: u32,
+    generation: u32,
+}
+
+struct Timer {
+    /// Nanoseconds of timers::now(), the timer doesn't fire earlier
+    deadline: u64,
+    /// deadline + slack, the timer doesn't fire later (plus interrupt latency)
+    expiry: u64,
+    /// Order of timers with the same expiry and protection against timers added by callbacks
+    sequence: u64,
+    callback: TimerCallback,
+    data: usize,
+}
+
+struct Slot {
+    /// Incremented when the slot is freed, so old TimerId doesn't cancel a new timer
+    generation: u32,
+    /// Index in the heap, NOT_QUEUED if the slot is free
+    heap_index: usize,
+    timer: Option<Timer>,
+}
+
+/// Indexed min-heap of timers
+///
+/// Timers are stored in slots, the heap contains slot indices, so cancel is O(log n)
+struct TimerQueue {
+    slots: ArrayVec<[Slot; MAX_TIMERS]>,
+    free_slots: ArrayVec<[u32; MAX_TIMERS]>,
+    heap: ArrayVec<[u32; MAX_TIMERS]>,
+    next_sequence: u64,
+    /// Expiry the hardware is armed for
+    armed_expiry: Option<u64>,
+}
+
+/// Timer queue of a CPU, in its PerCpu block
+pub struct CpuTimerQueue {
+    queue: Mutex<TimerQueue>,
+}
+
+/// Chooses the timer mode, calibrates and inits BSP's Local APIC timer
+///
+/// Local APIC and clocksource must be inited
+pub fn init() {
+    let has_tsc_deadline = CpuId::new()
+        .get_feature_info()
+        .expect("Failed to get CPUID features!")
+        .has_tsc_deadline();
+    // Deadlines are converted to the CPU's own TSC relative to now, so TSC warp between CPUs doesn't matter,
+    // but TSC frequency must be calibrated
+    let timer_mode = if has_tsc_deadline && tsc::is_used() {
+        TimerMode::TscDeadline
+    } else {
+        TimerMode::OneShot
+    };
+    TIMER_MODE.call_once(|| timer_mode);
+    irq::register_irq_handler(LOCAL_APIC_TIMER_IDT_VECTOR, interrupt_handler, 0)
+        .expect("Failed to register Local APIC timer handler");
+
+    if timer_mode == TimerMode::OneShot {
+        let mut frequencies = [0u64; CALIBRATIONS_NUMBER];
+        for frequency in frequencies.iter_mut() {
+            *frequency = calibrate();
+        }
+        frequencies.sort_unstable();
+        let frequency = frequencies[CALIBRATIONS_NUMBER / 2];
+        assert!(frequency != 0, "Local APIC timer calibration failed");
+        FREQUENCY.store(frequency, Ordering::Release);
+        log::info!(
+            "Local APIC timer in one-shot mode: {}.{:03} MHz",
+            frequency / 1_000_000,
+            frequency / 1_000 % 1_000
+        );
+    } else {
+        log::info!("Local APIC timer in TSC-deadline mode");
+    }
+
+    init_cpu();
+}
+
+/// Inits the current CPU's Local APIC timer, it stays disarmed until a timer is added
+///
+/// BSP must be inited by [init]
+pub fn init_cpu() {
+    let timer_mode = *TIMER_MODE.get().expect("Local APIC timer mode not set");
+    apic::set_timer_initial_count(0);
+    apic::set_timer_divider(TIMER_DIVIDER);
+    apic::fill_lvt_timer_register(timer_mode, false);
+}
+
+/// Adds timer to the current CPU, callback is called after delay, but not later than delay + slack
+///
+/// Bigger slack allows to fire several timers with one interrupt
+pub fn add_timer(
+    delay: Duration,
+    slack: Duration,
+    callback: TimerCallback,
+    data: usize,
+) -> Result<TimerId, TimerError> {
+    x86_64::instructions::interrupts::without_interrupts(|| {
+        let cpu_index = per_cpu::cpu_index();
+        let deadline = now().saturating_add(delay.as_nanos() as u64);
+        let expiry = deadline.saturating_add(slack.as_nanos() as u64);
+
+        let mut queue = timer_queue(cpu_index);
+        let sequence = queue.next_sequence;
+        let (slot, generation) = queue
+            .insert(Timer {
+                deadline,
+                expiry,
+                sequence,
+                callback,
+                data,
+            })
+            .ok_or(TimerError::QueueFull)?;
+        queue.next_sequence += 1;
+        queue.rearm();
+
+        Ok(TimerId {
+            cpu_index: cpu_index as u32,
+            slot,
+            generation,
+        })
+    })
+}
+
+/// Cancels the timer, it can be from other CPU
+///
+/// Returns false if the timer has already fired or been canceled
+pub fn cancel_timer(timer_id: TimerId) -> bool {
+    x86_64::instructions::interrupts::without_interrupts(|| {
+        let cpu_index = timer_id.cpu_index as usize;
+        let mut queue = timer_queue(cpu_index);
+        let canceled = queue.remove(timer_id.slot, timer_id.generation).is_some();
+        // Other CPU's timer stays armed, its interrupt finds nothing and rearms
+        if canceled && cpu_index == per_cpu::cpu_index() {
+            queue.rearm();
+        }
+        canceled
+    })
+}
+
+/// Local APIC timer interrupt handler
+///
+/// Runs expired timers of the current CPU and arms the timer for the next one
+fn interrupt_handler(_: usize) -> IrqReturn {
+    let cpu_index = per_cpu::cpu_index();
+    let max_sequence = {
+        let mut queue = timer_queue(cpu_index);
+        // Fired, or it's an early interrupt of a long one-shot interval
+        queue.armed_expiry = None;
+        queue.next_sequence
+    };
+    let now = now();
+
+    // Callbacks may add and cancel timers, so the lock isn't held while they run
+    loop {
+        let timer = timer_queue(cpu_index).pop_expired(now, max_sequence);
+        let Some(timer) = timer else {
+            break;
+        };
+        (timer.callback)(timer.data);
+    }
+
+    timer_queue(cpu_index).rearm();
+    IrqReturn::Handled
+}
+
+/// Locks the timer queue of the CPU
+#[inline]
+fn timer_queue(cpu_index: usize) -> MutexGuard<'static, TimerQueue> {
+    let per_cpu = per_cpu::get(cpu_index).expect("CPU is not started");
+    unsafe { per_cpu.as_ref().timer_queue.queue.lock() }
+}
+
+impl CpuTimerQueue {
+    pub const fn new() -> Self {
+        Self {
+            queue: Mutex::new(TimerQueue::new()),
+        }
+    }
+}
+
+impl Slot {
+    const EMPTY: Self = Self {
+        generation: 0,
+        heap_index: NOT_QUEUED,
+        timer: None,
+    };
+}
+
+impl Default for Slot {
+    #[inline]
+    fn default() -> Self {
+        Self::EMPTY
+    }
+}
+
+impl TimerQueue {
+    const fn new() -> Self {
+        Self {
+            slots: ArrayVec::from_array_empty([Slot::EMPTY; MAX_TIMERS]),
+            free_slots: ArrayVec::from_array_empty([0; MAX_TIMERS]),
+            heap: ArrayVec::from_array_empty([0; MAX_TIMERS]),
+            next_sequence: 0,
+            armed_expiry: None,
+        }
+    }
+
+    /// Returns None if the queue is full
+    fn insert(&mut self, timer: Timer) -> Option<(u32, u32)> {
+        let slot = match self.free_slots.pop() {
+            Some(slot) => slot,
+            None => {
+                if self.slots.try_push(Slot::EMPTY).is_some() {
+                    return None;
+                }
+                (self.slots.len() - 1) as u32
+            }
+        };
+        let heap_index = self.heap.len();
+        self.heap.push(slot);
+        let slot_ref = &mut self.slots[slot as usize];
+        slot_ref.heap_index = heap_index;
+        slot_ref.timer = Some(timer);
+        let generation = slot_ref.generation;
+        self.sift_up(heap_index);
+        Some((slot, generation))
+    }
+
+    fn remove(&mut self, slot: u32, generation: u32) -> Option<Timer> {
+        let slot_ref = self.slots.get(slot as usize)?;
+        if slot_ref.generation != generation || slot_ref.heap_index == NOT_QUEUED {
+            return None;
+        }
+        let heap_index = slot_ref.heap_index;
+
+        let last_index = self.heap.len() - 1;
+        self.swap(heap_index, last_index);
+        self.heap.pop();
+        if heap_index < self.heap.len() {
+            self.sift_down(heap_index);
+            self.sift_up(heap_index);
+        }
+
+        let slot_ref = &mut self.slots[slot as usize];
+        slot_ref.heap_index = NOT_QUEUED;
+        slot_ref.generation = slot_ref.generation.wrapping_add(1);
+        self.free_slots.push(slot);
+        slot_ref.timer.take()
+    }
+
+    /// Removes the top timer if its deadline has passed and it was added before max_sequence
+    fn pop_expired(&mut self, now: u64, max_sequence: u64) -> Option<Timer> {
+        let &slot = self.heap.first()?;
+        let slot_ref = &self.slots[slot as usize];
+        let timer = slot_ref.timer.as_ref().expect("Free slot in timer heap");
+        if timer.deadline > now || timer.sequence >= max_sequence {
+            return None;
+        }
+        let generation = slot_ref.generation;
+        self.remove(slot, generation)
+    }
+
+    /// Arms the current CPU's timer for the top of the queue, disarms if the queue is empty
+    ///
+    /// Must be called only for the queue of the current CPU
+    fn rearm(&mut self) {
+        let expiry = self.heap.first().map(|&slot| self.timer(slot).expiry);
+        if expiry == self.armed_expiry {
+            return;
+        }
+        match expiry {
+            Some(expiry) => arm(expiry),
+            None => disarm(),
+        }
+        self.armed_expiry = expiry;
+    }
+
+    #[inline]
+    fn timer(&self, slot: u32) -> &Timer {
+        self.slots[slot as usize]
+            .timer
+            .as_ref()
+            .expect("Free slot in timer heap")
+    }
+
+    #[inline]
+    fn is_less(&self, a: usize, b: usize) -> bool {
+        let a = self.timer(self.heap[a]);
+        let b = self.timer(self.heap[b]);
+        (a.expiry, a.sequence) < (b.expiry, b.sequence)
+    }
+
+    #[inline]
+    fn swap(&mut self, a: usize, b: usize) {
+        self.heap.swap(a, b);
+        self.slots[self.heap[a] as usize].heap_index = a;
+        self.slots[self.heap[b] as usize].heap_index = b;
+    }
+
+    fn sift_up(&mut self, mut index: usize) {
+        while index > 0 {
+            let parent = (index - 1) / 2;
+            if !self.is_less(index, parent) {
+                break;
+            }
+            self.swap(index, parent);
+            index = parent;
+        }
+    }
+
+    fn sift_down(&mut self, mut index: usize) {
+        loop {
+            let left = 2 * index + 1;
+            let right = left + 1;
+            let mut smallest = index;
+            if left < self.heap.len() && self.is_less(left, smallest) {
+                smallest = left;
+            }
+            if right < self.heap.len() && self.is_less(right, smallest) {
+                smallest = right;
+            }
+            if smallest == index {
+                break;
+            }
+            self.swap(index, smallest);
+            index = smallest;
+        }
+    }
+}
+
+/// Arms the current CPU's timer, the expiry may be in the past (fires immediately)
+fn arm(expiry: u64) {
+    let delay = expiry.saturating_sub(now());
+    match TIMER_MODE.get().expect("Local APIC timer mode not set") {
+        TimerMode::TscDeadline => unsafe {
+            // 0 disarms, so the deadline is at least one tick after TSC reset
+            let deadline = tsc::read() + tsc::nanoseconds_to_ticks(delay).max(1);
+            Msr::new(IA32_TSC_DEADLINE_MSR).write(deadline);
+        },
+        _ => {
+            let ticks = delay as u128 * FREQUENCY.load(Ordering::Acquire) as u128 / 1_000_000_000;
+            // Too long interval fires earlier and is rearmed by the interrupt
+            apic::set_timer_initial_count(ticks.clamp(1, u32::MAX as u128) as u32);
+        }
+    }
+}
+
+/// Disarms the current CPU's timer
+fn disarm() {
+    match TIMER_MODE.get().expect("Local APIC timer mode not set") {
+        TimerMode::TscDeadline => unsafe {
+            Msr::new(IA32_TSC_DEADLINE_MSR).write(0);
+        },
+        _ => apic::set_timer_initial_count(0),
+    }
+}
+
+/// Nanoseconds of the clocksource
+#[inline]
+fn now() -> u64 {
+    super::now().as_nanos() as u64
+}
+
+/// Measures timer frequency with one-shot countdown against the clocksource
+///
+/// The measurement starts and ends on a clocksource change, so coarse PIT clock doesn't lose a tick
+fn calibrate() -> u64 {
+    // PIT ticks are counted by IRQ0 handler
+    let interrupts_were_enabled = x86_64::instructions::interrupts::are_enabled();
+    x86_64::instructions::interrupts::enable();
+
+    apic::set_timer_divider(TIMER_DIVIDER);
+    apic::fill_lvt_timer_register(TimerMode::OneShot, true);
+
+    let wait_clock_edge = || {
+        let clock = now();
+        loop {
+            let current_clock = now();
+            if current_clock != clock {
+                return current_clock;
+            }
+            core::hint::spin_loop();
+        }
+    };
+    let start = wait_clock_edge();
+    apic::set_timer_initial_count(u32::MAX);
+    while now() - start < CALIBRATION_DURATION.as_nanos() as u64 {
+        core::hint::spin_loop();
+    }
+    let end = wait_clock_edge();
+    let count = apic::timer_current_count();
+    apic::set_timer_initial_count(0);
+
+    if !interrupts_were_enabled {
+        x86_64::instructions::interrupts::disable();
+    }
+
+    ((u32::MAX - count) as u128 * 1_000_000_000 / (end - start) as u128) as u64
+}
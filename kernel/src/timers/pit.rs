@@ -2,6 +2,8 @@
 ///
 /// Only used to calibrate other timers if HPET is not available, since I'm too lazy to deal with this ancient shit.
 // http://www.brokenthorn.com/Resources/OSDev16.html
+use crate::interrupts::idt::IO_APIC_ISA_IRQ_VECTORS_RANGE;
+use crate::interrupts::irq::{self, IrqReturn};
 use core::sync::atomic::{AtomicU32, AtomicU64, Ordering};
 
 const BASE_FREQ: u32 = 1193182;
@@ -12,6 +14,7 @@ const OCW_RL_DATA: u8 = 0x30; // 110000
 const OCW_MASK_COUNTER: u8 = 0xC0; // 11000000
 const OCW_COUNTER_0: u8 = 0x0; // 00000000
 const OCW_MODE_SQUAREWAVEGEN: u8 = 0x6; // 0110
+const OCW_MODE_TERMINALCOUNT: u8 = 0x0; // 0000
 const REG_COMMAND: u16 = 0x43;
 const REG_COUNTER0: u16 = 0x40;
 
@@ -20,6 +23,7 @@ const REG_COUNTER0: u16 = 0x40;
 // I assume that ONLY ONE core will increase the counter, because it is the only one that will handle the RTC interrupt and several cores will not be able to try to increment the counter.
 static TICK_COUNTER: AtomicU64 = AtomicU64::new(0);
 static MILLISECONDS_PER_TICK: AtomicU32 = AtomicU32::new(0);
+static DIVISOR: AtomicU32 = AtomicU32::new(0);
 
 /// Inits and starts PIT interrupts
 ///
@@ -41,6 +45,13 @@ pub fn init(interval_in_milliseconds: u32) {
     let divisor: u16 = (BASE_FREQ / freq) as u16;
     // (godbolt tested) With Acquire just mov is used, with SeqCst xchg used, thats blocks the bus (like lock prefix).
     MILLISECONDS_PER_TICK.store(interval_in_milliseconds, Ordering::SeqCst);
+    DIVISOR.store(divisor as u32, Ordering::SeqCst);
+    irq::register_irq_handler(
+        *IO_APIC_ISA_IRQ_VECTORS_RANGE.start(),
+        tick_interrupt_handler,
+        0,
+    )
+    .expect("Failed to register PIT handler");
 
     // Send operational command
     let mut ocw: u8 = 0;
@@ -59,10 +70,26 @@ pub fn init(interval_in_milliseconds: u32) {
     }
 }
 
-#[inline]
-pub fn tick_interrupt_handler() {
+/// Stops periodic PIT interrupts
+///
+/// Mode 0 (interrupt on terminal count) with max count, the counter fires once more and stays silent
+pub fn stop() {
+    let mut ocw: u8 = 0;
+    ocw = (ocw & !OCW_MASK_MODE) | OCW_MODE_TERMINALCOUNT;
+    ocw = (ocw & !OCW_MASK_RL) | OCW_RL_DATA;
+    ocw = (ocw & !OCW_MASK_COUNTER) | OCW_COUNTER_0;
+    unsafe {
+        x86_64::instructions::port::Port::new(REG_COMMAND).write(ocw);
+        x86_64::instructions::port::Port::<u8>::new(REG_COUNTER0).write(0);
+        x86_64::instructions::port::Port::<u8>::new(REG_COUNTER0).write(0);
+    }
+}
+
+/// IRQ0 handler
+fn tick_interrupt_handler(_: usize) -> IrqReturn {
     // I checked in godbolt and lock prefix is generated.
     TICK_COUNTER.fetch_add(1, Ordering::AcqRel);
+    IrqReturn::Handled
 }
 
 #[inline]
@@ -73,6 +100,12 @@ pub fn get_ticks_counter() -> u64 {
     TICK_COUNTER.load(Ordering::Acquire)
 }
 
+/// Exact tick period (interval is rounded to the divisor)
+#[inline]
+pub fn tick_period_in_nanoseconds() -> u64 {
+    DIVISOR.load(Ordering::Acquire) as u64 * 1_000_000_000 / BASE_FREQ as u64
+}
+
 /// Sleeps
 pub fn sleep(milliseconds: u32) {
     let start_tick = TICK_COUNTER.load(Ordering::Acquire);
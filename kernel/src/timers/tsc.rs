@@ -0,0 +1,241 @@
+// Invariant TSC clocksource
+//
+// Invariant TSC runs at constant rate in all power states, so it's used as a system-wide clock.
+// TSC frequency is calibrated against HPET, or PIT if HPET is not available.
+// Ticks are converted to nanoseconds with mult/shift: ns = ticks * mult >> TSC_SHIFT, without divide.
+//
+// TSC of different CPUs may be not synchronized, every AP is checked against BSP when started (warp check, like Linux check_tsc_warp).
+// TSC is not used if warp is detected.
+use super::{hpet, pit};
+use crate::sync::Mutex;
+use core::sync::atomic::{AtomicBool, AtomicU64, AtomicUsize, Ordering};
+use core::time::Duration;
+use spin::Once;
+
+/// Shift of mult/shift conversion
+const TSC_SHIFT: u32 = 32;
+
+/// Duration of one calibration
+const CALIBRATION_DURATION: Duration = Duration::from_millis(10);
+
+/// Number of calibrations, median is used
+const CALIBRATIONS_NUMBER: usize = 3;
+
+/// Duration of warp check with one AP
+const WARP_CHECK_DURATION: Duration = Duration::from_millis(2);
+
+static TSC_CLOCK: Once<TscClock> = Once::new();
+
+/// TSC is invariant, calibrated and synchronized between CPUs
+static TSC_USED: AtomicBool = AtomicBool::new(false);
+
+struct TscClock {
+    /// Hz
+    frequency: u64,
+    /// Nanoseconds per tick << TSC_SHIFT
+    mult: u64,
+}
+
+/// Detects invariant TSC and calibrates it
+///
+/// HPET or PIT must be inited
+pub fn init() {
+    // Check Invariant TSC support using cpuid (works on Intel and AMD)
+    let cpuid = raw_cpuid::CpuId::new();
+    let has_invariant_tsc = cpuid
+        .get_advanced_power_mgmt_info()
+        .expect("Failed to get cpuid advanced power management info")
+        .has_invariant_tsc();
+    if !has_invariant_tsc {
+        log::info!("Invariant TSC not supported");
+        return;
+    }
+
+    let mut frequencies = [0u64; CALIBRATIONS_NUMBER];
+    for frequency in frequencies.iter_mut() {
+        *frequency = if hpet::is_supported() {
+            calibrate_with_hpet()
+        } else {
+            calibrate_with_pit()
+        };
+    }
+    frequencies.sort_unstable();
+    let frequency = frequencies[CALIBRATIONS_NUMBER / 2];
+    assert!(frequency != 0, "TSC calibration failed");
+
+    TSC_CLOCK.call_once(|| TscClock {
+        frequency,
+        mult: ((1_000_000_000u128 << TSC_SHIFT) / frequency as u128) as u64,
+    });
+    TSC_USED.store(true, Ordering::Release);
+    log::info!(
+        "Invariant TSC supported, calibrated with {}: {}.{:03} MHz",
+        if hpet::is_supported() { "HPET" } else { "PIT" },
+        frequency / 1_000_000,
+        frequency / 1_000 % 1_000
+    );
+}
+
+/// TSC is used as clocksource
+#[inline]
+pub fn is_used() -> bool {
+    TSC_USED.load(Ordering::Acquire)
+}
+
+/// Reads TSC
+///
+/// rdtsc is not serializing, it may be executed before preceding instructions
+#[inline(always)]
+pub fn read() -> u64 {
+    unsafe { core::arch::x86_64::_rdtsc() }
+}
+
+/// Nanoseconds since TSC reset
+///
+/// TSC must be used
+#[inline]
+pub fn now() -> u64 {
+    ticks_to_nanoseconds(read())
+}
+
+/// TSC frequency in Hz
+#[inline]
+pub fn frequency() -> u64 {
+    clock().frequency
+}
+
+#[inline]
+pub fn ticks_to_nanoseconds(ticks: u64) -> u64 {
+    ((ticks as u128 * clock().mult as u128) >> TSC_SHIFT) as u64
+}
+
+#[inline]
+pub fn nanoseconds_to_ticks(nanoseconds: u64) -> u64 {
+    (nanoseconds as u128 * clock().frequency as u128 / 1_000_000_000) as u64
+}
+
+#[inline]
+fn clock() -> &'static TscClock {
+    TSC_CLOCK.get().expect("TSC clock not set")
+}
+
+/// Measures TSC frequency against HPET
+///
+/// HPET read is slow, so TSC is read before and after it and the middle is used
+fn calibrate_with_hpet() -> u64 {
+    let read_pair = || {
+        let tsc_before = read();
+        let hpet_ticks = hpet::get_current_ticks();
+        let tsc_after = read();
+        (tsc_before + (tsc_after - tsc_before) / 2, hpet_ticks)
+    };
+
+    let calibration_hpet_ticks = hpet::duration_to_ticks(CALIBRATION_DURATION);
+    let (tsc_start, hpet_start) = read_pair();
+    while hpet::get_current_ticks() - hpet_start < calibration_hpet_ticks {
+        core::hint::spin_loop();
+    }
+    let (tsc_end, hpet_end) = read_pair();
+
+    let nanoseconds = hpet::ticks_to_duration(hpet_end - hpet_start).as_nanos();
+    ((tsc_end - tsc_start) as u128 * 1_000_000_000 / nanoseconds) as u64
+}
+
+/// Measures TSC frequency against PIT
+///
+/// PIT ticks are counted by IRQ0 handler, so interrupts are enabled while measuring
+fn calibrate_with_pit() -> u64 {
+    let interrupts_were_enabled = x86_64::instructions::interrupts::are_enabled();
+    x86_64::instructions::interrupts::enable();
+
+    let wait_tick_edge = || {
+        let pit_ticks = pit::get_ticks_counter();
+        while pit::get_ticks_counter() == pit_ticks {
+            core::hint::spin_loop();
+        }
+        (read(), pit::get_ticks_counter())
+    };
+    let (tsc_start, pit_start) = wait_tick_edge();
+    let calibration_pit_ticks = (CALIBRATION_DURATION.as_nanos() as u64)
+        .div_ceil(pit::tick_period_in_nanoseconds())
+        .max(1);
+    while pit::get_ticks_counter() - pit_start < calibration_pit_ticks - 1 {
+        core::hint::spin_loop();
+    }
+    let (tsc_end, pit_end) = wait_tick_edge();
+
+    if !interrupts_were_enabled {
+        x86_64::instructions::interrupts::disable();
+    }
+
+    let nanoseconds = (pit_end - pit_start) as u128 * pit::tick_period_in_nanoseconds() as u128;
+    ((tsc_end - tsc_start) as u128 * 1_000_000_000 / nanoseconds) as u64
+}
+
+/// Warp check state, BSP and one AP at a time
+static WARP_CHECK_ARRIVED: AtomicUsize = AtomicUsize::new(0);
+static WARP_CHECK_FINISHED: AtomicUsize = AtomicUsize::new(0);
+static WARP_CHECK_LAST_TSC: Mutex<u64> = Mutex::new(0);
+static WARP_CHECK_MAX_WARP: AtomicU64 = AtomicU64::new(0);
+
+/// BSP side of the warp check with the started AP
+///
+/// The AP must call [check_warp_ap]. If TSC goes backwards between the CPUs, TSC is not used anymore
+pub fn check_warp_bsp(ap_cpu_index: usize) {
+    if !is_used() {
+        return;
+    }
+    warp_check_rendezvous();
+    warp_check_loop();
+    WARP_CHECK_FINISHED.fetch_add(1, Ordering::AcqRel);
+    while WARP_CHECK_FINISHED.load(Ordering::Acquire) != 2 {
+        core::hint::spin_loop();
+    }
+
+    let max_warp = WARP_CHECK_MAX_WARP.load(Ordering::Acquire);
+    if max_warp != 0 {
+        TSC_USED.store(false, Ordering::Release);
+        log::warn!("TSC warp between CPU 0 and CPU {ap_cpu_index}: {max_warp} ticks, TSC not used");
+    }
+
+    // Ready for the next AP
+    WARP_CHECK_MAX_WARP.store(0, Ordering::Release);
+    WARP_CHECK_FINISHED.store(0, Ordering::Release);
+    WARP_CHECK_ARRIVED.store(0, Ordering::Release);
+}
+
+/// AP side of the warp check, see [check_warp_bsp]
+pub fn check_warp_ap() {
+    if !is_used() {
+        return;
+    }
+    warp_check_rendezvous();
+    warp_check_loop();
+    WARP_CHECK_FINISHED.fetch_add(1, Ordering::AcqRel);
+}
+
+fn warp_check_rendezvous() {
+    WARP_CHECK_ARRIVED.fetch_add(1, Ordering::AcqRel);
+    while WARP_CHECK_ARRIVED.load(Ordering::Acquire) != 2 {
+        core::hint::spin_loop();
+    }
+}
+
+/// Both CPUs read TSC under the lock, TSC read after the other CPU's read must not be smaller
+fn warp_check_loop() {
+    let end = read() + nanoseconds_to_ticks(WARP_CHECK_DURATION.as_nanos() as u64);
+    loop {
+        let mut last_tsc = WARP_CHECK_LAST_TSC.lock();
+        let previous_tsc = *last_tsc;
+        let current_tsc = read();
+        *last_tsc = current_tsc;
+        drop(last_tsc);
+
+        if current_tsc < previous_tsc {
+            WARP_CHECK_MAX_WARP.fetch_max(previous_tsc - current_tsc, Ordering::AcqRel);
+        }
+        if current_tsc > end {
+            break;
+        }
+    }
+}
@@ -0,0 +1,203 @@
+// Binary tracepoints
+//
+// trace_event! writes a fixed size record (TSC, CPU, event, 2 arguments) to the trace buffer of the current CPU.
+// Without the trace feature the macro expands to nothing, tracepoints can stay in hot paths.
+// With it, events are enabled at runtime by a mask, a disabled tracepoint is a load and a not taken branch
+// (kernel code isn't patched at runtime).
+//
+// Buffers keep the last TRACE_RECORDS_NUMBER records of each CPU, older ones are overwritten.
+// dump writes all buffers to QEMU debugcon (-debugcon file:trace.bin), trace-decoder prints them on the host.
+//
+// Dump format (little endian), must match trace-decoder:
+// magic "KTRACE01", TSC frequency u64 (0 if unknown), record size u32, CPUs number u32,
+// then for each CPU: cpu_index u32, records number u32, records from the oldest.
+
+#[cfg(feature = "trace")]
+use crate::smp::{per_cpu, MAX_CPUS};
+#[cfg(feature = "trace")]
+use core::sync::atomic::{AtomicPtr, AtomicU64, AtomicUsize, Ordering};
+
+/// Records of one CPU
+#[cfg(feature = "trace")]
+const TRACE_RECORDS_NUMBER: usize = 8192;
+
+/// QEMU debugcon port
+#[cfg(feature = "trace")]
+const DEBUGCON_PORT: u16 = 0xE9;
+
+#[cfg(feature = "trace")]
+const DUMP_MAGIC: &[u8; 8] = b"KTRACE01";
+
+/// Trace buffer of each CPU, null until the CPU allocates it
+#[cfg(feature = "trace")]
+static TRACE_BUFFERS: [AtomicPtr<TraceBuffer>; MAX_CPUS] =
+    [const { AtomicPtr::new(core::ptr::null_mut()) }; MAX_CPUS];
+
+/// Bit of each enabled TraceEvent
+#[cfg(feature = "trace")]
+static ENABLED_EVENTS: AtomicU64 = AtomicU64::new(u64::MAX);
+
+/// Trace events, IDs are stable, trace-decoder knows their names
+#[derive(Clone, Copy, Debug, PartialEq)]
+#[repr(u16)]
+pub enum TraceEvent {
+    /// Physical address, size
+    PmmAlloc = 0,
+    /// Physical address, size
+    PmmFree = 1,
+    /// Slab pointer, slab size
+    SlabAlloc = 2,
+    /// Slab pointer, slab size
+    SlabFree = 3,
+    /// Vector
+    IrqEnter = 4,
+    /// Vector
+    IrqExit = 5,
+}
+
+/// 32 bytes
+#[cfg(feature = "trace")]
+#[derive(Clone, Copy)]
+#[repr(C)]
+struct TraceRecord {
+    tsc: u64,
+    cpu_index: u16,
+    event: u16,
+    reserved: u32,
+    args: [u64; 2],
+}
+
+#[cfg(feature = "trace")]
+struct TraceBuffer {
+    /// Records written, the next record goes to head % TRACE_RECORDS_NUMBER
+    head: AtomicUsize,
+    records: [TraceRecord; TRACE_RECORDS_NUMBER],
+}
+
+/// Records the event if tracing is compiled in and the event is enabled
+///
+/// Arguments are converted to u64 with `as`
+#[macro_export]
+macro_rules! trace_event {
+    ($event:expr) => {
+        $crate::trace_event!($event, 0, 0)
+    };
+    ($event:expr, $arg0:expr) => {
+        $crate::trace_event!($event, $arg0, 0)
+    };
+    ($event:expr, $arg0:expr, $arg1:expr) => {
+        #[cfg(feature = "trace")]
+        $crate::trace::record($event, $arg0 as u64, $arg1 as u64);
+    };
+}
+
+/// Allocates trace buffer of the bootstrap processor
+///
+/// vmalloc must be inited
+pub fn init() {
+    init_cpu();
+}
+
+/// Allocates trace buffer of the current CPU
+pub fn init_cpu() {
+    #[cfg(feature = "trace")]
+    {
+        let buffer =
+            crate::memory_management::virtual_memory_manager::vmalloc(size_of::<TraceBuffer>())
+                as *mut TraceBuffer;
+        assert!(!buffer.is_null(), "Failed to allocate trace buffer");
+        unsafe {
+            (&raw mut (*buffer).head).write(AtomicUsize::new(0));
+        }
+        TRACE_BUFFERS[per_cpu::cpu_index()].store(buffer, Ordering::Release);
+    }
+}
+
+/// Sets the mask of enabled events, bit N enables TraceEvent with ID N
+pub fn set_enabled_events(mask: u64) {
+    #[cfg(feature = "trace")]
+    ENABLED_EVENTS.store(mask, Ordering::Relaxed);
+}
+
+#[cfg(feature = "trace")]
+#[inline(always)]
+pub fn record(event: TraceEvent, arg0: u64, arg1: u64) {
+    if ENABLED_EVENTS.load(Ordering::Relaxed) & (1 << event as u64) != 0 {
+        record_enabled(event, arg0, arg1);
+    }
+}
+
+#[cfg(feature = "trace")]
+#[cold]
+#[inline(never)]
+fn record_enabled(event: TraceEvent, arg0: u64, arg1: u64) {
+    let cpu_index = per_cpu::cpu_index();
+    let buffer = TRACE_BUFFERS[cpu_index].load(Ordering::Acquire);
+    if buffer.is_null() {
+        return;
+    }
+    unsafe {
+        // Nested interrupts get other slots
+        let head = (*buffer).head.fetch_add(1, Ordering::Relaxed);
+        let record = TraceRecord {
+            tsc: crate::timers::tsc::read(),
+            cpu_index: cpu_index as u16,
+            event: event as u16,
+            reserved: 0,
+            args: [arg0, arg1],
+        };
+        (&raw mut (*buffer).records[head % TRACE_RECORDS_NUMBER]).write_volatile(record);
+    }
+}
+
+/// Writes trace buffers of all CPUs to QEMU debugcon
+///
+/// Tracing is paused while dumping, records written by other CPUs at that time may be torn
+pub fn dump() {
+    #[cfg(feature = "trace")]
+    {
+        let enabled_events = ENABLED_EVENTS.swap(0, Ordering::SeqCst);
+        let tsc_frequency = if crate::timers::tsc::is_used() {
+            crate::timers::tsc::frequency()
+        } else {
+            0
+        };
+        let buffers = (0..MAX_CPUS)
+            .map(|cpu_index| (cpu_index, TRACE_BUFFERS[cpu_index].load(Ordering::Acquire)))
+            .filter(|(_, buffer)| !buffer.is_null());
+
+        write_debugcon(DUMP_MAGIC);
+        write_debugcon(&tsc_frequency.to_le_bytes());
+        write_debugcon(&(size_of::<TraceRecord>() as u32).to_le_bytes());
+        write_debugcon(&(buffers.clone().count() as u32).to_le_bytes());
+        for (cpu_index, buffer) in buffers {
+            let head = unsafe { (*buffer).head.load(Ordering::Acquire) };
+            let records_number = head.min(TRACE_RECORDS_NUMBER);
+            write_debugcon(&(cpu_index as u32).to_le_bytes());
+            write_debugcon(&(records_number as u32).to_le_bytes());
+            for position in head - records_number..head {
+                let record = unsafe {
+                    (&raw const (*buffer).records[position % TRACE_RECORDS_NUMBER]).read_volatile()
+                };
+                write_debugcon(&record.tsc.to_le_bytes());
+                write_debugcon(&record.cpu_index.to_le_bytes());
+                write_debugcon(&record.event.to_le_bytes());
+                write_debugcon(&record.reserved.to_le_bytes());
+                write_debugcon(&record.args[0].to_le_bytes());
+                write_debugcon(&record.args[1].to_le_bytes());
+            }
+        }
+
+        ENABLED_EVENTS.store(enabled_events, Ordering::SeqCst);
+    }
+}
+
+#[cfg(feature = "trace")]
+fn write_debugcon(bytes: &[u8]) {
+    let mut port = x86_64::instructions::port::Port::<u8>::new(DEBUGCON_PORT);
+    for &byte in bytes {
+        unsafe {
+            port.write(byte);
+        }
+    }
+}
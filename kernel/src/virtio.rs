@@ -0,0 +1,94 @@
+// Virtio devices over modern PCI transport (virtio 1.x)
+//
+// Drivers: block (blk) and network (net). Both use split virtqueues with VIRTIO_F_RING_EVENT_IDX when offered,
+// up to one queue (pair) per CPU with its MSI-X interrupt on that CPU, batched submission and completion.
+// There is no IOMMU, buffers are physical addresses of High or DMA32 zone memory.
+// Legacy-only (transitional without VERSION_1) devices aren't supported.
+
+pub mod blk;
+pub mod net;
+mod transport;
+mod virtqueue;
+
+use crate::pci;
+use alloc::vec::Vec;
+
+pub const VIRTIO_VENDOR_ID: u16 = 0x1AF4;
+
+/// Device independent feature bits
+const FEATURE_RING_EVENT_IDX: u64 = 1 << 29;
+const FEATURE_VERSION_1: u64 = 1 << 32;
+
+/// Device status
+const STATUS_ACKNOWLEDGE: u8 = 1;
+const STATUS_DRIVER: u8 = 2;
+const STATUS_DRIVER_OK: u8 = 4;
+const STATUS_FEATURES_OK: u8 = 8;
+const STATUS_FAILED: u8 = 128;
+
+/// Device types
+const DEVICE_TYPE_NET: u16 = 1;
+const DEVICE_TYPE_BLK: u16 = 2;
+
+/// Modern devices have PCI device ID 0x1040 + type, transitional ones 0x1000-0x103F
+const MODERN_DEVICE_ID_BASE: u16 = 0x1040;
+const TRANSITIONAL_DEVICE_ID_NET: u16 = 0x1000;
+const TRANSITIONAL_DEVICE_ID_BLK: u16 = 0x1001;
+
+/// Probes virtio functions found by [pci::init]
+///
+/// Must be called after SMP init, queues are created for all CPUs
+pub fn init() {
+    let mut blk_devices = Vec::new();
+    let mut net_devices = Vec::new();
+    for device in pci::devices()
+        .iter()
+        .filter(|device| device.vendor_id == VIRTIO_VENDOR_ID)
+    {
+        match device_type(device.device_id) {
+            Some(DEVICE_TYPE_BLK) => match blk::BlockDevice::new(device, blk_devices.len()) {
+                Ok(blk) => {
+                    log::info!(
+                        "virtio-blk {}: {} sectors, {} queues",
+                        device.address,
+                        blk.capacity(),
+                        blk.queues_number()
+                    );
+                    blk_devices.push(blk);
+                }
+                Err(error) => log::warn!("virtio-blk {}: {error:?}", device.address),
+            },
+            Some(DEVICE_TYPE_NET) => match net::NetDevice::new(device, net_devices.len()) {
+                Ok(net) => {
+                    let mac = net.mac();
+                    log::info!(
+                        "virtio-net {}: MAC {:02x}:{:02x}:{:02x}:{:02x}:{:02x}:{:02x}, {} queue pairs",
+                        device.address,
+                        mac[0],
+                        mac[1],
+                        mac[2],
+                        mac[3],
+                        mac[4],
+                        mac[5],
+                        net.queue_pairs_number()
+                    );
+                    net_devices.push(net);
+                }
+                Err(error) => log::warn!("virtio-net {}: {error:?}", device.address),
+            },
+            _ => {}
+        }
+    }
+    // Interrupts of the devices look them up here, until then they return NotMine
+    blk::set_devices(blk_devices);
+    net::set_devices(net_devices);
+}
+
+fn device_type(device_id: u16) -> Option<u16> {
+    match device_id {
+        TRANSITIONAL_DEVICE_ID_NET => Some(DEVICE_TYPE_NET),
+        TRANSITIONAL_DEVICE_ID_BLK => Some(DEVICE_TYPE_BLK),
+        id if id >= MODERN_DEVICE_ID_BASE => Some(id - MODERN_DEVICE_ID_BASE),
+        _ => None,
+    }
+}
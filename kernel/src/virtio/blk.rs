@@ -0,0 +1,474 @@
+// Virtio block device (virtio 1.x, section 5.2)
+//
+// With VIRTIO_BLK_F_MQ the device has up to one request queue per CPU, queue N interrupts CPU N (msi::queue_cpu).
+// Requests are submitted to the queue of the current CPU in batches: all requests of one submit are added
+// to the ring and the device is notified once. Completions are popped in batches in the queue's interrupt,
+// completion callbacks run there after the queue lock is released.
+//
+// Data is DMA'd directly to and from the caller's physical memory (High or DMA32 zone, no bounce buffers).
+// Request headers and status bytes are in a per-queue DMA array indexed by the head descriptor of the chain.
+
+use super::transport::{Transport, TransportError};
+use super::virtqueue::{Buffer, Virtqueue};
+use crate::interrupts::irq::IrqReturn;
+use crate::interrupts::msi::{self, MsiVector};
+use crate::memory_management::physical_memory_manager::{self, MemoryZoneEnum};
+use crate::memory_management::virtual_memory_manager;
+use crate::memory_management::PAGE_SIZE;
+use crate::pci::PciDevice;
+use crate::scheduler;
+use crate::smp::per_cpu;
+use crate::sync::Mutex;
+use alloc::vec::Vec;
+use core::ptr::NonNull;
+use core::sync::atomic::{AtomicU8, Ordering};
+use spin::Once;
+use tinyvec::ArrayVec;
+use x86_64::PhysAddr;
+
+pub const SECTOR_SIZE: usize = 512;
+
+/// Feature bits
+const FEATURE_SIZE_MAX: u64 = 1 << 1;
+const FEATURE_RO: u64 = 1 << 5;
+const FEATURE_BLK_SIZE: u64 = 1 << 6;
+const FEATURE_FLUSH: u64 = 1 << 9;
+const FEATURE_MQ: u64 = 1 << 12;
+
+/// Device configuration (struct virtio_blk_config)
+const CONFIG_CAPACITY: u64 = 0;
+const CONFIG_SIZE_MAX: u64 = 8;
+const CONFIG_BLK_SIZE: u64 = 20;
+const CONFIG_NUM_QUEUES: u64 = 34;
+
+/// Request types
+const REQUEST_IN: u32 = 0;
+const REQUEST_OUT: u32 = 1;
+const REQUEST_FLUSH: u32 = 4;
+
+/// Request status written by the device
+const STATUS_OK: u8 = 0;
+const STATUS_UNSUPPORTED: u8 = 2;
+
+/// Header: type, reserved, sector
+const REQUEST_HEADER_SIZE: usize = 16;
+
+/// Max entries of a request queue
+const MAX_QUEUE_SIZE: u16 = 256;
+
+/// Completions popped under the queue lock at once
+const COMPLETION_BATCH: usize = 32;
+
+static DEVICES: Once<Vec<BlockDevice>> = Once::new();
+
+#[derive(Debug, Copy, Clone, PartialEq)]
+pub enum BlockOperation {
+    Read,
+    Write,
+    Flush,
+}
+
+#[derive(Debug, Copy, Clone, PartialEq)]
+pub enum BlockError {
+    /// Device failed the request
+    Io,
+    /// Device doesn't support the request (flush without VIRTIO_BLK_F_FLUSH)
+    Unsupported,
+    /// Write to read-only device
+    ReadOnly,
+    /// Sectors are outside of the device or the buffer isn't whole sectors
+    InvalidRequest,
+}
+
+/// Called in the interrupt of the queue with the data of the request
+pub type BlockCompletion = fn(usize, Result<(), BlockError>);
+
+/// Request with one physically contiguous buffer
+#[derive(Debug, Copy, Clone)]
+pub struct BlockRequest {
+    pub operation: BlockOperation,
+    pub sector: u64,
+    /// Physical memory of the High or DMA32 zone, ignored by flush
+    pub buffer: PhysAddr,
+    /// Multiple of SECTOR_SIZE
+    pub len: u32,
+    pub completion: BlockCompletion,
+    pub data: usize,
+}
+
+pub struct BlockDevice {
+    transport: Transport,
+    /// Capacity in sectors
+    capacity: u64,
+    block_size: u32,
+    /// Max size of one buffer
+    size_max: u32,
+    read_only: bool,
+    flush_supported: bool,
+    queues: Vec<BlockQueue>,
+}
+
+struct BlockQueue {
+    inner: Mutex<BlockQueueInner>,
+    vector: MsiVector,
+}
+
+struct BlockQueueInner {
+    virtqueue: Virtqueue,
+    /// Headers of the chains, then status bytes, indexed by the head descriptor
+    headers: PhysAddr,
+    /// Completion and data of the chains, indexed by the head descriptor
+    completions: Vec<Option<(BlockCompletion, usize)>>,
+}
+
+/// Completion of a synchronous request, the task waits for the status
+struct SyncRequest {
+    task: NonNull<scheduler::task::Task>,
+    /// 0 - in flight, 1 - ok, 2 + error index
+    status: AtomicU8,
+}
+
+/// Block devices found by [super::init]
+#[inline]
+pub fn devices() -> &'static [BlockDevice] {
+    DEVICES.get().map_or(&[], |devices| devices.as_slice())
+}
+
+pub(super) fn set_devices(devices: Vec<BlockDevice>) {
+    DEVICES.call_once(|| devices);
+}
+
+impl BlockDevice {
+    /// Negotiates features and creates a queue per CPU
+    ///
+    /// device_index is the index of the device in [devices]
+    pub(super) fn new(
+        pci_device: &'static PciDevice,
+        device_index: usize,
+    ) -> Result<Self, TransportError> {
+        let mut transport = Transport::new(pci_device)?;
+        transport.negotiate_features(
+            FEATURE_SIZE_MAX | FEATURE_RO | FEATURE_BLK_SIZE | FEATURE_FLUSH | FEATURE_MQ,
+        )?;
+
+        let device_queues = if transport.has_feature(FEATURE_MQ) {
+            transport.read_config_u16(CONFIG_NUM_QUEUES).max(1)
+        } else {
+            1
+        };
+        let queues_number = (device_queues as usize).min(per_cpu::cpus_number());
+        let mut queues = Vec::with_capacity(queues_number);
+        for queue in 0..queues_number {
+            let (virtqueue, vector) = transport.setup_queue(
+                queue as u16,
+                MAX_QUEUE_SIZE,
+                msi::queue_cpu(queue),
+                queue_interrupt,
+                device_index << 16 | queue,
+            )?;
+            let size = virtqueue.size() as usize;
+            let headers = unsafe {
+                physical_memory_manager::alloc_zeroed(
+                    &[MemoryZoneEnum::High, MemoryZoneEnum::Dma32],
+                    (size * (REQUEST_HEADER_SIZE + 1))
+                        .next_power_of_two()
+                        .max(PAGE_SIZE),
+                )
+            };
+            if headers.is_null() {
+                vector.free();
+                transport.fail();
+                return Err(TransportError::NoResources);
+            }
+            queues.push(BlockQueue {
+                inner: Mutex::new(BlockQueueInner {
+                    virtqueue,
+                    headers,
+                    completions: alloc::vec![None; size],
+                }),
+                vector,
+            });
+        }
+        transport.driver_ok();
+
+        let block_size = if transport.has_feature(FEATURE_BLK_SIZE) {
+            transport.read_config_u32(CONFIG_BLK_SIZE)
+        } else {
+            SECTOR_SIZE as u32
+        };
+        let size_max = if transport.has_feature(FEATURE_SIZE_MAX) {
+            transport.read_config_u32(CONFIG_SIZE_MAX)
+        } else {
+            u32::MAX
+        };
+        Ok(Self {
+            capacity: transport.read_config_u64(CONFIG_CAPACITY),
+            block_size,
+            size_max,
+            read_only: transport.has_feature(FEATURE_RO),
+            flush_supported: transport.has_feature(FEATURE_FLUSH),
+            transport,
+            queues,
+        })
+    }
+
+    /// Capacity in sectors
+    #[inline]
+    pub fn capacity(&self) -> u64 {
+        self.capacity
+    }
+
+    #[inline]
+    pub fn block_size(&self) -> u32 {
+        self.block_size
+    }
+
+    #[inline]
+    pub fn read_only(&self) -> bool {
+        self.read_only
+    }
+
+    #[inline]
+    pub fn queues_number(&self) -> usize {
+        self.queues.len()
+    }
+
+    #[inline]
+    pub fn pci_device(&self) -> &'static PciDevice {
+        self.transport.pci_device()
+    }
+
+    /// Submits the requests to the queue of the current CPU with one notification
+    ///
+    /// Returns the number of submitted requests, the rest doesn't fit into the queue and must be resubmitted.
+    /// Invalid requests are completed with an error immediately
+    pub fn submit(&self, requests: &[BlockRequest]) -> usize {
+        x86_64::instructions::interrupts::without_interrupts(|| {
+            let queue = &self.queues[per_cpu::cpu_index() % self.queues.len()];
+            let mut inner = queue.inner.lock();
+            let mut invalid: ArrayVec<[(usize, Option<BlockError>); COMPLETION_BATCH]> =
+                ArrayVec::new();
+            let mut submitted = 0;
+            for request in requests {
+                if let Err(error) = self.validate(request) {
+                    if invalid.try_push((submitted, Some(error))).is_some() {
+                        break;
+                    }
+                    submitted += 1;
+                    continue;
+                }
+                if !inner.add(request) {
+                    break;
+                }
+                submitted += 1;
+            }
+            inner.virtqueue.kick();
+            drop(inner);
+
+            // Callbacks may submit again, the queue is unlocked
+            for (index, error) in invalid {
+                let request = &requests[index];
+                (request.completion)(request.data, Err(error.unwrap()));
+            }
+            submitted
+        })
+    }
+
+    /// Reads sectors into the buffer and waits for the completion
+    ///
+    /// Must be called from a task, it blocks
+    pub fn read(&self, sector: u64, buffer: PhysAddr, len: u32) -> Result<(), BlockError> {
+        self.request_sync(BlockOperation::Read, sector, buffer, len)
+    }
+
+    /// Writes sectors from the buffer and waits for the completion
+    ///
+    /// Must be called from a task, it blocks
+    pub fn write(&self, sector: u64, buffer: PhysAddr, len: u32) -> Result<(), BlockError> {
+        self.request_sync(BlockOperation::Write, sector, buffer, len)
+    }
+
+    /// Flushes the write cache of the device and waits for the completion
+    pub fn flush(&self) -> Result<(), BlockError> {
+        self.request_sync(BlockOperation::Flush, 0, PhysAddr::zero(), 0)
+    }
+
+    fn request_sync(
+        &self,
+        operation: BlockOperation,
+        sector: u64,
+        buffer: PhysAddr,
+        len: u32,
+    ) -> Result<(), BlockError> {
+        let sync_request = SyncRequest {
+            task: scheduler::current_task(),
+            status: AtomicU8::new(0),
+        };
+        let request = BlockRequest {
+            operation,
+            sector,
+            buffer,
+            len,
+            completion: complete_sync,
+            data: &sync_request as *const SyncRequest as usize,
+        };
+        // The queue may be full of requests of other tasks
+        while self.submit(core::slice::from_ref(&request)) == 0 {
+            scheduler::yield_now();
+        }
+        loop {
+            match sync_request.status.load(Ordering::Acquire) {
+                0 => scheduler::block_current(),
+                1 => return Ok(()),
+                status => return Err(ERRORS[status as usize - 2]),
+            }
+        }
+    }
+
+    fn validate(&self, request: &BlockRequest) -> Result<(), BlockError> {
+        match request.operation {
+            BlockOperation::Flush if !self.flush_supported => Err(BlockError::Unsupported),
+            BlockOperation::Flush => Ok(()),
+            BlockOperation::Write if self.read_only => Err(BlockError::ReadOnly),
+            BlockOperation::Read | BlockOperation::Write => {
+                let sectors = request.len as u64 / SECTOR_SIZE as u64;
+                if request.len == 0
+                    || request.len as usize % SECTOR_SIZE != 0
+                    || request.len > self.size_max
+                    || request
+                        .sector
+                        .checked_add(sectors)
+                        .is_none_or(|end| end > self.capacity)
+                {
+                    Err(BlockError::InvalidRequest)
+                } else {
+                    Ok(())
+                }
+            }
+        }
+    }
+}
+
+impl BlockQueueInner {
+    /// Adds the request chain, false if the queue is full
+    fn add(&mut self, request: &BlockRequest) -> bool {
+        let needed = if request.operation == BlockOperation::Flush {
+            2
+        } else {
+            3
+        };
+        if (self.virtqueue.free_descriptors() as usize) < needed {
+            return false;
+        }
+        // The head is the first free descriptor, its header slot is written before the chain is added
+        let head = self.virtqueue.next_free();
+        let header_addr = self.headers + (head as usize * REQUEST_HEADER_SIZE) as u64;
+        let status_addr = self.status_addr(head);
+        let request_type = match request.operation {
+            BlockOperation::Read => REQUEST_IN,
+            BlockOperation::Write => REQUEST_OUT,
+            BlockOperation::Flush => REQUEST_FLUSH,
+        };
+        unsafe {
+            let header_ptr = virtual_memory_manager::virt_addr_in_cpmm_from_phys_addr(header_addr)
+                .as_mut_ptr::<u32>();
+            header_ptr.write_volatile(request_type);
+            header_ptr.add(1).write_volatile(0);
+            (header_ptr.add(2) as *mut u64).write_volatile(request.sector);
+            virtual_memory_manager::virt_addr_in_cpmm_from_phys_addr(status_addr)
+                .as_mut_ptr::<u8>()
+                .write_volatile(0xFF);
+        }
+
+        let header = Buffer {
+            addr: header_addr,
+            len: REQUEST_HEADER_SIZE as u32,
+            device_writable: false,
+        };
+        let status = Buffer {
+            addr: status_addr,
+            len: 1,
+            device_writable: true,
+        };
+        let added_head = if request.operation == BlockOperation::Flush {
+            self.virtqueue.add(&[header, status])
+        } else {
+            let data = Buffer {
+                addr: request.buffer,
+                len: request.len,
+                device_writable: request.operation == BlockOperation::Read,
+            };
+            self.virtqueue.add(&[header, data, status])
+        };
+        debug_assert_eq!(added_head, Some(head));
+        self.completions[head as usize] = Some((request.completion, request.data));
+        true
+    }
+
+    #[inline]
+    fn status_addr(&self, head: u16) -> PhysAddr {
+        self.headers + (self.virtqueue.size() as usize * REQUEST_HEADER_SIZE + head as usize) as u64
+    }
+}
+
+const ERRORS: [BlockError; 4] = [
+    BlockError::Io,
+    BlockError::Unsupported,
+    BlockError::ReadOnly,
+    BlockError::InvalidRequest,
+];
+
+fn complete_sync(data: usize, result: Result<(), BlockError>) {
+    let sync_request = unsafe { &*(data as *const SyncRequest) };
+    let task = sync_request.task;
+    let status = match result {
+        Ok(()) => 1,
+        Err(error) => 2 + ERRORS.iter().position(|e| *e == error).unwrap() as u8,
+    };
+    // The request is on the stack of the task, it may return as soon as it sees the status
+    sync_request.status.store(status, Ordering::Release);
+    scheduler::wake(task);
+}
+
+/// Interrupt of a request queue, data is device index << 16 | queue index
+fn queue_interrupt(data: usize) -> IrqReturn {
+    let Some(device) = devices().get(data >> 16) else {
+        return IrqReturn::NotMine;
+    };
+    let queue = &device.queues[data & 0xFFFF];
+    loop {
+        let mut completed: ArrayVec<[(usize, u8); COMPLETION_BATCH]> = ArrayVec::new();
+        let mut callbacks: ArrayVec<[Option<(BlockCompletion, usize)>; COMPLETION_BATCH]> =
+            ArrayVec::new();
+        let mut inner = queue.inner.lock();
+        while completed.len() < COMPLETION_BATCH {
+            let Some((head, _)) = inner.virtqueue.pop_used() else {
+                break;
+            };
+            let status = unsafe {
+                virtual_memory_manager::virt_addr_in_cpmm_from_phys_addr(inner.status_addr(head))
+                    .as_ptr::<u8>()
+                    .read_volatile()
+            };
+            completed.push((head as usize, status));
+            callbacks.push(inner.completions[head as usize].take());
+        }
+        let done = completed.len() < COMPLETION_BATCH && inner.virtqueue.enable_interrupts();
+        drop(inner);
+
+        for ((_, status), callback) in completed.iter().zip(callbacks) {
+            let Some((completion, data)) = callback else {
+                continue;
+            };
+            let result = match *status {
+                STATUS_OK => Ok(()),
+                STATUS_UNSUPPORTED => Err(BlockError::Unsupported),
+                _ => Err(BlockError::Io),
+            };
+            completion(data, result);
+        }
+        if done {
+            return IrqReturn::Handled;
+        }
+    }
+}
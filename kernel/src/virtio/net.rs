@@ -0,0 +1,440 @@
+// Virtio network device (virtio 1.x, section 5.1)
+//
+// With VIRTIO_NET_F_MQ the device has up to one receive/transmit queue pair per CPU, the pair count is set
+// through the control queue. Pair N interrupts CPU N (msi::queue_cpu).
+//
+// Receive buffers are 2 KB slots of one per-queue DMA block, all of them are posted at init and reposted
+// after the receive callback returns, so frames are read in place.
+// Transmitted frames are DMA'd directly from the caller's physical memory, the header chained before each
+// frame is one shared zeroed header (no offloads are negotiated). Frames of one transmit are added to the
+// queue of the current CPU and the device is notified once, completions are popped in batches.
+
+use super::transport::{Transport, TransportError};
+use super::virtqueue::{Buffer, Virtqueue};
+use crate::interrupts::irq::IrqReturn;
+use crate::interrupts::msi::{self, MsiVector};
+use crate::memory_management::physical_memory_manager::{self, MemoryZoneEnum};
+use crate::memory_management::virtual_memory_manager;
+use crate::memory_management::PAGE_SIZE;
+use crate::pci::PciDevice;
+use crate::smp::per_cpu;
+use crate::sync::Mutex;
+use alloc::vec::Vec;
+use spin::Once;
+use tinyvec::ArrayVec;
+use x86_64::PhysAddr;
+
+/// Feature bits
+const FEATURE_MAC: u64 = 1 << 5;
+const FEATURE_CTRL_VQ: u64 = 1 << 17;
+const FEATURE_MQ: u64 = 1 << 22;
+
+/// Device configuration (struct virtio_net_config)
+const CONFIG_MAC: u64 = 0;
+const CONFIG_MAX_VIRTQUEUE_PAIRS: u64 = 8;
+
+/// Control queue: class VIRTIO_NET_CTRL_MQ, command VQ_PAIRS_SET
+const CTRL_CLASS_MQ: u8 = 4;
+const CTRL_MQ_VQ_PAIRS_SET: u8 = 0;
+const CTRL_OK: u8 = 0;
+
+/// struct virtio_net_hdr with num_buffers (VERSION_1)
+const NET_HEADER_SIZE: usize = 12;
+
+/// Receive slot, header and a frame of the default MTU
+const RX_BUFFER_SIZE: usize = 2048;
+
+/// Max entries of a queue
+const MAX_QUEUE_SIZE: u16 = 256;
+
+/// Completions popped under the queue lock at once
+const COMPLETION_BATCH: usize = 32;
+
+static DEVICES: Once<Vec<NetDevice>> = Once::new();
+
+/// Called in the receive interrupt with the data of [NetDevice::set_receiver] and the frame without the header
+///
+/// The frame is reposted after the callback returns
+pub type Receiver = fn(usize, &[u8]);
+
+/// Called in the transmit interrupt with the data of the frame when the device doesn't need it anymore
+pub type TxCompletion = fn(usize);
+
+/// Ethernet frame in one physically contiguous buffer
+#[derive(Debug, Copy, Clone)]
+pub struct TxFrame {
+    /// Physical memory of the High or DMA32 zone
+    pub buffer: PhysAddr,
+    pub len: u32,
+    pub completion: TxCompletion,
+    pub data: usize,
+}
+
+pub struct NetDevice {
+    transport: Transport,
+    mac: [u8; 6],
+    /// Zeroed header of all transmitted frames
+    tx_header: PhysAddr,
+    receiver: Mutex<Option<(Receiver, usize)>>,
+    pairs: Vec<QueuePair>,
+    /// The device may still interrupt on the polled control queue
+    control_vector: Option<MsiVector>,
+}
+
+struct QueuePair {
+    rx: Mutex<RxQueue>,
+    tx: Mutex<TxQueue>,
+    rx_vector: MsiVector,
+    tx_vector: MsiVector,
+}
+
+struct RxQueue {
+    virtqueue: Virtqueue,
+    /// Slots of RX_BUFFER_SIZE, slot of a chain is remembered by its head descriptor
+    buffers: PhysAddr,
+    slots: Vec<u16>,
+}
+
+struct TxQueue {
+    virtqueue: Virtqueue,
+    /// Completion and data of the chains, indexed by the head descriptor
+    completions: Vec<Option<(TxCompletion, usize)>>,
+}
+
+/// Network devices found by [super::init]
+#[inline]
+pub fn devices() -> &'static [NetDevice] {
+    DEVICES.get().map_or(&[], |devices| devices.as_slice())
+}
+
+pub(super) fn set_devices(devices: Vec<NetDevice>) {
+    let devices = DEVICES.call_once(|| devices);
+    // Interrupts before the devices were published returned NotMine, frames received meanwhile are taken here
+    for (device_index, device) in devices.iter().enumerate() {
+        for pair in 0..device.pairs.len() {
+            x86_64::instructions::interrupts::without_interrupts(|| {
+                rx_interrupt(device_index << 16 | pair);
+            });
+        }
+    }
+}
+
+impl NetDevice {
+    /// Negotiates features, creates a queue pair per CPU and posts receive buffers
+    ///
+    /// device_index is the index of the device in [devices]
+    pub(super) fn new(
+        pci_device: &'static PciDevice,
+        device_index: usize,
+    ) -> Result<Self, TransportError> {
+        let mut transport = Transport::new(pci_device)?;
+        transport.negotiate_features(FEATURE_MAC | FEATURE_CTRL_VQ | FEATURE_MQ)?;
+
+        let multiqueue =
+            transport.has_feature(FEATURE_CTRL_VQ) && transport.has_feature(FEATURE_MQ);
+        let max_pairs = if multiqueue {
+            transport.read_config_u16(CONFIG_MAX_VIRTQUEUE_PAIRS).max(1)
+        } else {
+            1
+        };
+        let pairs_number = (max_pairs as usize).min(per_cpu::cpus_number());
+
+        let tx_header = alloc_dma(PAGE_SIZE).ok_or(TransportError::NoResources)?;
+        let mut pairs = Vec::with_capacity(pairs_number);
+        for pair in 0..pairs_number {
+            let cpu_index = msi::queue_cpu(pair);
+            let data = device_index << 16 | pair;
+            let (rx_virtqueue, rx_vector) = transport.setup_queue(
+                2 * pair as u16,
+                MAX_QUEUE_SIZE,
+                cpu_index,
+                rx_interrupt,
+                data,
+            )?;
+            let (tx_virtqueue, tx_vector) = transport.setup_queue(
+                2 * pair as u16 + 1,
+                MAX_QUEUE_SIZE,
+                cpu_index,
+                tx_interrupt,
+                data,
+            )?;
+            let rx_size = rx_virtqueue.size() as usize;
+            let tx_size = tx_virtqueue.size() as usize;
+            let buffers = alloc_dma(rx_size * RX_BUFFER_SIZE).ok_or_else(|| {
+                transport.fail();
+                TransportError::NoResources
+            })?;
+            let mut rx = RxQueue {
+                virtqueue: rx_virtqueue,
+                buffers,
+                slots: alloc::vec![0; rx_size],
+            };
+            for slot in 0..rx_size as u16 {
+                rx.post(slot);
+            }
+            pairs.push(QueuePair {
+                rx: Mutex::new(rx),
+                tx: Mutex::new(TxQueue {
+                    virtqueue: tx_virtqueue,
+                    completions: alloc::vec![None; tx_size],
+                }),
+                rx_vector,
+                tx_vector,
+            });
+        }
+        // Control queue follows all pairs the device supports, it's polled
+        let mut control = if multiqueue {
+            Some(transport.setup_queue(
+                2 * max_pairs,
+                MAX_QUEUE_SIZE,
+                msi::queue_cpu(0),
+                control_interrupt,
+                0,
+            )?)
+        } else {
+            None
+        };
+        transport.driver_ok();
+
+        // Receive buffers were added before DRIVER_OK, the device may use them now
+        for pair in &pairs {
+            pair.rx.lock().virtqueue.kick();
+        }
+        if let Some((control, _)) = &mut control {
+            if !set_pairs_number(control, pairs_number as u16) {
+                log::warn!(
+                    "virtio-net {}: setting {} queue pairs failed",
+                    pci_device.address,
+                    pairs_number
+                );
+            }
+        }
+
+        let mut mac = [0; 6];
+        if transport.has_feature(FEATURE_MAC) {
+            for (i, byte) in mac.iter_mut().enumerate() {
+                *byte = transport.read_config_u8(CONFIG_MAC + i as u64);
+            }
+        }
+        Ok(Self {
+            transport,
+            mac,
+            tx_header,
+            receiver: Mutex::new(None),
+            pairs,
+            control_vector: control.map(|(_, vector)| vector),
+        })
+    }
+
+    /// MAC address, zero if the device doesn't report it
+    #[inline]
+    pub fn mac(&self) -> [u8; 6] {
+        self.mac
+    }
+
+    #[inline]
+    pub fn queue_pairs_number(&self) -> usize {
+        self.pairs.len()
+    }
+
+    #[inline]
+    pub fn pci_device(&self) -> &'static PciDevice {
+        self.transport.pci_device()
+    }
+
+    /// Sets the callback of received frames, frames received without it are dropped
+    pub fn set_receiver(&self, receiver: Receiver, data: usize) {
+        x86_64::instructions::interrupts::without_interrupts(|| {
+            *self.receiver.lock() = Some((receiver, data));
+        });
+    }
+
+    /// Transmits the frames through the queue of the current CPU with one notification
+    ///
+    /// Returns the number of queued frames, the rest doesn't fit into the queue and must be retransmitted
+    pub fn transmit(&self, frames: &[TxFrame]) -> usize {
+        x86_64::instructions::interrupts::without_interrupts(|| {
+            let pair = &self.pairs[per_cpu::cpu_index() % self.pairs.len()];
+            let mut tx = pair.tx.lock();
+            let mut queued = 0;
+            for frame in frames {
+                let header = Buffer {
+                    addr: self.tx_header,
+                    len: NET_HEADER_SIZE as u32,
+                    device_writable: false,
+                };
+                let data = Buffer {
+                    addr: frame.buffer,
+                    len: frame.len,
+                    device_writable: false,
+                };
+                let Some(head) = tx.virtqueue.add(&[header, data]) else {
+                    break;
+                };
+                tx.completions[head as usize] = Some((frame.completion, frame.data));
+                queued += 1;
+            }
+            tx.virtqueue.kick();
+            queued
+        })
+    }
+}
+
+impl RxQueue {
+    /// Adds the slot as a device-writable buffer
+    fn post(&mut self, slot: u16) {
+        let buffer = Buffer {
+            addr: self.slot_addr(slot),
+            len: RX_BUFFER_SIZE as u32,
+            device_writable: true,
+        };
+        let head = self
+            .virtqueue
+            .add(&[buffer])
+            .expect("Receive queue has a descriptor per slot");
+        self.slots[head as usize] = slot;
+    }
+
+    #[inline]
+    fn slot_addr(&self, slot: u16) -> PhysAddr {
+        self.buffers + (slot as usize * RX_BUFFER_SIZE) as u64
+    }
+}
+
+/// Sends VQ_PAIRS_SET and polls for the acknowledgment, used once at init
+fn set_pairs_number(control: &mut Virtqueue, pairs_number: u16) -> bool {
+    let Some(command) = alloc_dma(PAGE_SIZE) else {
+        return false;
+    };
+    // class, command, virtqueue_pairs, then the ack byte
+    unsafe {
+        let ptr =
+            virtual_memory_manager::virt_addr_in_cpmm_from_phys_addr(command).as_mut_ptr::<u8>();
+        ptr.write_volatile(CTRL_CLASS_MQ);
+        ptr.add(1).write_volatile(CTRL_MQ_VQ_PAIRS_SET);
+        (ptr.add(2) as *mut u16).write_volatile(pairs_number);
+        ptr.add(4).write_volatile(0xFF);
+    }
+    let buffers = [
+        Buffer {
+            addr: command,
+            len: 2,
+            device_writable: false,
+        },
+        Buffer {
+            addr: command + 2u64,
+            len: 2,
+            device_writable: false,
+        },
+        Buffer {
+            addr: command + 4u64,
+            len: 1,
+            device_writable: true,
+        },
+    ];
+    control.disable_interrupts();
+    control.add(&buffers);
+    control.kick();
+    while control.pop_used().is_none() {
+        core::hint::spin_loop();
+    }
+    let ack = unsafe {
+        virtual_memory_manager::virt_addr_in_cpmm_from_phys_addr(command + 4u64)
+            .as_ptr::<u8>()
+            .read_volatile()
+    };
+    unsafe {
+        physical_memory_manager::free(command, PAGE_SIZE);
+    }
+    ack == CTRL_OK
+}
+
+/// Zeroed block of the High or DMA32 zone
+fn alloc_dma(size: usize) -> Option<PhysAddr> {
+    let phys_addr = unsafe {
+        physical_memory_manager::alloc_zeroed(
+            &[MemoryZoneEnum::High, MemoryZoneEnum::Dma32],
+            size.next_power_of_two().max(PAGE_SIZE),
+        )
+    };
+    (!phys_addr.is_null()).then_some(phys_addr)
+}
+
+/// Queue pair of the interrupt, data is device index << 16 | pair index
+#[inline]
+fn queue_pair(data: usize) -> Option<(&'static NetDevice, &'static QueuePair)> {
+    let device = devices().get(data >> 16)?;
+    Some((device, device.pairs.get(data & 0xFFFF)?))
+}
+
+fn rx_interrupt(data: usize) -> IrqReturn {
+    let Some((device, pair)) = queue_pair(data) else {
+        return IrqReturn::NotMine;
+    };
+    let receiver = *device.receiver.lock();
+    let mut rx = pair.rx.lock();
+    loop {
+        let mut received = 0;
+        while received < COMPLETION_BATCH {
+            let Some((head, len)) = rx.virtqueue.pop_used() else {
+                break;
+            };
+            let slot = rx.slots[head as usize];
+            let len = (len as usize).min(RX_BUFFER_SIZE);
+            // The slot isn't reposted until the callback returns, so it's read in place with the queue locked
+            if let Some((receiver, receiver_data)) = receiver {
+                if len > NET_HEADER_SIZE {
+                    let frame = unsafe {
+                        core::slice::from_raw_parts(
+                            virtual_memory_manager::virt_addr_in_cpmm_from_phys_addr(
+                                rx.slot_addr(slot),
+                            )
+                            .as_ptr::<u8>()
+                            .add(NET_HEADER_SIZE),
+                            len - NET_HEADER_SIZE,
+                        )
+                    };
+                    receiver(receiver_data, frame);
+                }
+            }
+            rx.post(slot);
+            received += 1;
+        }
+        rx.virtqueue.kick();
+        if received < COMPLETION_BATCH && rx.virtqueue.enable_interrupts() {
+            return IrqReturn::Handled;
+        }
+    }
+}
+
+fn tx_interrupt(data: usize) -> IrqReturn {
+    let Some((_, pair)) = queue_pair(data) else {
+        return IrqReturn::NotMine;
+    };
+    loop {
+        let mut callbacks: ArrayVec<[Option<(TxCompletion, usize)>; COMPLETION_BATCH]> =
+            ArrayVec::new();
+        let mut tx = pair.tx.lock();
+        while callbacks.len() < COMPLETION_BATCH {
+            let Some((head, _)) = tx.virtqueue.pop_used() else {
+                break;
+            };
+            callbacks.push(tx.completions[head as usize].take());
+        }
+        let done = callbacks.len() < COMPLETION_BATCH && tx.virtqueue.enable_interrupts();
+        drop(tx);
+
+        // Callbacks may transmit again, the queue is unlocked
+        for (completion, data) in callbacks.into_iter().flatten() {
+            completion(data);
+        }
+        if done {
+            return IrqReturn::Handled;
+        }
+    }
+}
+
+/// The control queue is polled, its used chains are taken by [set_pairs_number]
+fn control_interrupt(_data: usize) -> IrqReturn {
+    IrqReturn::Handled
+}
@@ -0,0 +1,319 @@
+// Virtio over PCI, modern interface (virtio 1.x, section 4.1)
+//
+// Vendor capabilities of the function point to structures in its BARs: common configuration, notification area,
+// ISR status and device-specific configuration. Each used BAR is mapped uncached once.
+// Queue interrupts are MSI-X: queue N uses table entry N, the configuration change interrupt isn't used.
+
+use super::virtqueue::Virtqueue;
+use super::{
+    FEATURE_RING_EVENT_IDX, FEATURE_VERSION_1, STATUS_ACKNOWLEDGE, STATUS_DRIVER, STATUS_DRIVER_OK,
+    STATUS_FAILED, STATUS_FEATURES_OK,
+};
+use crate::interrupts::irq::IrqHandler;
+use crate::interrupts::msi::{self, MsiVector, MsiXTable};
+use crate::pci::PciDevice;
+use x86_64::VirtAddr;
+
+/// Vendor-specific PCI capability
+const CAPABILITY_VENDOR: u8 = 0x09;
+
+/// cfg_type of virtio_pci_cap
+const CFG_TYPE_COMMON: u8 = 1;
+const CFG_TYPE_NOTIFY: u8 = 2;
+const CFG_TYPE_DEVICE: u8 = 4;
+
+/// No MSI-X vector
+const NO_VECTOR: u16 = 0xFFFF;
+
+/// Common configuration registers (struct virtio_pci_common_cfg)
+const COMMON_DEVICE_FEATURE_SELECT: u64 = 0x00;
+const COMMON_DEVICE_FEATURE: u64 = 0x04;
+const COMMON_DRIVER_FEATURE_SELECT: u64 = 0x08;
+const COMMON_DRIVER_FEATURE: u64 = 0x0C;
+const COMMON_CONFIG_MSIX_VECTOR: u64 = 0x10;
+const COMMON_NUM_QUEUES: u64 = 0x12;
+const COMMON_DEVICE_STATUS: u64 = 0x14;
+const COMMON_QUEUE_SELECT: u64 = 0x16;
+const COMMON_QUEUE_SIZE: u64 = 0x18;
+const COMMON_QUEUE_MSIX_VECTOR: u64 = 0x1A;
+const COMMON_QUEUE_ENABLE: u64 = 0x1C;
+const COMMON_QUEUE_NOTIFY_OFF: u64 = 0x1E;
+const COMMON_QUEUE_DESC: u64 = 0x20;
+const COMMON_QUEUE_DRIVER: u64 = 0x28;
+const COMMON_QUEUE_DEVICE: u64 = 0x30;
+
+/// Modern virtio PCI function
+pub struct Transport {
+    device: &'static PciDevice,
+    common: VirtAddr,
+    notify: VirtAddr,
+    notify_off_multiplier: u32,
+    device_config: VirtAddr,
+    msi_x_table: MsiXTable,
+    /// Negotiated features
+    features: u64,
+}
+
+#[derive(Debug)]
+pub enum TransportError {
+    /// Legacy-only device or a required structure is missing
+    NotModern,
+    /// No MSI-X capability or it can't be mapped
+    NoMsiX,
+    /// Device rejected the features
+    FeaturesRejected,
+    /// Queue doesn't exist or has size 0
+    NoQueue(u16),
+    /// No memory for the queue or no interrupt vector
+    NoResources,
+}
+
+impl Transport {
+    /// Maps the virtio structures and resets the device
+    pub fn new(device: &'static PciDevice) -> Result<Self, TransportError> {
+        let mut common = None;
+        let mut notify = None;
+        let mut device_config = None;
+        let mut mapped_bars: [Option<VirtAddr>; 6] = [None; 6];
+        let config = device.config();
+        for capability in device
+            .capabilities
+            .iter()
+            .filter(|capability| capability.id == CAPABILITY_VENDOR)
+        {
+            let offset = capability.offset as u16;
+            let cfg_type = config.read_u8(offset + 3);
+            let bar = config.read_u8(offset + 4) as usize;
+            if bar >= mapped_bars.len() {
+                continue;
+            }
+            let structure_offset = config.read_u32(offset + 8) as u64;
+            // The first capability of each type is the preferred one
+            let slot = match cfg_type {
+                CFG_TYPE_COMMON if common.is_none() => &mut common,
+                CFG_TYPE_NOTIFY if notify.is_none() => &mut notify,
+                CFG_TYPE_DEVICE if device_config.is_none() => &mut device_config,
+                _ => continue,
+            };
+            if mapped_bars[bar].is_none() {
+                mapped_bars[bar] = device.map_bar(bar);
+            }
+            let Some(bar_virt_addr) = mapped_bars[bar] else {
+                continue;
+            };
+            *slot = Some((bar_virt_addr + structure_offset, offset));
+        }
+        let (Some((common, _)), Some((notify, notify_capability)), Some((device_config, _))) =
+            (common, notify, device_config)
+        else {
+            return Err(TransportError::NotModern);
+        };
+        let notify_off_multiplier = config.read_u32(notify_capability + 16);
+        let msi_x_table = device.map_msi_x_table().ok_or(TransportError::NoMsiX)?;
+
+        let transport = Self {
+            device,
+            common,
+            notify,
+            notify_off_multiplier,
+            device_config,
+            msi_x_table,
+            features: 0,
+        };
+        transport.write_u8(COMMON_DEVICE_STATUS, 0);
+        while transport.read_u8(COMMON_DEVICE_STATUS) != 0 {
+            core::hint::spin_loop();
+        }
+        transport.write_u8(COMMON_DEVICE_STATUS, STATUS_ACKNOWLEDGE | STATUS_DRIVER);
+        device.enable_bus_master();
+        Ok(transport)
+    }
+
+    /// Accepts the wanted features the device offers, VERSION_1 is required
+    ///
+    /// Returns the negotiated features
+    pub fn negotiate_features(&mut self, wanted: u64) -> Result<u64, TransportError> {
+        let offered = self.read_features(COMMON_DEVICE_FEATURE_SELECT, COMMON_DEVICE_FEATURE);
+        let features = offered & (wanted | FEATURE_VERSION_1 | FEATURE_RING_EVENT_IDX);
+        if features & FEATURE_VERSION_1 == 0 {
+            self.fail();
+            return Err(TransportError::NotModern);
+        }
+        for half in 0..2 {
+            self.write_u32(COMMON_DRIVER_FEATURE_SELECT, half);
+            self.write_u32(COMMON_DRIVER_FEATURE, (features >> (half * 32)) as u32);
+        }
+        self.write_u8(
+            COMMON_DEVICE_STATUS,
+            STATUS_ACKNOWLEDGE | STATUS_DRIVER | STATUS_FEATURES_OK,
+        );
+        if self.read_u8(COMMON_DEVICE_STATUS) & STATUS_FEATURES_OK == 0 {
+            self.fail();
+            return Err(TransportError::FeaturesRejected);
+        }
+        self.features = features;
+        Ok(features)
+    }
+
+    #[inline]
+    pub fn has_feature(&self, feature: u64) -> bool {
+        self.features & feature != 0
+    }
+
+    #[inline]
+    pub fn pci_device(&self) -> &'static PciDevice {
+        self.device
+    }
+
+    /// Max queues of the device
+    #[inline]
+    pub fn queues_number(&self) -> u16 {
+        self.read_u16(COMMON_NUM_QUEUES)
+    }
+
+    /// Creates the queue with up to max_size entries and binds its interrupt to the CPU
+    ///
+    /// handler is called with data on the CPU when the device uses buffers of the queue
+    pub fn setup_queue(
+        &mut self,
+        index: u16,
+        max_size: u16,
+        cpu_index: usize,
+        handler: IrqHandler,
+        data: usize,
+    ) -> Result<(Virtqueue, MsiVector), TransportError> {
+        self.write_u16(COMMON_QUEUE_SELECT, index);
+        let device_size = self.read_u16(COMMON_QUEUE_SIZE);
+        if index >= self.queues_number() || device_size == 0 {
+            return Err(TransportError::NoQueue(index));
+        }
+        if index >= self.msi_x_table.entries_number() {
+            return Err(TransportError::NoResources);
+        }
+        // Split queue sizes are powers of two
+        let size = max_size.min(device_size);
+        let size = 1 << (u16::BITS - 1 - size.leading_zeros());
+        self.write_u16(COMMON_QUEUE_SIZE, size);
+
+        let notify_off = self.read_u16(COMMON_QUEUE_NOTIFY_OFF) as u64;
+        let notify_addr = self.notify + notify_off * self.notify_off_multiplier as u64;
+        let virtqueue = Virtqueue::new(
+            index,
+            size,
+            notify_addr,
+            self.has_feature(FEATURE_RING_EVENT_IDX),
+        )
+        .ok_or(TransportError::NoResources)?;
+
+        let vector = msi::allocate(Some(cpu_index), handler, data)
+            .map_err(|_| TransportError::NoResources)?;
+        self.msi_x_table.set_entry(index, vector.message());
+        self.write_u16(COMMON_QUEUE_MSIX_VECTOR, index);
+        if self.read_u16(COMMON_QUEUE_MSIX_VECTOR) != index {
+            vector.free();
+            return Err(TransportError::NoResources);
+        }
+
+        let (desc, driver, device) = virtqueue.ring_addresses();
+        self.write_u64(COMMON_QUEUE_DESC, desc.as_u64());
+        self.write_u64(COMMON_QUEUE_DRIVER, driver.as_u64());
+        self.write_u64(COMMON_QUEUE_DEVICE, device.as_u64());
+        self.write_u16(COMMON_QUEUE_ENABLE, 1);
+        Ok((virtqueue, vector))
+    }
+
+    /// Queues are set up, the device may use them
+    pub fn driver_ok(&self) {
+        self.write_u16(COMMON_CONFIG_MSIX_VECTOR, NO_VECTOR);
+        self.device.enable_msi_x();
+        self.device.unmask_msi_x();
+        self.write_u8(
+            COMMON_DEVICE_STATUS,
+            STATUS_ACKNOWLEDGE | STATUS_DRIVER | STATUS_FEATURES_OK | STATUS_DRIVER_OK,
+        );
+    }
+
+    /// Gives up the device
+    pub fn fail(&self) {
+        let status = self.read_u8(COMMON_DEVICE_STATUS);
+        self.write_u8(COMMON_DEVICE_STATUS, status | STATUS_FAILED);
+    }
+
+    #[inline]
+    pub fn read_config_u8(&self, offset: u64) -> u8 {
+        unsafe { ((self.device_config + offset).as_ptr::<u8>()).read_volatile() }
+    }
+
+    #[inline]
+    pub fn read_config_u16(&self, offset: u64) -> u16 {
+        unsafe { ((self.device_config + offset).as_ptr::<u16>()).read_volatile() }
+    }
+
+    #[inline]
+    pub fn read_config_u32(&self, offset: u64) -> u32 {
+        unsafe { ((self.device_config + offset).as_ptr::<u32>()).read_volatile() }
+    }
+
+    /// 64-bit fields may be torn, they are read as two halves
+    #[inline]
+    pub fn read_config_u64(&self, offset: u64) -> u64 {
+        self.read_config_u32(offset) as u64 | (self.read_config_u32(offset + 4) as u64) << 32
+    }
+
+    fn read_features(&self, select: u64, register: u64) -> u64 {
+        let mut features = 0;
+        for half in 0..2 {
+            self.write_u32(select, half);
+            features |= (self.read_u32(register) as u64) << (half * 32);
+        }
+        features
+    }
+
+    #[inline]
+    fn read_u8(&self, register: u64) -> u8 {
+        unsafe { (self.common + register).as_ptr::<u8>().read_volatile() }
+    }
+
+    #[inline]
+    fn read_u16(&self, register: u64) -> u16 {
+        unsafe { (self.common + register).as_ptr::<u16>().read_volatile() }
+    }
+
+    #[inline]
+    fn read_u32(&self, register: u64) -> u32 {
+        unsafe { (self.common + register).as_ptr::<u32>().read_volatile() }
+    }
+
+    #[inline]
+    fn write_u8(&self, register: u64, value: u8) {
+        unsafe {
+            (self.common + register)
+                .as_mut_ptr::<u8>()
+                .write_volatile(value)
+        }
+    }
+
+    #[inline]
+    fn write_u16(&self, register: u64, value: u16) {
+        unsafe {
+            (self.common + register)
+                .as_mut_ptr::<u16>()
+                .write_volatile(value)
+        }
+    }
+
+    #[inline]
+    fn write_u32(&self, register: u64, value: u32) {
+        unsafe {
+            (self.common + register)
+                .as_mut_ptr::<u32>()
+                .write_volatile(value)
+        }
+    }
+
+    #[inline]
+    fn write_u64(&self, register: u64, value: u64) {
+        self.write_u32(register, value as u32);
+        self.write_u32(register + 4, (value >> 32) as u32);
+    }
+}
@@ -0,0 +1,321 @@
+// Split virtqueue (virtio 1.x, section 2.7)
+//
+// Descriptor table, available ring and used ring are in one physically contiguous block from the High or DMA32 zone,
+// the driver accesses it through the CPMM, the device by physical addresses.
+//
+// Buffers are added without publishing, kick publishes all of them with one available index write
+// and notifies the device only if it asked for it, so a batch costs one notification (one VM exit).
+// With VIRTIO_F_RING_EVENT_IDX the driver and the device tell each other the index they want to be woken at
+// (used_event, avail_event), without it only the NO_INTERRUPT/NO_NOTIFY flags are used.
+//
+// The queue isn't synchronized, the driver locks it.
+
+use crate::memory_management::physical_memory_manager::{self, MemoryZoneEnum};
+use crate::memory_management::virtual_memory_manager;
+use crate::memory_management::PAGE_SIZE;
+use core::sync::atomic::{fence, Ordering};
+use x86_64::{PhysAddr, VirtAddr};
+
+const DESCRIPTOR_SIZE: usize = 16;
+
+/// Descriptor flags
+const DESCRIPTOR_F_NEXT: u16 = 1;
+const DESCRIPTOR_F_WRITE: u16 = 2;
+
+/// Available ring flags, the driver doesn't want interrupts
+const AVAIL_F_NO_INTERRUPT: u16 = 1;
+
+/// Used ring flags, the device doesn't want notifications
+const USED_F_NO_NOTIFY: u16 = 1;
+
+/// Physically contiguous part of a request
+#[derive(Debug, Copy, Clone)]
+pub struct Buffer {
+    pub addr: PhysAddr,
+    pub len: u32,
+    /// The device writes the buffer, otherwise reads it
+    pub device_writable: bool,
+}
+
+pub struct Virtqueue {
+    index: u16,
+    size: u16,
+    /// Block of the rings
+    phys_addr: PhysAddr,
+    descriptors: VirtAddr,
+    avail: VirtAddr,
+    used: VirtAddr,
+    notify_addr: VirtAddr,
+    event_idx: bool,
+    free_head: u16,
+    free_number: u16,
+    /// Available index of added buffers, published by kick
+    avail_idx: u16,
+    /// Available index the device has seen
+    published_idx: u16,
+    last_used_idx: u16,
+}
+
+unsafe impl Send for Virtqueue {}
+
+impl Virtqueue {
+    /// Allocates zeroed rings, size must be a power of two
+    ///
+    /// None if there is no memory
+    pub(super) fn new(
+        index: u16,
+        size: u16,
+        notify_addr: VirtAddr,
+        event_idx: bool,
+    ) -> Option<Self> {
+        debug_assert!(size.is_power_of_two());
+        let (avail_offset, used_offset, rings_size) = layout(size);
+        let block_size = rings_size.next_power_of_two().max(PAGE_SIZE);
+        let phys_addr = unsafe {
+            physical_memory_manager::alloc_zeroed(
+                &[MemoryZoneEnum::High, MemoryZoneEnum::Dma32],
+                block_size,
+            )
+        };
+        if phys_addr.is_null() {
+            return None;
+        }
+        let base = virtual_memory_manager::virt_addr_in_cpmm_from_phys_addr(phys_addr);
+        let virtqueue = Self {
+            index,
+            size,
+            phys_addr,
+            descriptors: base,
+            avail: base + avail_offset as u64,
+            used: base + used_offset as u64,
+            notify_addr,
+            event_idx,
+            free_head: 0,
+            free_number: size,
+            avail_idx: 0,
+            published_idx: 0,
+            last_used_idx: 0,
+        };
+        for descriptor in 0..size - 1 {
+            virtqueue.write_descriptor_next(descriptor, descriptor + 1);
+        }
+        Some(virtqueue)
+    }
+
+    /// Physical addresses of the descriptor table, available ring and used ring
+    pub(super) fn ring_addresses(&self) -> (PhysAddr, PhysAddr, PhysAddr) {
+        let (avail_offset, used_offset, _) = layout(self.size);
+        (
+            self.phys_addr,
+            self.phys_addr + avail_offset as u64,
+            self.phys_addr + used_offset as u64,
+        )
+    }
+
+    #[inline]
+    pub fn size(&self) -> u16 {
+        self.size
+    }
+
+    #[inline]
+    pub fn free_descriptors(&self) -> u16 {
+        self.free_number
+    }
+
+    /// Head descriptor of the next added chain, drivers index per-request data by it
+    #[inline]
+    pub fn next_free(&self) -> u16 {
+        self.free_head
+    }
+
+    /// Adds the chain of buffers, the device doesn't see it until [Self::kick]
+    ///
+    /// Returns the head descriptor (the ID of the chain in the used ring),
+    /// None if there are not enough free descriptors
+    pub fn add(&mut self, buffers: &[Buffer]) -> Option<u16> {
+        if buffers.is_empty() || buffers.len() > self.free_number as usize {
+            return None;
+        }
+        let head = self.free_head;
+        let mut descriptor = head;
+        for (i, buffer) in buffers.iter().enumerate() {
+            let next = self.read_descriptor_next(descriptor);
+            let mut flags = if buffer.device_writable {
+                DESCRIPTOR_F_WRITE
+            } else {
+                0
+            };
+            if i + 1 != buffers.len() {
+                flags |= DESCRIPTOR_F_NEXT;
+            }
+            let descriptor_ptr = self.descriptor_ptr(descriptor);
+            unsafe {
+                (descriptor_ptr as *mut u64).write_volatile(buffer.addr.as_u64());
+                (descriptor_ptr.add(8) as *mut u32).write_volatile(buffer.len);
+                (descriptor_ptr.add(12) as *mut u16).write_volatile(flags);
+            }
+            if i + 1 != buffers.len() {
+                descriptor = next;
+            } else {
+                self.free_head = next;
+            }
+        }
+        self.free_number -= buffers.len() as u16;
+
+        let slot = self.avail_idx % self.size;
+        unsafe {
+            self.avail_ring_ptr(slot).write_volatile(head);
+        }
+        self.avail_idx = self.avail_idx.wrapping_add(1);
+        Some(head)
+    }
+
+    /// Publishes added buffers and notifies the device if it waits for them
+    pub fn kick(&mut self) {
+        if self.avail_idx == self.published_idx {
+            return;
+        }
+        // Ring entries before the index
+        fence(Ordering::Release);
+        unsafe {
+            ((self.avail + 2u64).as_mut_ptr::<u16>()).write_volatile(self.avail_idx);
+        }
+        // The index before reading what the device wants
+        fence(Ordering::SeqCst);
+        let old_idx = self.published_idx;
+        self.published_idx = self.avail_idx;
+        let notify = if self.event_idx {
+            let avail_event = unsafe { self.used_event_ptr(true).read_volatile() };
+            need_event(avail_event, self.avail_idx, old_idx)
+        } else {
+            unsafe { self.used.as_ptr::<u16>().read_volatile() & USED_F_NO_NOTIFY == 0 }
+        };
+        if notify {
+            unsafe {
+                self.notify_addr
+                    .as_mut_ptr::<u16>()
+                    .write_volatile(self.index);
+            }
+        }
+    }
+
+    /// Takes the next used chain and frees its descriptors
+    ///
+    /// Returns the head descriptor and the number of bytes the device wrote
+    pub fn pop_used(&mut self) -> Option<(u16, u32)> {
+        let used_idx = unsafe { (self.used + 2u64).as_ptr::<u16>().read_volatile() };
+        if used_idx == self.last_used_idx {
+            return None;
+        }
+        // The entry after the index
+        fence(Ordering::Acquire);
+        let slot = (self.last_used_idx % self.size) as u64;
+        let (head, len) = unsafe {
+            let element_ptr = (self.used + 4u64 + slot * 8).as_ptr::<u32>();
+            (
+                element_ptr.read_volatile() as u16,
+                element_ptr.add(1).read_volatile(),
+            )
+        };
+        self.last_used_idx = self.last_used_idx.wrapping_add(1);
+
+        // Chain goes to the head of the free list
+        let mut descriptor = head;
+        let mut number = 1;
+        while self.read_descriptor_flags(descriptor) & DESCRIPTOR_F_NEXT != 0 {
+            descriptor = self.read_descriptor_next(descriptor);
+            number += 1;
+        }
+        self.write_descriptor_next(descriptor, self.free_head);
+        self.free_head = head;
+        self.free_number += number;
+        Some((head, len))
+    }
+
+    /// Asks the device for an interrupt on the next used chain
+    ///
+    /// Returns false if chains were used meanwhile, the caller must pop them (the interrupt may not come)
+    pub fn enable_interrupts(&mut self) -> bool {
+        unsafe {
+            if self.event_idx {
+                self.used_event_ptr(false)
+                    .write_volatile(self.last_used_idx);
+            } else {
+                let flags_ptr = self.avail.as_mut_ptr::<u16>();
+                flags_ptr.write_volatile(flags_ptr.read_volatile() & !AVAIL_F_NO_INTERRUPT);
+            }
+        }
+        fence(Ordering::SeqCst);
+        let used_idx = unsafe { (self.used + 2u64).as_ptr::<u16>().read_volatile() };
+        used_idx == self.last_used_idx
+    }
+
+    /// Asks the device not to interrupt, used chains are polled
+    ///
+    /// It's a hint, with event idx the device interrupts once more at the event index
+    pub fn disable_interrupts(&mut self) {
+        if !self.event_idx {
+            unsafe {
+                let flags_ptr = self.avail.as_mut_ptr::<u16>();
+                flags_ptr.write_volatile(flags_ptr.read_volatile() | AVAIL_F_NO_INTERRUPT);
+            }
+        }
+    }
+
+    #[inline]
+    fn descriptor_ptr(&self, descriptor: u16) -> *mut u8 {
+        debug_assert!(descriptor < self.size);
+        (self.descriptors + descriptor as u64 * DESCRIPTOR_SIZE as u64).as_mut_ptr()
+    }
+
+    #[inline]
+    fn read_descriptor_flags(&self, descriptor: u16) -> u16 {
+        unsafe { (self.descriptor_ptr(descriptor).add(12) as *const u16).read_volatile() }
+    }
+
+    #[inline]
+    fn read_descriptor_next(&self, descriptor: u16) -> u16 {
+        unsafe { (self.descriptor_ptr(descriptor).add(14) as *const u16).read_volatile() }
+    }
+
+    #[inline]
+    fn write_descriptor_next(&self, descriptor: u16, next: u16) {
+        unsafe { (self.descriptor_ptr(descriptor).add(14) as *mut u16).write_volatile(next) }
+    }
+
+    #[inline]
+    fn avail_ring_ptr(&self, slot: u16) -> *mut u16 {
+        (self.avail + 4u64 + slot as u64 * 2).as_mut_ptr()
+    }
+
+    /// avail_event (end of the used ring) if device, used_event (end of the available ring) otherwise
+    #[inline]
+    fn used_event_ptr(&self, device: bool) -> *mut u16 {
+        if device {
+            (self.used + 4u64 + self.size as u64 * 8).as_mut_ptr()
+        } else {
+            self.avail_ring_ptr(self.size)
+        }
+    }
+}
+
+/// Offsets of the available and used rings and the size of all rings
+///
+/// Descriptors are 16 bytes aligned, available ring 2 bytes, used ring 4 bytes
+#[inline]
+fn layout(size: u16) -> (usize, usize, usize) {
+    let size = size as usize;
+    let avail_offset = size * DESCRIPTOR_SIZE;
+    // flags, idx, ring, used_event
+    let avail_end = avail_offset + 4 + size * 2 + 2;
+    let used_offset = avail_end.next_multiple_of(4);
+    // flags, idx, ring of id and len, avail_event
+    let used_end = used_offset + 4 + size * 8 + 2;
+    (avail_offset, used_offset, used_end)
+}
+
+/// The other side wants to be woken when the index passes event_idx
+#[inline]
+fn need_event(event_idx: u16, new_idx: u16, old_idx: u16) -> bool {
+    new_idx.wrapping_sub(event_idx).wrapping_sub(1) < new_idx.wrapping_sub(old_idx)
+}
@@ -0,0 +1,150 @@
+// Decodes trace dumps of the kernel
+//
+// Reads the file written by QEMU debugcon (-debugcon file:trace.bin) and prints records of all CPUs ordered by TSC.
+// The file may contain several dumps, every one is printed.
+//
+// Dump format (little endian), must match kernel/src/trace.rs:
+// magic "KTRACE01", TSC frequency u64 (0 if unknown), record size u32, CPUs number u32,
+// then for each CPU: cpu_index u32, records number u32, records from the oldest.
+// Record: tsc u64, cpu_index u16, event u16, reserved u32, args [u64; 2].
+
+const DUMP_MAGIC: &[u8; 8] = b"KTRACE01";
+const RECORD_SIZE: usize = 32;
+
+/// Names of kernel TraceEvent by ID
+const EVENT_NAMES: [&str; 6] = [
+    "pmm_alloc",
+    "pmm_free",
+    "slab_alloc",
+    "slab_free",
+    "irq_enter",
+    "irq_exit",
+];
+
+struct Record {
+    tsc: u64,
+    cpu_index: u16,
+    event: u16,
+    args: [u64; 2],
+}
+
+/// Reads fields from the dump, panics if it's truncated
+struct Reader<'a> {
+    bytes: &'a [u8],
+    position: usize,
+}
+
+fn main() {
+    let mut args = std::env::args();
+    if args.len() < 2 {
+        panic!("Wrong arguments number! Need 1: trace file path");
+    }
+    // Skip program name
+    args.next();
+
+    let trace_file_path = args.next().unwrap();
+    let bytes = std::fs::read(&trace_file_path)
+        .unwrap_or_else(|error| panic!("Failed to read trace file: {error}"));
+
+    let mut reader = Reader {
+        bytes: &bytes,
+        position: 0,
+    };
+    let mut dump_index = 0;
+    while !reader.is_end() {
+        decode_dump(&mut reader, dump_index);
+        dump_index += 1;
+    }
+    if dump_index == 0 {
+        println!("Trace file is empty");
+    }
+}
+
+fn decode_dump(reader: &mut Reader, dump_index: usize) {
+    if reader.bytes(DUMP_MAGIC.len()) != DUMP_MAGIC {
+        panic!(
+            "Invalid dump magic at offset {}",
+            reader.position - DUMP_MAGIC.len()
+        );
+    }
+    let tsc_frequency = reader.u64();
+    let record_size = reader.u32() as usize;
+    if record_size != RECORD_SIZE {
+        panic!("Unsupported record size {record_size}, decoder supports {RECORD_SIZE}");
+    }
+    let cpus_number = reader.u32();
+
+    let mut records = Vec::new();
+    for _ in 0..cpus_number {
+        let _cpu_index = reader.u32();
+        let records_number = reader.u32();
+        for _ in 0..records_number {
+            let tsc = reader.u64();
+            let cpu_index = reader.u16();
+            let event = reader.u16();
+            let _reserved = reader.u32();
+            let args = [reader.u64(), reader.u64()];
+            records.push(Record {
+                tsc,
+                cpu_index,
+                event,
+                args,
+            });
+        }
+    }
+    // Each CPU's records are already ordered, TSCs of CPUs are synchronized by the kernel
+    records.sort_by_key(|record| record.tsc);
+
+    println!(
+        "Dump {dump_index}: {} records of {cpus_number} CPUs",
+        records.len()
+    );
+    let Some(first_tsc) = records.first().map(|record| record.tsc) else {
+        return;
+    };
+    for record in &records {
+        let event_name = EVENT_NAMES
+            .get(record.event as usize)
+            .copied()
+            .unwrap_or("unknown");
+        let time = if tsc_frequency != 0 {
+            format!(
+                "{:>14.3} us",
+                (record.tsc - first_tsc) as f64 * 1_000_000.0 / tsc_frequency as f64
+            )
+        } else {
+            format!("{:>14} cycles", record.tsc - first_tsc)
+        };
+        println!(
+            "cpu {:>3} {time} {event_name:<10} {:#018x} {:#x}",
+            record.cpu_index, record.args[0], record.args[1]
+        );
+    }
+}
+
+impl Reader<'_> {
+    fn is_end(&self) -> bool {
+        self.position >= self.bytes.len()
+    }
+
+    fn bytes(&mut self, size: usize) -> &[u8] {
+        if self.position + size > self.bytes.len() {
+            panic!("Trace file is truncated at offset {}", self.position);
+        }
+        let bytes = &self.bytes[self.position..self.position + size];
+        self.position += size;
+        bytes
+    }
+
+    fn u16(&mut self) -> u16 {
+        u16::from_le_bytes(self.bytes(2).try_into().unwrap())
+    }
+
+    fn u32(&mut self) -> u32 {
+        u32::from_le_bytes(self.bytes(4).try_into().unwrap())
+    }
+
+    fn u64(&mut self) -> u64 {
+        u64::from_le_bytes(self.bytes(8).try_into().unwrap())
+    }
+}